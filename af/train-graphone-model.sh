@@ -39,4 +39,5 @@ opengrm="$runfiles/opengrm_ngram"
 "$festus/ngramfinalize" \
   --phi_label=0 \
   --to_runtime_model \
+  --mappable \
   > "$model"
@@ -238,6 +238,7 @@ bool AlignablesUtil::Init(const AlignablesSpec &spec) {
   typedef Arc::Weight Weight;
 
   std::unique_ptr<SymbolTable> input_symbols;
+  input_label_type_ = spec.input_label_type();
   switch (spec.input_label_type()) {
     case ::festus::BYTE:
       input_label_maker_.reset(new ByteLabelMaker());
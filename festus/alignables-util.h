@@ -122,6 +122,8 @@ class AlignablesUtil {
     return MakePairLatticeForOutputFst(MakeOutputFst(output));
   }
 
+  LabelType InputLabelType() const { return input_label_type_; }
+
   const fst::SymbolTable *InputSymbols() const {
     return input_label_maker_->Symbols();
   }
@@ -161,6 +163,7 @@ class AlignablesUtil {
 
   bool Init(const AlignablesSpec &spec);
 
+  LabelType input_label_type_ = UNKNOWN_LABEL_TYPE;
   std::unique_ptr<const LabelMaker> input_label_maker_;
   std::unique_ptr<const LabelMaker> output_label_maker_;
 
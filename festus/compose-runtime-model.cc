@@ -0,0 +1,151 @@
+// festus/compose-runtime-model.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Precomposes the runtime bytes_to_graphones FST with the graphone model.
+
+#include <cstring>
+#include <memory>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+#include <fst/extensions/ngram/ngram-fst.h>
+#include <fst/script/info-impl.h>
+
+#include "festus/runtime/compact.h"
+#include "festus/runtime/dense-matcher.h"
+#include "festus/runtime/g2p.h"
+#include "festus/runtime/lookahead.h"
+#include "festus/runtime/model-io.h"
+#include "festus/runtime/quantized.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+
+// Register the runtime FST types, as in g2p-lookup.
+static festus::BitfieldCompactFstRegisterer<MyArc> compact_reg;
+static fst::FstRegisterer<fst::NGramFst<MyArc>> ngram_reg;
+static festus::QuantizedCompactFstRegisterer<MyArc> quantized_reg;
+static fst::FstRegisterer<festus::ILabelLookAheadFst<MyArc>> lookahead_reg;
+static fst::FstRegisterer<festus::DenseByteFst<MyArc>> dense_reg;
+
+void PrintInfo(const fst::Fst<MyArc> &fst) {
+  fst::FstInfo info(fst, false);
+  fst::PrintFstInfoImpl(info, true /* pipe, i.e. print to stderr */);
+}
+
+}  // namespace
+
+static const char kUsage[] =
+    R"(Precomposes the runtime bytes_to_graphones FST with the graphone model.
+
+Reads the bytes_to_graphones FST (as written by make-runtime-fsts) and the
+graphone model (as written by ngramfinalize --to_runtime_model), composes them
+while resolving the backoff arcs of the model, and writes the result in const
+format with aligned sections, so that the runtime can map it into memory. The
+composed model can be passed to g2p-lookup --composed_model in place of
+--bytes_to_graphones and --graphone_model, which saves one composition per word
+at the expense of a larger model.
+
+With --lookahead, the composed model is written as an input label lookahead FST
+instead, so that the runtime composes it with the spelling using lookahead
+composition: partial graphone hypotheses that cannot be completed are never
+expanded, and the weights of the graphone model are pushed forward.
+
+With --dense_matcher, it is written with an index of the input labels of each
+state instead, so that the runtime finds the arcs for each byte of the spelling
+in constant time.
+
+Since the composed model contains a copy of the graphone model for each state
+of bytes_to_graphones, composition is refused if the result would exceed
+--max_states states; use the separate machines for such models.
+
+Usage:
+  compose-runtime-model bytes_to_graphones.fst graphone_model.fst [out.fst]
+)";
+
+DEFINE_bool(lookahead, false,
+            "Store the composed model in input label lookahead format");
+DEFINE_bool(dense_matcher, false,
+            "Store the composed model with a dense byte matcher index");
+DEFINE_int32(phi_label, 0, "Input label of backoff arcs in the model");
+DEFINE_int64(max_states, 1 << 22,
+             "Maximal number of states of the composed model; 0 for no limit");
+
+int main(int argc, char *argv[]) {
+  SET_FLAGS(kUsage, &argc, &argv, true);
+  if (argc < 3 || argc > 4) {
+    ShowUsage();
+    return 2;
+  }
+
+  if (FLAGS_lookahead && FLAGS_dense_matcher) {
+    LOG(ERROR) << "--lookahead and --dense_matcher are mutually exclusive";
+    return 2;
+  }
+
+  string out_name = (argc > 3 && std::strcmp(argv[3], "-") != 0) ? argv[3] : "";
+
+  std::unique_ptr<fst::Fst<MyArc>> bytes_to_graphones(
+      festus::ReadModelFst<MyArc>(argv[1], false));
+  if (!bytes_to_graphones) return 2;
+  PrintInfo(*bytes_to_graphones);
+  if (bytes_to_graphones->Type() == festus::kILabelLookAheadFstType) {
+    // Its input labels have been renumbered.
+    LOG(ERROR) << "bytes_to_graphones must not be a lookahead FST";
+    return 2;
+  }
+
+  std::unique_ptr<fst::Fst<MyArc>> graphone_model(
+      festus::ReadModelFst<MyArc>(argv[2], false));
+  if (!graphone_model) return 2;
+  PrintInfo(*graphone_model);
+
+  if (FLAGS_max_states > 0) {
+    // Each state of the result pairs a state of each input, so the product of
+    // their sizes bounds the size of the result.
+    const int64 bound =
+        static_cast<int64>(fst::CountStates(*bytes_to_graphones)) *
+        fst::CountStates(*graphone_model);
+    if (bound > FLAGS_max_states) {
+      LOG(ERROR) << "Composed model could have up to " << bound
+                 << " states, which exceeds --max_states="
+                 << FLAGS_max_states;
+      return 1;
+    }
+  }
+
+  fst::VectorFst<MyArc> composed_model;
+  festus::ComposeGraphoneModel(*bytes_to_graphones, *graphone_model,
+                               FLAGS_phi_label, &composed_model);
+  std::unique_ptr<fst::Fst<MyArc>> output;
+  if (FLAGS_lookahead) {
+    output.reset(new festus::ILabelLookAheadFst<MyArc>(composed_model));
+  } else if (FLAGS_dense_matcher) {
+    fst::ArcSort(&composed_model, fst::ILabelCompare<MyArc>());
+    output.reset(new festus::DenseByteFst<MyArc>(composed_model));
+  } else {
+    output.reset(new fst::ConstFst<MyArc>(composed_model));
+  }
+  PrintInfo(*output);
+  if (!festus::WriteAlignedFst(*output, out_name)) {
+    LOG(ERROR) << "Could not write composed model";
+    return 1;
+  }
+  return 0;
+}
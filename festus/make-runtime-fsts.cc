@@ -26,10 +26,12 @@
 #include <fst/script/info-impl.h>
 
 #include "festus/alignables-util.h"
-#include "festus/iterator.h"
 #include "festus/types.h"
 #include "festus/runtime/compact.h"
+#include "festus/runtime/dense-matcher.h"
 #include "festus/runtime/fst-util.h"
+#include "festus/runtime/lookahead.h"
+#include "festus/runtime/model-io.h"
 
 namespace {
 
@@ -39,32 +41,32 @@ void PrintInfo(const fst::Fst<Arc> &fst, bool test_properties=false) {
   fst::PrintFstInfoImpl(info, true /* pipe, i.e. print to stderr */);
 }
 
-inline bool OutOfRange(int value, unsigned int max_value) {
-  return value < 0 || static_cast<unsigned int>(value) >= max_value;
-}
-
+// Writes the given FST in the smallest compact bitfield layout that can
+// represent it. Returns false if there is no such layout.
 template <class Arc>
-void Compactify(const fst::VectorFst<Arc> &fst,
+bool Compactify(const fst::VectorFst<Arc> &fst,
                 const string &path) {
-  typedef festus::Compactor_8_10_0_14<fst::LogArc> MyCompactor;
-  for (auto s : festus::States(fst)) {
-    for (const auto &arc : festus::Arcs(fst, s)) {
-      if (OutOfRange(arc.ilabel, MyCompactor::kMaxILabel)) {
-        LOG(ERROR) << "ilabel out of range: " << arc.ilabel;
-      }
-      if (OutOfRange(arc.olabel, MyCompactor::kMaxOLabel)) {
-        LOG(ERROR) << "olabel out of range: " << arc.olabel;
-      }
-      if (OutOfRange(arc.nextstate, MyCompactor::kMaxState)) {
-        LOG(ERROR) << "nextstate out of range: " << arc.nextstate;
-      }
-    }
-  }
   fst::VectorFst<fst::LogArc> log_fst;
   festus::ConvertWeight(fst, &log_fst);
-  festus::LogCompact_8_10_0_14_Fst compact_fst(log_fst);
-  PrintInfo(compact_fst);
-  compact_fst.Write(path);
+  auto compact_fst = festus::MakeBitfieldCompactFst(log_fst);
+  if (!compact_fst) return false;
+  PrintInfo(*compact_fst);
+  return festus::WriteAlignedFst(*compact_fst, path);
+}
+
+// Returns the name of the runtime input tape (see
+// festus/runtime/input-labeler.h) for the given input label type.
+const char *InputTapeName(festus::LabelType type) {
+  switch (type) {
+    case festus::BYTE:
+      return "byte";
+    case festus::UNICODE:
+      return "unicode";
+    case festus::SYMBOL:
+      return "symbol";
+    default:
+      return nullptr;
+  }
 }
 
 }  // namespace
@@ -78,7 +80,25 @@ input and output sequences, respectively.
 
 This tool writes the two canonical projection/injection FSTs to the files
 specified on the command line. The FSTs are written in a compact representation
-and using Log arcs, for direct use with the runtime inference library.
+and using Log arcs, for direct use with the runtime inference library. The
+compact representation packs each arc into 32 or 64 bits, using the smallest
+layout that can hold all labels and state IDs (see compact.h). Their sections
+are aligned, so that the runtime can map them into memory.
+
+With --lookahead, the first FST is instead written as an input label lookahead
+FST, which makes the runtime compose it with the spelling using lookahead
+composition. Such an FST is larger and takes longer to load.
+
+With --dense_matcher, the first FST is instead written in const format together
+with an index of the input labels of each state, so that the runtime finds the
+arcs for each byte of the spelling in constant time rather than by binary
+search. The index takes 52 bytes per state plus 4 bytes per distinct label.
+
+The input tape of the first FST follows the input_label_type of the spec:
+bytes, Unicode codepoints, or symbols. The runtime must convert spellings in
+the same way (g2p-lookup --input_tape), which this tool reports. For symbol
+tapes, --input_symbols_out writes the input symbol table for use with
+g2p-lookup --input_symbols. The dense matcher only supports byte tapes.
 
 Usage:
   make-runtime-fsts --alignables=spec.txt input_to_pair.fst output_to_pair.fst
@@ -86,6 +106,12 @@ Usage:
 
 DEFINE_string(alignables, "", "Path to alignables spec");
 DEFINE_bool(compactify, true, "Store FSTs in compact format");
+DEFINE_bool(lookahead, false,
+            "Store the first FST in input label lookahead format");
+DEFINE_bool(dense_matcher, false,
+            "Store the first FST with a dense byte matcher index");
+DEFINE_string(input_symbols_out, "",
+              "Path for writing the input symbol table of a symbol tape");
 
 int main(int argc, char *argv[]) {
   SET_FLAGS(kUsage, &argc, &argv, true);
@@ -101,21 +127,63 @@ int main(int argc, char *argv[]) {
     return 2;
   }
 
+  if (FLAGS_lookahead && FLAGS_dense_matcher) {
+    LOG(ERROR) << "--lookahead and --dense_matcher are mutually exclusive";
+    return 2;
+  }
+
   auto util = festus::AlignablesUtil::FromFile(FLAGS_alignables);
   if (!util) return 2;
 
+  const char *input_tape = InputTapeName(util->InputLabelType());
+  if (input_tape == nullptr) {
+    LOG(ERROR) << "Unsupported input label type: " << util->InputLabelType();
+    return 2;
+  }
+  LOG(INFO) << "Input tape: " << input_tape;
+  if (FLAGS_dense_matcher && util->InputLabelType() != festus::BYTE) {
+    LOG(ERROR) << "--dense_matcher requires a byte input tape, but the spec "
+               << "has a " << input_tape << " input tape";
+    return 2;
+  }
+  if (!FLAGS_input_symbols_out.empty()) {
+    if (util->InputSymbols() == nullptr) {
+      LOG(ERROR) << "--input_symbols_out requires a symbol input tape";
+      return 2;
+    }
+    if (!util->InputSymbols()->WriteText(FLAGS_input_symbols_out)) return 1;
+  } else if (util->InputSymbols() != nullptr) {
+    LOG(WARNING) << "The runtime needs the input symbols of this spec; "
+                 << "write them with --input_symbols_out";
+  }
+
   const auto &i2p = util->InputToPairFst();
   fst::VectorFst<ARC_TYPE(i2p)> fst(i2p);
   // TODO: Also remove forbidden factors on the output side.
   fst.SetInputSymbols(nullptr);
   fst.SetOutputSymbols(nullptr);
-  if (FLAGS_compactify) {
-    Compactify(fst, out1);
+  if (FLAGS_lookahead) {
+    fst::VectorFst<fst::LogArc> log_fst;
+    festus::ConvertWeight(fst, &log_fst);
+    festus::ILabelLookAheadFst<fst::LogArc> lookahead_fst(log_fst);
+    PrintInfo(lookahead_fst);
+    if (!festus::WriteAlignedFst(lookahead_fst, out1)) return 1;
+    std::cerr << string(80, '-') << std::endl;
+  } else if (FLAGS_dense_matcher) {
+    fst::VectorFst<fst::LogArc> log_fst;
+    festus::ConvertWeight(fst, &log_fst);
+    fst::ArcSort(&log_fst, fst::ILabelCompare<fst::LogArc>());
+    festus::DenseByteFst<fst::LogArc> dense_fst(log_fst);
+    PrintInfo(dense_fst);
+    if (!festus::WriteAlignedFst(dense_fst, out1)) return 1;
+    std::cerr << string(80, '-') << std::endl;
+  } else if (FLAGS_compactify) {
+    if (!Compactify(fst, out1)) return 1;
     std::cerr << string(80, '-') << std::endl;
   } else {
     fst::VectorFst<fst::LogArc> log_fst;
     festus::ConvertWeight(fst, &log_fst);
-    log_fst.Write(out1);
+    if (!festus::WriteAlignedFst(log_fst, out1)) return 1;
   }
 
   fst = util->PairToOutputFst();
@@ -124,11 +192,11 @@ int main(int argc, char *argv[]) {
   fst::Invert(&fst);
   fst::ArcSort(&fst, fst::OLabelCompare<ARC_TYPE(fst)>());
   if (FLAGS_compactify) {
-    Compactify(fst, out2);
+    if (!Compactify(fst, out2)) return 1;
   } else {
     fst::VectorFst<fst::LogArc> log_fst;
     festus::ConvertWeight(fst, &log_fst);
-    log_fst.Write(out2);
+    if (!festus::WriteAlignedFst(log_fst, out2)) return 1;
   }
 
   return 0;
@@ -20,13 +20,19 @@
 // computed along the backoff path. This makes n-gram models usable with older
 // versions of OpenFst (<1.5.0).
 
+#include <cstddef>
 #include <cstring>
+#include <iostream>
 #include <memory>
+#include <sstream>
 
 #include <fst/compat.h>
 #include <fst/fstlib.h>
 #include <fst/extensions/ngram/ngram-fst.h>
 
+#include "festus/runtime/model-io.h"
+#include "festus/runtime/quantized.h"
+
 namespace festus {
 
 // OpenFst < 1.5.0 lacks the method fst::Matcher::Final(), so it cannot
@@ -84,11 +90,66 @@ bool MakeAllStatesFinal(fst::MutableFst<Arc> *fst,
 
 }  // namespace festus
 
+namespace {
+
+// Returns the number of bytes that fst occupies when written.
+template <class F>
+std::size_t WrittenSize(const F &fst) {
+  std::ostringstream strm;
+  fst.Write(strm, fst::FstWriteOptions("size"));
+  return strm.str().size();
+}
+
+// Writes a quantized copy of the n-gram model and prints its size relative to
+// the unquantized NGramFst, and the quantization errors, to stderr.
+bool WriteQuantized(const fst::VectorFst<fst::LogArc> &model,
+                    const fst::NGramFst<fst::LogArc> &ngram,
+                    int phi_label,
+                    int weight_bits,
+                    const string &path) {
+  festus::QuantizationReport report;
+  auto quantized = festus::MakeQuantizedCompactFst(model, phi_label,
+                                                   weight_bits, &report);
+  if (!quantized) return false;
+  const std::size_t ngram_size = WrittenSize(ngram);
+  const std::size_t quantized_size = WrittenSize(*quantized);
+  std::cerr << "type\t" << report.type << "\n"
+            << "ngram_bytes\t" << ngram_size << "\n"
+            << "quantized_bytes\t" << quantized_size << "\n"
+            << "size_ratio\t"
+            << static_cast<double>(quantized_size) / ngram_size << "\n"
+            << "probs\t" << report.num_probs << "\n"
+            << "prob_codebook_size\t" << report.prob_codebook_size << "\n"
+            << "prob_mean_error\t" << report.prob_mean_error << "\n"
+            << "prob_max_error\t" << report.prob_max_error << "\n"
+            << "backoffs\t" << report.num_backoffs << "\n"
+            << "backoff_codebook_size\t" << report.backoff_codebook_size
+            << "\n"
+            << "backoff_mean_error\t" << report.backoff_mean_error << "\n"
+            << "backoff_max_error\t" << report.backoff_max_error
+            << std::endl;
+  return festus::WriteAlignedFst(*quantized, path);
+}
+
+}  // namespace
+
 static const char kUsage[] =
     R"(Makes all states in an n-gram model final with their correct final
 weights computed along the backoff path. This makes n-gram models usable with
 older versions of OpenFst (<1.5.0).
 
+With --to_runtime_model, the model is converted to the NGramFst format used by
+the runtime. With --mappable in addition, it is written in a layout that the
+runtime can map into memory (see festus/runtime/model-io.h); such files can
+only be read by the runtime.
+
+With --to_runtime_model and --quantize_bits=8 or 16, the weights are instead
+quantized to that many bits and the model is written in the compact format of
+festus/runtime/quantized.h, which the runtime can always map into memory. The
+size of the quantized model relative to the NGramFst, and the mean and maximal
+absolute quantization errors (in nats) of the log-probabilities and backoff
+weights, are printed to stderr.
+
 Usage:
   ngramfinalize [--flags] [in.fst [out.fst]]
 )";
@@ -96,6 +157,10 @@ Usage:
 DEFINE_int32(phi_label, 0, "Phi (failure, backoff) label");
 
 DEFINE_bool(to_runtime_model, false, "Convert to the runtime model format");
+DEFINE_bool(mappable, false,
+            "Write the runtime model in memory-mappable format");
+DEFINE_int32(quantize_bits, 0,
+             "Quantize runtime model weights to 8 or 16 bits; 0 disables");
 
 int main(int argc, char *argv[]) {
   SET_FLAGS(kUsage, &argc, &argv, true);
@@ -118,7 +183,16 @@ int main(int argc, char *argv[]) {
     log_fst.SetInputSymbols(nullptr);
     log_fst.SetOutputSymbols(nullptr);
     fst::NGramFst<fst::LogArc> ngram(log_fst);
-    ngram.Write(out_name);
+    if (FLAGS_quantize_bits != 0) {
+      if (!WriteQuantized(log_fst, ngram, FLAGS_phi_label, FLAGS_quantize_bits,
+                          out_name)) {
+        return 1;
+      }
+    } else if (FLAGS_mappable) {
+      if (!festus::WriteMappableNGramFst(ngram, out_name)) return 1;
+    } else {
+      ngram.Write(out_name);
+    }
   } else {
     model->Write(out_name);
   }
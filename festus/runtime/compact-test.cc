@@ -0,0 +1,103 @@
+// festus/runtime/compact-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the bitfield compactors.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "compact.h"
+
+#include <memory>
+#include <sstream>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+
+static festus::BitfieldCompactFstRegisterer<MyArc> compact_reg;
+
+// Makes an unweighted chain with the given number of states, whose arcs have
+// the given labels.
+MyVectorFst MakeChain(int num_states, int ilabel, int olabel) {
+  MyVectorFst fst;
+  for (int s = 0; s < num_states; ++s) {
+    fst.AddState();
+  }
+  fst.SetStart(0);
+  for (int s = 0; s + 1 < num_states; ++s) {
+    fst.AddArc(s, MyArc(ilabel, olabel, MyArc::Weight::One(), s + 1));
+  }
+  fst.SetFinal(num_states - 1, MyArc::Weight::One());
+  return fst;
+}
+
+// Checks that the smallest layout for the given FST has the given type and
+// that the compact FST is equivalent to the original, also after a round trip
+// through the generic Fst<>::Read().
+void ExpectLayout(const MyVectorFst &fst, const string &compactor_type) {
+  auto compact_fst = festus::MakeBitfieldCompactFst(fst);
+  ASSERT_TRUE(compact_fst != nullptr);
+  EXPECT_EQ("compact_" + compactor_type, compact_fst->Type());
+  EXPECT_TRUE(fst::Equal(fst, *compact_fst));
+
+  std::stringstream strm;
+  ASSERT_TRUE(compact_fst->Write(strm, fst::FstWriteOptions("test")));
+  std::unique_ptr<fst::Fst<MyArc>> read_fst(
+      fst::Fst<MyArc>::Read(strm, fst::FstReadOptions("test")));
+  ASSERT_TRUE(read_fst != nullptr);
+  EXPECT_EQ(compact_fst->Type(), read_fst->Type());
+  EXPECT_TRUE(fst::Equal(fst, *read_fst));
+}
+
+TEST(CompactTest, Extent) {
+  const festus::BitfieldExtent extent =
+      festus::GetBitfieldExtent(MakeChain(5, 7, 300));
+  EXPECT_EQ(7, extent.max_ilabel);
+  EXPECT_EQ(300, extent.max_olabel);
+  EXPECT_EQ(4, extent.max_state);
+}
+
+TEST(CompactTest, ElementSizes) {
+  typedef festus::UnweightedBitfieldCompactor<MyArc, 8, 24, 32> WideCompactor;
+  EXPECT_EQ(4, sizeof(festus::Compactor_8_10_0_14<MyArc>::Element));
+  EXPECT_EQ(8, sizeof(WideCompactor::Element));
+}
+
+TEST(CompactTest, PicksSmallestLayout) {
+  // The original layout is preferred whenever it fits.
+  ExpectLayout(MakeChain(10, 254, 1022), "bitfield_8_10_0_14");
+  // More graphones than 10 bits can hold.
+  ExpectLayout(MakeChain(10, 97, 1023), "bitfield_8_12_0_12");
+  // More states than 14 bits can hold.
+  ExpectLayout(MakeChain(20000, 97, 200), "bitfield_8_8_0_16");
+  // More phonemes than 8 bits can hold.
+  ExpectLayout(MakeChain(10, 300, 300), "bitfield_10_10_0_12");
+  // Neither fits into 32 bits.
+  ExpectLayout(MakeChain(70000, 97, 5000), "bitfield_8_24_0_32");
+  ExpectLayout(MakeChain(10, 1000, 100000), "bitfield_16_24_0_24");
+}
+
+TEST(CompactTest, NoLayoutFits) {
+  EXPECT_TRUE(festus::MakeBitfieldCompactFst(MakeChain(2, 1 << 22, 1))
+              == nullptr);
+}
+
+}  // namespace
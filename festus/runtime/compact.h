@@ -17,20 +17,64 @@
 //
 // \file
 // Compactors for use with OpenFst's CompactFst template class.
+//
+// UnweightedBitfieldCompactor packs the input label, output label, and target
+// state of an unweighted arc into bitfields of a 32-bit or 64-bit element.
+// BitfieldCompactors lists the family of field widths that the runtime
+// supports; MakeBitfieldCompactFst() picks the smallest one that can represent
+// a given FST, and BitfieldCompactFstRegisterer registers all of them, so that
+// the generic Fst<>::Read() recognizes every variant.
 
 #ifndef FESTUS_RUNTIME_COMPACT_H__
 #define FESTUS_RUNTIME_COMPACT_H__
 
+#include <cstddef>
 #include <cstdio>
 #include <istream>
+#include <memory>
 #include <ostream>
+#include <tuple>
+#include <type_traits>
 
 #include <fst/compact-fst.h>
 #include <fst/compat.h>
 #include <fst/fst.h>
+#include <fst/register.h>
 
 namespace festus {
 
+// Largest label and state ID values of an FST, which determine whether a
+// given bitfield compactor can represent it.
+struct BitfieldExtent {
+  uint64 max_ilabel = 0;
+  uint64 max_olabel = 0;
+  uint64 max_state = 0;
+};
+
+template <class A>
+BitfieldExtent GetBitfieldExtent(const fst::Fst<A> &fst) {
+  BitfieldExtent extent;
+  for (fst::StateIterator<fst::Fst<A>> siter(fst); !siter.Done();
+       siter.Next()) {
+    const auto s = siter.Value();
+    CHECK_GE(s, 0);
+    if (static_cast<uint64>(s) > extent.max_state) extent.max_state = s;
+    for (fst::ArcIterator<fst::Fst<A>> aiter(fst, s); !aiter.Done();
+         aiter.Next()) {
+      const A &arc = aiter.Value();
+      CHECK_GE(arc.ilabel, 0);
+      CHECK_GE(arc.olabel, 0);
+      if (static_cast<uint64>(arc.ilabel) > extent.max_ilabel) {
+        extent.max_ilabel = arc.ilabel;
+      }
+      if (static_cast<uint64>(arc.olabel) > extent.max_olabel) {
+        extent.max_olabel = arc.olabel;
+      }
+    }
+  }
+  return extent;
+}
+
 template <class A, int ILABEL_BITS, int OLABEL_BITS, int NEXTSTATE_BITS>
 class UnweightedBitfieldCompactor {
  public:
@@ -39,15 +83,35 @@ class UnweightedBitfieldCompactor {
   typedef typename A::StateId StateId;
   typedef typename A::Weight Weight;
 
+  static_assert(ILABEL_BITS + OLABEL_BITS + NEXTSTATE_BITS <= 64,
+                "Bitfields do not fit into 64 bits");
+
+  // Elements occupy 32 bits if the fields fit, and 64 bits otherwise.
+  typedef typename std::conditional<
+    ILABEL_BITS + OLABEL_BITS + NEXTSTATE_BITS <= 32,
+    uint32, uint64>::type Storage;
+
   struct Element {
-    unsigned int ilabel : ILABEL_BITS;
-    unsigned int olabel : OLABEL_BITS;
-    unsigned int nextstate : NEXTSTATE_BITS;
+    Storage ilabel : ILABEL_BITS;
+    Storage olabel : OLABEL_BITS;
+    Storage nextstate : NEXTSTATE_BITS;
   };
 
-  static constexpr unsigned int kMaxILabel = (1 << ILABEL_BITS) - 1;
-  static constexpr unsigned int kMaxOLabel = (1 << OLABEL_BITS) - 1;
-  static constexpr unsigned int kMaxState = (1 << NEXTSTATE_BITS) - 1;
+  static_assert(sizeof(Element) == sizeof(Storage),
+                "Unexpected size of Element");
+
+  // The largest value of each field is reserved for kNoLabel or kNoStateId.
+  static constexpr uint64 kMaxILabel = (uint64{1} << ILABEL_BITS) - 1;
+  static constexpr uint64 kMaxOLabel = (uint64{1} << OLABEL_BITS) - 1;
+  static constexpr uint64 kMaxState = (uint64{1} << NEXTSTATE_BITS) - 1;
+
+  // Returns true if all labels and state IDs within the given extent can be
+  // represented.
+  static bool Fits(const BitfieldExtent &extent) {
+    return extent.max_ilabel < kMaxILabel &&
+        extent.max_olabel < kMaxOLabel &&
+        extent.max_state < kMaxState;
+  }
 
   Element Compact(StateId s, const A &arc) const {
     Element element;
@@ -55,7 +119,7 @@ class UnweightedBitfieldCompactor {
       element.ilabel = kMaxILabel;
     } else {
       CHECK_GE(arc.ilabel, 0);
-      const unsigned int label = arc.ilabel;
+      const uint64 label = arc.ilabel;
       if (label < kMaxILabel) {
         element.ilabel = label;
       } else {
@@ -67,7 +131,7 @@ class UnweightedBitfieldCompactor {
       element.olabel = kMaxOLabel;
     } else {
       CHECK_GE(arc.olabel, 0);
-      const unsigned int label = arc.olabel;
+      const uint64 label = arc.olabel;
       if (label < kMaxOLabel) {
         element.olabel = label;
       } else {
@@ -84,7 +148,7 @@ class UnweightedBitfieldCompactor {
       element.nextstate = kMaxState;
     } else {
       CHECK_GE(arc.nextstate, 0);
-      const unsigned int next = arc.nextstate;
+      const uint64 next = arc.nextstate;
       if (next < kMaxState) {
         element.nextstate = next;
       } else {
@@ -97,9 +161,12 @@ class UnweightedBitfieldCompactor {
 
   Arc Expand(StateId s, const Element &e,
              uint32 f = fst::kArcValueFlags) const {
-    Label ilabel = e.ilabel == kMaxILabel ? fst::kNoLabel : e.ilabel;
-    Label olabel = e.olabel == kMaxOLabel ? fst::kNoLabel : e.olabel;
-    StateId next = e.nextstate == kMaxState ? fst::kNoStateId : e.nextstate;
+    Label ilabel = e.ilabel == kMaxILabel
+        ? fst::kNoLabel : static_cast<Label>(e.ilabel);
+    Label olabel = e.olabel == kMaxOLabel
+        ? fst::kNoLabel : static_cast<Label>(e.olabel);
+    StateId next = e.nextstate == kMaxState
+        ? fst::kNoStateId : static_cast<StateId>(e.nextstate);
     return Arc(ilabel, olabel, Weight::One(), next);
   }
 
@@ -136,10 +203,6 @@ class UnweightedBitfieldCompactor {
 template <class A>
 using Compactor_8_10_0_14 = UnweightedBitfieldCompactor<A, 8, 10, 14>;
 
-static_assert(sizeof(Compactor_8_10_0_14<fst::StdArc>::Element[8])
-              ==               8+10+0+14,
-              "Unexpected size of Element");
-
 template <class A>
 using Compact_8_10_0_14_Fst = fst::CompactFst<A, Compactor_8_10_0_14<A>>;
 
@@ -147,6 +210,104 @@ typedef Compact_8_10_0_14_Fst<fst::StdArc> StdCompact_8_10_0_14_Fst;
 typedef Compact_8_10_0_14_Fst<fst::LogArc> LogCompact_8_10_0_14_Fst;
 typedef Compact_8_10_0_14_Fst<fst::Log64Arc> Log64Compact_8_10_0_14_Fst;
 
+// The family of bitfield layouts supported by the runtime, ordered by element
+// size. MakeBitfieldCompactFst() uses the first one that fits, so the
+// original 8/10/14 layout comes first. Layouts can be added, but must never
+// be removed, since existing model files refer to them by type name.
+template <class A>
+using BitfieldCompactors = std::tuple<
+    // 32-bit elements.
+    Compactor_8_10_0_14<A>,
+    UnweightedBitfieldCompactor<A, 8, 12, 12>,
+    UnweightedBitfieldCompactor<A, 8, 8, 16>,
+    UnweightedBitfieldCompactor<A, 8, 14, 10>,
+    UnweightedBitfieldCompactor<A, 10, 10, 12>,
+    // 64-bit elements.
+    UnweightedBitfieldCompactor<A, 8, 24, 32>,
+    UnweightedBitfieldCompactor<A, 16, 16, 32>,
+    UnweightedBitfieldCompactor<A, 16, 24, 24>,
+    UnweightedBitfieldCompactor<A, 21, 21, 22>>;
+
+namespace internal {
+
+// Calls visitor->Visit<C>() for each type C in the given tuple type, in order.
+template <class Tuple, std::size_t I = 0,
+          bool kDone = (I == std::tuple_size<Tuple>::value)>
+struct ForEachTupleType {
+  template <class Visitor>
+  static void Apply(Visitor *visitor) {
+    visitor->template Visit<typename std::tuple_element<I, Tuple>::type>();
+    ForEachTupleType<Tuple, I + 1>::Apply(visitor);
+  }
+};
+
+template <class Tuple, std::size_t I>
+struct ForEachTupleType<Tuple, I, true> {
+  template <class Visitor>
+  static void Apply(Visitor *visitor) {}
+};
+
+template <class A>
+class BitfieldCompactFstMaker {
+ public:
+  BitfieldCompactFstMaker(const fst::Fst<A> &fst, const BitfieldExtent &extent)
+      : fst_(fst), extent_(extent) {}
+
+  template <class C>
+  void Visit() {
+    if (!result_ && C::Fits(extent_)) {
+      result_.reset(new fst::CompactFst<A, C>(fst_));
+    }
+  }
+
+  std::unique_ptr<fst::Fst<A>> Release() { return std::move(result_); }
+
+ private:
+  const fst::Fst<A> &fst_;
+  const BitfieldExtent &extent_;
+  std::unique_ptr<fst::Fst<A>> result_;
+};
+
+// Registers CompactFst<A, C> for each compactor type C visited.
+template <class A>
+struct CompactFstRegistrar {
+  template <class C>
+  void Visit() {
+    fst::FstRegisterer<fst::CompactFst<A, C>> registerer;
+  }
+};
+
+}  // namespace internal
+
+// Returns a copy of the given unweighted FST in the smallest bitfield layout
+// that can represent all its labels and state IDs, or nullptr if there is
+// none.
+template <class A>
+std::unique_ptr<fst::Fst<A>> MakeBitfieldCompactFst(const fst::Fst<A> &fst) {
+  const BitfieldExtent extent = GetBitfieldExtent(fst);
+  internal::BitfieldCompactFstMaker<A> maker(fst, extent);
+  internal::ForEachTupleType<BitfieldCompactors<A>>::Apply(&maker);
+  auto result = maker.Release();
+  if (!result) {
+    LOG(ERROR) << "No bitfield layout can represent input labels up to "
+               << extent.max_ilabel << ", output labels up to "
+               << extent.max_olabel << ", and state IDs up to "
+               << extent.max_state;
+  }
+  return result;
+}
+
+// Registers the CompactFst types of all layouts in BitfieldCompactors<A>.
+// Declare a static instance for each arc type, like fst::FstRegisterer.
+template <class A>
+class BitfieldCompactFstRegisterer {
+ public:
+  BitfieldCompactFstRegisterer() {
+    internal::CompactFstRegistrar<A> registrar;
+    internal::ForEachTupleType<BitfieldCompactors<A>>::Apply(&registrar);
+  }
+};
+
 }  // namespace festus
 
 #endif  // FESTUS_RUNTIME_COMPACT_H__
@@ -0,0 +1,174 @@
+// festus/runtime/compile-lexicon.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Compiles a pronunciation lexicon in TSV format into a memory-mappable file.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "mapped-lexicon.h"
+
+namespace {
+
+// Splits a line into at most max_fields tab-separated fields.
+std::vector<string> SplitTabs(const string &line, std::size_t max_fields) {
+  std::vector<string> fields;
+  std::size_t pos = 0;
+  while (fields.size() + 1 < max_fields) {
+    auto tab = line.find('\t', pos);
+    if (tab == string::npos) break;
+    fields.push_back(line.substr(pos, tab - pos));
+    pos = tab + 1;
+  }
+  fields.push_back(line.substr(pos));
+  return fields;
+}
+
+// Reads lexicon entries from a stream. Each line contains a word, a
+// pronunciation, and optionally the probability of the pronunciation; any
+// further columns are ignored. Pronunciations without a probability share the
+// probability mass that the explicit probabilities of their word leave over
+// evenly. Fails if the explicit probabilities of a word sum to more than 1.
+bool ReadLexicon(std::istream &strm, const string &source,
+                 festus::LexiconEntries *entries) {
+  std::size_t lineno = 0;
+  for (string line; std::getline(strm, line); /*empty*/) {
+    ++lineno;
+    if (line.empty() || line[0] == '#') continue;
+    auto fields = SplitTabs(line, 4);
+    if (fields.size() < 2 || fields[0].empty()) {
+      LOG(ERROR) << source << ":" << lineno << ": Expected at least 2 fields";
+      return false;
+    }
+    auto &prons = (*entries)[fields[0]];
+    bool duplicate = false;
+    for (const auto &pron : prons) {
+      duplicate |= pron.first == fields[1];
+    }
+    if (duplicate) {
+      VLOG(1) << source << ":" << lineno << ": Skipping duplicate entry";
+      continue;
+    }
+    float prob = -1;
+    if (fields.size() > 2) {
+      char *end;
+      prob = std::strtof(fields[2].c_str(), &end);
+      if (*end != '\0' || prob < 0 || prob > 1) {
+        LOG(ERROR) << source << ":" << lineno << ": Invalid probability: "
+                   << fields[2];
+        return false;
+      }
+    }
+    prons.emplace_back(fields[1], prob);
+  }
+  for (auto &entry : *entries) {
+    auto &prons = entry.second;
+    double explicit_mass = 0;
+    std::size_t num_implicit = 0;
+    for (const auto &pron : prons) {
+      if (pron.second < 0) {
+        ++num_implicit;
+      } else {
+        explicit_mass += pron.second;
+      }
+    }
+    if (explicit_mass > 1 + 1e-4) {
+      LOG(ERROR) << source << ": Probabilities of " << entry.first
+                 << " sum to " << explicit_mass << ", which exceeds 1";
+      return false;
+    }
+    if (num_implicit > 0) {
+      const float implicit_prob =
+          std::max(0.0, 1 - explicit_mass) / num_implicit;
+      for (auto &pron : prons) {
+        if (pron.second < 0) pron.second = implicit_prob;
+      }
+    }
+    // Keep the order of the input among pronunciations of equal probability.
+    std::stable_sort(prons.begin(), prons.end(),
+                     [](const std::pair<string, float> &a,
+                        const std::pair<string, float> &b) {
+                       return a.second > b.second;
+                     });
+  }
+  return true;
+}
+
+}  // namespace
+
+static const char kUsage[] =
+    R"(Compiles a pronunciation lexicon into a memory-mappable file.
+
+The input lexicon is in tab-separated value (TSV) format, with an orthographic
+word in the first column, a pronunciation in the second column, and optionally
+the probability of the pronunciation in the third column (as in the output of
+g2p-lookup). Pronunciations without a probability evenly share whatever mass
+the other pronunciations of their word leave over. Empty lines and lines
+starting with '#' are ignored.
+
+The compiled lexicon can be used with g2p-lookup --lexicon.
+
+Usage:
+  compile-lexicon [in.tsv [out.lex]]
+)";
+
+int main(int argc, char *argv[]) {
+  SET_FLAGS(kUsage, &argc, &argv, true);
+  if (argc > 3) {
+    ShowUsage();
+    return 2;
+  }
+
+  string in_name = (argc > 1 && std::strcmp(argv[1], "-") != 0) ? argv[1] : "";
+  string out_name = (argc > 2 && std::strcmp(argv[2], "-") != 0) ? argv[2] : "";
+
+  festus::LexiconEntries entries;
+  if (in_name.empty()) {
+    if (!ReadLexicon(std::cin, "stdin", &entries)) return 2;
+  } else {
+    std::ifstream file(in_name);
+    if (!file) {
+      LOG(ERROR) << "Could not open " << in_name;
+      return 2;
+    }
+    if (!ReadLexicon(file, in_name, &entries)) return 2;
+  }
+  VLOG(1) << "Read " << entries.size() << " words";
+
+  bool success;
+  if (out_name.empty()) {
+    success = festus::WriteMappedLexicon(entries, std::cout);
+  } else {
+    std::ofstream file(out_name, std::ios::out | std::ios::binary);
+    success = festus::WriteMappedLexicon(entries, file);
+  }
+  if (!success) {
+    LOG(ERROR) << "Could not write lexicon";
+    return 1;
+  }
+  return 0;
+}
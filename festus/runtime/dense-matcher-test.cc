@@ -0,0 +1,216 @@
+// festus/runtime/dense-matcher-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the dense byte matcher.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "dense-matcher.h"
+
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+typedef festus::DenseByteFst<MyArc> MyDenseFst;
+
+static fst::FstRegisterer<MyDenseFst> dense_reg;
+
+// Makes an input-label-sorted FST whose states have various numbers of arcs,
+// including runs of arcs with the same label and input epsilons.
+MyVectorFst MakeTestFst() {
+  MyVectorFst fst;
+  const int kNumStates = 20;
+  for (int s = 0; s < kNumStates; ++s) {
+    fst.AddState();
+  }
+  fst.SetStart(0);
+  fst.SetFinal(kNumStates - 1, MyArc::Weight::One());
+  unsigned int seed = 1;
+  for (int s = 0; s < kNumStates; ++s) {
+    for (int i = 0; i < 3 * s; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int label = (seed >> 8) % (s % 2 ? 256 : 8);
+      fst.AddArc(s, MyArc(label, i + 1, 0.5f * i, (s + i) % kNumStates));
+    }
+  }
+  fst::ArcSort(&fst, fst::ILabelCompare<MyArc>());
+  return fst;
+}
+
+// Collects the arcs that the matcher finds for the given label.
+std::vector<MyArc> FindAll(fst::MatcherBase<MyArc> *matcher,
+                           MyArc::Label label) {
+  std::vector<MyArc> arcs;
+  for (matcher->Find(label); !matcher->Done(); matcher->Next()) {
+    arcs.push_back(matcher->Value());
+  }
+  return arcs;
+}
+
+// Checks that the dense matcher of fst finds the same arcs as a SortedMatcher.
+void ExpectSameMatches(const MyVectorFst &reference,
+                       const fst::Fst<MyArc> &fst) {
+  std::unique_ptr<fst::MatcherBase<MyArc>> matcher(
+      fst.InitMatcher(fst::MATCH_INPUT));
+  ASSERT_TRUE(matcher != nullptr);
+  EXPECT_EQ(fst::MATCH_INPUT, matcher->Type(true));
+  fst::SortedMatcher<MyVectorFst> sorted_matcher(reference, fst::MATCH_INPUT);
+  for (fst::StateIterator<MyVectorFst> siter(reference); !siter.Done();
+       siter.Next()) {
+    matcher->SetState(siter.Value());
+    sorted_matcher.SetState(siter.Value());
+    for (int label = fst::kNoLabel; label < 300; ++label) {
+      const auto expected = FindAll(&sorted_matcher, label);
+      const auto actual = FindAll(matcher.get(), label);
+      ASSERT_EQ(expected.size(), actual.size()) << label;
+      for (std::size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(expected[i].ilabel, actual[i].ilabel);
+        EXPECT_EQ(expected[i].olabel, actual[i].olabel);
+        EXPECT_EQ(expected[i].weight, actual[i].weight);
+        EXPECT_EQ(expected[i].nextstate, actual[i].nextstate);
+      }
+    }
+  }
+}
+
+TEST(DenseByteMatcherTest, MatchesLikeSortedMatcher) {
+  const MyVectorFst fst = MakeTestFst();
+  MyDenseFst dense_fst(fst);
+  EXPECT_EQ(festus::kDenseByteFstType, dense_fst.Type());
+  EXPECT_TRUE(fst::Equal(fst, dense_fst));
+  ExpectSameMatches(fst, dense_fst);
+}
+
+TEST(DenseByteMatcherTest, ReadWrite) {
+  const MyVectorFst fst = MakeTestFst();
+  std::stringstream strm;
+  ASSERT_TRUE(MyDenseFst(fst).Write(strm, fst::FstWriteOptions("test")));
+  std::unique_ptr<fst::Fst<MyArc>> read_fst(
+      fst::Fst<MyArc>::Read(strm, fst::FstReadOptions("test")));
+  ASSERT_TRUE(read_fst != nullptr);
+  EXPECT_EQ(festus::kDenseByteFstType, read_fst->Type());
+  EXPECT_TRUE(fst::Equal(fst, *read_fst));
+  ExpectSameMatches(fst, *read_fst);
+}
+
+TEST(DenseByteMatcherTest, RejectsInconsistentIndex) {
+  // A single state with one arc labeled 1.
+  const std::vector<uint64> bits = {2, 0, 0, 0};
+  const std::vector<uint32> ranks = {0, 1, 1, 1};
+  auto read = [&bits, &ranks](const std::vector<uint32> &positions) {
+    std::stringstream strm;
+    fst::WriteType(strm, bits);
+    fst::WriteType(strm, ranks);
+    fst::WriteType(strm, positions);
+    return std::unique_ptr<festus::DenseByteIndex>(
+        festus::DenseByteIndex::Read(strm, fst::FstReadOptions("test")));
+  };
+  const std::vector<uint32> positions = {0, 1};
+  std::unique_ptr<festus::DenseByteIndex> index = read(positions);
+  ASSERT_TRUE(index != nullptr);
+  std::size_t begin, end;
+  ASSERT_TRUE(index->Find(0, 1, &begin, &end));
+  EXPECT_EQ(0u, begin);
+  EXPECT_EQ(1u, end);
+  // Missing the sentinel of the state.
+  EXPECT_TRUE(read({0}) == nullptr);
+  EXPECT_TRUE(read({}) == nullptr);
+  EXPECT_TRUE(read({0, 1, 1}) == nullptr);
+}
+
+TEST(DenseByteMatcherTest, RejectsIndexOfOtherFst) {
+  const MyVectorFst fst = MakeTestFst();
+  const fst::ConstFst<MyArc> const_fst(fst);
+  // An index read back for a copy of the FST that lacks one arc.
+  MyVectorFst other = fst;
+  other.DeleteArcs(5, 1);
+  std::stringstream strm;
+  ASSERT_TRUE(festus::DenseByteIndex::Build(other)->Write(
+      strm, fst::FstWriteOptions("test")));
+  std::shared_ptr<festus::DenseByteIndex> index(
+      festus::DenseByteIndex::Read(strm, fst::FstReadOptions("test")));
+  ASSERT_TRUE(index != nullptr);
+  festus::DenseByteMatcher<fst::ConstFst<MyArc>> matcher(
+      const_fst, fst::MATCH_INPUT, index);
+  EXPECT_TRUE(matcher.GetData() == nullptr);
+  // An index for an FST with fewer states.
+  MyVectorFst truncated = fst;
+  truncated.DeleteStates({truncated.NumStates() - 1});
+  festus::DenseByteMatcher<fst::ConstFst<MyArc>> truncated_matcher(
+      const_fst, fst::MATCH_INPUT, festus::DenseByteIndex::Build(truncated));
+  EXPECT_TRUE(truncated_matcher.GetData() == nullptr);
+  // The matchers fall back to binary search.
+  fst::SortedMatcher<MyVectorFst> sorted_matcher(fst, fst::MATCH_INPUT);
+  for (int state = 0; state < fst.NumStates(); ++state) {
+    matcher.SetState(state);
+    truncated_matcher.SetState(state);
+    sorted_matcher.SetState(state);
+    for (int label = 0; label < 256; ++label) {
+      const auto expected = FindAll(&sorted_matcher, label).size();
+      EXPECT_EQ(expected, FindAll(&matcher, label).size());
+      EXPECT_EQ(expected, FindAll(&truncated_matcher, label).size());
+    }
+  }
+  // An index for the FST itself is kept.
+  festus::DenseByteMatcher<fst::ConstFst<MyArc>> fitting_matcher(
+      const_fst, fst::MATCH_INPUT, festus::DenseByteIndex::Build(fst));
+  EXPECT_TRUE(fitting_matcher.GetData() != nullptr);
+}
+
+TEST(DenseByteMatcherTest, Compose) {
+  const MyVectorFst fst = MakeTestFst();
+  MyVectorFst spelling;
+  spelling.AddState();
+  spelling.SetStart(0);
+  for (int label : {3, 200, 5, 0, 7}) {
+    const auto next = spelling.AddState();
+    spelling.AddArc(next - 1, MyArc(label, label, 0, next));
+  }
+  spelling.SetFinal(spelling.NumStates() - 1, MyArc::Weight::One());
+  MyVectorFst expected, actual;
+  fst::Compose(spelling, fst::ConstFst<MyArc>(fst), &expected);
+  fst::Compose(spelling, MyDenseFst(fst), &actual);
+  EXPECT_TRUE(fst::Equal(expected, actual));
+}
+
+TEST(DenseByteMatcherTest, FallsBackWithoutIndex) {
+  // Labels beyond the byte range cannot be indexed.
+  MyVectorFst fst;
+  fst.AddState();
+  fst.SetStart(0);
+  fst.SetFinal(0, MyArc::Weight::One());
+  fst.AddArc(0, MyArc(1, 1, 0, 0));
+  fst.AddArc(0, MyArc(300, 2, 0, 0));
+  const fst::ConstFst<MyArc> const_fst(fst);
+  festus::DenseByteMatcher<fst::ConstFst<MyArc>> matcher(const_fst,
+                                                         fst::MATCH_INPUT);
+  EXPECT_TRUE(matcher.GetData() == nullptr);
+  matcher.SetState(0);
+  ASSERT_TRUE(matcher.Find(300));
+  EXPECT_EQ(2, matcher.Value().olabel);
+  ExpectSameMatches(fst, MyDenseFst(fst));
+}
+
+}  // namespace
@@ -0,0 +1,385 @@
+// festus/runtime/dense-matcher.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// FSTs over byte input labels with constant-time input label matching.
+//
+// A DenseByteFst carries a per-state index of its input labels: a 256-bit
+// bitmap of the labels that occur at the state, together with rank counts and
+// the position of the first arc for each label. Its matcher finds the arcs
+// with a given input label with a bitmap test and a population count, instead
+// of the binary search over the arcs of the state that SortedMatcher performs.
+// When such an FST appears as the second argument of a ComposeFst, OpenFst
+// uses its matcher automatically.
+//
+// Unlike ILabelLookAheadFst, the input labels are not renumbered, so a
+// DenseByteFst can be used wherever the underlying ConstFst could.
+
+#ifndef FESTUS_RUNTIME_DENSE_MATCHER_H__
+#define FESTUS_RUNTIME_DENSE_MATCHER_H__
+
+#include <bitset>
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+#include <fst/matcher-fst.h>
+
+namespace festus {
+
+// Index of the arcs of each state by input label, for labels in [0, 256).
+class DenseByteIndex {
+ public:
+  static constexpr int kNumLabels = 256;
+
+  // Builds the index for the given FST. Returns nullptr if the FST is not
+  // sorted by input label or has input labels outside [0, kNumLabels).
+  template <class F>
+  static std::shared_ptr<DenseByteIndex> Build(const F &fst) {
+    typedef typename F::Arc Arc;
+    if (!fst.Properties(fst::kILabelSorted, true)) {
+      LOG(WARNING) << "DenseByteIndex: FST is not sorted by input label";
+      return nullptr;
+    }
+    std::shared_ptr<DenseByteIndex> index(new DenseByteIndex());
+    const auto num_states = fst::CountStates(fst);
+    index->bits_.assign(num_states * kWordsPerState, 0);
+    index->ranks_.assign(num_states * kWordsPerState, 0);
+    for (fst::StateIterator<F> siter(fst); !siter.Done(); siter.Next()) {
+      const auto state = siter.Value();
+      uint64 *bits = &index->bits_[state * kWordsPerState];
+      uint32 pos = 0;
+      for (fst::ArcIterator<F> aiter(fst, state); !aiter.Done();
+           aiter.Next(), ++pos) {
+        const typename Arc::Label label = aiter.Value().ilabel;
+        if (label < 0 || label >= kNumLabels) {
+          LOG(WARNING) << "DenseByteIndex: Input label " << label
+                       << " is out of range";
+          return nullptr;
+        }
+        const uint64 bit = uint64{1} << (label % kBitsPerWord);
+        if (!(bits[label / kBitsPerWord] & bit)) {
+          bits[label / kBitsPerWord] |= bit;
+          index->positions_.push_back(pos);
+        }
+      }
+      // Sentinel that ends the arcs with the largest label.
+      index->positions_.push_back(pos);
+    }
+    // Turn the bitmaps into rank counts, in the order of the positions.
+    uint32 rank = 0;
+    for (typename Arc::StateId state = 0; state < num_states; ++state) {
+      for (int word = 0; word < kWordsPerState; ++word) {
+        const std::size_t i = state * kWordsPerState + word;
+        index->ranks_[i] = rank;
+        rank += Popcount(index->bits_[i]);
+      }
+      ++rank;  // Skip the sentinel.
+    }
+    return index;
+  }
+
+  // Finds the arcs of the given state with the given input label. If there
+  // are any, sets [*begin, *end) to their positions among the arcs of the
+  // state and returns true.
+  bool Find(int64 state, int64 label,
+            std::size_t *begin, std::size_t *end) const {
+    if (label < 0 || label >= kNumLabels) return false;
+    const std::size_t i = state * kWordsPerState + label / kBitsPerWord;
+    const uint64 bit = uint64{1} << (label % kBitsPerWord);
+    if (!(bits_[i] & bit)) return false;
+    const uint32 rank = ranks_[i] + Popcount(bits_[i] & (bit - 1));
+    *begin = positions_[rank];
+    *end = positions_[rank + 1];
+    return true;
+  }
+
+  std::size_t NumStates() const { return bits_.size() / kWordsPerState; }
+
+  // Checks that the index can be used with the given FST: it must have as
+  // many states as the FST, and the positions of each state must increase
+  // and end in the number of arcs of the state, so that Find() stays within
+  // the arcs of the state. Since every matcher of a DenseByteFst attaches
+  // the index to the same FST, the positions are only checked against the
+  // first FST passed here, and the result is remembered.
+  template <class F>
+  bool Fits(const F &fst) const {
+    const auto num_states = fst::CountStates(fst);
+    if (num_states < 0 ||
+        NumStates() != static_cast<std::size_t>(num_states)) {
+      LOG(WARNING) << "DenseByteIndex: Index has " << NumStates()
+                   << " states, but the FST has " << num_states;
+      return false;
+    }
+    std::call_once(fits_once_, [this, &fst]() {
+      fits_ = PositionsFit(fst);
+    });
+    return fits_;
+  }
+
+  // Size of the index in bytes.
+  std::size_t Size() const {
+    return bits_.size() * sizeof(bits_[0]) +
+        ranks_.size() * sizeof(ranks_[0]) +
+        positions_.size() * sizeof(positions_[0]);
+  }
+
+  bool Write(std::ostream &strm, const fst::FstWriteOptions &opts) const {
+    fst::WriteType(strm, bits_);
+    fst::WriteType(strm, ranks_);
+    fst::WriteType(strm, positions_);
+    if (strm.fail()) {
+      LOG(ERROR) << "DenseByteIndex::Write: Write failed: " << opts.source;
+      return false;
+    }
+    return true;
+  }
+
+  static DenseByteIndex *Read(std::istream &strm,
+                              const fst::FstReadOptions &opts) {
+    std::unique_ptr<DenseByteIndex> index(new DenseByteIndex());
+    fst::ReadType(strm, &index->bits_);
+    fst::ReadType(strm, &index->ranks_);
+    fst::ReadType(strm, &index->positions_);
+    if (strm.fail() || index->bits_.size() != index->ranks_.size() ||
+        index->bits_.size() % kWordsPerState != 0) {
+      LOG(ERROR) << "DenseByteIndex::Read: Read failed: " << opts.source;
+      return nullptr;
+    }
+    if (!index->IsConsistent()) {
+      LOG(ERROR) << "DenseByteIndex::Read: Inconsistent index: "
+                 << opts.source;
+      return nullptr;
+    }
+    return index.release();
+  }
+
+ private:
+  static constexpr int kBitsPerWord = 64;
+  static constexpr int kWordsPerState = kNumLabels / kBitsPerWord;
+
+  DenseByteIndex() = default;
+
+  static uint32 Popcount(uint64 word) {
+    return std::bitset<kBitsPerWord>(word).count();
+  }
+
+  template <class F>
+  bool PositionsFit(const F &fst) const {
+    for (std::size_t state = 0; state < NumStates(); ++state) {
+      const std::size_t first = ranks_[state * kWordsPerState];
+      const std::size_t sentinel =
+          state + 1 < NumStates() ? ranks_[(state + 1) * kWordsPerState] - 1
+                                  : positions_.size() - 1;
+      for (std::size_t i = first; i < sentinel; ++i) {
+        if (positions_[i] >= positions_[i + 1]) {
+          LOG(WARNING) << "DenseByteIndex: Positions of state " << state
+                       << " do not increase";
+          return false;
+        }
+      }
+      if (positions_[sentinel] != fst.NumArcs(state)) {
+        LOG(WARNING) << "DenseByteIndex: State " << state << " has "
+                     << fst.NumArcs(state) << " arcs, but the index ends at "
+                     << positions_[sentinel];
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Checks that the rank counts agree with the bitmaps, and that there is a
+  // position for every label and a sentinel for every state, so that Find()
+  // stays within positions_.
+  bool IsConsistent() const {
+    std::size_t rank = 0;
+    for (std::size_t i = 0; i < bits_.size(); ++i) {
+      if (ranks_[i] != rank) return false;
+      rank += Popcount(bits_[i]);
+      if (i % kWordsPerState == kWordsPerState - 1) ++rank;  // Sentinel.
+    }
+    return positions_.size() == rank;
+  }
+
+  // For each state, the bitmap of its input labels.
+  std::vector<uint64> bits_;
+  // For each word of a bitmap, the index into positions_ of its first label.
+  std::vector<uint32> ranks_;
+  // For each state, the position of the first arc for each of its labels in
+  // increasing order, followed by the number of arcs of the state.
+  std::vector<uint32> positions_;
+  // Whether the positions fit the FST that Fits() was first called with.
+  mutable std::once_flag fits_once_;
+  mutable bool fits_ = false;
+};
+
+// Matcher that uses a DenseByteIndex to find arcs by input label. The FST
+// must expose its arcs as arrays to InitArcIterator(), as ConstFst does.
+// Output label matching (and input label matching without an index, or with
+// an index that does not fit the FST) is delegated to a SortedMatcher.
+template <class F>
+class DenseByteMatcher : public fst::MatcherBase<typename F::Arc> {
+ public:
+  typedef F FST;
+  typedef typename F::Arc Arc;
+  typedef typename Arc::Label Label;
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Weight Weight;
+  typedef DenseByteIndex MatcherData;
+
+  DenseByteMatcher(const FST &fst, fst::MatchType match_type,
+                   std::shared_ptr<MatcherData> data = nullptr)
+      : DenseByteMatcher(fst.Copy(), match_type, std::move(data)) {
+    owned_fst_.reset(&fst_);
+  }
+
+  // This doesn't copy the FST.
+  DenseByteMatcher(const FST *fst, fst::MatchType match_type,
+                   std::shared_ptr<MatcherData> data = nullptr)
+      : fst_(*fst),
+        match_type_(match_type),
+        data_(std::move(data)),
+        loop_(fst::kNoLabel, 0, Weight::One(), fst::kNoStateId) {
+    if (match_type_ == fst::MATCH_INPUT) {
+      if (!data_) {
+        data_ = MatcherData::Build(fst_);
+      } else if (!data_->Fits(fst_)) {
+        LOG(WARNING) << "DenseByteMatcher: Index does not fit the FST; "
+                     << "falling back to binary search";
+        data_.reset();
+      }
+    }
+    if (match_type_ != fst::MATCH_INPUT || !data_) {
+      fallback_.reset(new fst::SortedMatcher<FST>(&fst_, match_type_));
+    }
+  }
+
+  // This makes a copy of the FST.
+  DenseByteMatcher(const DenseByteMatcher<FST> &matcher, bool safe = false)
+      : owned_fst_(matcher.fst_.Copy(safe)),
+        fst_(*owned_fst_),
+        match_type_(matcher.match_type_),
+        data_(matcher.data_),
+        loop_(matcher.loop_) {
+    if (matcher.fallback_) {
+      fallback_.reset(new fst::SortedMatcher<FST>(&fst_, match_type_));
+    }
+  }
+
+  DenseByteMatcher<FST> *Copy(bool safe = false) const override {
+    return new DenseByteMatcher<FST>(*this, safe);
+  }
+
+  fst::MatchType Type(bool test) const override {
+    return fallback_ ? fallback_->Type(test) : fst::MATCH_INPUT;
+  }
+
+  void SetState(StateId s) override {
+    if (fallback_) {
+      fallback_->SetState(s);
+      return;
+    }
+    if (state_ == s) return;
+    state_ = s;
+    fst::ArcIteratorData<Arc> data;
+    fst_.InitArcIterator(s, &data);
+    DCHECK(data.base == nullptr);
+    arcs_ = data.arcs;
+    current_ = end_ = arcs_;
+    current_loop_ = false;
+    loop_.nextstate = s;
+  }
+
+  bool Find(Label label) override {
+    if (fallback_) return fallback_->Find(label);
+    current_loop_ = label == 0;
+    std::size_t begin, end;
+    if (data_->Find(state_, label == fst::kNoLabel ? 0 : label,
+                    &begin, &end)) {
+      current_ = arcs_ + begin;
+      end_ = arcs_ + end;
+    } else {
+      current_ = end_ = arcs_;
+    }
+    return current_loop_ || current_ != end_;
+  }
+
+  bool Done() const override {
+    if (fallback_) return fallback_->Done();
+    return !current_loop_ && current_ == end_;
+  }
+
+  const Arc &Value() const override {
+    if (fallback_) return fallback_->Value();
+    return current_loop_ ? loop_ : *current_;
+  }
+
+  void Next() override {
+    if (fallback_) {
+      fallback_->Next();
+    } else if (current_loop_) {
+      current_loop_ = false;
+    } else {
+      ++current_;
+    }
+  }
+
+  const FST &GetFst() const override { return fst_; }
+
+  uint64 Properties(uint64 inprops) const override {
+    return fallback_ ? fallback_->Properties(inprops) : inprops;
+  }
+
+  uint32 Flags() const override {
+    return fallback_ ? fallback_->Flags() : 0;
+  }
+
+  const MatcherData *GetData() const { return data_.get(); }
+
+  std::shared_ptr<MatcherData> GetSharedData() const { return data_; }
+
+ private:
+  std::unique_ptr<const FST> owned_fst_;
+  const FST &fst_;
+  const fst::MatchType match_type_;
+  std::shared_ptr<MatcherData> data_;
+  std::unique_ptr<fst::SortedMatcher<FST>> fallback_;
+  StateId state_ = fst::kNoStateId;
+  const Arc *arcs_ = nullptr;
+  const Arc *current_ = nullptr;
+  const Arc *end_ = nullptr;
+  bool current_loop_ = false;
+  Arc loop_;  // The implicit epsilon self-loop matched by Find(0).
+};
+
+static constexpr char kDenseByteFstType[] = "dense_byte";
+
+template <class Arc>
+using DenseByteFst = fst::MatcherFst<
+    fst::ConstFst<Arc>,
+    DenseByteMatcher<fst::ConstFst<Arc>>,
+    kDenseByteFstType>;
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_DENSE_MATCHER_H__
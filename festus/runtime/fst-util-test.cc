@@ -0,0 +1,267 @@
+// festus/runtime/fst-util-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for FST utilities of the runtime library.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "fst-util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+
+// Makes an acyclic lattice with states in non-topological order and with a
+// state that is not coaccessible.
+MyVectorFst MakeLattice() {
+  MyVectorFst lattice;
+  for (int i = 0; i < 6; ++i) {
+    lattice.AddState();
+  }
+  lattice.SetStart(0);
+  lattice.AddArc(0, MyArc(1, 1, 0.5f, 3));
+  lattice.AddArc(0, MyArc(2, 2, 1.0f, 2));
+  lattice.AddArc(3, MyArc(3, 3, 0.25f, 2));
+  lattice.AddArc(3, MyArc(4, 4, 2.0f, 1));
+  lattice.AddArc(2, MyArc(5, 5, 0.0f, 1));
+  lattice.AddArc(2, MyArc(6, 6, 1.0f, 5));  // State 5 is a dead end.
+  lattice.AddArc(1, MyArc(7, 7, 0.0f, 4));
+  lattice.SetFinal(1, 3.0f);
+  lattice.SetFinal(4, 0.5f);
+  return lattice;
+}
+
+TEST(FstUtilTest, NegLogSumExp) {
+  EXPECT_EQ(std::numeric_limits<double>::infinity(),
+            festus::NegLogSumExp({}));
+  EXPECT_DOUBLE_EQ(2.0, festus::NegLogSumExp({2.0}));
+  EXPECT_NEAR(-std::log(std::exp(-1.0) + std::exp(-3.0)),
+              festus::NegLogSumExp(
+                  {1.0, 3.0, std::numeric_limits<double>::infinity()}),
+              1e-12);
+  // Large values must not underflow.
+  EXPECT_NEAR(1000 - std::log(2.0), festus::NegLogSumExp({1000.0, 1000.0}),
+              1e-9);
+  // Sums of any length agree with std::exp(), including terms far below the
+  // smallest one.
+  std::vector<double> x;
+  for (int n = 1; n <= 9; ++n) {
+    x.push_back(0.37 * n * n);
+    double sum = 0;
+    for (double xi : x) sum += std::exp(-xi);
+    EXPECT_NEAR(-std::log(sum), festus::NegLogSumExp(x), 1e-12) << n;
+  }
+  EXPECT_DOUBLE_EQ(1.0, festus::NegLogSumExp({1.0, 800.0, 2000.0}));
+}
+
+TEST(FstUtilTest, SumAndCountPathsTopSorted) {
+  MyVectorFst lattice = MakeLattice();
+  ASSERT_TRUE(fst::TopSort(&lattice));
+  festus::AcyclicPathsBuffers<MyArc::StateId> buffers;
+  MyArc::Weight total_weight;
+  double num_paths;
+  ASSERT_TRUE(festus::SumAndCountPathsTopSorted(lattice, &total_weight,
+                                                &num_paths, &buffers));
+  EXPECT_NEAR(fst::ShortestDistance(lattice).Value(), total_weight.Value(),
+              1e-5);
+  MyVectorFst copy(lattice);
+  EXPECT_EQ(festus::CountPaths(&copy), num_paths);
+  EXPECT_EQ(6, num_paths);
+  ASSERT_EQ(2u, buffers.final_states.size());
+  for (auto state : buffers.final_states) {
+    EXPECT_NE(MyArc::Weight::Zero(), lattice.Final(state));
+  }
+
+  // The buffers can be reused.
+  MyVectorFst empty;
+  ASSERT_TRUE(festus::SumAndCountPathsTopSorted(empty, &total_weight,
+                                                &num_paths, &buffers));
+  EXPECT_EQ(MyArc::Weight::Zero(), total_weight);
+  EXPECT_EQ(0, num_paths);
+  EXPECT_TRUE(buffers.final_states.empty());
+}
+
+TEST(FstUtilTest, SumAndCountPathsNotTopSorted) {
+  MyVectorFst lattice = MakeLattice();
+  festus::AcyclicPathsBuffers<MyArc::StateId> buffers;
+  MyArc::Weight total_weight;
+  double num_paths;
+  EXPECT_FALSE(festus::SumAndCountPathsTopSorted(lattice, &total_weight,
+                                                 &num_paths, &buffers));
+  lattice.AddArc(4, MyArc(8, 8, 1.0f, 3));
+  EXPECT_FALSE(fst::TopSort(&lattice));
+  EXPECT_FALSE(festus::SumAndCountPathsTopSorted(lattice, &total_weight,
+                                                 &num_paths, &buffers));
+}
+
+TEST(FstUtilTest, ConnectAndTopSortInto) {
+  const MyVectorFst lattice = MakeLattice();
+  MyVectorFst expected(lattice);
+  fst::Connect(&expected);
+  festus::ConnectBuffers<MyArc> buffers;
+  MyVectorFst connected;
+  festus::ConnectAndTopSortInto(
+      fst::ProjectFst<MyArc>(lattice, fst::PROJECT_INPUT), &connected,
+      &buffers);
+  EXPECT_EQ(5, connected.NumStates());
+  EXPECT_EQ(0, connected.Start());
+  EXPECT_TRUE(festus::HasStoredProperties(
+      connected, festus::kConnectedAndTopSorted | fst::kAcyclic));
+  EXPECT_TRUE(fst::Isomorphic(expected, connected));
+  EXPECT_EQ(6, festus::CountPathsTopSorted(connected));
+
+  // The buffers and the output machine can be reused, also for cyclic input.
+  MyVectorFst cyclic = MakeLattice();
+  cyclic.AddArc(4, MyArc(8, 8, 1.0f, 3));
+  festus::ConnectAndTopSortInto(cyclic, &connected, &buffers);
+  fst::Connect(&cyclic);
+  EXPECT_EQ(5, connected.NumStates());
+  EXPECT_TRUE(festus::HasStoredProperties(
+      connected, festus::kConnected | fst::kCyclic));
+  EXPECT_TRUE(fst::Isomorphic(cyclic, connected));
+
+  // Nothing is connected without a final state.
+  MyVectorFst dead_end = MakeLattice();
+  dead_end.SetFinal(1, MyArc::Weight::Zero());
+  dead_end.SetFinal(4, MyArc::Weight::Zero());
+  festus::ConnectAndTopSortInto(dead_end, &connected, &buffers);
+  EXPECT_EQ(0, connected.NumStates());
+  EXPECT_EQ(fst::kNoStateId, connected.Start());
+}
+
+// Returns the weights of the paths in the output of ShortestPath().
+std::vector<float> PathWeights(const fst::StdVectorFst &paths) {
+  std::vector<std::pair<string, float>> prons;
+  festus::internal::ShortestPathsToVector(
+      paths, [](int64 label, string *str) { str->append(1, 'a' + label); },
+      &prons);
+  std::vector<float> weights;
+  for (const auto &pron : prons) {
+    weights.push_back(pron.second);
+  }
+  return weights;
+}
+
+TEST(FstUtilTest, LazyShortestPaths) {
+  const MyVectorFst lattice = MakeLattice();
+  fst::StdVectorFst std_lattice, expected, paths;
+  festus::ConvertWeight(lattice, &std_lattice);
+  festus::LazyShortestPathsBuffers<MyArc> buffers;
+  double num_paths;
+  bool exact;
+  const fst::DeterminizeFst<MyArc> determinized(lattice);
+  ASSERT_TRUE(festus::LazyShortestPaths(
+      determinized, 3, std::numeric_limits<float>::infinity(), 0, &paths,
+      &num_paths, &exact, &buffers));
+  fst::ShortestPath(std_lattice, &expected, 3);
+  std::vector<float> expected_weights = PathWeights(expected);
+  std::sort(expected_weights.begin(), expected_weights.end());
+  EXPECT_EQ(expected_weights, PathWeights(paths));
+  EXPECT_FALSE(exact);
+  EXPECT_GE(num_paths, 3);
+  EXPECT_LE(num_paths, 6);
+
+  // Exploring all paths counts them exactly.
+  ASSERT_TRUE(festus::LazyShortestPaths(
+      lattice, 10, std::numeric_limits<float>::infinity(), 0, &paths,
+      &num_paths, &exact, &buffers));
+  EXPECT_EQ(6, PathWeights(paths).size());
+  EXPECT_TRUE(exact);
+  EXPECT_EQ(6, num_paths);
+
+  // The best paths are 1.25 and 1.5, the next one is 3.
+  ASSERT_TRUE(festus::LazyShortestPaths(lattice, 10, 1.0f, 0, &paths,
+                                        &num_paths, &exact, &buffers));
+  EXPECT_EQ(std::vector<float>({1.25f, 1.5f}), PathWeights(paths));
+  EXPECT_FALSE(exact);
+
+  // The start state has no final weight, and no other state is expanded, so
+  // no path is found.
+  EXPECT_FALSE(festus::LazyShortestPaths(lattice, 10, 1.0f, 1, &paths,
+                                         &num_paths, &exact, &buffers));
+
+  // Both paths within the threshold need only states 0 to 4.
+  ASSERT_TRUE(festus::LazyShortestPaths(lattice, 10, 1.0f, 5, &paths,
+                                        &num_paths, &exact, &buffers));
+  EXPECT_EQ(std::vector<float>({1.25f, 1.5f}), PathWeights(paths));
+  EXPECT_FALSE(exact);
+
+  MyVectorFst negative = MakeLattice();
+  negative.AddArc(0, MyArc(8, 8, -1.0f, 4));
+  EXPECT_FALSE(festus::LazyShortestPaths(
+      negative, 3, std::numeric_limits<float>::infinity(), 0, &paths,
+      &num_paths, &exact, &buffers));
+}
+
+TEST(FstUtilTest, SymbolStringPool) {
+  fst::SymbolTable symbols("phonemes");
+  symbols.AddSymbol("<epsilon>", 0);
+  symbols.AddSymbol("a", 1);
+  symbols.AddSymbol("ch", 3);
+  symbols.AddSymbol("xyz", 7);
+  const festus::SymbolStringPool pool(symbols);
+  EXPECT_EQ(8, pool.NumLabels());
+  for (int label = -1; label < 10; ++label) {
+    string str = "prefix";
+    pool.Append(label, &str);
+    EXPECT_EQ("prefix" + symbols.Find(label), str) << label;
+  }
+  EXPECT_EQ(0, festus::SymbolStringPool().NumLabels());
+}
+
+TEST(FstUtilTest, ShortestPathsToVector) {
+  fst::SymbolTable symbols("phonemes");
+  symbols.AddSymbol("<epsilon>", 0);
+  symbols.AddSymbol("k", 1);
+  symbols.AddSymbol("a", 2);
+  symbols.AddSymbol("t", 3);
+  fst::StdVectorFst paths;
+  for (int i = 0; i < 5; ++i) {
+    paths.AddState();
+  }
+  paths.SetStart(0);
+  paths.AddArc(0, fst::StdArc(1, 1, 1.0f, 1));
+  paths.AddArc(1, fst::StdArc(0, 0, 0.5f, 2));
+  paths.AddArc(2, fst::StdArc(2, 2, 0.0f, 3));
+  paths.SetFinal(3, 0.25f);
+  paths.AddArc(0, fst::StdArc(3, 3, 2.0f, 4));
+  paths.SetFinal(4, 0.0f);
+  paths.SetOutputSymbols(&symbols);
+
+  const std::vector<std::pair<string, float>> expected = {
+    {"k a", 1.75f}, {"t", 2.0f},
+  };
+  EXPECT_EQ(expected, festus::ShortestPathsToVector(paths));
+  // Rendering with the pool reuses the existing strings.
+  std::vector<std::pair<string, float>> actual = {{"long previous string", 0}};
+  festus::ShortestPathsToVector(paths, festus::SymbolStringPool(symbols),
+                                &actual);
+  EXPECT_EQ(expected, actual);
+}
+
+}  // namespace
@@ -21,10 +21,14 @@
 #ifndef FESTUS_RUNTIME_FST_UTIL_H__
 #define FESTUS_RUNTIME_FST_UTIL_H__
 
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
+#include <cstring>
 #include <iterator>
 #include <limits>
 #include <set>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -150,7 +154,160 @@ void ConnectAndComputeProperties(fst::MutableFst<Arc> *fst) {
   }
 }
 
-// Compose, project, connect, and remove epsilons.
+// Copies ifst into ofst. Unlike assignment, which gives a VectorFst a fresh
+// implementation, this keeps the existing storage (and allocators) of ofst,
+// so that repeated copies into the same machine avoid reallocation.
+template <class Arc>
+inline void CopyInto(const fst::Fst<Arc> &ifst, fst::MutableFst<Arc> *ofst) {
+  fst::ArcMap(ifst, ofst, fst::IdentityArcMapper<Arc>());
+}
+
+// Scratch space for ConnectAndTopSortInto(), which can be reused across
+// calls.
+template <class Arc>
+struct ConnectBuffers {
+  typedef typename Arc::StateId StateId;
+  std::vector<char> color;
+  std::vector<char> coaccess;
+  // The final weight and the range of arcs (in arcs) of each visited state
+  // of the input machine.
+  std::vector<typename Arc::Weight> finals;
+  std::vector<std::size_t> arcs_begin;
+  std::vector<std::size_t> arcs_end;
+  std::vector<Arc> arcs;
+  // The visited states in the order in which they were finished, and their
+  // states in the output machine.
+  std::vector<StateId> postorder;
+  std::vector<StateId> output_states;
+  std::vector<std::pair<StateId, std::size_t>> stack;
+};
+
+// Copies the connected part of ifst into ofst, keeping the existing storage
+// of ofst as CopyInto() does. This replaces CopyInto() followed by
+// ConnectAndComputeProperties(), but visits each state of ifst only once,
+// which matters when ifst is a lazy composition.
+//
+// A single depth-first traversal expands each accessible state of ifst,
+// remembers its arcs, and decides whether it is coaccessible when it is
+// finished (after all its successors). If no cycle is found, only the
+// connected states are written to ofst, numbered in reverse postorder, so
+// that ofst is topologically sorted with start state 0, and its
+// connectivity, cyclicity, and sortedness properties are set without
+// further traversals. Cyclic machines are written in full and then passed
+// to ConnectAndComputeProperties().
+template <class Arc>
+void ConnectAndTopSortInto(const fst::Fst<Arc> &ifst,
+                           fst::MutableFst<Arc> *ofst,
+                           ConnectBuffers<Arc> *buffers) {
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Weight Weight;
+  enum : char { kWhite, kGray, kBlack };
+  ofst->DeleteStates();
+  const StateId start = ifst.Start();
+  if (start == fst::kNoStateId) return;
+  auto &color = buffers->color;
+  auto &coaccess = buffers->coaccess;
+  auto &finals = buffers->finals;
+  auto &arcs_begin = buffers->arcs_begin;
+  auto &arcs_end = buffers->arcs_end;
+  auto &arcs = buffers->arcs;
+  auto &postorder = buffers->postorder;
+  auto &output_states = buffers->output_states;
+  auto &stack = buffers->stack;
+  color.clear();
+  coaccess.clear();
+  arcs.clear();
+  postorder.clear();
+  stack.clear();
+
+  // Expands state s of ifst and pushes it onto the stack.
+  auto discover = [&](StateId s) {
+    if (static_cast<std::size_t>(s) >= color.size()) {
+      color.resize(s + 1, kWhite);
+      coaccess.resize(s + 1, false);
+      finals.resize(s + 1);
+      arcs_begin.resize(s + 1);
+      arcs_end.resize(s + 1);
+    }
+    color[s] = kGray;
+    finals[s] = ifst.Final(s);
+    arcs_begin[s] = arcs.size();
+    for (fst::ArcIterator<fst::Fst<Arc>> aiter(ifst, s); !aiter.Done();
+         aiter.Next()) {
+      arcs.push_back(aiter.Value());
+    }
+    arcs_end[s] = arcs.size();
+    stack.emplace_back(s, arcs_begin[s]);
+  };
+
+  bool cyclic = false;
+  discover(start);
+  while (!stack.empty()) {
+    const StateId s = stack.back().first;
+    if (stack.back().second < arcs_end[s]) {
+      const StateId t = arcs[stack.back().second++].nextstate;
+      if (static_cast<std::size_t>(t) >= color.size() || color[t] == kWhite) {
+        discover(t);
+      } else if (color[t] == kGray) {
+        cyclic = true;
+      }
+      continue;
+    }
+    // All successors of s are finished, unless there is a cycle.
+    bool coaccessible = finals[s] != Weight::Zero();
+    for (std::size_t a = arcs_begin[s]; a < arcs_end[s]; ++a) {
+      coaccessible = coaccessible || coaccess[arcs[a].nextstate];
+    }
+    coaccess[s] = coaccessible;
+    color[s] = kBlack;
+    postorder.push_back(s);
+    stack.pop_back();
+  }
+  VLOG(3) << "Visited " << postorder.size() << " states and " << arcs.size()
+          << " arcs" << (cyclic ? " with cycles" : "");
+
+  // Without cycles, the coaccessibility of every state is known. With
+  // cycles, all states are kept for ConnectAndComputeProperties().
+  output_states.assign(color.size(), fst::kNoStateId);
+  StateId num_states = 0;
+  for (auto iter = postorder.rbegin(); iter != postorder.rend(); ++iter) {
+    if (cyclic || coaccess[*iter]) output_states[*iter] = num_states++;
+  }
+  if (num_states == 0) return;
+  ofst->ReserveStates(num_states);
+  for (StateId state = 0; state < num_states; ++state) {
+    ofst->AddState();
+  }
+  for (auto iter = postorder.rbegin(); iter != postorder.rend(); ++iter) {
+    const StateId state = output_states[*iter];
+    if (state == fst::kNoStateId) continue;
+    ofst->SetFinal(state, finals[*iter]);
+    ofst->ReserveArcs(state, arcs_end[*iter] - arcs_begin[*iter]);
+    for (std::size_t a = arcs_begin[*iter]; a < arcs_end[*iter]; ++a) {
+      Arc arc = arcs[a];
+      arc.nextstate = output_states[arc.nextstate];
+      if (arc.nextstate != fst::kNoStateId) ofst->AddArc(state, arc);
+    }
+  }
+  // The start state comes first in reverse postorder.
+  ofst->SetStart(0);
+  if (cyclic) {
+    ofst->SetProperties(fst::kAccessible,
+                        fst::kAccessible | fst::kNotAccessible);
+    ConnectAndComputeProperties(ofst);
+    return;
+  }
+  static constexpr uint64 kProperties =
+      fst::kAccessible | fst::kCoAccessible | fst::kAcyclic |
+      fst::kInitialAcyclic | fst::kTopSorted;
+  static constexpr uint64 kMask =
+      kProperties | fst::kNotAccessible | fst::kNotCoAccessible |
+      fst::kCyclic | fst::kInitialCyclic | fst::kNotTopSorted;
+  ofst->SetProperties(kProperties, kMask);
+}
+
+// Compose, project, connect, and remove epsilons. The buffers are optional
+// scratch space for connecting, see ConnectAndTopSortInto().
 template <class Arc>
 void ComposeProjectRmEpsilon(
     const fst::Fst<Arc> &ifst1,
@@ -158,13 +315,27 @@ void ComposeProjectRmEpsilon(
     fst::ProjectType project_type,
     fst::MutableFst<Arc> *ofst,
     float delta = fst::kDelta,
-    bool use_trivial_filter = false) {  // ignored (requires OpenFst 1.5.1)
+    bool use_trivial_filter = false,
+    ConnectBuffers<Arc> *buffers = nullptr) {
+  ConnectBuffers<Arc> local_buffers;
+  if (!buffers) buffers = &local_buffers;
   fst::CacheOptions nopts;
   nopts.gc_limit = 0;  // Cache only the last state for fastest copy.
-  fst::ComposeFst<Arc> composed(ifst1, ifst2, nopts);
-  *ofst = fst::ProjectFst<Arc>(composed, project_type);
-  VLOG_PROPERTIES(3, *ofst);
-  ConnectAndComputeProperties(ofst);
+  if (use_trivial_filter &&
+      fst::LookAheadMatchType(ifst1, ifst2) == fst::MATCH_NONE) {
+    // The caller guarantees that no epsilon filtering is needed. This does
+    // not apply when lookahead composition is possible, which is preferred.
+    typedef fst::Matcher<fst::Fst<Arc>> M;
+    fst::ComposeFstOptions<Arc, M, fst::TrivialComposeFilter<M>> copts(nopts);
+    fst::ComposeFst<Arc> composed(ifst1, ifst2, copts);
+    ConnectAndTopSortInto(fst::ProjectFst<Arc>(composed, project_type), ofst,
+                          buffers);
+  } else {
+    // Uses lookahead composition if ifst2 is an input lookahead FST.
+    fst::ComposeFst<Arc> composed(ifst1, ifst2, nopts);
+    ConnectAndTopSortInto(fst::ProjectFst<Arc>(composed, project_type), ofst,
+                          buffers);
+  }
   VLOG_PROPERTIES(3, *ofst);
   if (ofst->Properties(fst::kEpsilons, false)) {
     fst::RmEpsilon(ofst, false, Arc::Weight::Zero(), fst::kNoStateId, delta);
@@ -208,19 +379,149 @@ fst::ComposeFst<A> PhiComposeFst(
       PhiComposeOptions(fst1, fst2, phi_label, cache_options));
 }
 
-// Eager composition with a phi-FST on the right.
+// Eager composition with a phi-FST on the right. The buffers are optional
+// scratch space for connecting, see ConnectAndTopSortInto().
 template <class Arc>
 void PhiCompose(
     const fst::Fst<Arc> &ifst1,  // arbitrary FST
     const fst::Fst<Arc> &ifst2,  // FST with phi labels, e.g. backoff model
     typename Arc::Label phi_label,
     fst::MutableFst<Arc> *ofst,
-    bool connect = true) {
+    bool connect = true,
+    ConnectBuffers<Arc> *buffers = nullptr) {
   fst::CacheOptions nopts;
   nopts.gc_limit = 0;  // Cache only the last state for fastest copy.
-  *ofst = PhiComposeFst<Arc>(ifst1, ifst2, phi_label, nopts);
   if (connect) {
-    ConnectAndComputeProperties(ofst);
+    ConnectBuffers<Arc> local_buffers;
+    ConnectAndTopSortInto(PhiComposeFst<Arc>(ifst1, ifst2, phi_label, nopts),
+                          ofst, buffers ? buffers : &local_buffers);
+  } else {
+    CopyInto(PhiComposeFst<Arc>(ifst1, ifst2, phi_label, nopts), ofst);
+  }
+}
+
+// Scratch space for BeamPrunedCopy(), which can be reused across calls.
+template <class StateId>
+struct BeamSearchBuffers {
+  // The states of the input machine, grouped by position in the string.
+  std::vector<std::vector<StateId>> positions;
+  // Best forward score and output state of each state of the input machine.
+  std::vector<float> forward;
+  std::vector<StateId> output_states;
+  std::vector<float> scores;
+};
+
+// Copies a lazy machine ifst into ofst while pruning it with a beam search.
+//
+// The machine ifst must be a composition with a string on the left, so that
+// every arc with a non-epsilon input label advances by one position in the
+// string. States at the same position compete with each other: a state is not
+// expanded if its best forward score (the smallest sum of arc weights on any
+// path from the start state found so far) exceeds the best forward score at
+// its position by more than beam, or if max_active_states > 0 and more than
+// that many states at its position have better scores. Since only expanded
+// states of ifst are ever visited, the work and memory per position are
+// bounded by the beam.
+//
+// The result is a subgraph of ifst, which is accessible but not necessarily
+// coaccessible, since pruned states remain as non-final dead ends.
+template <class Arc>
+void BeamPrunedCopy(const fst::Fst<Arc> &ifst,
+                    float beam,
+                    std::size_t max_active_states,
+                    fst::MutableFst<Arc> *ofst,
+                    BeamSearchBuffers<typename Arc::StateId> *buffers) {
+  typedef typename Arc::StateId StateId;
+  constexpr float kInfinity = std::numeric_limits<float>::infinity();
+  ofst->DeleteStates();
+  const StateId start = ifst.Start();
+  if (start == fst::kNoStateId) return;
+  auto &positions = buffers->positions;
+  auto &forward = buffers->forward;
+  auto &output_states = buffers->output_states;
+  auto &scores = buffers->scores;
+  for (auto &states : positions) {
+    states.clear();
+  }
+  forward.clear();
+  output_states.clear();
+
+  // Records a path with the given forward score to state s of ifst and
+  // returns the corresponding state of ofst.
+  auto discover = [&](StateId s, std::size_t position,
+                      float score) -> StateId {
+    if (static_cast<std::size_t>(s) >= forward.size()) {
+      forward.resize(s + 1, kInfinity);
+      output_states.resize(s + 1, fst::kNoStateId);
+    }
+    if (output_states[s] == fst::kNoStateId) {
+      output_states[s] = ofst->AddState();
+      if (positions.size() <= position) positions.resize(position + 1);
+      positions[position].push_back(s);
+    }
+    forward[s] = std::min(forward[s], score);
+    return output_states[s];
+  };
+
+  ofst->SetStart(discover(start, 0, 0));
+  for (std::size_t position = 0; position < positions.size(); ++position) {
+    float best = kInfinity;
+    for (StateId s : positions[position]) {
+      best = std::min(best, forward[s]);
+    }
+    float threshold = best + beam;
+    if (max_active_states > 0 &&
+        positions[position].size() > max_active_states) {
+      scores.clear();
+      for (StateId s : positions[position]) {
+        scores.push_back(forward[s]);
+      }
+      auto nth = scores.begin() + (max_active_states - 1);
+      std::nth_element(scores.begin(), nth, scores.end());
+      threshold = std::min(threshold, *nth);
+    }
+    // Epsilon transitions can add states at the current position while it is
+    // being expanded, so the states must be accessed by index.
+    for (std::size_t i = 0; i < positions[position].size(); ++i) {
+      const StateId s = positions[position][i];
+      if (forward[s] > threshold) continue;
+      const StateId state = output_states[s];
+      ofst->SetFinal(state, ifst.Final(s));
+      for (fst::ArcIterator<fst::Fst<Arc>> aiter(ifst, s); !aiter.Done();
+           aiter.Next()) {
+        Arc arc = aiter.Value();
+        const std::size_t next_position =
+            arc.ilabel == 0 ? position : position + 1;
+        arc.nextstate = discover(arc.nextstate, next_position,
+                                 forward[s] + arc.weight.Value());
+        ofst->AddArc(state, arc);
+      }
+    }
+  }
+  // Every state was added as the start state or as the target of an arc.
+  ofst->SetProperties(fst::kAccessible,
+                      fst::kAccessible | fst::kNotAccessible);
+}
+
+// Beam-pruned copy (see above), connect, project, and remove epsilons.
+template <class Arc>
+void BeamPruneProjectRmEpsilon(
+    const fst::Fst<Arc> &ifst,
+    float beam,
+    std::size_t max_active_states,
+    fst::ProjectType project_type,
+    fst::MutableFst<Arc> *ofst,
+    BeamSearchBuffers<typename Arc::StateId> *buffers,
+    float delta = fst::kDelta) {
+  BeamPrunedCopy(ifst, beam, max_active_states, ofst, buffers);
+  VLOG_PROPERTIES(3, *ofst);
+  if (ofst->Start() == fst::kNoStateId) return;
+  ConnectAndComputeProperties(ofst);
+  fst::Project(ofst, project_type);
+  VLOG_PROPERTIES(3, *ofst);
+  if (ofst->Properties(fst::kEpsilons, false)) {
+    fst::RmEpsilon(ofst, false, Arc::Weight::Zero(), fst::kNoStateId, delta);
+    VLOG_PROPERTIES(3, *ofst);
   }
 }
 
@@ -293,44 +594,146 @@ void DeterminizeConvertWeight(
   ConvertWeight(determinized, ofst);
 }
 
-// Converts the output FST of ShortestPath() into vector form.
-// Returns a vector holding the output string and weight of each successful
-// path in the FST.
-template <class F>
-std::vector<std::pair<string, float>> ShortestPathsToVector(
-    const F &paths_fst) {
+// A symbol table rendered into a single contiguous string pool, indexed by
+// label. Unlike SymbolTable::Find(), which returns a fresh string, Append()
+// copies the bytes of a symbol directly into a caller-owned string, so that
+// rendering into a string with sufficient capacity does not allocate.
+//
+// The labels of the symbol table should be dense, since the index has an
+// entry for each label up to the largest one.
+class SymbolStringPool {
+ public:
+  SymbolStringPool() = default;
+
+  explicit SymbolStringPool(const fst::SymbolTable &symbols) {
+    std::vector<std::pair<int64, string>> entries;
+    for (fst::SymbolTableIterator siter(symbols); !siter.Done();
+         siter.Next()) {
+      if (siter.Value() < 0) continue;
+      entries.emplace_back(siter.Value(), siter.Symbol());
+    }
+    std::sort(entries.begin(), entries.end());
+    const std::size_t num_labels =
+        entries.empty() ? 0 : entries.back().first + 1;
+    offsets_.reserve(num_labels + 1);
+    auto entry = entries.begin();
+    for (std::size_t label = 0; label < num_labels; ++label) {
+      offsets_.push_back(pool_.size());
+      if (entry != entries.end() &&
+          entry->first == static_cast<int64>(label)) {
+        pool_.append(entry->second);
+        ++entry;
+      }
+    }
+    offsets_.push_back(pool_.size());
+  }
+
+  // Returns the number of labels in the index, one more than the largest.
+  std::size_t NumLabels() const {
+    return offsets_.empty() ? 0 : offsets_.size() - 1;
+  }
+
+  // Appends the symbol of the given label to *str. Appends nothing if the
+  // label is not in the symbol table, just like appending the empty string
+  // that SymbolTable::Find() returns for it.
+  void Append(int64 label, string *str) const {
+    if (label < 0 || label >= static_cast<int64>(NumLabels())) return;
+    str->append(pool_, offsets_[label], offsets_[label + 1] - offsets_[label]);
+  }
+
+ private:
+  string pool_;
+  std::vector<uint32> offsets_;
+};
+
+namespace internal {
+
+template <class F, class AppendSymbol>
+void ShortestPathsToVector(
+    const F &paths_fst,
+    const AppendSymbol &append_symbol,
+    std::vector<std::pair<string, float>> *paths) {
   typedef typename F::Arc Arc;
   typedef typename F::StateId StateId;
   typedef typename F::Weight Weight;
-  std::vector<std::pair<string, float>> paths;
   const StateId start = paths_fst.Start();
-  if (start == fst::kNoStateId) return paths;
-  paths.reserve(paths_fst.NumArcs(start));
-  const fst::SymbolTable *symbols = paths_fst.OutputSymbols();
-  CHECK(symbols != nullptr);
-  typedef fst::ArcIterator<fst::VectorFst<Arc>> MyArcIterator;
-  for (MyArcIterator iter1(paths_fst, start); !iter1.Done(); iter1.Next()) {
+  if (start == fst::kNoStateId) {
+    paths->clear();
+    return;
+  }
+  paths->resize(paths_fst.NumArcs(start));
+  auto path = paths->begin();
+  for (fst::ArcIterator<F> iter1(paths_fst, start); !iter1.Done();
+       iter1.Next(), ++path) {
     const auto &first_arc = iter1.Value();
-    string str = first_arc.olabel != 0 ? symbols->Find(first_arc.olabel) : "";
+    string &str = path->first;
+    str.clear();
+    if (first_arc.olabel != 0) append_symbol(first_arc.olabel, &str);
     Weight weight = first_arc.weight;
     StateId state = first_arc.nextstate;
     CHECK_NE(state, fst::kNoStateId);
     while (paths_fst.Final(state) == Weight::Zero()) {
-      fst::ArcIterator<fst::VectorFst<Arc>> iter(paths_fst, state);
+      fst::ArcIterator<F> iter(paths_fst, state);
       const Arc &arc = iter.Value();
       if (arc.olabel != 0) {
         if (!str.empty()) str.push_back(' ');
-        str.append(symbols->Find(arc.olabel));
+        append_symbol(arc.olabel, &str);
       }
       weight = Times(weight, arc.weight);
       state = arc.nextstate;
       CHECK_NE(state, fst::kNoStateId);
       CHECK((iter.Next(), iter.Done()));
     }
-    CHECK(fst::ArcIterator<fst::VectorFst<Arc>>(paths_fst, state).Done());
+    CHECK(fst::ArcIterator<F>(paths_fst, state).Done());
     weight = Times(weight, paths_fst.Final(state));
-    paths.emplace_back(std::move(str), weight.Value());
+    path->second = weight.Value();
   }
+}
+
+}  // namespace internal
+
+// Converts the output FST of ShortestPath() into vector form.
+// Stores the output string and weight of each successful path in the FST in
+// the given vector, reusing the storage of its existing elements. The output
+// labels are rendered with the given symbols, which should be those of the
+// output symbol table of the FST; once the strings of the vector have grown
+// large enough, this does not allocate.
+template <class F>
+void ShortestPathsToVector(
+    const F &paths_fst,
+    const SymbolStringPool &symbols,
+    std::vector<std::pair<string, float>> *paths) {
+  internal::ShortestPathsToVector(
+      paths_fst,
+      [&symbols](int64 label, string *str) { symbols.Append(label, str); },
+      paths);
+}
+
+// Converts the output FST of ShortestPath() into vector form.
+// Stores the output string and weight of each successful path in the FST in
+// the given vector, reusing the storage of its existing elements.
+template <class F>
+void ShortestPathsToVector(
+    const F &paths_fst,
+    std::vector<std::pair<string, float>> *paths) {
+  const fst::SymbolTable *symbols = paths_fst.OutputSymbols();
+  CHECK(symbols != nullptr);
+  internal::ShortestPathsToVector(
+      paths_fst,
+      [symbols](int64 label, string *str) {
+        str->append(symbols->Find(label));
+      },
+      paths);
+}
+
+// Converts the output FST of ShortestPath() into vector form.
+// Returns a vector holding the output string and weight of each successful
+// path in the FST.
+template <class F>
+std::vector<std::pair<string, float>> ShortestPathsToVector(
+    const F &paths_fst) {
+  std::vector<std::pair<string, float>> paths;
+  ShortestPathsToVector(paths_fst, &paths);
   return paths;
 }
 
@@ -418,6 +821,343 @@ inline double CountPaths(const F &fst) {
   return CountPaths(&vector_fst);
 }
 
+namespace internal {
+
+#if defined(__GNUC__)
+// A vector of doubles for the SIMD extensions of GCC and Clang, which compile
+// to SSE2 on x86-64 and to NEON on ARM64.
+typedef double DoubleVector __attribute__((vector_size(16)));
+typedef uint64 UInt64Vector __attribute__((vector_size(16)));
+constexpr std::size_t kDoubleVectorSize = sizeof(DoubleVector) / sizeof(double);
+
+// Computes exp(max(x, -708)) for each lane of x <= 0, to within an ulp or so
+// of std::exp(). Unlike calls of std::exp(), this only uses arithmetic and
+// bitwise operations that work on all lanes at once.
+inline DoubleVector ExpNonPositive(DoubleVector x) {
+  // Clamp to the smallest argument whose exponential is a normal double.
+  const DoubleVector kMinArg = DoubleVector{} - 708;
+  const auto clamp = x < kMinArg;
+  UInt64Vector x_bits, min_bits, mask;
+  std::memcpy(&x_bits, &x, sizeof(x));
+  std::memcpy(&min_bits, &kMinArg, sizeof(kMinArg));
+  std::memcpy(&mask, &clamp, sizeof(mask));
+  x_bits = (x_bits & ~mask) | (min_bits & mask);
+  std::memcpy(&x, &x_bits, sizeof(x));
+  // Reduce to x = k ln(2) + r with |r| <= ln(2)/2. Adding 1.5 * 2^52 rounds
+  // x / ln(2) to the integer k, which ends up in the low bits of k_bits.
+  const double kShift = 6755399441055744.0;
+  DoubleVector k = x * 1.4426950408889634 + kShift;
+  UInt64Vector k_bits;
+  std::memcpy(&k_bits, &k, sizeof(k));
+  k -= kShift;
+  const DoubleVector r =
+      (x - k * 6.93147180369123816490e-01) - k * 1.90821492927058770002e-10;
+  // Taylor polynomial of exp(r) of degree 13.
+  DoubleVector p = r * (1.0 / 6227020800) + 1.0 / 479001600;
+  p = p * r + 1.0 / 39916800;
+  p = p * r + 1.0 / 3628800;
+  p = p * r + 1.0 / 362880;
+  p = p * r + 1.0 / 40320;
+  p = p * r + 1.0 / 5040;
+  p = p * r + 1.0 / 720;
+  p = p * r + 1.0 / 120;
+  p = p * r + 1.0 / 24;
+  p = p * r + 1.0 / 6;
+  p = p * r + 0.5;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+  // Multiply by 2^k, whose biased exponent is k + 1023.
+  const UInt64Vector scale_bits = (k_bits + 1023) << 52;
+  DoubleVector scale;
+  std::memcpy(&scale, &scale_bits, sizeof(scale));
+  return p * scale;
+}
+#endif  // __GNUC__
+
+}  // namespace internal
+
+// Computes -log(sum_i exp(-x[i])) for the n given negative log values.
+//
+// All terms are added up relative to the smallest value, with a single call
+// of std::log(), rather than by pairwise log-addition as in
+// fst::LogWeight::Plus(). With GCC and Clang, the exponentials are computed
+// and summed several at a time in SIMD registers.
+inline double NegLogSumExp(const double *x, std::size_t n) {
+  double min = std::numeric_limits<double>::infinity();
+  for (std::size_t i = 0; i < n; ++i) {
+    min = std::min(min, x[i]);
+  }
+  if (min == std::numeric_limits<double>::infinity()) return min;
+#if defined(__GNUC__)
+  using internal::DoubleVector;
+  using internal::kDoubleVectorSize;
+  DoubleVector sums = {};
+  DoubleVector terms = {};
+  std::size_t i = 0;
+  for (; i + kDoubleVectorSize <= n; i += kDoubleVectorSize) {
+    std::memcpy(&terms, x + i, sizeof(terms));
+    sums += internal::ExpNonPositive(min - terms);
+  }
+  if (i < n) {
+    // Pad the last vector with terms whose exponentials are negligible.
+    for (std::size_t lane = 0; lane < kDoubleVectorSize; ++lane) {
+      terms[lane] = i + lane < n ? x[i + lane]
+                                 : std::numeric_limits<double>::infinity();
+    }
+    sums += internal::ExpNonPositive(min - terms);
+  }
+  double sum = 0;
+  for (std::size_t lane = 0; lane < kDoubleVectorSize; ++lane) {
+    sum += sums[lane];
+  }
+#else
+  double sum = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    sum += std::exp(min - x[i]);
+  }
+#endif
+  return min - std::log(sum);
+}
+
+inline double NegLogSumExp(const std::vector<double> &x) {
+  return NegLogSumExp(x.data(), x.size());
+}
+
+// Scratch space for SumAndCountPathsTopSorted(), which can be reused across
+// calls. After a successful call, final_states holds the accessible final
+// states of the FST.
+template <class StateId>
+struct AcyclicPathsBuffers {
+  // The incoming terms of state s are terms[terms_begin[s], terms_end[s]).
+  std::vector<std::size_t> terms_begin;
+  std::vector<std::size_t> terms_end;
+  std::vector<double> terms;
+  std::vector<double> num_paths;
+  std::vector<double> final_terms;
+  std::vector<StateId> final_states;
+};
+
+// Computes, in a single forward pass in topological order, the total weight
+// (sum over all accepting paths) of a topologically sorted FST over a
+// semiring with negative log weights (e.g. the log semiring), the number of
+// accepting paths, and the set of accessible final states.
+//
+// A first pass over the arcs lays out a contiguous range of terms for the
+// incoming arcs of each state. The forward pass then visits the states in
+// order: the incoming terms of a state are complete when it is reached, so
+// its forward weight is the log-sum of that range (see NegLogSumExp()), and
+// its outgoing arcs add terms to later states. Returns false if an arc does
+// not lead to a later state, in which case the outputs are unspecified.
+template <class F>
+bool SumAndCountPathsTopSorted(
+    const F &fst,
+    typename F::Arc::Weight *total_weight,
+    double *num_paths,
+    AcyclicPathsBuffers<typename F::Arc::StateId> *buffers) {
+  typedef typename F::Arc Arc;
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Weight Weight;
+  *total_weight = Weight::Zero();
+  *num_paths = 0;
+  auto &terms_begin = buffers->terms_begin;
+  auto &terms_end = buffers->terms_end;
+  auto &terms = buffers->terms;
+  auto &paths = buffers->num_paths;
+  auto &final_terms = buffers->final_terms;
+  auto &final_states = buffers->final_states;
+  final_terms.clear();
+  final_states.clear();
+  const StateId start = fst.Start();
+  if (start == fst::kNoStateId) return true;
+  const StateId num_states = fst::CountStates(fst);
+
+  // Count the incoming arcs of each state, plus the empty path to the start.
+  terms_begin.assign(num_states + 1, 0);
+  ++terms_begin[start + 1];
+  for (StateId s = 0; s < num_states; ++s) {
+    for (fst::ArcIterator<F> aiter(fst, s); !aiter.Done(); aiter.Next()) {
+      const StateId t = aiter.Value().nextstate;
+      if (t <= s) return false;
+      ++terms_begin[t + 1];
+    }
+  }
+  for (StateId s = 0; s < num_states; ++s) {
+    terms_begin[s + 1] += terms_begin[s];
+  }
+  terms_end.assign(terms_begin.begin(), terms_begin.end() - 1);
+  terms.resize(terms_begin[num_states]);
+  paths.assign(num_states, 0);
+  terms[terms_end[start]++] = 0;
+  paths[start] = 1;
+
+  for (StateId s = 0; s < num_states; ++s) {
+    const double forward = NegLogSumExp(terms.data() + terms_begin[s],
+                                        terms_end[s] - terms_begin[s]);
+    if (forward == std::numeric_limits<double>::infinity()) continue;
+    const Weight final_weight = fst.Final(s);
+    if (final_weight != Weight::Zero()) {
+      final_terms.push_back(forward + final_weight.Value());
+      final_states.push_back(s);
+      *num_paths += paths[s];
+    }
+    for (fst::ArcIterator<F> aiter(fst, s); !aiter.Done(); aiter.Next()) {
+      const auto &arc = aiter.Value();
+      terms[terms_end[arc.nextstate]++] = forward + arc.weight.Value();
+      paths[arc.nextstate] += paths[s];
+    }
+  }
+  *total_weight = Weight(NegLogSumExp(final_terms));
+  return true;
+}
+
+// Scratch space for LazyShortestPaths(), which can be reused across calls.
+template <class Arc>
+struct LazyShortestPathsBuffers {
+  typedef typename Arc::Label Label;
+  typedef typename Arc::StateId StateId;
+  // A path from the start state, which ends in state (or, if state is
+  // kNoStateId, is a complete path ending in the final state of its parent).
+  struct Item {
+    double cost;
+    StateId state;
+    Label label;
+    std::size_t parent;
+  };
+  std::vector<Item> items;
+  std::vector<std::size_t> heap;
+  // How often each state of the input machine was popped off the heap.
+  std::vector<std::size_t> pops;
+  std::vector<Label> labels;
+};
+
+// Finds up to nshortest paths with the smallest sums of weights through a
+// deterministic acceptor with nonnegative weights (e.g. a DeterminizeFst in
+// the log semiring), without expanding states of ifst that no such path
+// needs. Like ShortestPath() with unique = false, paths whose weight exceeds
+// that of the best path by more than weight_threshold are discarded.
+//
+// Partial paths are popped off a heap in order of increasing weight, and
+// each state is expanded at most nshortest times. The search stops once
+// nshortest complete paths have been popped, the next path is outside the
+// threshold, or (if max_states > 0) a state beyond the first max_states
+// distinct states would be expanded. The paths are stored in ofst in the
+// format of ShortestPath(), with the weight of each path on its first arc.
+//
+// *num_paths is set to the number of complete paths that were discovered,
+// which is a lower bound on the number of paths through ifst, and *exact is
+// set to true if it is that number, i.e. if the search explored all paths.
+// Returns false if a negative weight is found, or if the limit on states is
+// reached before any complete path is found, in which case the outputs are
+// unspecified.
+template <class Arc, class PathArc>
+bool LazyShortestPaths(
+    const fst::Fst<Arc> &ifst,
+    std::size_t nshortest,
+    float weight_threshold,
+    std::size_t max_states,
+    fst::MutableFst<PathArc> *ofst,
+    double *num_paths,
+    bool *exact,
+    LazyShortestPathsBuffers<Arc> *buffers) {
+  typedef typename Arc::Label Label;
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Weight Weight;
+  typedef typename LazyShortestPathsBuffers<Arc>::Item Item;
+  ofst->DeleteStates();
+  *num_paths = 0;
+  *exact = true;
+  const StateId start = ifst.Start();
+  if (start == fst::kNoStateId || nshortest == 0) return true;
+  auto &items = buffers->items;
+  auto &heap = buffers->heap;
+  auto &pops = buffers->pops;
+  auto &labels = buffers->labels;
+  items.clear();
+  heap.clear();
+  pops.clear();
+
+  // Ties are broken by discovery order, so that the result is deterministic.
+  auto greater = [&items](std::size_t i, std::size_t j) {
+    return items[i].cost > items[j].cost ||
+        (items[i].cost == items[j].cost && i > j);
+  };
+  auto push = [&](double cost, StateId state, Label label,
+                  std::size_t parent) {
+    items.push_back(Item{cost, state, label, parent});
+    heap.push_back(items.size() - 1);
+    std::push_heap(heap.begin(), heap.end(), greater);
+  };
+
+  const StateId path_start = ofst->AddState();
+  ofst->SetStart(path_start);
+  std::size_t num_found = 0;
+  std::size_t num_states = 0;
+  double best = 0;
+  push(0, start, 0, 0);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    const std::size_t i = heap.back();
+    heap.pop_back();
+    const Item item = items[i];
+    if (num_found > 0 && item.cost > best + weight_threshold) {
+      *exact = false;
+      break;
+    }
+    if (item.state == fst::kNoStateId) {
+      // A complete path, whose labels are read off its ancestors.
+      if (num_found++ == 0) best = item.cost;
+      labels.clear();
+      for (std::size_t j = item.parent; j > 0; j = items[j].parent) {
+        labels.push_back(items[j].label);
+      }
+      if (labels.empty()) labels.push_back(0);
+      StateId state = path_start;
+      const typename PathArc::Weight cost(item.cost);
+      for (auto iter = labels.rbegin(); iter != labels.rend(); ++iter) {
+        const StateId next = ofst->AddState();
+        ofst->AddArc(state, PathArc(*iter, *iter,
+                                    state == path_start
+                                        ? cost
+                                        : PathArc::Weight::One(),
+                                    next));
+        state = next;
+      }
+      ofst->SetFinal(state, PathArc::Weight::One());
+      if (num_found == nshortest) {
+        *exact = heap.empty();
+        break;
+      }
+      continue;
+    }
+    const StateId s = item.state;
+    if (static_cast<std::size_t>(s) >= pops.size()) pops.resize(s + 1, 0);
+    if (pops[s] == nshortest) {
+      // This path cannot be among the nshortest ones.
+      *exact = false;
+      continue;
+    }
+    if (pops[s]++ == 0 && max_states > 0 && num_states++ == max_states) {
+      VLOG(2) << "Stopping after expanding " << max_states << " states";
+      *exact = false;
+      if (num_found == 0) return false;
+      break;
+    }
+    const Weight final_weight = ifst.Final(s);
+    if (final_weight != Weight::Zero()) {
+      if (final_weight.Value() < 0) return false;
+      push(item.cost + final_weight.Value(), fst::kNoStateId, 0, i);
+      ++*num_paths;
+    }
+    for (fst::ArcIterator<fst::Fst<Arc>> aiter(ifst, s); !aiter.Done();
+         aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.weight.Value() < 0) return false;
+      push(item.cost + arc.weight.Value(), arc.nextstate, arc.olabel, i);
+    }
+  }
+  return true;
+}
+
 }  // namespace festus
 
 #endif  // FESTUS_RUNTIME_FST_UTIL_H__
@@ -0,0 +1,410 @@
+// festus/runtime/g2p-benchmark.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Measures throughput and heap allocations of grapheme-to-phoneme (G2P)
+// pronunciation lookup.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+#include <fst/extensions/ngram/ngram-fst.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "compact.h"
+#include "dense-matcher.h"
+#include "g2p.h"
+#include "g2p-stats.h"
+#include "input-labeler.h"
+#include "lookahead.h"
+#include "model-io.h"
+#include "quantized.h"
+
+// Global allocation counters, maintained by the replacement operator new
+// below. Only allocations made through operator new are counted, which
+// covers all allocations made by OpenFst and the standard containers.
+static std::atomic<uint64> num_allocations(0);
+static std::atomic<uint64> num_allocated_bytes(0);
+
+void *operator new(std::size_t size) {
+  ++num_allocations;
+  num_allocated_bytes += size;
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+typedef fst::LogArc MyArc;
+typedef festus::G2P<MyArc> MyG2P;
+
+namespace {
+
+// See the corresponding comments in g2p-lookup.cc.
+static festus::BitfieldCompactFstRegisterer<MyArc> compact_reg;
+static fst::FstRegisterer<fst::NGramFst<MyArc>> ngram_reg;
+static festus::QuantizedCompactFstRegisterer<MyArc> quantized_reg;
+static fst::FstRegisterer<festus::ILabelLookAheadFst<MyArc>> lookahead_reg;
+static fst::FstRegisterer<festus::DenseByteFst<MyArc>> dense_reg;
+
+// Reads an FST and reports its size and the time it took to load it.
+std::unique_ptr<const MyG2P::Lattice> ReadAndDescribeFst(const string &path,
+                                                         bool memory_map) {
+  typedef std::chrono::steady_clock Clock;
+  const auto start = Clock::now();
+  std::unique_ptr<const MyG2P::Lattice> fst(
+      festus::ReadModelFst<MyArc>(path, memory_map));
+  const std::chrono::duration<double, std::milli> load_millis =
+      Clock::now() - start;
+  if (!fst) return fst;
+  std::size_t num_arcs = 0;
+  std::size_t num_states = 0;
+  for (fst::StateIterator<MyG2P::Lattice> siter(*fst); !siter.Done();
+       siter.Next()) {
+    num_arcs += fst->NumArcs(siter.Value());
+    ++num_states;
+  }
+  std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+  std::cout << std::left << std::setw(24) << fst->Type() << std::right
+            << std::setw(10) << num_states << " states"
+            << std::setw(10) << num_arcs << " arcs"
+            << std::setw(12) << file.tellg() << " bytes"
+            << std::fixed << std::setprecision(3)
+            << std::setw(10) << load_millis.count() << " ms  " << path
+            << std::endl;
+  return fst;
+}
+
+bool ReadWords(const string &path, std::vector<string> *words) {
+  std::ifstream file;
+  if (!path.empty()) {
+    file.open(path);
+    if (!file) {
+      LOG(ERROR) << "Could not open " << path;
+      return false;
+    }
+  }
+  std::istream &strm = path.empty() ? std::cin : file;
+  for (string word; std::getline(strm, word); /*empty*/) {
+    words->push_back(std::move(word));
+  }
+  return true;
+}
+
+// Prints one row of the table of results.
+void PrintRow(const string &name,
+              double num_words,
+              std::chrono::duration<double> elapsed,
+              uint64 allocations,
+              uint64 allocated_bytes,
+              std::size_t failures,
+              std::chrono::duration<double, std::milli> max_latency,
+              uint64 max_allocated_bytes) {
+  std::cout << std::left << std::setw(12) << name << std::right
+            << std::fixed << std::setprecision(1)
+            << std::setw(12) << num_words / elapsed.count()
+            << std::setw(14) << allocations / num_words
+            << std::setw(14) << allocated_bytes / num_words
+            << std::setw(10) << failures
+            << std::setw(10) << std::setprecision(3) << max_latency.count()
+            << std::setw(12) << max_allocated_bytes
+            << std::endl;
+}
+
+// Runs the given lookup function over all words for the given number of
+// iterations and reports throughput and allocations per word, as well as the
+// worst-case latency and allocated bytes of a single word.
+template <class LookupFunction>
+void Run(const string &name,
+         const std::vector<string> &words,
+         int iterations,
+         LookupFunction lookup) {
+  typedef std::chrono::steady_clock Clock;
+  festus::G2PResult result;
+  // Warm up, so that one-time costs (e.g. model copies) are not counted.
+  for (const auto &word : words) lookup(word, &result);
+  const uint64 allocations = num_allocations;
+  const uint64 allocated_bytes = num_allocated_bytes;
+  std::size_t failures = 0;
+  Clock::duration max_latency = Clock::duration::zero();
+  uint64 max_allocated_bytes = 0;
+  const auto start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    for (const auto &word : words) {
+      const uint64 word_allocated_bytes = num_allocated_bytes;
+      const auto word_start = Clock::now();
+      if (!lookup(word, &result)) ++failures;
+      max_latency = std::max(max_latency, Clock::now() - word_start);
+      max_allocated_bytes = std::max(
+          max_allocated_bytes, num_allocated_bytes - word_allocated_bytes);
+    }
+  }
+  PrintRow(name, static_cast<double>(words.size()) * iterations,
+           Clock::now() - start, num_allocations - allocations,
+           num_allocated_bytes - allocated_bytes, failures / iterations,
+           max_latency, max_allocated_bytes);
+}
+
+// Like Run(), but pronounces the words in batches of the given size with
+// G2P<>::PronounceBatch(). The worst-case latency and allocated bytes are those
+// of a whole batch.
+void RunBatch(const string &name,
+              const std::vector<string> &words,
+              int iterations,
+              int batch_size,
+              const MyG2P &g2p,
+              const festus::G2POptions &options) {
+  typedef std::chrono::steady_clock Clock;
+  if (batch_size < 1) batch_size = 1;
+  std::vector<std::vector<string>> batches;
+  for (std::size_t i = 0; i < words.size(); i += batch_size) {
+    const std::size_t end = std::min(i + batch_size, words.size());
+    batches.emplace_back(words.begin() + i, words.begin() + end);
+  }
+  festus::G2PWorkspace<MyArc> workspace;
+  std::vector<festus::G2PResult> results;
+  for (const auto &batch : batches) {
+    g2p.PronounceBatch(batch, &results, options, &workspace);
+  }
+  const uint64 allocations = num_allocations;
+  const uint64 allocated_bytes = num_allocated_bytes;
+  std::size_t failures = 0;
+  Clock::duration max_latency = Clock::duration::zero();
+  uint64 max_allocated_bytes = 0;
+  const auto start = Clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    for (const auto &batch : batches) {
+      const uint64 batch_allocated_bytes = num_allocated_bytes;
+      const auto batch_start = Clock::now();
+      failures += batch.size() -
+                  g2p.PronounceBatch(batch, &results, options, &workspace);
+      max_latency = std::max(max_latency, Clock::now() - batch_start);
+      max_allocated_bytes = std::max(
+          max_allocated_bytes, num_allocated_bytes - batch_allocated_bytes);
+    }
+  }
+  PrintRow(name, static_cast<double>(words.size()) * iterations,
+           Clock::now() - start, num_allocations - allocations,
+           num_allocated_bytes - allocated_bytes, failures / iterations,
+           max_latency, max_allocated_bytes);
+}
+
+}  // namespace
+
+static const char kUsage[] =
+    R"(Measures throughput and heap allocations of G2P pronunciation lookup.
+
+Reads orthographic words (one word per line) from a file or from stdin,
+pronounces all of them repeatedly, and reports words per second, heap
+allocations per word, allocated bytes per word, the number of words that could
+not be pronounced, and the maximal latency (in milliseconds) and allocated
+bytes of any single word, for each of the following modes:
+
+  fresh:      each call to Pronounce() uses fresh scratch space;
+  workspace:  all calls share one reusable G2PWorkspace;
+  viterbi:    like workspace, but with G2POptions::VITERBI;
+  beam:       like workspace, but with the pruning options --beam and
+              --max_active_states (only run if one of them is set);
+  composed:   like workspace, but with the precomposed model given by
+              --composed_model instead of --bytes_to_graphones and
+              --graphone_model (only run if that flag is set);
+  batch:      pronounces --batch_size words at a time with PronounceBatch(),
+              which shares the work on common prefixes among the words of a
+              batch (the maximal latency and bytes are those of a batch);
+  comp-batch: like batch, but with --composed_model.
+
+The batch modes pay off for word lists with many shared prefixes, such as
+lists of inflected forms like af/lex_generated.txt; compare their words per
+second with those of workspace and composed.
+
+The model flags (including --mmap, --input_tape, and --input_symbols) are the
+same as for g2p-lookup. The number
+of states and arcs, the file size, and the load time of each model are also
+reported, to show the tradeoff between latency and model size of the
+precomposed model, and the effect of --mmap on startup time.
+
+With --stats, the words are pronounced once more in workspace mode, and the
+time taken by each stage and the number of states and arcs of its lattice are
+printed as in g2p-lookup --stats. Running this for models over bytes and over
+Unicode codepoints (make-runtime-fsts for specs with either input_label_type)
+compares the lattice sizes and latency of the two input tapes.
+
+Usage:
+  g2p-benchmark [--flags...] [WORDS_FILE]
+)";
+
+DEFINE_string(bytes_to_graphones, "", "Path to bytes_to_graphones FST");
+DEFINE_string(graphone_model, "", "Path to graphone_model FST");
+DEFINE_string(phonemes_to_graphones, "", "Path to phonemes_to_graphones FST");
+DEFINE_string(composed_model, "",
+              "Path to precomposed bytes_to_graphones and graphone_model FST");
+DEFINE_bool(mmap, true, "Map model files into memory where possible");
+DEFINE_string(input_tape, "byte",
+              "Input labels of the model: byte, unicode, or symbol");
+DEFINE_string(input_symbols, "",
+              "With --input_tape=symbol: path to the input symbol table");
+
+DEFINE_int32(max_prons,
+             festus::G2POptions::kDefaultMaxProns,
+             "Maximal number of pronunciations per word");
+DEFINE_double(beam, std::numeric_limits<float>::infinity(),
+              "Beam for pruning during lattice construction, in nats");
+DEFINE_int32(max_active_states, 0,
+             "Maximal number of partial hypotheses per prefix; 0 for no limit");
+DEFINE_int32(iterations, 10, "Number of passes over the input words");
+DEFINE_int32(batch_size, 1024, "Number of words per batch in batch modes");
+DEFINE_bool(stats, false, "Print time and lattice size of each stage");
+
+int main(int argc, char *argv[]) {
+  SET_FLAGS(kUsage, &argc, &argv, true);
+  if (argc > 2) {
+    ShowUsage();
+    return 2;
+  }
+
+  string in_name = (argc > 1 && std::strcmp(argv[1], "-") != 0) ? argv[1] : "";
+  std::vector<string> words;
+  if (!ReadWords(in_name, &words)) return 2;
+
+  auto bytes_to_graphones =
+      ReadAndDescribeFst(FLAGS_bytes_to_graphones, FLAGS_mmap);
+  if (!bytes_to_graphones) return 2;
+
+  auto graphone_model = ReadAndDescribeFst(FLAGS_graphone_model, FLAGS_mmap);
+  if (!graphone_model) return 2;
+
+  auto phonemes_to_graphones =
+      ReadAndDescribeFst(FLAGS_phonemes_to_graphones, FLAGS_mmap);
+  if (!phonemes_to_graphones) return 2;
+
+  std::unique_ptr<const MyG2P::Lattice> composed_model;
+  if (!FLAGS_composed_model.empty()) {
+    composed_model = ReadAndDescribeFst(FLAGS_composed_model, FLAGS_mmap);
+    if (!composed_model) return 2;
+  }
+
+  // Each model gets its own labeler, since it takes ownership.
+  auto set_input_labeler = [](MyG2P *g2p) {
+    if (FLAGS_input_tape == "byte") return true;
+    string error;
+    auto labeler = festus::MakeInputLabeler(FLAGS_input_tape,
+                                            FLAGS_input_symbols, " ", &error);
+    if (!labeler) {
+      LOG(ERROR) << error;
+      return false;
+    }
+    g2p->SetInputLabeler(std::move(labeler));
+    return true;
+  };
+
+  MyG2P g2p;
+  if (!set_input_labeler(&g2p)) return 2;
+  g2p.SetBytesToGraphonesFst(std::move(bytes_to_graphones));
+  g2p.SetGraphoneModelFst(std::move(graphone_model));
+  g2p.SetPhonemesToGraphonesFst(std::unique_ptr<const MyG2P::Lattice>(
+      phonemes_to_graphones->Copy()));
+
+  festus::G2POptions options;
+  options.max_prons = FLAGS_max_prons;
+
+  std::cout << words.size() << " words, " << FLAGS_iterations
+            << " iterations" << std::endl;
+  std::cout << "mode             words/s   allocs/word    bytes/word  failures"
+            << "    max ms   max bytes" << std::endl;
+
+  Run("fresh", words, FLAGS_iterations,
+      [&g2p, &options](const string &word, festus::G2PResult *result) {
+        return g2p.Pronounce(word, result, options);
+      });
+
+  festus::G2PWorkspace<MyArc> workspace;
+  Run("workspace", words, FLAGS_iterations,
+      [&g2p, &options, &workspace](const string &word,
+                                   festus::G2PResult *result) {
+        return g2p.Pronounce(word, result, options, &workspace);
+      });
+
+  festus::G2POptions viterbi_options = options;
+  viterbi_options.mode = festus::G2POptions::VITERBI;
+  Run("viterbi", words, FLAGS_iterations,
+      [&g2p, &viterbi_options, &workspace](const string &word,
+                                           festus::G2PResult *result) {
+        return g2p.Pronounce(word, result, viterbi_options, &workspace);
+      });
+
+  if (FLAGS_beam < std::numeric_limits<float>::infinity() ||
+      FLAGS_max_active_states > 0) {
+    festus::G2POptions beam_options = options;
+    beam_options.beam = FLAGS_beam;
+    beam_options.max_active_states = std::max(FLAGS_max_active_states, 0);
+    Run("beam", words, FLAGS_iterations,
+        [&g2p, &beam_options, &workspace](const string &word,
+                                          festus::G2PResult *result) {
+          return g2p.Pronounce(word, result, beam_options, &workspace);
+        });
+  }
+
+  RunBatch("batch", words, FLAGS_iterations, FLAGS_batch_size, g2p, options);
+
+  if (composed_model) {
+    MyG2P composed_g2p;
+    if (!set_input_labeler(&composed_g2p)) return 2;
+    composed_g2p.SetComposedModelFst(std::move(composed_model));
+    composed_g2p.SetPhonemesToGraphonesFst(std::move(phonemes_to_graphones));
+    festus::G2PWorkspace<MyArc> composed_workspace;
+    Run("composed", words, FLAGS_iterations,
+        [&composed_g2p, &options, &composed_workspace](
+            const string &word, festus::G2PResult *result) {
+          return composed_g2p.Pronounce(word, result, options,
+                                        &composed_workspace);
+        });
+    RunBatch("comp-batch", words, FLAGS_iterations, FLAGS_batch_size,
+             composed_g2p, options);
+  }
+
+  if (FLAGS_stats) {
+    festus::G2PStats stats;
+    festus::G2PWorkspace<MyArc> stats_workspace;
+    stats_workspace.SetStats(&stats);
+    festus::G2PResult result;
+    for (const string &word : words) {
+      g2p.Pronounce(word, &result, options, &stats_workspace);
+    }
+    std::cout << std::endl;
+    stats.Print(std::cout);
+  }
+
+  return 0;
+}
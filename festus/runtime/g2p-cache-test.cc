@@ -0,0 +1,146 @@
+// festus/runtime/g2p-cache-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the G2P result cache.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-cache.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+festus::G2PResult MakeResult(const string &pron) {
+  festus::G2PResult result;
+  result.pronunciations.emplace_back(pron, 1.0f);
+  result.num_hypotheses = 1;
+  return result;
+}
+
+TEST(G2PCacheTest, HitAndMiss) {
+  festus::G2PCache cache(10);
+  festus::G2POptions opts;
+  festus::G2PResult result;
+  EXPECT_FALSE(cache.Lookup("kat", opts, &result));
+  cache.Insert("kat", opts, MakeResult("k a t"));
+  ASSERT_TRUE(cache.Lookup("kat", opts, &result));
+  ASSERT_EQ(1, result.pronunciations.size());
+  EXPECT_EQ("k a t", result.pronunciations[0].first);
+
+  auto stats = cache.Stats();
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(1, stats.misses);
+  EXPECT_EQ(0, stats.evictions);
+  EXPECT_EQ(1, stats.size);
+}
+
+TEST(G2PCacheTest, OptionsArePartOfKey) {
+  festus::G2PCache cache(10);
+  festus::G2POptions opts;
+  festus::G2PResult result;
+  cache.Insert("kat", opts, MakeResult("k a t"));
+  opts.max_prons = 1;
+  EXPECT_FALSE(cache.Lookup("kat", opts, &result));
+  opts = festus::G2POptions();
+  opts.real_pruning_threshold = 0.25f;
+  EXPECT_FALSE(cache.Lookup("kat", opts, &result));
+  opts = festus::G2POptions();
+  opts.mode = festus::G2POptions::VITERBI;
+  EXPECT_FALSE(cache.Lookup("kat", opts, &result));
+}
+
+TEST(G2PCacheTest, ModelIsPartOfKey) {
+  festus::G2PCache cache(10);
+  festus::G2POptions opts;
+  festus::G2PResult result;
+  cache.Insert("kat", opts, MakeResult("k a t"), 1);
+  EXPECT_TRUE(cache.Lookup("kat", opts, &result, 1));
+  EXPECT_FALSE(cache.Lookup("kat", opts, &result, 2));
+  EXPECT_FALSE(cache.Lookup("kat", opts, &result));
+}
+
+TEST(G2PCacheTest, LeastRecentlyUsedIsEvicted) {
+  festus::G2PCache cache(2, 1);
+  festus::G2POptions opts;
+  festus::G2PResult result;
+  cache.Insert("a", opts, MakeResult("a"));
+  cache.Insert("b", opts, MakeResult("b"));
+  EXPECT_TRUE(cache.Lookup("a", opts, &result));  // "b" is now the LRU entry.
+  cache.Insert("c", opts, MakeResult("c"));
+  EXPECT_TRUE(cache.Lookup("a", opts, &result));
+  EXPECT_FALSE(cache.Lookup("b", opts, &result));
+  EXPECT_TRUE(cache.Lookup("c", opts, &result));
+
+  auto stats = cache.Stats();
+  EXPECT_EQ(1, stats.evictions);
+  EXPECT_EQ(2, stats.size);
+
+  cache.Clear();
+  EXPECT_EQ(0, cache.Stats().size);
+  EXPECT_FALSE(cache.Lookup("a", opts, &result));
+}
+
+TEST(G2PCacheTest, ZeroCapacity) {
+  festus::G2PCache cache(0);
+  festus::G2POptions opts;
+  festus::G2PResult result;
+  cache.Insert("a", opts, MakeResult("a"));
+  EXPECT_FALSE(cache.Lookup("a", opts, &result));
+  EXPECT_EQ(0, cache.Stats().size);
+}
+
+TEST(G2PCacheTest, Concurrent) {
+  static constexpr int kNumThreads = 8;
+  static constexpr int kNumWords = 1000;
+  static constexpr int kCapacity = 256;
+  festus::G2PCache cache(kCapacity, 4);
+  festus::G2POptions opts;
+  std::vector<int> errors(kNumThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([t, &cache, &opts, &errors]() {
+      festus::G2PResult result;
+      for (int i = 0; i < kNumWords; ++i) {
+        const string word = std::to_string((i * 31 + t) % kNumWords);
+        if (cache.Lookup(word, opts, &result)) {
+          if (result.pronunciations.size() != 1 ||
+              result.pronunciations[0].first != word) {
+            ++errors[t];
+          }
+        } else {
+          cache.Insert(word, opts, MakeResult(word));
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t < kNumThreads; ++t) {
+    EXPECT_EQ(0, errors[t]);
+  }
+  auto stats = cache.Stats();
+  EXPECT_EQ(kNumThreads * kNumWords, stats.hits + stats.misses);
+  EXPECT_LE(stats.size, kCapacity);
+}
+
+}  // namespace
@@ -0,0 +1,215 @@
+// festus/runtime/g2p-cache.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Thread-safe, size-bounded cache of G2P pronunciation results.
+
+#ifndef FESTUS_RUNTIME_G2P_CACHE_H__
+#define FESTUS_RUNTIME_G2P_CACHE_H__
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p.h"
+
+namespace festus {
+
+struct G2PCacheStats {
+  uint64 hits = 0;
+  uint64 misses = 0;
+  uint64 evictions = 0;
+
+  // The number of entries currently in the cache.
+  std::size_t size = 0;
+};
+
+// Least-recently-used cache of successful G2P results, keyed on the spelling,
+// the options that were used to compute them, and optionally the identifier of
+// the model (see G2P<>::ModelId()), so that one cache can outlive a model that
+// is replaced while serving.
+//
+// The cache is split into independently locked shards, each of which is an
+// LRU cache holding an equal share of the overall capacity, so that
+// concurrent lookups of different words rarely contend for the same lock.
+class G2PCache {
+ public:
+  static constexpr std::size_t kDefaultNumShards = 16;
+
+  // Creates a cache holding at most (approximately) capacity entries, which
+  // are distributed over num_shards shards.
+  explicit G2PCache(std::size_t capacity,
+                    std::size_t num_shards = kDefaultNumShards)
+      : shard_capacity_((capacity + num_shards - 1) / num_shards) {
+    CHECK_GT(num_shards, 0);
+    shards_.reserve(num_shards);
+    for (std::size_t i = 0; i < num_shards; ++i) {
+      shards_.emplace_back(new Shard());
+    }
+  }
+
+  // Looks up the result for the given spelling, options, and model. Returns
+  // true and sets *result if found; returns false otherwise.
+  bool Lookup(const string &spelling,
+              const G2POptions &opts,
+              G2PResult *result,
+              uint64 model_id = 0) {
+    const string key = MakeKey(spelling, opts, model_id);
+    Shard *shard = GetShard(key);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto iter = shard->index.find(key);
+    if (iter == shard->index.end()) {
+      ++shard->misses;
+      return false;
+    }
+    ++shard->hits;
+    shard->entries.splice(shard->entries.begin(), shard->entries,
+                          iter->second);
+    *result = iter->second->second;
+    return true;
+  }
+
+  // Stores the result for the given spelling, options, and model, evicting
+  // the least recently used entry of its shard if the shard is full.
+  void Insert(const string &spelling,
+              const G2POptions &opts,
+              const G2PResult &result,
+              uint64 model_id = 0) {
+    if (shard_capacity_ == 0) return;
+    string key = MakeKey(spelling, opts, model_id);
+    Shard *shard = GetShard(key);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto iter = shard->index.find(key);
+    if (iter != shard->index.end()) {
+      iter->second->second = result;
+      shard->entries.splice(shard->entries.begin(), shard->entries,
+                            iter->second);
+      return;
+    }
+    shard->entries.emplace_front(key, result);
+    shard->index.emplace(std::move(key), shard->entries.begin());
+    if (shard->entries.size() > shard_capacity_) {
+      shard->index.erase(shard->entries.back().first);
+      shard->entries.pop_back();
+      ++shard->evictions;
+    }
+  }
+
+  // Removes all entries. Does not reset the counters.
+  void Clear() {
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      shard->index.clear();
+      shard->entries.clear();
+    }
+  }
+
+  // Returns the sum of the counters of all shards.
+  G2PCacheStats Stats() const {
+    G2PCacheStats stats;
+    for (const auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      stats.hits += shard->hits;
+      stats.misses += shard->misses;
+      stats.evictions += shard->evictions;
+      stats.size += shard->entries.size();
+    }
+    return stats;
+  }
+
+ private:
+  typedef std::list<std::pair<string, G2PResult>> Entries;
+
+  struct Shard {
+    std::mutex mutex;
+    // Entries in order of recency of use, most recently used first.
+    Entries entries;
+    std::unordered_map<string, Entries::iterator> index;
+    uint64 hits = 0;
+    uint64 misses = 0;
+    uint64 evictions = 0;
+  };
+
+  // The key consists of the spelling followed by the raw bytes of the model
+  // identifier and of all options that affect the result of
+  // G2P<>::Pronounce().
+  static string MakeKey(const string &spelling, const G2POptions &opts,
+                        uint64 model_id) {
+    string key = spelling;
+    key.push_back('\0');
+    AppendBytes(model_id, &key);
+    AppendBytes(opts.max_prons, &key);
+    AppendBytes(opts.real_pruning_threshold, &key);
+    AppendBytes(opts.delta, &key);
+    AppendBytes(opts.mode, &key);
+    AppendBytes(opts.beam, &key);
+    AppendBytes(opts.max_active_states, &key);
+    AppendBytes(opts.skip_out_of_alphabet, &key);
+    AppendBytes(opts.max_determinized_states, &key);
+    return key;
+  }
+
+  template <class T>
+  static void AppendBytes(const T &value, string *key) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    key->append(bytes, sizeof(T));
+  }
+
+  Shard *GetShard(const string &key) {
+    // Use the high bits of the hash, since the shard's hash table is indexed
+    // by the low bits.
+    const std::size_t hash = std::hash<string>()(key);
+    return shards_[(hash >> 16) % shards_.size()].get();
+  }
+
+  const std::size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  G2PCache(const G2PCache &) = delete;
+  G2PCache &operator=(const G2PCache &) = delete;
+};
+
+// Finds pronunciations like G2P<>::Pronounce(), but first consults the cache
+// (if not null) and stores successful results in it. Results are cached per
+// model, so a cache may be shared by successive models.
+template <class Arc>
+bool CachedPronounce(const G2P<Arc> &g2p,
+                     G2PCache *cache,
+                     const string &spelling,
+                     G2PResult *result,
+                     const G2POptions &opts,
+                     G2PWorkspace<Arc> *workspace) {
+  const uint64 model_id = g2p.ModelId();
+  if (cache && cache->Lookup(spelling, opts, result, model_id)) return true;
+  if (!g2p.Pronounce(spelling, result, opts, workspace)) return false;
+  if (cache) cache->Insert(spelling, opts, *result, model_id);
+  return true;
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_CACHE_H__
@@ -0,0 +1,202 @@
+// festus/runtime/g2p-client.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Command-line client for a G2P server started with g2p-lookup --socket.
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-protocol.h"
+
+namespace {
+
+// Words whose requests have been sent but whose output has not been written
+// yet, in input order.
+struct Pending {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<string> words;
+  bool done = false;
+};
+
+// Writes a response in the same TSV format as g2p-lookup. Returns false if
+// the lookup failed.
+bool WriteResponse(const string &word, uint8 status, const string &body) {
+  festus::G2PResult result;
+  if (status != festus::kG2POk) {
+    LOG(ERROR) << "No prounciations found for " << word << ": " << body;
+    return false;
+  }
+  if (!festus::ParseG2PPronunciations(body, &result)) {
+    LOG(ERROR) << "Malformed response for " << word;
+    return false;
+  }
+  double cumul = 0;
+  for (const auto &p : result.pronunciations) {
+    cumul += p.second;
+    std::cout << word << "\t" << p.first << "\t" << p.second
+              << "\t" << cumul << std::endl;
+  }
+  return true;
+}
+
+}  // namespace
+
+static const char kUsage[] =
+    R"(Looks up pronunciations using a G2P server (see g2p-lookup --socket).
+
+Reads orthographic words (one word per line) from a file or from stdin, sends
+them to the server at --socket, and writes their pronunciations to stdout in the
+same format as g2p-lookup. Up to --window requests are in flight at a time.
+
+With --stats, prints the server statistics instead. With --reload, makes the
+server reload its model from the files it was started with, and waits until the
+new model is in use (or the reload has failed).
+
+Usage:
+  g2p-client --socket=PATH [--flags...] [WORDS_FILE]
+)";
+
+DEFINE_string(socket, "", "Unix domain socket path of the server");
+DEFINE_int32(window, 256, "Maximal number of outstanding requests");
+DEFINE_bool(stats, false, "Print server statistics and exit");
+DEFINE_bool(reload, false, "Make the server reload its model and exit");
+
+int main(int argc, char *argv[]) {
+  SET_FLAGS(kUsage, &argc, &argv, true);
+  if (argc > 2) {
+    ShowUsage();
+    return 2;
+  }
+
+  auto client = festus::G2PClient::Connect(FLAGS_socket);
+  if (!client) return 2;
+
+  if (FLAGS_stats) {
+    string stats;
+    if (!client->GetStats(&stats)) {
+      LOG(ERROR) << "Could not retrieve server statistics";
+      return 1;
+    }
+    std::cout << stats;
+    return 0;
+  }
+
+  if (FLAGS_reload) {
+    string message;
+    if (!client->Reload(&message)) {
+      LOG(ERROR) << "Could not reload model: " << message;
+      return 1;
+    }
+    LOG(INFO) << message;
+    return 0;
+  }
+
+  std::ifstream file;
+  if (argc > 1 && std::strcmp(argv[1], "-") != 0) {
+    file.open(argv[1]);
+    if (!file) {
+      LOG(ERROR) << "Could not open " << argv[1];
+      return 2;
+    }
+  }
+  std::istream &input = file.is_open() ? file : std::cin;
+  const std::size_t window = FLAGS_window > 0 ? FLAGS_window : 1;
+
+  // The sender reads words and sends requests, numbered in input order, while
+  // the main thread receives responses and writes them in input order.
+  Pending pending;
+  bool send_failed = false;
+  std::thread sender([&]() {
+    uint32 id = 0;
+    for (string word; std::getline(input, word); ++id) {
+      {
+        std::unique_lock<std::mutex> lock(pending.mutex);
+        pending.changed.wait(lock, [&pending, window] {
+          return pending.words.size() < window;
+        });
+        pending.words.push_back(word);
+        pending.changed.notify_all();
+      }
+      if (!client->Send(id, festus::kG2PPronounce, word)) {
+        LOG(ERROR) << "Could not send request";
+        std::lock_guard<std::mutex> lock(pending.mutex);
+        pending.words.pop_back();  // No response will arrive for it.
+        send_failed = true;
+        break;
+      }
+    }
+    std::lock_guard<std::mutex> lock(pending.mutex);
+    pending.done = true;
+    pending.changed.notify_all();
+  });
+
+  bool success = true;
+  uint32 next_id = 0;
+  std::map<uint32, std::pair<uint8, string>> received;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(pending.mutex);
+      pending.changed.wait(lock, [&pending, &received] {
+        return pending.words.size() > received.size() || pending.done;
+      });
+      if (pending.words.size() == received.size()) break;
+    }
+    uint32 id;
+    uint8 status;
+    string body;
+    if (!client->Receive(&id, &status, &body)) {
+      LOG(ERROR) << "Lost connection to server";
+      success = false;
+      break;
+    }
+    received[id] = std::make_pair(status, std::move(body));
+    // Write all responses that are next in input order.
+    for (auto iter = received.find(next_id); iter != received.end();
+         iter = received.find(++next_id)) {
+      string word;
+      {
+        std::lock_guard<std::mutex> lock(pending.mutex);
+        word = std::move(pending.words.front());
+        pending.words.pop_front();
+        pending.changed.notify_all();
+      }
+      success &= WriteResponse(word, iter->second.first, iter->second.second);
+      received.erase(iter);
+    }
+  }
+  if (!success) {
+    // Unblock the sender, if necessary.
+    std::lock_guard<std::mutex> lock(pending.mutex);
+    pending.words.clear();
+    pending.changed.notify_all();
+  }
+  sender.join();
+  return success && !send_failed ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+// festus/runtime/g2p-loadgen.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Load generator for a G2P server started with g2p-lookup --socket. Measures
+// throughput and latency percentiles.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-protocol.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+bool ReadWords(const string &path, std::vector<string> *words) {
+  std::ifstream file;
+  if (!path.empty()) {
+    file.open(path);
+    if (!file) {
+      LOG(ERROR) << "Could not open " << path;
+      return false;
+    }
+  }
+  std::istream &strm = path.empty() ? std::cin : file;
+  for (string word; std::getline(strm, word); /*empty*/) {
+    words->push_back(std::move(word));
+  }
+  return true;
+}
+
+// Sends num_requests requests over one connection, keeping up to window
+// requests in flight, and records the latency of each request in
+// milliseconds. Returns false if the connection failed.
+bool RunConnection(const string &socket_path,
+                   const std::vector<string> &words,
+                   std::size_t first_word,
+                   uint32 num_requests,
+                   uint32 window,
+                   std::vector<double> *latencies,
+                   uint64 *failures) {
+  auto client = festus::G2PClient::Connect(socket_path);
+  if (!client) return false;
+  std::vector<Clock::time_point> send_times(num_requests);
+  latencies->reserve(num_requests);
+  uint32 sent = 0;
+  uint32 received = 0;
+  while (received < num_requests) {
+    while (sent < num_requests && sent - received < window) {
+      const string &word = words[(first_word + sent) % words.size()];
+      send_times[sent] = Clock::now();
+      if (!client->Send(sent, festus::kG2PPronounce, word)) return false;
+      ++sent;
+    }
+    uint32 id;
+    uint8 status;
+    string body;
+    if (!client->Receive(&id, &status, &body) || id >= sent) return false;
+    const std::chrono::duration<double, std::milli> latency =
+        Clock::now() - send_times[id];
+    latencies->push_back(latency.count());
+    if (status != festus::kG2POk) ++*failures;
+    ++received;
+  }
+  return true;
+}
+
+// Returns the given percentile of the sorted values.
+double Percentile(const std::vector<double> &sorted, double percentile) {
+  if (sorted.empty()) return 0;
+  const std::size_t rank = static_cast<std::size_t>(
+      percentile / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[rank];
+}
+
+}  // namespace
+
+static const char kUsage[] =
+    R"(Load generator for a G2P server (see g2p-lookup --socket).
+
+Reads orthographic words (one word per line) from a file or from stdin. Opens
+--connections connections to the server at --socket, each of which sends
+--requests requests for words taken round-robin from the input (starting at
+different offsets), keeping up to --window requests in flight. With the default
+--window=1, each connection waits for a response before sending the next
+request, i.e. it behaves like a synchronous client.
+
+Reports the overall throughput, the 50th, 90th, 99th percentiles and maximum
+of the request latency, and the server statistics at the end of the run.
+
+Usage:
+  g2p-loadgen --socket=PATH [--flags...] [WORDS_FILE]
+)";
+
+DEFINE_string(socket, "", "Unix domain socket path of the server");
+DEFINE_int32(connections, 4, "Number of concurrent connections");
+DEFINE_int32(requests, 10000, "Number of requests per connection");
+DEFINE_int32(window, 1,
+             "Maximal number of outstanding requests per connection");
+
+int main(int argc, char *argv[]) {
+  SET_FLAGS(kUsage, &argc, &argv, true);
+  if (argc > 2) {
+    ShowUsage();
+    return 2;
+  }
+
+  string in_name = (argc > 1 && std::strcmp(argv[1], "-") != 0) ? argv[1] : "";
+  std::vector<string> words;
+  if (!ReadWords(in_name, &words)) return 2;
+  if (words.empty()) {
+    LOG(ERROR) << "No input words";
+    return 2;
+  }
+
+  const int num_connections = std::max(FLAGS_connections, 1);
+  const uint32 num_requests = std::max(FLAGS_requests, 1);
+  const uint32 window = std::max(FLAGS_window, 1);
+  std::vector<std::vector<double>> latencies(num_connections);
+  std::vector<uint64> failures(num_connections, 0);
+  std::atomic<int> num_broken(0);
+  std::vector<std::thread> threads;
+  const auto start = Clock::now();
+  for (int c = 0; c < num_connections; ++c) {
+    threads.emplace_back([&, c]() {
+      const std::size_t first_word = words.size() * c / num_connections;
+      if (!RunConnection(FLAGS_socket, words, first_word, num_requests, window,
+                         &latencies[c], &failures[c])) {
+        ++num_broken;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  std::vector<double> all_latencies;
+  uint64 all_failures = 0;
+  for (int c = 0; c < num_connections; ++c) {
+    all_latencies.insert(all_latencies.end(), latencies[c].begin(),
+                         latencies[c].end());
+    all_failures += failures[c];
+  }
+  std::sort(all_latencies.begin(), all_latencies.end());
+
+  std::cout << std::fixed << std::setprecision(3)
+            << "connections\t" << num_connections << "\n"
+            << "window\t" << window << "\n"
+            << "requests\t" << all_latencies.size() << "\n"
+            << "failures\t" << all_failures << "\n"
+            << "broken_connections\t" << num_broken << "\n"
+            << "seconds\t" << elapsed.count() << "\n"
+            << "requests_per_second\t"
+            << all_latencies.size() / elapsed.count() << "\n"
+            << "p50_ms\t" << Percentile(all_latencies, 50) << "\n"
+            << "p90_ms\t" << Percentile(all_latencies, 90) << "\n"
+            << "p99_ms\t" << Percentile(all_latencies, 99) << "\n"
+            << "max_ms\t" << Percentile(all_latencies, 100) << "\n";
+
+  auto client = festus::G2PClient::Connect(FLAGS_socket);
+  string stats;
+  if (client && client->GetStats(&stats)) {
+    std::cout << "\nserver statistics:\n" << stats;
+  }
+  std::cout << std::flush;
+  return num_broken == 0 ? 0 : 1;
+}
@@ -18,10 +18,25 @@
 // \file
 // Command-line interface for grapheme-to-phoneme (G2P) pronunciation lookup.
 
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include <fst/compat.h>
 #include <fst/fstlib.h>
@@ -29,10 +44,22 @@
 
 // NB: Non-standard include directive to facilitate stand-alone compilation.
 #include "compact.h"
+#include "dense-matcher.h"
+#include "g2p-cache.h"
+#include "g2p-model-handle.h"
+#include "g2p-registry.h"
+#include "g2p-server.h"
+#include "g2p-stats.h"
 #include "g2p.h"
+#include "lookahead.h"
+#include "mapped-lexicon.h"
+#include "model-io.h"
+#include "quantized.h"
 
 typedef fst::LogArc MyArc;
 typedef festus::G2P<MyArc> MyG2P;
+typedef festus::G2PModelHandle<MyArc> MyModelHandle;
+typedef festus::G2PModelRegistry<MyArc> MyRegistry;
 
 namespace {
 
@@ -44,17 +71,353 @@ namespace {
 // - no need to store weights, as these machines are typically unweighted;
 // - use 14 bits (16383 possible values) for the target state of an arc.
 //
-// Register the corresponding compact FST type so that the generic Read()
-// operation (in the body of ReadFst) can recognize and load such FSTs.
-static fst::FstRegisterer<festus::Compact_8_10_0_14_Fst<MyArc>> compact_reg;
+// Larger machines use other bitfield layouts, chosen by make-runtime-fsts.
+// Register the compact FST types of all layouts so that the generic Read()
+// operation (in the body of ReadModelFst) can recognize and load such FSTs.
+static festus::BitfieldCompactFstRegisterer<MyArc> compact_reg;
 
 // The graphones_model FST is a backoff language model in OpenGrm format.
-// Register the LOUDS-compressed FST representation here, for use with Read().
+// Register the LOUDS-compressed FST representation here, for use with Read(),
+// as well as the compact representations with quantized weights.
 static fst::FstRegisterer<fst::NGramFst<MyArc>> ngram_reg;
+static festus::QuantizedCompactFstRegisterer<MyArc> quantized_reg;
+
+// The bytes_to_graphones FST and the composed model can also be stored in input
+// label lookahead format, or with a dense byte matcher index.
+static fst::FstRegisterer<festus::ILabelLookAheadFst<MyArc>> lookahead_reg;
+static fst::FstRegisterer<festus::DenseByteFst<MyArc>> dense_reg;
 
-inline std::unique_ptr<const MyG2P::Lattice> ReadFst(const string &path) {
-  // TODO: std::make_unique() in C++14.
-  return std::unique_ptr<const MyG2P::Lattice>(MyG2P::Lattice::Read(path));
+// Splits a comma-separated list, skipping empty elements.
+std::vector<string> SplitWords(const string &list) {
+  std::vector<string> words;
+  std::istringstream strm(list);
+  for (string word; std::getline(strm, word, ',');) {
+    if (!word.empty()) words.push_back(word);
+  }
+  return words;
+}
+
+// A single word of input together with the outcome of its lookup.
+struct Lookup {
+  string word;
+  festus::G2PResult result;
+  bool success = false;
+};
+
+// The scratch space of one worker thread. The workspace keeps copies of the
+// FSTs of the last model it was used with, which share the data of that model.
+// With a registry, the worker therefore also holds on to that model, so that
+// the registry counts it as in use (and as resident) until the worker moves on
+// to another language.
+struct Worker {
+  festus::G2PWorkspace<MyArc> workspace;
+  std::shared_ptr<const festus::G2P<MyArc>> model;
+};
+
+// The lookup pipeline: exact matches are answered from the lexicon (if not
+// null), then from the cache (if not null), and finally by the current model.
+// All of these are shared by all worker threads. Each lookup pins the model
+// that is current when it starts, so the model can be reloaded at any time. If
+// stats is not null, the stages of each lookup by the model are recorded
+// there.
+//
+// If registry is not null, it is used instead of models and the lexicon, and
+// each word is preceded by a language code and a tab, which selects the model.
+struct Pronouncer {
+  const MyModelHandle *models = nullptr;
+  MyRegistry *registry = nullptr;
+  const festus::MappedLexicon *lexicon = nullptr;
+  festus::G2PCache *cache = nullptr;
+  festus::G2PStats *stats = nullptr;
+  festus::G2POptions options;
+
+  void SetUpWorker(Worker *worker) const {
+    worker->workspace.SetStats(stats);
+  }
+
+  void Pronounce(Worker *worker, Lookup *lookup) const {
+    if (registry) {
+      PronounceInLanguage(worker, lookup);
+      return;
+    }
+    const auto model = models->Get();
+    lookup->success = festus::LexiconPronounce(
+        *model->g2p, lexicon, cache, lookup->word, &lookup->result, options,
+        &worker->workspace);
+  }
+
+  void PronounceInLanguage(Worker *worker, Lookup *lookup) const {
+    lookup->success = false;
+    const auto tab = lookup->word.find('\t');
+    if (tab == string::npos) {
+      lookup->result.error = "Expected LANGUAGE<TAB>WORD";
+      return;
+    }
+    // Replacing the model lets go of the previous one only after the new one
+    // was obtained, so that the same model is not unloaded and loaded again.
+    worker->model =
+        registry->Get(lookup->word.substr(0, tab), &lookup->result.error);
+    if (!worker->model) return;
+    // The cache is keyed on the model, and hence on the language.
+    lookup->success = festus::CachedPronounce(
+        *worker->model, cache, lookup->word.substr(tab + 1), &lookup->result,
+        options, &worker->workspace);
+  }
+};
+
+// Pronounces the first size words in the given batch, using up to num_threads
+// worker threads. Workers claim words via a shared counter and store each
+// result alongside its word, so that output order does not depend on
+// scheduling.
+void PronounceBatch(const Pronouncer &pronouncer,
+                    int num_threads,
+                    std::size_t size,
+                    std::vector<Lookup> *batch) {
+  std::atomic<std::size_t> next(0);
+  auto worker = [&pronouncer, &next, size, batch]() {
+    Worker worker;
+    pronouncer.SetUpWorker(&worker);
+    for (std::size_t i = next++; i < size; i = next++) {
+      pronouncer.Pronounce(&worker, &(*batch)[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int t = 0; t < num_threads; ++t) {
+    workers.emplace_back(worker);
+  }
+  for (auto &thread : workers) {
+    thread.join();
+  }
+}
+
+// Reloads the model and, on success, drops the results of the old model from
+// the cache (if not null). Sets *message to a description of the outcome.
+// With a registry, unloads all models instead, so that each of them is loaded
+// again on next use.
+bool ReloadModel(MyModelHandle *models, MyRegistry *registry,
+                 festus::G2PCache *cache, string *message) {
+  if (registry) {
+    registry->UnloadAll();
+    if (cache) cache->Clear();
+    *message = "Unloaded all G2P models";
+    LOG(INFO) << *message;
+    return true;
+  }
+  if (!models->Reload()) {
+    *message = models->Stats().last_error;
+    return false;
+  }
+  if (cache) cache->Clear();
+  const festus::G2PModelStats stats = models->Stats();
+  std::ostringstream strm;
+  strm << "Loaded G2P model version " << stats.version << " in "
+       << stats.last_reload_ms << " ms";
+  *message = strm.str();
+  LOG(INFO) << *message;
+  return true;
+}
+
+// Reloads the model whenever the process receives SIGHUP. Must be called
+// before any other thread is started, so that all threads inherit the blocked
+// signal and SIGHUP is only ever received by the thread started here.
+void ReloadOnSighup(MyModelHandle *models, MyRegistry *registry,
+                    festus::G2PCache *cache) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  std::thread([models, registry, cache, signals]() {
+    for (int signal; sigwait(&signals, &signal) == 0;) {
+      LOG(INFO) << "Received SIGHUP; reloading G2P model";
+      string message;
+      ReloadModel(models, registry, cache, &message);
+    }
+  }).detach();
+}
+
+// Logs the load time and resident size of the model of each language.
+void LogRegistryStats(const MyRegistry &registry) {
+  const festus::G2PRegistryStats stats = registry.Stats();
+  LOG(INFO) << "Models: " << stats.resident_bytes << " bytes resident"
+            << " (budget " << stats.memory_budget << ")";
+  for (const auto &language : stats.languages) {
+    if (language.requests == 0) continue;
+    LOG(INFO) << "Model " << language.language << ": "
+              << (language.loaded ? "loaded" : "not loaded") << ", "
+              << language.resident_bytes << " bytes, last load took "
+              << language.last_load_ms << " ms, " << language.requests
+              << " requests, " << language.loads << " loads, "
+              << language.failed_loads << " failed loads, "
+              << language.evictions << " evictions";
+  }
+}
+
+// Serves lookups over the Unix domain socket at the given path until killed.
+// Returns false if the server could not be started or stopped serving
+// because of an error.
+bool Serve(const Pronouncer &pronouncer,
+           MyModelHandle *models,
+           MyRegistry *registry,
+           const festus::G2PServerOptions &options,
+           const string &socket_path,
+           int stats_interval) {
+  festus::G2PServer server(options, [&pronouncer]() {
+    std::shared_ptr<Worker> worker(new Worker());
+    pronouncer.SetUpWorker(worker.get());
+    return [&pronouncer, worker](const string &word,
+                                 festus::G2PResult *result) {
+      Lookup lookup;
+      lookup.word = word;
+      pronouncer.Pronounce(worker.get(), &lookup);
+      *result = std::move(lookup.result);
+      return lookup.success;
+    };
+  });
+  server.SetReloadFunction([&pronouncer, models, registry](string *message) {
+    return ReloadModel(models, registry, pronouncer.cache, message);
+  });
+  server.SetStatsFunction([models, registry]() {
+    return registry ? registry->Stats().ToString()
+                    : models->Stats().ToString();
+  });
+  if (!server.Start(socket_path)) return false;
+  LOG(INFO) << "Serving G2P requests at " << socket_path;
+  // The stats thread logs periodically until Serve() returns, and is joined
+  // before the server is destroyed.
+  std::mutex stats_mutex;
+  std::condition_variable stats_done;
+  bool serving = true;
+  std::thread stats_thread;
+  if (stats_interval > 0) {
+    stats_thread = std::thread([&]() {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(stats_mutex);
+          if (stats_done.wait_for(lock, std::chrono::seconds(stats_interval),
+                                  [&serving] { return !serving; })) {
+            return;
+          }
+        }
+        const festus::G2PServerStats stats = server.Stats();
+        LOG(INFO) << "Server: " << stats.active_connections
+                  << " connections, " << stats.requests << " requests, "
+                  << stats.batches << " batches, queue depth "
+                  << stats.queue_depth << " (peak "
+                  << stats.peak_queue_depth << ")";
+        if (registry) {
+          LogRegistryStats(*registry);
+        } else {
+          const festus::G2PModelStats model_stats = models->Stats();
+          LOG(INFO) << "Model: version " << model_stats.version << ", "
+                    << model_stats.failed_reloads << " failed reloads, "
+                    << "last reload took " << model_stats.last_reload_ms
+                    << " ms (max " << model_stats.max_reload_ms << " ms)";
+        }
+        if (pronouncer.stats) pronouncer.stats->Print(std::cerr);
+      }
+    });
+  }
+  const bool shut_down = server.Serve();
+  if (stats_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      serving = false;
+    }
+    stats_done.notify_all();
+    stats_thread.join();
+  }
+  return shut_down;
+}
+
+// Writes lines of tab-separated values to an output stream. Lines are
+// collected in a buffer that is written out in large blocks, either when it
+// is full or when Flush() is called.
+class TsvWriter {
+ public:
+  static constexpr std::size_t kBufferSize = 1 << 16;
+
+  explicit TsvWriter(std::ostream *strm) : strm_(strm) {
+    buffer_.reserve(2 * kBufferSize);
+  }
+
+  ~TsvWriter() { Flush(); }
+
+  void AddField(const string &value) {
+    StartField();
+    buffer_.append(value);
+  }
+
+  // Formats the value like an ostream with default settings would.
+  void AddField(double value) {
+    StartField();
+    char digits[32];
+    const int size = std::snprintf(digits, sizeof(digits), "%g", value);
+    buffer_.append(digits, size);
+  }
+
+  void EndLine() {
+    buffer_.push_back('\n');
+    at_line_start_ = true;
+    if (buffer_.size() >= kBufferSize) Flush();
+  }
+
+  bool Flush() {
+    if (!buffer_.empty()) {
+      strm_->write(buffer_.data(), buffer_.size());
+      buffer_.clear();
+    }
+    strm_->flush();
+    return strm_->good();
+  }
+
+ private:
+  void StartField() {
+    if (!at_line_start_) buffer_.push_back('\t');
+    at_line_start_ = false;
+  }
+
+  std::ostream *strm_;
+  string buffer_;
+  bool at_line_start_ = true;
+
+  TsvWriter(const TsvWriter &) = delete;
+  TsvWriter &operator=(const TsvWriter &) = delete;
+};
+
+// Flushes the writer unless further input is already available, so that
+// output is written in large blocks when reading from a file, but each line
+// is answered immediately when words are typed or sent one at a time.
+void FlushUnlessInputPending(TsvWriter *writer) {
+  if (std::cin.rdbuf()->in_avail() <= 0) writer->Flush();
+}
+
+// Writes the pronunciations of a word in TSV format. Returns false if the
+// lookup failed.
+bool WriteLookup(const Lookup &lookup, TsvWriter *writer) {
+  const festus::G2PResult &result = lookup.result;
+  if (!lookup.success) {
+    LOG(ERROR) << "No prounciations found for " << lookup.word
+               << ": " << result.error;
+    return false;
+  }
+  VLOG(1) << result.num_hypotheses
+          << " hypothes" << (result.num_hypotheses == 1 ? "is" : "es")
+          << " searched";
+  auto num_prons = result.pronunciations.size();
+  VLOG(1) << num_prons
+          << " pronunciation" << (num_prons == 1 ? "" : "s")
+          << " found";
+  double cumul = 0;
+  for (const auto &p : result.pronunciations) {
+    cumul += p.second;
+    writer->AddField(lookup.word);
+    writer->AddField(p.first);
+    writer->AddField(p.second);
+    writer->AddField(cumul);
+    writer->EndLine();
+  }
+  return true;
 }
 
 }  // namespace
@@ -72,11 +435,14 @@ tab-separated value (TSV) format with the following four columns:
   4. the cumulative probability of the current and preceding pronunciations.
 
 When multiple pronunciations are generated, they are output in decending order
-of posterior probability.
+of posterior probability. Output is buffered and written out whenever no further
+input is pending, so words can also be looked up interactively.
 
 The grapheme-to-phoneme model is specified by the three flags
 --bytes_to_graphones, --graphone_model, and --phonemes_to_graphones
-corresponding to the factorization of the model.
+corresponding to the factorization of the model. Alternatively, the flag
+--composed_model specifies a precomposed bytes_to_graphones and graphone_model
+machine (see compose-runtime-model), which replaces the first two flags.
 
 The flag --max_prons specifies the upper limit on the number of
 pronunciations that will be generated for a given word.
@@ -86,6 +452,92 @@ applied to the marginal posterior lattice during decoding when max_prons > 1.
 A hypotheses will be pruned away if its probability is less than theta times
 the probability of the most likely hypothesis.
 
+The flags --beam and --max_active_states bound the size of the graphone lattice
+built for each word by discarding unlikely partial hypotheses early; see
+G2POptions for details. Both are disabled by default.
+
+The flag --max_determinized_states makes decoding determinize the phoneme
+lattice on demand, stopping once --max_prons pronunciations have been found,
+and at most this many determinized states; the reported number of hypotheses
+is then only a lower bound. It is disabled (0) by default.
+
+Words that the model cannot read, e.g. because they contain characters that do
+not occur in any graphone, are rejected before any lattice is built. With
+--skip_out_of_alphabet, such characters are removed from the word instead, and
+the rest of it is pronounced.
+
+The flag --mode selects the inference procedure: "marginal" (the default)
+computes marginal posterior probabilities of pronunciations; "viterbi" is a
+faster approximation that outputs the pronunciation of the single best graphone
+path, together with its joint probability, and ignores --max_prons.
+
+The flag --threads specifies the number of worker threads. When it is greater
+than 1, words are read in batches of --batch_size words and looked up
+concurrently; the output is still written in input order.
+
+The flag --cache_size enables a cache of up to that many pronunciation results,
+which is shared by all threads and split into --cache_shards independently
+locked shards. Cache statistics are logged at the end.
+
+The flag --mmap (on by default) maps the model files into memory instead of
+reading them, so that their pages are shared by all processes that use the same
+model and startup time does not depend on model size. This requires aligned
+files as written by make-runtime-fsts and compose-runtime-model, and graphone
+models written by ngramfinalize --to_runtime_model with --mappable or
+--quantize_bits; other files are read into memory as usual.
+
+With --socket, g2p-lookup runs as a server: it loads the model once and then
+answers pronunciation requests sent to the Unix domain socket at the given path
+(see g2p-protocol.h for the protocol, and g2p-client and g2p-loadgen for
+clients), instead of reading words from a file or stdin. Requests from all
+clients are queued and looked up in batches of up to --batch_size requests by
+--threads worker threads; a worker waits up to --batch_delay_us microseconds
+for a batch to fill up. When --max_queue_depth requests are waiting, the server
+stops reading further requests until the queue has drained. Server statistics,
+including the queue depth, are logged every --stats_interval seconds and can be
+queried with g2p-client --stats.
+
+The model can be replaced without interrupting lookups: on SIGHUP, or when
+serving also on g2p-client --reload, the model files are read again and the new
+model is used for all lookups that start after it has been loaded. Lookups in
+progress finish with the old model. If --validation_words is given, each of
+these comma-separated words must be pronounced by a new model, otherwise the
+old model remains in use. The model version and reload times are included in
+the server statistics.
+
+With --stats, the time taken by each stage of looking up a word with the model,
+and the number of states and arcs of the lattice resulting from each stage, are
+collected into histograms. The histograms and the slowest words are printed to
+stderr at the end (or every --stats_interval seconds when serving). Words found
+in the lexicon or cache are not included.
+
+The flag --input_tape selects how words are converted into the input labels of
+the model, which must match the input_label_type of the alignables spec it was
+trained from (make-runtime-fsts reports it): "byte" (the default), "unicode"
+for Unicode codepoints of UTF-8 words, or "symbol" for space-separated symbols
+from the symbol table given by --input_symbols (as written by make-runtime-fsts
+--input_symbols_out). Words that cannot be converted have no pronunciations.
+
+The flag --lexicon specifies a lexicon compiled with compile-lexicon. Words
+found in the lexicon are answered from it directly, without using the model.
+
+With --model_config, the models of several languages are served at once,
+instead of the model given by the model flags. The file lists the model files
+of each language on a line of the form
+
+  LANGUAGE bytes_to_graphones=B graphone_model=G phonemes_to_graphones=P
+
+with paths B, G, P, or with composed_model=C instead of the first two, and
+optionally input_tape=T and input_symbols=S (see g2p-registry.h).
+Each input line (or request) then consists of a language code, a tab, and a
+word, and the output has the language code as an additional first column. The
+model of a language is loaded when it is first used. If the models loaded
+exceed --memory_budget_mb, the least recently used ones are unloaded until they
+fit, unless they are in use. Reloading unloads all models. The load time and
+resident size of each model are logged at the end (or every --stats_interval
+seconds when serving), and reported by g2p-client --stats. --lexicon cannot be
+used with --model_config, and --validation_words is ignored.
+
 Usage:
   g2p-lookup [--flags...] [WORDS_FILE]
 )";
@@ -93,6 +545,21 @@ Usage:
 DEFINE_string(bytes_to_graphones, "", "Path to bytes_to_graphones FST");
 DEFINE_string(graphone_model, "", "Path to graphone_model FST");
 DEFINE_string(phonemes_to_graphones, "", "Path to phonemes_to_graphones FST");
+DEFINE_string(composed_model, "",
+              "Path to precomposed bytes_to_graphones and graphone_model FST");
+DEFINE_string(input_tape, "byte",
+              "Input labels of the model: byte, unicode, or symbol");
+DEFINE_string(input_symbols, "",
+              "With --input_tape=symbol: path to the input symbol table");
+DEFINE_string(lexicon, "", "Path to compiled lexicon (optional)");
+DEFINE_bool(mmap, true, "Map model files into memory where possible");
+DEFINE_string(validation_words, "",
+              "Comma-separated words that a model must be able to pronounce");
+DEFINE_string(model_config, "",
+              "Path to a file listing the model files of each language");
+DEFINE_int32(memory_budget_mb, 0,
+             "With --model_config: megabytes of models to keep loaded; "
+             "0 for no limit");
 
 DEFINE_int32(max_prons,
              festus::G2POptions::kDefaultMaxProns,
@@ -103,51 +570,185 @@ DEFINE_double(real_pruning_threshold,
 DEFINE_double(delta,
               fst::kDelta,
               "Convergence threshold for FST operations");
+DEFINE_double(beam, std::numeric_limits<float>::infinity(),
+              "Beam for pruning during lattice construction, in nats");
+DEFINE_int32(max_active_states, 0,
+             "Maximal number of partial hypotheses per prefix; 0 for no limit");
+DEFINE_int32(max_determinized_states, 0,
+             "Maximal number of lattice states determinized on demand during "
+             "decoding; 0 to determinize in full");
+DEFINE_bool(skip_out_of_alphabet, false,
+            "Remove characters the model cannot read instead of rejecting");
+DEFINE_string(mode, "marginal", "Inference mode: marginal or viterbi");
+
+DEFINE_int32(threads, 1, "Number of worker threads");
+DEFINE_int32(batch_size, 4096,
+             "Number of words looked up at a time when threads > 1, or "
+             "maximal number of requests per batch when serving");
+
+DEFINE_string(socket, "", "Serve requests at this Unix domain socket path");
+DEFINE_int32(batch_delay_us, 0,
+             "Server only: microseconds to wait for a batch to fill up");
+DEFINE_int32(max_queue_depth, 1024,
+             "Server only: maximal number of waiting requests");
+DEFINE_int32(stats_interval, 60,
+             "Server only: seconds between statistics logs; 0 disables");
+
+DEFINE_bool(stats, false,
+            "Print per-stage latency and lattice size statistics");
+
+DEFINE_int32(cache_size, 0, "Maximal number of cached results; 0 disables");
+DEFINE_int32(cache_shards, festus::G2PCache::kDefaultNumShards,
+             "Number of independently locked cache shards");
 
 int main(int argc, char *argv[]) {
+  // Buffer stdin independently of stdio, so that pending input can be
+  // detected; see FlushUnlessInputPending().
+  std::ios_base::sync_with_stdio(false);
   SET_FLAGS(kUsage, &argc, &argv, true);
 
-  auto bytes_to_graphones = ReadFst(FLAGS_bytes_to_graphones);
-  if (!bytes_to_graphones) return 2;
+  festus::G2PModelFiles files;
+  files.bytes_to_graphones = FLAGS_bytes_to_graphones;
+  files.graphone_model = FLAGS_graphone_model;
+  files.composed_model = FLAGS_composed_model;
+  files.phonemes_to_graphones = FLAGS_phonemes_to_graphones;
+  files.input_tape = FLAGS_input_tape;
+  files.input_symbols = FLAGS_input_symbols;
+  files.memory_map = FLAGS_mmap;
+  const std::vector<string> validation_words =
+      SplitWords(FLAGS_validation_words);
 
-  auto graphone_model = ReadFst(FLAGS_graphone_model);
-  if (!graphone_model) return 2;
+  std::unique_ptr<festus::MappedLexicon> lexicon;
+  if (!FLAGS_lexicon.empty()) {
+    lexicon = festus::MappedLexicon::FromFile(FLAGS_lexicon);
+    if (!lexicon) return 2;
+  }
 
-  auto phonemes_to_graphones = ReadFst(FLAGS_phonemes_to_graphones);
-  if (!phonemes_to_graphones) return 2;
+  std::unique_ptr<festus::G2PCache> cache;
+  if (FLAGS_cache_size > 0) {
+    cache.reset(new festus::G2PCache(FLAGS_cache_size,
+                                     std::max(FLAGS_cache_shards, 1)));
+  }
 
-  MyG2P g2p;
-  g2p.SetBytesToGraphonesFst(std::move(bytes_to_graphones));
-  g2p.SetGraphoneModelFst(std::move(graphone_model));
-  g2p.SetPhonemesToGraphonesFst(std::move(phonemes_to_graphones));
+  std::unique_ptr<festus::G2PStats> g2p_stats;
+  if (FLAGS_stats) g2p_stats.reset(new festus::G2PStats());
 
-  festus::G2POptions options;
-  options.max_prons = FLAGS_max_prons;
-  options.real_pruning_threshold = FLAGS_real_pruning_threshold;
-  options.delta = FLAGS_delta;
+  Pronouncer pronouncer;
+  pronouncer.lexicon = lexicon.get();
+  pronouncer.cache = cache.get();
+  pronouncer.stats = g2p_stats.get();
+  pronouncer.options.max_prons = FLAGS_max_prons;
+  pronouncer.options.real_pruning_threshold = FLAGS_real_pruning_threshold;
+  pronouncer.options.delta = FLAGS_delta;
+  pronouncer.options.beam = FLAGS_beam;
+  pronouncer.options.max_active_states = std::max(FLAGS_max_active_states, 0);
+  pronouncer.options.max_determinized_states =
+      std::max(FLAGS_max_determinized_states, 0);
+  pronouncer.options.skip_out_of_alphabet = FLAGS_skip_out_of_alphabet;
+  if (FLAGS_mode == "viterbi") {
+    pronouncer.options.mode = festus::G2POptions::VITERBI;
+  } else if (FLAGS_mode != "marginal") {
+    LOG(ERROR) << "Unknown mode: " << FLAGS_mode;
+    return 2;
+  }
+
+  std::unique_ptr<MyRegistry> registry;
+  if (!FLAGS_model_config.empty()) {
+    if (lexicon) {
+      LOG(ERROR) << "--lexicon cannot be used with --model_config";
+      return 2;
+    }
+    std::ifstream config(FLAGS_model_config);
+    if (!config) {
+      LOG(ERROR) << "Could not open " << FLAGS_model_config;
+      return 2;
+    }
+    std::vector<std::pair<string, festus::G2PModelFiles>> languages;
+    string error;
+    if (!festus::ParseG2PModelConfig(config, &languages, &error)) {
+      LOG(ERROR) << FLAGS_model_config << ": " << error;
+      return 2;
+    }
+    for (auto &language : languages) {
+      language.second.memory_map = FLAGS_mmap;
+    }
+    const std::size_t memory_budget =
+        static_cast<std::size_t>(std::max(FLAGS_memory_budget_mb, 0)) << 20;
+    registry.reset(new MyRegistry(memory_budget));
+    registry->RegisterFiles(languages);
+    pronouncer.registry = registry.get();
+  }
+
+  const festus::G2POptions &options = pronouncer.options;
+  MyModelHandle models(
+      [&files](string *error) {
+        return festus::LoadG2PModel<MyArc>(files, nullptr, error);
+      },
+      [&validation_words, &options](const MyG2P &g2p, string *error) {
+        festus::G2PResult result;
+        festus::G2PWorkspace<MyArc> workspace;
+        for (const string &word : validation_words) {
+          if (!g2p.Pronounce(word, &result, options, &workspace)) {
+            *error = "Cannot pronounce " + word + ": " + result.error;
+            return false;
+          }
+        }
+        return true;
+      });
+  ReloadOnSighup(&models, registry.get(), cache.get());
+  if (!registry && !models.Reload()) return 2;
+  pronouncer.models = &models;
+
+  if (!FLAGS_socket.empty()) {
+    festus::G2PServerOptions server_options;
+    server_options.num_threads = std::max(FLAGS_threads, 1);
+    server_options.max_batch_size = std::max(FLAGS_batch_size, 1);
+    server_options.max_batch_delay =
+        std::chrono::microseconds(std::max(FLAGS_batch_delay_us, 0));
+    server_options.max_queue_depth = std::max(FLAGS_max_queue_depth, 1);
+    return Serve(pronouncer, &models, registry.get(), server_options,
+                 FLAGS_socket, FLAGS_stats_interval) ? 0 : 1;
+  }
 
-  festus::G2PResult result;
   bool success = true;
-  for (string word; std::getline(std::cin, word); /*empty*/) {
-    if (g2p.Pronounce(word, &result, options)) {
-      VLOG(1) << result.num_hypotheses
-              << " hypothes" << (result.num_hypotheses == 1 ? "is" : "es")
-              << " searched";
-      auto num_prons = result.pronunciations.size();
-      VLOG(1) << num_prons
-              << " pronunciation" << (num_prons == 1 ? "" : "s")
-              << " found";
-      double cumul = 0;
-      for (const auto &p : result.pronunciations) {
-        cumul += p.second;
-        std::cout << word << "\t" << p.first << "\t" << p.second
-                  << "\t" << cumul << std::endl;
+  TsvWriter writer(&std::cout);
+  if (FLAGS_threads <= 1) {
+    Worker worker;
+    pronouncer.SetUpWorker(&worker);
+    Lookup lookup;
+    while (std::getline(std::cin, lookup.word)) {
+      pronouncer.Pronounce(&worker, &lookup);
+      success &= WriteLookup(lookup, &writer);
+      FlushUnlessInputPending(&writer);
+    }
+  } else {
+    const std::size_t batch_size = FLAGS_batch_size > 0 ? FLAGS_batch_size : 1;
+    // The lookups are reused from batch to batch, together with the storage
+    // of their words and results.
+    std::vector<Lookup> batch(batch_size);
+    std::size_t size = 0;
+    auto flush = [&pronouncer, &batch, &size, &success, &writer]() {
+      PronounceBatch(pronouncer, FLAGS_threads, size, &batch);
+      for (std::size_t i = 0; i < size; ++i) {
+        success &= WriteLookup(batch[i], &writer);
       }
-    } else {
-      LOG(ERROR) << "No prounciations found for " << word
-                 << ": " << result.error;
-      success = false;
+      FlushUnlessInputPending(&writer);
+      size = 0;
+    };
+    while (std::getline(std::cin, batch[size].word)) {
+      if (++size == batch_size) flush();
     }
+    if (size > 0) flush();
+  }
+  success &= writer.Flush();
+
+  if (cache) {
+    const festus::G2PCacheStats stats = cache->Stats();
+    LOG(INFO) << "Cache: " << stats.hits << " hits, " << stats.misses
+              << " misses, " << stats.evictions << " evictions, "
+              << stats.size << " entries";
   }
+  if (registry) LogRegistryStats(*registry);
+  if (g2p_stats) g2p_stats->Print(std::cerr);
   return success ? 0 : 1;
 }
@@ -0,0 +1,204 @@
+// festus/runtime/g2p-microbenchmark.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Benchmark suite for G2P<>::Pronounce(), using the checked-in graphone
+// language models (see g2p-test-model.h), so that results are comparable
+// across revisions. Unlike g2p-benchmark, it needs no trained model.
+//
+// Each benchmark is parameterized by word length (in bytes) and
+// G2POptions::max_prons, and reports the throughput (items_per_second) and
+// the 50th, 90th, 99th percentile and maximum latency of a single call (in
+// microseconds) as user counters. For machine-readable results, run with
+//
+//   g2p-microbenchmark --benchmark_out=results.json --benchmark_out_format=json
+//
+// Each model is benchmarked as separate machines and as a precomposed model,
+// and with and without a dense byte matcher (see dense-matcher.h) for the
+// machine that is composed with the spelling.
+//
+// An optional argument specifies the directory containing the models;
+// it defaults to festus/runtime, relative to the current directory.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+#include <fst/extensions/ngram/ngram-fst.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "dense-matcher.h"
+#include "g2p-stats.h"
+#include "g2p-test-model.h"
+#include "g2p.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef festus::G2P<MyArc> MyG2P;
+
+const char *const kGraphoneModels[] = {
+  "ngram_model_with_final_backoff.fst",
+  "ngram_model_without_final_backoff.fst",
+};
+
+// Words are made up by concatenating these, so that every word length can be
+// benchmarked with plausible spellings. All are in ASCII, so that truncating
+// their concatenation never splits a UTF-8 character.
+const char *const kWords[] = {
+  "aap", "boek", "skool", "kat", "hond", "ding", "water", "lekker", "nooit",
+  "meisie", "tjie", "skryf", "ek", "is", "jy", "ons", "hulle", "vrou", "man",
+  "kind", "ewe", "geweldig", "ongelooflik",
+};
+
+const std::size_t kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+
+// Returns kNumWords distinct words of the given length in bytes.
+std::vector<string> MakeWords(std::size_t length) {
+  std::vector<string> words;
+  for (std::size_t i = 0; i < kNumWords; ++i) {
+    string word;
+    for (std::size_t j = i; word.size() < length; ++j) {
+      word += kWords[j % kNumWords];
+    }
+    word.resize(length);
+    words.push_back(std::move(word));
+  }
+  return words;
+}
+
+std::unique_ptr<MyG2P> MakeG2P(const festus::G2PTestMachines &machines,
+                               bool composed,
+                               bool dense) {
+  std::unique_ptr<MyG2P> g2p(new MyG2P());
+  std::unique_ptr<const MyG2P::Lattice> bytes_to_graphones;
+  if (dense && !composed) {
+    bytes_to_graphones.reset(
+        new festus::DenseByteFst<MyArc>(machines.bytes_to_graphones));
+  } else {
+    bytes_to_graphones =
+        festus::CompactG2PTestMachine(machines.bytes_to_graphones);
+  }
+  std::unique_ptr<const MyG2P::Lattice> graphone_model(
+      new fst::NGramFst<MyArc>(machines.graphone_model));
+  if (composed) {
+    fst::VectorFst<MyArc> composed_model;
+    festus::ComposeGraphoneModel(*bytes_to_graphones, *graphone_model, 0,
+                                 &composed_model);
+    if (dense) {
+      fst::ArcSort(&composed_model, fst::ILabelCompare<MyArc>());
+      g2p->SetComposedModelFst(std::unique_ptr<const MyG2P::Lattice>(
+          new festus::DenseByteFst<MyArc>(composed_model)));
+    } else {
+      g2p->SetComposedModelFst(std::unique_ptr<const MyG2P::Lattice>(
+          new fst::ConstFst<MyArc>(composed_model)));
+    }
+  } else {
+    g2p->SetBytesToGraphonesFst(std::move(bytes_to_graphones));
+    g2p->SetGraphoneModelFst(std::move(graphone_model));
+  }
+  g2p->SetPhonemesToGraphonesFst(
+      festus::CompactG2PTestMachine(machines.phonemes_to_graphones));
+  return g2p;
+}
+
+// Pronounces words of length state.range(0) with max_prons state.range(1),
+// reusing one workspace, as a worker thread of g2p-lookup does.
+void BM_Pronounce(benchmark::State &state,
+                  const MyG2P *g2p,
+                  festus::G2POptions::Mode mode) {
+  typedef std::chrono::steady_clock Clock;
+  const std::vector<string> words = MakeWords(state.range(0));
+  festus::G2POptions options;
+  options.max_prons = state.range(1);
+  options.mode = mode;
+  festus::G2PWorkspace<MyArc> workspace;
+  festus::G2PResult result;
+  festus::Histogram micros;
+  uint64 num_failures = 0;
+  std::size_t i = 0;
+  for (auto _ : state) {
+    const auto start = Clock::now();
+    if (!g2p->Pronounce(words[i], &result, options, &workspace)) {
+      ++num_failures;
+    }
+    const std::chrono::duration<double, std::micro> elapsed =
+        Clock::now() - start;
+    micros.Add(elapsed.count());
+    if (++i == words.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["p50_us"] = micros.Quantile(0.5);
+  state.counters["p90_us"] = micros.Quantile(0.9);
+  state.counters["p99_us"] = micros.Quantile(0.99);
+  state.counters["max_us"] = micros.Max();
+  state.counters["failures"] = num_failures;
+}
+
+void RegisterBenchmarks(const string &name, const MyG2P *g2p) {
+  const std::vector<int64_t> lengths = {3, 6, 12, 24};
+  benchmark::RegisterBenchmark(
+      ("BM_Pronounce/" + name).c_str(), BM_Pronounce, g2p,
+      festus::G2POptions::MARGINAL)
+      ->ArgsProduct({lengths, {1, 3, 10}})
+      ->ArgNames({"len", "max_prons"});
+  benchmark::RegisterBenchmark(
+      ("BM_PronounceViterbi/" + name).c_str(), BM_Pronounce, g2p,
+      festus::G2POptions::VITERBI)
+      ->ArgsProduct({lengths, {1}})
+      ->ArgNames({"len", "max_prons"});
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  benchmark::Initialize(&argc, argv);
+  if (argc > 2) {
+    LOG(ERROR) << "Usage: " << argv[0]
+               << " [--benchmark_flags...] [MODEL_DIR]";
+    return 2;
+  }
+  const string model_dir = argc > 1 ? argv[1] : "festus/runtime";
+
+  std::vector<std::unique_ptr<MyG2P>> models;
+  for (const char *graphone_model : kGraphoneModels) {
+    festus::G2PTestMachines machines;
+    if (!festus::MakeG2PTestMachines(model_dir + "/" + graphone_model,
+                                     &machines)) {
+      return 2;
+    }
+    string name(graphone_model);
+    name.resize(name.rfind(".fst"));
+    for (bool composed : {false, true}) {
+      for (bool dense : {false, true}) {
+        models.push_back(MakeG2P(machines, composed, dense));
+        RegisterBenchmarks(name + (composed ? "/composed" : "") +
+                           (dense ? "/dense" : ""),
+                           models.back().get());
+      }
+    }
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,198 @@
+// festus/runtime/g2p-model-handle-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for reloadable G2P models.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-model-handle.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-cache.h"
+#include "g2p-test-model.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef festus::G2P<MyArc> MyG2P;
+typedef festus::G2PModelHandle<MyArc> MyModelHandle;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+
+const char kGraphoneModel[] =
+    "festus/runtime/ngram_model_with_final_backoff.fst";
+
+class G2PModelHandleTest : public ::testing::Test {
+ protected:
+  static void SetUpTestCase() {
+    machines_ = new festus::G2PTestMachines();
+    ASSERT_TRUE(festus::MakeG2PTestMachines(kGraphoneModel, machines_));
+  }
+
+  static void TearDownTestCase() {
+    delete machines_;
+    machines_ = nullptr;
+  }
+
+  // Loads a model from the test machines, or fails if fail_next_load_ is set.
+  std::unique_ptr<MyG2P> Load(string *error) {
+    ++num_loads_;
+    if (fail_next_load_.exchange(false)) {
+      *error = "injected failure";
+      return nullptr;
+    }
+    std::unique_ptr<MyG2P> g2p(new MyG2P());
+    g2p->SetBytesToGraphonesFst(std::unique_ptr<const MyG2P::Lattice>(
+        new MyVectorFst(machines_->bytes_to_graphones)));
+    g2p->SetGraphoneModelFst(std::unique_ptr<const MyG2P::Lattice>(
+        new MyVectorFst(machines_->graphone_model)));
+    g2p->SetPhonemesToGraphonesFst(std::unique_ptr<const MyG2P::Lattice>(
+        new MyVectorFst(machines_->phonemes_to_graphones)));
+    return g2p;
+  }
+
+  MyModelHandle::Loader Loader() {
+    return [this](string *error) { return Load(error); };
+  }
+
+  static festus::G2PTestMachines *machines_;
+  std::atomic<int> num_loads_{0};
+  std::atomic<bool> fail_next_load_{false};
+};
+
+festus::G2PTestMachines *G2PModelHandleTest::machines_ = nullptr;
+
+TEST_F(G2PModelHandleTest, ReloadPublishesNewVersion) {
+  MyModelHandle models(Loader());
+  EXPECT_TRUE(models.Get() == nullptr);
+  EXPECT_EQ(0, models.Version());
+
+  ASSERT_TRUE(models.Reload());
+  auto first = models.Get();
+  ASSERT_TRUE(first != nullptr);
+  EXPECT_EQ(1, first->version);
+  festus::G2PResult result;
+  ASSERT_TRUE(first->g2p->Pronounce("kat", &result));
+
+  ASSERT_TRUE(models.Reload());
+  auto second = models.Get();
+  EXPECT_EQ(2, second->version);
+  EXPECT_EQ(2, models.Version());
+  EXPECT_NE(first->g2p->ModelId(), second->g2p->ModelId());
+
+  // The pinned snapshot is still usable, and is freed when released.
+  festus::G2PResult old_result;
+  ASSERT_TRUE(first->g2p->Pronounce("kat", &old_result));
+  EXPECT_EQ(result.pronunciations, old_result.pronunciations);
+  std::weak_ptr<const MyModelHandle::Snapshot> weak_first = first;
+  first.reset();
+  EXPECT_TRUE(weak_first.expired());
+
+  const festus::G2PModelStats stats = models.Stats();
+  EXPECT_EQ(2, stats.version);
+  EXPECT_EQ(2, stats.reloads);
+  EXPECT_EQ(0, stats.failed_reloads);
+  EXPECT_GT(stats.last_reload_ms, 0);
+  EXPECT_GE(stats.max_reload_ms, stats.last_reload_ms);
+  EXPECT_NE(string::npos, stats.ToString().find("model_version\t2\n"));
+}
+
+TEST_F(G2PModelHandleTest, FailedReloadKeepsCurrentModel) {
+  MyModelHandle models(Loader());
+  ASSERT_TRUE(models.Reload());
+  fail_next_load_ = true;
+  EXPECT_FALSE(models.Reload());
+  EXPECT_EQ(1, models.Get()->version);
+  const festus::G2PModelStats stats = models.Stats();
+  EXPECT_EQ(1, stats.failed_reloads);
+  EXPECT_EQ("injected failure", stats.last_error);
+}
+
+TEST_F(G2PModelHandleTest, ValidatorRejectsModel) {
+  bool accept = true;
+  MyModelHandle models(Loader(), [&accept](const MyG2P &g2p, string *error) {
+    festus::G2PResult result;
+    if (!g2p.Pronounce("kat", &result)) return false;
+    if (!accept) *error = "rejected";
+    return accept;
+  });
+  ASSERT_TRUE(models.Reload());
+  accept = false;
+  EXPECT_FALSE(models.Reload());
+  EXPECT_EQ(1, models.Version());
+  EXPECT_EQ("rejected", models.Stats().last_error);
+}
+
+TEST_F(G2PModelHandleTest, ReloadAsync) {
+  MyModelHandle models(Loader());
+  ASSERT_TRUE(models.ReloadAsync());
+  models.WaitForReload();
+  EXPECT_EQ(1, models.Version());
+  ASSERT_TRUE(models.ReloadAsync());
+  models.WaitForReload();
+  EXPECT_EQ(2, models.Version());
+  EXPECT_EQ(2, num_loads_);
+}
+
+// Readers keep pronouncing words while the model is reloaded repeatedly.
+TEST_F(G2PModelHandleTest, ReloadWhileReading) {
+  static constexpr int kNumThreads = 4;
+  static constexpr int kNumReloads = 5;
+  MyModelHandle models(Loader());
+  ASSERT_TRUE(models.Reload());
+  festus::G2PResult expected;
+  ASSERT_TRUE(models.Get()->g2p->Pronounce("kat", &expected));
+
+  festus::G2PCache cache(16);
+  std::atomic<bool> done(false);
+  std::vector<int> errors(kNumThreads, 0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < kNumThreads; ++t) {
+    readers.emplace_back([t, &models, &cache, &done, &errors, &expected]() {
+      festus::G2PWorkspace<MyArc> workspace;
+      festus::G2PResult result;
+      while (!done) {
+        const auto model = models.Get();
+        if (!festus::CachedPronounce(*model->g2p, &cache, "kat", &result,
+                                     festus::G2POptions(), &workspace) ||
+            result.pronunciations != expected.pronunciations) {
+          ++errors[t];
+        }
+      }
+    });
+  }
+  for (int i = 0; i < kNumReloads; ++i) {
+    EXPECT_TRUE(models.Reload());
+  }
+  done = true;
+  for (auto &thread : readers) {
+    thread.join();
+  }
+  for (int t = 0; t < kNumThreads; ++t) {
+    EXPECT_EQ(0, errors[t]);
+  }
+  EXPECT_EQ(1 + kNumReloads, models.Version());
+}
+
+}  // namespace
@@ -0,0 +1,200 @@
+// festus/runtime/g2p-model-handle.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Versioned handle to a G2P model that can be replaced while it is in use.
+//
+// Readers call Get() to pin an immutable snapshot of the current model, and
+// use it for as long as they hold on to it. Reload() loads and validates a new
+// model and publishes it atomically; readers that pinned the old model keep
+// using it, and it is freed once the last of them lets go. A G2PWorkspace
+// notices the change of model by itself (see G2PWorkspace), but keeps sharing
+// the FSTs of the old model until it is next used with the new one.
+
+#ifndef FESTUS_RUNTIME_G2P_MODEL_HANDLE_H__
+#define FESTUS_RUNTIME_G2P_MODEL_HANDLE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p.h"
+
+namespace festus {
+
+// An immutable G2P model together with its version, which counts the models
+// published by a G2PModelHandle, starting at 1.
+template <class Arc>
+struct G2PModelSnapshot {
+  std::unique_ptr<const G2P<Arc>> g2p;
+  uint64 version = 0;
+};
+
+struct G2PModelStats {
+  uint64 version = 0;         // Version of the current model; 0 if none.
+  uint64 reloads = 0;         // Models published so far.
+  uint64 failed_reloads = 0;  // Reloads whose model was rejected.
+  double last_reload_ms = 0;  // Time taken to load and validate the current
+  double max_reload_ms = 0;   // model, and the maximum over all reloads.
+  string last_error;          // Reason why the last failed reload failed.
+
+  // Formats the statistics as "name TAB value" lines, like G2PServerStats.
+  string ToString() const {
+    std::ostringstream strm;
+    strm << "model_version\t" << version << "\n"
+         << "model_reloads\t" << reloads << "\n"
+         << "model_failed_reloads\t" << failed_reloads << "\n"
+         << "model_last_reload_ms\t" << last_reload_ms << "\n"
+         << "model_max_reload_ms\t" << max_reload_ms << "\n";
+    return strm.str();
+  }
+};
+
+template <class Arc>
+class G2PModelHandle {
+ public:
+  typedef G2PModelSnapshot<Arc> Snapshot;
+
+  // Loads a new model. Returns nullptr and sets *error on failure.
+  typedef std::function<std::unique_ptr<G2P<Arc>>(string *error)> Loader;
+
+  // Checks a freshly loaded model before it is published. Returns false and
+  // sets *error if the model must not be used.
+  typedef std::function<bool(const G2P<Arc> &, string *error)> Validator;
+
+  explicit G2PModelHandle(Loader loader, Validator validator = nullptr)
+      : loader_(std::move(loader)), validator_(std::move(validator)) {}
+
+  ~G2PModelHandle() { WaitForReload(); }
+
+  // Returns the current model, or nullptr if none has been published yet.
+  // The snapshot remains valid for as long as the caller holds on to it.
+  std::shared_ptr<const Snapshot> Get() const {
+    return std::atomic_load(&current_);
+  }
+
+  // Loads and validates a new model and publishes it. Returns false, and
+  // keeps the current model, if the new model could not be loaded or was
+  // rejected. Concurrent reloads are serialized.
+  bool Reload() {
+    std::lock_guard<std::mutex> reload_lock(reload_mutex_);
+    typedef std::chrono::steady_clock Clock;
+    const auto start = Clock::now();
+    string error;
+    std::unique_ptr<G2P<Arc>> g2p = loader_(&error);
+    if (g2p && validator_ && !validator_(*g2p, &error)) g2p.reset();
+    const std::chrono::duration<double, std::milli> elapsed =
+        Clock::now() - start;
+    if (!g2p) {
+      if (error.empty()) error = "Could not load model";
+      LOG(ERROR) << "G2P model reload failed: " << error;
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      ++stats_.failed_reloads;
+      stats_.last_error = error;
+      return false;
+    }
+    Publish(std::move(g2p), elapsed.count());
+    return true;
+  }
+
+  // Starts Reload() in a background thread. Returns false if a background
+  // reload is still in progress, in which case no new one is started.
+  bool ReloadAsync() {
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    if (reloading_) return false;
+    if (reload_thread_.joinable()) reload_thread_.join();
+    reloading_ = true;
+    reload_thread_ = std::thread([this] {
+      Reload();
+      reloading_ = false;
+    });
+    return true;
+  }
+
+  // Waits for a background reload started by ReloadAsync() to finish.
+  void WaitForReload() {
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    if (reload_thread_.joinable()) reload_thread_.join();
+  }
+
+  // Publishes the given model without loading or validating it.
+  void Set(std::unique_ptr<G2P<Arc>> g2p) {
+    std::lock_guard<std::mutex> reload_lock(reload_mutex_);
+    Publish(std::move(g2p), 0);
+  }
+
+  uint64 Version() const {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_.version;
+  }
+
+  G2PModelStats Stats() const {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_;
+  }
+
+ private:
+  // Requires reload_mutex_ to be held.
+  void Publish(std::unique_ptr<G2P<Arc>> g2p, double reload_ms) {
+    const uint64 version = stats_.version + 1;
+    std::shared_ptr<Snapshot> snapshot(new Snapshot(), [](Snapshot *s) {
+      VLOG(1) << "Releasing G2P model version " << s->version;
+      delete s;
+    });
+    snapshot->g2p = std::move(g2p);
+    snapshot->version = version;
+    std::atomic_store(&current_,
+                      std::shared_ptr<const Snapshot>(std::move(snapshot)));
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      stats_.version = version;
+      ++stats_.reloads;
+      stats_.last_reload_ms = reload_ms;
+      stats_.max_reload_ms = std::max(stats_.max_reload_ms, reload_ms);
+    }
+    VLOG(1) << "Published G2P model version " << version << " (loaded in "
+            << reload_ms << " ms)";
+  }
+
+  const Loader loader_;
+  const Validator validator_;
+  std::shared_ptr<const Snapshot> current_;
+
+  std::mutex reload_mutex_;
+  mutable std::mutex stats_mutex_;
+  G2PModelStats stats_;
+
+  std::mutex thread_mutex_;
+  std::thread reload_thread_;
+  std::atomic<bool> reloading_{false};
+
+  G2PModelHandle(const G2PModelHandle &) = delete;
+  G2PModelHandle &operator=(const G2PModelHandle &) = delete;
+};
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_MODEL_HANDLE_H__
@@ -0,0 +1,354 @@
+// festus/runtime/g2p-protocol.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Wire protocol of the G2P server (see g2p-server.h) and a client for it.
+//
+// Requests and responses are sent over a Unix domain stream socket as frames,
+// each of which consists of a 4-byte payload size followed by the payload.
+// All integers are in network (big-endian) byte order.
+//
+// A request payload consists of a 4-byte request id chosen by the client, a
+// 1-byte G2PRequestType, and the orthographic word (for kPronounce requests).
+// A response payload consists of the id of the request it answers, a 1-byte
+// G2PStatus, and a body: for successful kPronounce requests, one line
+// "pronunciation TAB probability" per pronunciation; for kStats requests, one
+// line "name TAB value" per statistic; for successful kReload requests, a
+// description of the new model; otherwise an error message.
+//
+// A client may send several requests before reading their responses. The
+// server may answer them in a different order, hence the request ids.
+
+#ifndef FESTUS_RUNTIME_G2P_PROTOCOL_H__
+#define FESTUS_RUNTIME_G2P_PROTOCOL_H__
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <utility>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p.h"
+
+namespace festus {
+
+enum G2PRequestType : uint8 {
+  kG2PPronounce = 1,
+  kG2PStats = 2,
+  kG2PReload = 3,  // Reload the model; answered once the reload has finished.
+};
+
+enum G2PStatus : uint8 {
+  kG2POk = 0,
+  kG2PFailed = 1,      // No pronunciation found; the body is the error.
+  kG2PBadRequest = 2,  // Malformed request; the body is the error.
+};
+
+// Upper bound on the payload size of a single frame, to guard against
+// corrupted or malicious size prefixes.
+constexpr std::size_t kMaxG2PFrameSize = 1 << 20;
+
+namespace internal {
+
+inline void AppendUint32(uint32 value, string *buffer) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    buffer->push_back(static_cast<char>((value >> shift) & 0xFF));
+  }
+}
+
+inline uint32 ParseUint32(const char *data) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+  return (uint32(bytes[0]) << 24) | (uint32(bytes[1]) << 16) |
+      (uint32(bytes[2]) << 8) | uint32(bytes[3]);
+}
+
+// Reads or writes exactly size bytes, retrying after interruptions and short
+// transfers. Returns false on error or end of file.
+inline bool ReadFully(int fd, char *data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool WriteFully(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    // Do not raise SIGPIPE if the peer has gone away.
+    const ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool MakeSocketAddress(const string &path, sockaddr_un *address) {
+  std::memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address->sun_path)) {
+    LOG(ERROR) << "Invalid socket path: " << path;
+    return false;
+  }
+  path.copy(address->sun_path, path.size());
+  return true;
+}
+
+}  // namespace internal
+
+// Writes a frame with the given payload. Returns false on error.
+inline bool WriteG2PFrame(int fd, const string &payload) {
+  string frame;
+  frame.reserve(4 + payload.size());
+  internal::AppendUint32(payload.size(), &frame);
+  frame.append(payload);
+  return internal::WriteFully(fd, frame.data(), frame.size());
+}
+
+// Reads a frame and stores its payload. Returns false on error, at end of
+// file, or if the payload is larger than kMaxG2PFrameSize.
+inline bool ReadG2PFrame(int fd, string *payload) {
+  char size_bytes[4];
+  if (!internal::ReadFully(fd, size_bytes, sizeof(size_bytes))) return false;
+  const uint32 size = internal::ParseUint32(size_bytes);
+  if (size > kMaxG2PFrameSize) {
+    LOG(ERROR) << "Frame of " << size << " bytes exceeds the maximal size";
+    return false;
+  }
+  payload->resize(size);
+  return size == 0 || internal::ReadFully(fd, &(*payload)[0], size);
+}
+
+inline string EncodeG2PRequest(uint32 id,
+                               G2PRequestType type,
+                               const string &word) {
+  string payload;
+  payload.reserve(5 + word.size());
+  internal::AppendUint32(id, &payload);
+  payload.push_back(static_cast<char>(type));
+  payload.append(word);
+  return payload;
+}
+
+// Returns false if the payload is too short to be a request.
+inline bool DecodeG2PRequest(const string &payload,
+                             uint32 *id,
+                             uint8 *type,
+                             string *word) {
+  if (payload.size() < 5) return false;
+  *id = internal::ParseUint32(payload.data());
+  *type = static_cast<uint8>(payload[4]);
+  word->assign(payload, 5, string::npos);
+  return true;
+}
+
+inline string EncodeG2PResponse(uint32 id,
+                                G2PStatus status,
+                                const string &body) {
+  string payload;
+  payload.reserve(5 + body.size());
+  internal::AppendUint32(id, &payload);
+  payload.push_back(static_cast<char>(status));
+  payload.append(body);
+  return payload;
+}
+
+// Returns false if the payload is too short to be a response.
+inline bool DecodeG2PResponse(const string &payload,
+                              uint32 *id,
+                              uint8 *status,
+                              string *body) {
+  if (payload.size() < 5) return false;
+  *id = internal::ParseUint32(payload.data());
+  *status = static_cast<uint8>(payload[4]);
+  body->assign(payload, 5, string::npos);
+  return true;
+}
+
+// Formats the pronunciations of a successful result as a response body.
+inline string FormatG2PPronunciations(const G2PResult &result) {
+  std::ostringstream body;
+  body.precision(9);  // Enough to restore a float exactly.
+  for (const auto &pron : result.pronunciations) {
+    body << pron.first << '\t' << pron.second << '\n';
+  }
+  return body.str();
+}
+
+// Parses a response body produced by FormatG2PPronunciations(). Returns false
+// if it is malformed.
+inline bool ParseG2PPronunciations(const string &body, G2PResult *result) {
+  result->pronunciations.clear();
+  for (std::size_t pos = 0; pos < body.size(); /*empty*/) {
+    const std::size_t end = body.find('\n', pos);
+    const std::size_t tab = body.find('\t', pos);
+    if (end == string::npos || tab == string::npos || tab > end) return false;
+    const string prob(body, tab + 1, end - tab - 1);
+    char *prob_end = nullptr;
+    const float value = std::strtof(prob.c_str(), &prob_end);
+    if (prob.empty() || *prob_end != '\0') return false;
+    result->pronunciations.emplace_back(body.substr(pos, tab - pos), value);
+    pos = end + 1;
+  }
+  return true;
+}
+
+// Creates a Unix domain socket that listens at the given path, replacing any
+// existing file there. Returns the socket, or -1 on error.
+inline int ListenUnixSocket(const string &path, int backlog) {
+  sockaddr_un address;
+  if (!internal::MakeSocketAddress(path, &address)) return -1;
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not create socket: " << std::strerror(errno);
+    return -1;
+  }
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+      listen(fd, backlog) != 0) {
+    LOG(ERROR) << "Could not listen at " << path << ": "
+               << std::strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Connects to the Unix domain socket at the given path. Returns the
+// connected socket, or -1 on error.
+inline int ConnectUnixSocket(const string &path) {
+  sockaddr_un address;
+  if (!internal::MakeSocketAddress(path, &address)) return -1;
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not create socket: " << std::strerror(errno);
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+              sizeof(address)) != 0) {
+    LOG(ERROR) << "Could not connect to " << path << ": "
+               << std::strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// A connection to a G2P server. Requests can be pipelined with Send() and
+// Receive(); Pronounce() and GetStats() send one request and wait for its
+// response. Not thread-safe, although one thread may Send() while another
+// thread Receive()s.
+class G2PClient {
+ public:
+  ~G2PClient() { close(fd_); }
+
+  // Connects to the server at the given socket path. Returns nullptr on
+  // error.
+  static std::unique_ptr<G2PClient> Connect(const string &path) {
+    const int fd = ConnectUnixSocket(path);
+    if (fd < 0) return nullptr;
+    return std::unique_ptr<G2PClient>(new G2PClient(fd));
+  }
+
+  bool Send(uint32 id, G2PRequestType type, const string &word) {
+    return WriteG2PFrame(fd_, EncodeG2PRequest(id, type, word));
+  }
+
+  // Receives the next response. Returns false on error.
+  bool Receive(uint32 *id, uint8 *status, string *body) {
+    string payload;
+    return ReadG2PFrame(fd_, &payload) &&
+        DecodeG2PResponse(payload, id, status, body);
+  }
+
+  // Pronounces the given word, like G2P<>::Pronounce(). Must not be mixed
+  // with pipelined requests whose responses are still outstanding. The
+  // number of hypotheses is not transmitted and is set to the number of
+  // pronunciations.
+  bool Pronounce(const string &word, G2PResult *result) {
+    result->pronunciations.clear();
+    result->error.clear();
+    uint8 status;
+    string body;
+    if (!Call(kG2PPronounce, word, &status, &body)) {
+      result->error = "Lost connection to server";
+      return false;
+    }
+    if (status != kG2POk) {
+      result->error = body;
+      return false;
+    }
+    if (!ParseG2PPronunciations(body, result)) {
+      result->error = "Malformed response from server";
+      return false;
+    }
+    result->num_hypotheses = result->pronunciations.size();
+    return true;
+  }
+
+  // Retrieves the server statistics as "name TAB value" lines.
+  bool GetStats(string *stats) {
+    uint8 status;
+    return Call(kG2PStats, "", &status, stats) && status == kG2POk;
+  }
+
+  // Makes the server reload its model. Returns false and sets *message to the
+  // error if the reload failed; otherwise the server keeps answering
+  // requests with the new model.
+  bool Reload(string *message) {
+    uint8 status;
+    if (!Call(kG2PReload, "", &status, message)) {
+      *message = "Lost connection to server";
+      return false;
+    }
+    return status == kG2POk;
+  }
+
+ private:
+  explicit G2PClient(int fd) : fd_(fd) {}
+
+  bool Call(G2PRequestType type, const string &word, uint8 *status,
+            string *body) {
+    const uint32 id = next_id_++;
+    uint32 response_id;
+    return Send(id, type, word) && Receive(&response_id, status, body) &&
+        response_id == id;
+  }
+
+  const int fd_;
+  uint32 next_id_ = 0;
+
+  G2PClient(const G2PClient &) = delete;
+  G2PClient &operator=(const G2PClient &) = delete;
+};
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_PROTOCOL_H__
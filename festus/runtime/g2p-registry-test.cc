@@ -0,0 +1,288 @@
+// festus/runtime/g2p-registry-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the multi-language G2P model registry.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-registry.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-test-model.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef festus::G2P<MyArc> MyG2P;
+typedef festus::G2PModelRegistry<MyArc> MyRegistry;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+
+const char kGraphoneModel[] =
+    "festus/runtime/ngram_model_with_final_backoff.fst";
+
+// Every test model claims to be this large.
+constexpr std::size_t kModelSize = 100;
+
+class G2PRegistryTest : public ::testing::Test {
+ protected:
+  static void SetUpTestCase() {
+    machines_ = new festus::G2PTestMachines();
+    ASSERT_TRUE(festus::MakeG2PTestMachines(kGraphoneModel, machines_));
+  }
+
+  static void TearDownTestCase() {
+    delete machines_;
+    machines_ = nullptr;
+  }
+
+  // Returns a loader that builds a model from the test machines, counting
+  // its calls in num_loads_[language], or fails if fail_next_load_ is set.
+  MyRegistry::Loader Loader(const string &language) {
+    return [this, language](std::size_t *size,
+                            string *error) -> std::unique_ptr<MyG2P> {
+      ++num_loads_[language];
+      if (fail_next_load_.exchange(false)) {
+        *error = "injected failure";
+        return std::unique_ptr<MyG2P>();
+      }
+      std::unique_ptr<MyG2P> g2p(new MyG2P());
+      g2p->SetBytesToGraphonesFst(std::unique_ptr<const MyG2P::Lattice>(
+          new MyVectorFst(machines_->bytes_to_graphones)));
+      g2p->SetGraphoneModelFst(std::unique_ptr<const MyG2P::Lattice>(
+          new MyVectorFst(machines_->graphone_model)));
+      g2p->SetPhonemesToGraphonesFst(std::unique_ptr<const MyG2P::Lattice>(
+          new MyVectorFst(machines_->phonemes_to_graphones)));
+      *size = kModelSize;
+      return g2p;
+    };
+  }
+
+  void Register(MyRegistry *registry, const std::vector<string> &languages) {
+    for (const string &language : languages) {
+      num_loads_[language] = 0;
+      registry->Register(language, Loader(language));
+    }
+  }
+
+  static festus::G2PLanguageStats LanguageStats(const MyRegistry &registry,
+                                                const string &language) {
+    for (const auto &stats : registry.Stats().languages) {
+      if (stats.language == language) return stats;
+    }
+    return festus::G2PLanguageStats();
+  }
+
+  static festus::G2PTestMachines *machines_;
+  std::map<string, std::atomic<int>> num_loads_;
+  std::atomic<bool> fail_next_load_{false};
+};
+
+festus::G2PTestMachines *G2PRegistryTest::machines_ = nullptr;
+
+TEST_F(G2PRegistryTest, LoadsOnFirstUse) {
+  MyRegistry registry;
+  Register(&registry, {"af", "zu"});
+  EXPECT_TRUE(registry.IsRegistered("af"));
+  EXPECT_FALSE(registry.IsRegistered("xh"));
+  EXPECT_EQ(0, registry.Stats().resident_bytes);
+
+  string error;
+  auto af = registry.Get("af", &error);
+  ASSERT_TRUE(af != nullptr) << error;
+  festus::G2PResult result;
+  EXPECT_TRUE(af->Pronounce("kat", &result));
+  EXPECT_EQ(af, registry.Get("af", &error));
+  EXPECT_EQ(1, num_loads_["af"]);
+  EXPECT_EQ(0, num_loads_["zu"]);
+
+  const festus::G2PLanguageStats stats = LanguageStats(registry, "af");
+  EXPECT_TRUE(stats.loaded);
+  EXPECT_EQ(kModelSize, stats.resident_bytes);
+  EXPECT_EQ(2, stats.requests);
+  EXPECT_EQ(1, stats.loads);
+  EXPECT_GT(stats.last_load_ms, 0);
+  EXPECT_FALSE(LanguageStats(registry, "zu").loaded);
+  EXPECT_EQ(kModelSize, registry.Stats().resident_bytes);
+  EXPECT_NE(string::npos,
+            registry.Stats().ToString().find("af.loads\t1\n"));
+}
+
+TEST_F(G2PRegistryTest, UnknownLanguage) {
+  MyRegistry registry;
+  string error;
+  EXPECT_TRUE(registry.Get("af", &error) == nullptr);
+  EXPECT_EQ("Unknown language: af", error);
+}
+
+TEST_F(G2PRegistryTest, FailedLoadIsRetried) {
+  MyRegistry registry;
+  Register(&registry, {"af"});
+  fail_next_load_ = true;
+  string error;
+  EXPECT_TRUE(registry.Get("af", &error) == nullptr);
+  EXPECT_EQ("injected failure", error);
+  EXPECT_EQ(1, LanguageStats(registry, "af").failed_loads);
+  EXPECT_TRUE(registry.Get("af", &error) != nullptr);
+  EXPECT_EQ(2, num_loads_["af"]);
+}
+
+TEST_F(G2PRegistryTest, EvictsLeastRecentlyUsedModel) {
+  MyRegistry registry(2 * kModelSize + kModelSize / 2);
+  Register(&registry, {"af", "xh", "zu"});
+  string error;
+  ASSERT_TRUE(registry.Get("af", &error) != nullptr);
+  ASSERT_TRUE(registry.Get("xh", &error) != nullptr);
+  ASSERT_TRUE(registry.Get("af", &error) != nullptr);  // xh is now the LRU.
+  ASSERT_TRUE(registry.Get("zu", &error) != nullptr);
+  EXPECT_TRUE(LanguageStats(registry, "af").loaded);
+  EXPECT_FALSE(LanguageStats(registry, "xh").loaded);
+  EXPECT_TRUE(LanguageStats(registry, "zu").loaded);
+  EXPECT_EQ(1, LanguageStats(registry, "xh").evictions);
+  EXPECT_EQ(2 * kModelSize, registry.Stats().resident_bytes);
+
+  // An evicted model is loaded again on next use.
+  ASSERT_TRUE(registry.Get("xh", &error) != nullptr);
+  EXPECT_EQ(2, num_loads_["xh"]);
+  EXPECT_FALSE(LanguageStats(registry, "af").loaded);
+}
+
+TEST_F(G2PRegistryTest, ModelsInUseAreNotEvicted) {
+  MyRegistry registry(kModelSize + kModelSize / 2);
+  Register(&registry, {"af", "xh", "zu"});
+  string error;
+  auto af = registry.Get("af", &error);
+  auto xh = registry.Get("xh", &error);
+  ASSERT_TRUE(af != nullptr && xh != nullptr);
+  // Both are in use, so the budget cannot be met.
+  EXPECT_TRUE(LanguageStats(registry, "af").loaded);
+  EXPECT_TRUE(LanguageStats(registry, "xh").loaded);
+  EXPECT_EQ(2 * kModelSize, registry.Stats().resident_bytes);
+
+  af.reset();
+  auto zu = registry.Get("zu", &error);
+  ASSERT_TRUE(zu != nullptr);
+  EXPECT_FALSE(LanguageStats(registry, "af").loaded);
+  EXPECT_TRUE(LanguageStats(registry, "xh").loaded);
+  EXPECT_EQ(2 * kModelSize, registry.Stats().resident_bytes);
+
+  // Unloading a model does not invalidate it for its users, and it remains
+  // resident until they let go of it.
+  registry.UnloadAll();
+  EXPECT_FALSE(LanguageStats(registry, "xh").loaded);
+  EXPECT_EQ(2 * kModelSize, registry.Stats().resident_bytes);
+  festus::G2PResult result;
+  EXPECT_TRUE(xh->Pronounce("kat", &result));
+  xh.reset();
+  zu.reset();
+  EXPECT_EQ(0, registry.Stats().resident_bytes);
+}
+
+TEST_F(G2PRegistryTest, EvictsModelOnceReleased) {
+  MyRegistry registry(kModelSize + kModelSize / 2);
+  Register(&registry, {"af", "xh"});
+  string error;
+  auto af = registry.Get("af", &error);
+  ASSERT_TRUE(af != nullptr) << error;
+  auto copy = af;
+  // The af model is in use while xh is loaded, so the budget cannot be met.
+  auto xh = registry.Get("xh", &error);
+  ASSERT_TRUE(xh != nullptr) << error;
+  EXPECT_TRUE(LanguageStats(registry, "af").loaded);
+  EXPECT_EQ(2 * kModelSize, registry.Stats().resident_bytes);
+
+  // Once all users of af let go of it, it is evicted.
+  af.reset();
+  EXPECT_TRUE(LanguageStats(registry, "af").loaded);
+  copy.reset();
+  EXPECT_FALSE(LanguageStats(registry, "af").loaded);
+  EXPECT_EQ(1, LanguageStats(registry, "af").evictions);
+  EXPECT_EQ(kModelSize, registry.Stats().resident_bytes);
+  EXPECT_TRUE(LanguageStats(registry, "xh").loaded);
+}
+
+TEST_F(G2PRegistryTest, ConcurrentFirstUse) {
+  static constexpr int kNumThreads = 8;
+  MyRegistry registry;
+  Register(&registry, {"af", "zu"});
+  std::vector<std::shared_ptr<const MyG2P>> models(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([t, &registry, &models]() {
+      string error;
+      models[t] = registry.Get(t % 2 ? "af" : "zu", &error);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t < kNumThreads; ++t) {
+    ASSERT_TRUE(models[t] != nullptr);
+    EXPECT_EQ(models[t % 2], models[t]);
+  }
+  EXPECT_EQ(1, num_loads_["af"]);
+  EXPECT_EQ(1, num_loads_["zu"]);
+}
+
+TEST(G2PModelConfigTest, Parse) {
+  std::istringstream strm(
+      "# Comment\n"
+      "\n"
+      "af bytes_to_graphones=af/b.fst graphone_model=af/g.fst "
+      "phonemes_to_graphones=af/p.fst\n"
+      "  zu\tcomposed_model=zu/c.fst  phonemes_to_graphones=zu/p.fst\n"
+      "km composed_model=km/c.fst phonemes_to_graphones=km/p.fst "
+      "input_tape=unicode\n");
+  std::vector<std::pair<string, festus::G2PModelFiles>> languages;
+  string error;
+  ASSERT_TRUE(festus::ParseG2PModelConfig(strm, &languages, &error)) << error;
+  ASSERT_EQ(3, languages.size());
+  EXPECT_EQ("af", languages[0].first);
+  EXPECT_EQ("af/b.fst", languages[0].second.bytes_to_graphones);
+  EXPECT_EQ("af/g.fst", languages[0].second.graphone_model);
+  EXPECT_EQ("af/p.fst", languages[0].second.phonemes_to_graphones);
+  EXPECT_TRUE(languages[0].second.composed_model.empty());
+  EXPECT_EQ("zu", languages[1].first);
+  EXPECT_EQ("zu/c.fst", languages[1].second.composed_model);
+  EXPECT_EQ("zu/p.fst", languages[1].second.phonemes_to_graphones);
+  EXPECT_EQ("byte", languages[1].second.input_tape);
+  EXPECT_EQ("km", languages[2].first);
+  EXPECT_EQ("unicode", languages[2].second.input_tape);
+}
+
+TEST(G2PModelConfigTest, Errors) {
+  std::vector<std::pair<string, festus::G2PModelFiles>> languages;
+  string error;
+  std::istringstream unknown("af lexicon=af/lex.fst\n");
+  EXPECT_FALSE(festus::ParseG2PModelConfig(unknown, &languages, &error));
+  EXPECT_EQ("Line 1: expected NAME=PATH, got lexicon=af/lex.fst", error);
+  std::istringstream incomplete("af\nzu composed_model=zu/c.fst\n");
+  EXPECT_FALSE(festus::ParseG2PModelConfig(incomplete, &languages, &error));
+  EXPECT_EQ("Line 1: incomplete model for language af", error);
+}
+
+}  // namespace
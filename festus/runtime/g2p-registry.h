@@ -0,0 +1,451 @@
+// festus/runtime/g2p-registry.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Registry of the G2P models of several languages, for serving all of them
+// from one process.
+//
+// Models are loaded on first use. The registry keeps track of the resident
+// size of each model, and when their total exceeds a memory budget, it
+// unloads the least recently used models that are not in use. A model that is
+// in use when it is unloaded remains valid until the last of its users lets
+// go, just like a model replaced in a G2PModelHandle, and counts as resident
+// until then. The budget is checked again whenever a model is let go of.
+
+#ifndef FESTUS_RUNTIME_G2P_REGISTRY_H__
+#define FESTUS_RUNTIME_G2P_REGISTRY_H__
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p.h"
+#include "input-labeler.h"
+#include "model-io.h"
+
+namespace festus {
+
+// Paths of the model files of one language, and its input tape; see the
+// flags of the same names of g2p-lookup. If composed_model is set,
+// bytes_to_graphones and graphone_model are not used.
+struct G2PModelFiles {
+  string bytes_to_graphones;
+  string graphone_model;
+  string composed_model;
+  string phonemes_to_graphones;
+  string input_tape = "byte";  // See MakeInputLabeler().
+  string input_symbols;        // Only used by the symbol tape.
+  bool memory_map = true;
+};
+
+// Reads the FSTs of a model with ReadModelFst(), so their types must be
+// registered. Sets *size (if not null) to the total size of the files, which
+// is what the model occupies in memory once it has been paged in. Returns
+// nullptr and sets *error on failure.
+template <class Arc>
+std::unique_ptr<G2P<Arc>> LoadG2PModel(const G2PModelFiles &files,
+                                       std::size_t *size,
+                                       string *error) {
+  typedef typename G2P<Arc>::Lattice Lattice;
+  std::unique_ptr<G2P<Arc>> g2p(new G2P<Arc>());
+  if (files.input_tape != "byte") {
+    // Symbols are separated by spaces, as in the alignables spec.
+    auto labeler =
+        MakeInputLabeler(files.input_tape, files.input_symbols, " ", error);
+    if (!labeler) return nullptr;
+    g2p->SetInputLabeler(std::move(labeler));
+  }
+  std::size_t total_size = 0;
+  auto read = [&files, &total_size, error](const string &path) {
+    std::unique_ptr<const Lattice> fst(
+        ReadModelFst<Arc>(path, files.memory_map));
+    if (!fst) {
+      *error = "Could not read " + path;
+    } else if (!path.empty()) {
+      std::ifstream file(path, std::ios::in | std::ios::binary |
+                                   std::ios::ate);
+      if (file) total_size += file.tellg();
+    }
+    return fst;
+  };
+  if (files.composed_model.empty()) {
+    auto bytes_to_graphones = read(files.bytes_to_graphones);
+    if (!bytes_to_graphones) return nullptr;
+    g2p->SetBytesToGraphonesFst(std::move(bytes_to_graphones));
+
+    auto graphone_model = read(files.graphone_model);
+    if (!graphone_model) return nullptr;
+    g2p->SetGraphoneModelFst(std::move(graphone_model));
+  } else {
+    auto composed_model = read(files.composed_model);
+    if (!composed_model) return nullptr;
+    g2p->SetComposedModelFst(std::move(composed_model));
+  }
+
+  auto phonemes_to_graphones = read(files.phonemes_to_graphones);
+  if (!phonemes_to_graphones) return nullptr;
+  g2p->SetPhonemesToGraphonesFst(std::move(phonemes_to_graphones));
+  if (size) *size = total_size;
+  return g2p;
+}
+
+// Parses a model configuration, which lists the model files of each language
+// on a line of its own, as a language code followed by whitespace-separated
+// NAME=PATH pairs, where NAME is one of the fields of G2PModelFiles (except
+// memory_map; the value of input_tape is not a path). Empty lines and lines
+// starting with '#' are ignored. For example:
+//
+//   af bytes_to_graphones=af/b graphone_model=af/g phonemes_to_graphones=af/p
+//   zu composed_model=zu/c phonemes_to_graphones=zu/p
+//   km composed_model=km/c phonemes_to_graphones=km/p input_tape=unicode
+//
+// Returns false and sets *error on failure.
+inline bool ParseG2PModelConfig(
+    std::istream &strm,
+    std::vector<std::pair<string, G2PModelFiles>> *languages,
+    string *error) {
+  int line_number = 0;
+  for (string line; std::getline(strm, line); /*empty*/) {
+    ++line_number;
+    std::istringstream fields(line);
+    string language;
+    if (!(fields >> language) || language[0] == '#') continue;
+    G2PModelFiles files;
+    for (string field; fields >> field; /*empty*/) {
+      const auto equals = field.find('=');
+      const string name = field.substr(0, equals);
+      const string path =
+          equals == string::npos ? string() : field.substr(equals + 1);
+      string *target = nullptr;
+      if (name == "bytes_to_graphones") {
+        target = &files.bytes_to_graphones;
+      } else if (name == "graphone_model") {
+        target = &files.graphone_model;
+      } else if (name == "composed_model") {
+        target = &files.composed_model;
+      } else if (name == "phonemes_to_graphones") {
+        target = &files.phonemes_to_graphones;
+      } else if (name == "input_tape") {
+        target = &files.input_tape;
+      } else if (name == "input_symbols") {
+        target = &files.input_symbols;
+      }
+      if (target == nullptr || path.empty()) {
+        *error = "Line " + std::to_string(line_number) +
+                 ": expected NAME=PATH, got " + field;
+        return false;
+      }
+      *target = path;
+    }
+    if (files.phonemes_to_graphones.empty() ||
+        (files.composed_model.empty() &&
+         (files.bytes_to_graphones.empty() || files.graphone_model.empty()))) {
+      *error = "Line " + std::to_string(line_number) +
+               ": incomplete model for language " + language;
+      return false;
+    }
+    languages->emplace_back(language, std::move(files));
+  }
+  return true;
+}
+
+struct G2PLanguageStats {
+  string language;
+  bool loaded = false;
+  std::size_t resident_bytes = 0;  // Size of the model, if loaded.
+  double last_load_ms = 0;         // Time taken by the last (re)load.
+  uint64 requests = 0;             // Calls to G2PModelRegistry<>::Get().
+  uint64 loads = 0;
+  uint64 failed_loads = 0;
+  uint64 evictions = 0;            // Unloads to stay within the budget.
+  string last_error;
+};
+
+struct G2PRegistryStats {
+  std::size_t memory_budget = 0;   // 0 if unlimited.
+  // Total size of all models that are loaded, or that were unloaded but are
+  // still in use.
+  std::size_t resident_bytes = 0;
+  std::vector<G2PLanguageStats> languages;  // Ordered by language code.
+
+  // Formats the statistics as "name TAB value" lines, like G2PModelStats,
+  // with the per-language values named "LANGUAGE.name".
+  string ToString() const {
+    std::ostringstream strm;
+    strm << "registry_memory_budget\t" << memory_budget << "\n"
+         << "registry_resident_bytes\t" << resident_bytes << "\n";
+    for (const auto &stats : languages) {
+      const string &prefix = stats.language;
+      strm << prefix << ".loaded\t" << stats.loaded << "\n"
+           << prefix << ".resident_bytes\t" << stats.resident_bytes << "\n"
+           << prefix << ".last_load_ms\t" << stats.last_load_ms << "\n"
+           << prefix << ".requests\t" << stats.requests << "\n"
+           << prefix << ".loads\t" << stats.loads << "\n"
+           << prefix << ".failed_loads\t" << stats.failed_loads << "\n"
+           << prefix << ".evictions\t" << stats.evictions << "\n";
+    }
+    return strm.str();
+  }
+};
+
+template <class Arc>
+class G2PModelRegistry {
+ public:
+  // Loads the model of a language. Returns nullptr and sets *error on failure;
+  // otherwise sets *size to the resident size of the model in bytes.
+  typedef std::function<std::unique_ptr<G2P<Arc>>(std::size_t *size,
+                                                    string *error)> Loader;
+
+  // The memory budget is in bytes; 0 means unlimited.
+  explicit G2PModelRegistry(std::size_t memory_budget = 0)
+      : memory_budget_(memory_budget),
+        resident_bytes_(std::make_shared<std::atomic<std::size_t>>(0)),
+        self_(std::make_shared<G2PModelRegistry *>(this)) {}
+
+  // Adds a language, or replaces the loader of a registered language (in
+  // which case the current model, if any, is unloaded). Must not be called
+  // while a model of the same language is being loaded by Get().
+  void Register(const string &language, Loader loader) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Entry> &entry = entries_[language];
+    if (!entry) {
+      entry.reset(new Entry());
+      entry->stats.language = language;
+    }
+    entry->loader = std::move(loader);
+    Unload(entry.get());
+  }
+
+  // Registers each language of a model configuration (see
+  // ParseG2PModelConfig()) with a loader that reads its files.
+  void RegisterFiles(
+      const std::vector<std::pair<string, G2PModelFiles>> &languages) {
+    for (const auto &language : languages) {
+      const G2PModelFiles files = language.second;
+      Register(language.first, [files](std::size_t *size, string *error) {
+        return LoadG2PModel<Arc>(files, size, error);
+      });
+    }
+  }
+
+  bool IsRegistered(const string &language) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(language) > 0;
+  }
+
+  // Returns the model of the given language, loading it if necessary.
+  // Returns nullptr and sets *error if the language is not registered or its
+  // model could not be loaded. The model remains valid for as long as the
+  // caller holds on to it, and is not evicted in the meantime. Letting go of
+  // it may evict it (or another model) if the budget is exceeded. Callers
+  // that keep copies of the model FSTs, such as a G2PWorkspace, should hold
+  // on to the model for as long as they keep the copies, since those share
+  // the data of the model.
+  //
+  // Loading a model does not block requests for other languages. Concurrent
+  // requests for a language whose model is being loaded wait for it.
+  std::shared_ptr<const G2P<Arc>> Get(const string &language, string *error) {
+    Entry *entry = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto iter = entries_.find(language);
+      if (iter == entries_.end()) {
+        *error = "Unknown language: " + language;
+        return nullptr;
+      }
+      entry = iter->second.get();
+      ++entry->stats.requests;
+      if (entry->model) return Touch(entry);
+    }
+    std::lock_guard<std::mutex> load_lock(entry->load_mutex);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (entry->model) return Touch(entry);  // Loaded by another thread.
+    }
+    typedef std::chrono::steady_clock Clock;
+    const auto start = Clock::now();
+    std::size_t size = 0;
+    string load_error;
+    std::unique_ptr<G2P<Arc>> g2p = entry->loader(&size, &load_error);
+    const std::chrono::duration<double, std::milli> elapsed =
+        Clock::now() - start;
+    std::lock_guard<std::mutex> lock(mutex_);
+    G2PLanguageStats &stats = entry->stats;
+    if (!g2p) {
+      if (load_error.empty()) load_error = "Could not load model";
+      LOG(ERROR) << "Loading G2P model for " << language
+                 << " failed: " << load_error;
+      ++stats.failed_loads;
+      stats.last_error = load_error;
+      *error = load_error;
+      return nullptr;
+    }
+    // The model counts as resident until it is destroyed, which may be after
+    // it was unloaded.
+    *resident_bytes_ += size;
+    auto resident_bytes = resident_bytes_;
+    entry->model.reset(g2p.release(),
+                       [resident_bytes, size](const G2P<Arc> *model) {
+                         delete model;
+                         *resident_bytes -= size;
+                       });
+    stats.loaded = true;
+    stats.resident_bytes = size;
+    stats.last_load_ms = elapsed.count();
+    ++stats.loads;
+    VLOG(1) << "Loaded G2P model for " << language << " (" << size
+            << " bytes) in " << elapsed.count() << " ms";
+    std::shared_ptr<const G2P<Arc>> model = Touch(entry);
+    if (!EnforceBudget()) {
+      LOG(WARNING) << "G2P models use " << *resident_bytes_
+                   << " bytes, exceeding the budget of " << memory_budget_
+                   << " bytes, but all of them are in use";
+    }
+    return model;
+  }
+
+  // Unloads the model of the given language, if it is loaded. It will be
+  // loaded again on next use, e.g. to pick up changed model files.
+  void Unload(const string &language) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = entries_.find(language);
+    if (iter != entries_.end()) Unload(iter->second.get());
+  }
+
+  void UnloadAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &entry : entries_) Unload(entry.second.get());
+  }
+
+  G2PRegistryStats Stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    G2PRegistryStats stats;
+    stats.memory_budget = memory_budget_;
+    stats.resident_bytes = *resident_bytes_;
+    for (const auto &entry : entries_) {
+      stats.languages.push_back(entry.second->stats);
+    }
+    return stats;
+  }
+
+ private:
+  struct Entry {
+    Loader loader;
+    std::shared_ptr<const G2P<Arc>> model;
+    uint64 last_use = 0;
+    G2PLanguageStats stats;
+    // Serializes loading the model of this language.
+    std::mutex load_mutex;
+  };
+
+  // Deleter of the models handed out by Get(). It holds a reference to the
+  // model, and checks the budget once all copies of the pointer handed out
+  // are gone, unless the registry is gone by then.
+  class Release {
+   public:
+    Release(std::shared_ptr<const G2P<Arc>> model,
+            std::weak_ptr<G2PModelRegistry *> registry)
+        : model_(std::move(model)), registry_(std::move(registry)) {}
+
+    void operator()(const G2P<Arc> *) {
+      model_.reset();
+      if (auto registry = registry_.lock()) {
+        std::lock_guard<std::mutex> lock((*registry)->mutex_);
+        (*registry)->EnforceBudget();
+      }
+    }
+
+   private:
+    std::shared_ptr<const G2P<Arc>> model_;
+    std::weak_ptr<G2PModelRegistry *> registry_;
+  };
+
+  // Returns a new reference to the model of entry. Requires mutex_ to be
+  // held.
+  std::shared_ptr<const G2P<Arc>> Touch(Entry *entry) {
+    entry->last_use = ++clock_;
+    return std::shared_ptr<const G2P<Arc>>(
+        entry->model.get(), Release(entry->model, self_));
+  }
+
+  // Requires mutex_ to be held. If the model is not in use, this destroys it.
+  void Unload(Entry *entry) {
+    if (!entry->model) return;
+    entry->model.reset();
+    entry->stats.loaded = false;
+    entry->stats.resident_bytes = 0;
+  }
+
+  // Unloads idle models in least recently used order until the resident
+  // models fit into the budget. A model is idle if only the registry holds on
+  // to it; each pointer handed out by Get() (and all of its copies) holds one
+  // reference. Since other references are only handed out while mutex_ is
+  // held, an idle model cannot become busy while it is being unloaded, and
+  // unloading it destroys it. The number of languages is small, so a linear
+  // scan for the least recently used model is good enough. Requires mutex_ to
+  // be held. Returns false if the budget cannot be met because too many
+  // models are in use.
+  bool EnforceBudget() {
+    while (memory_budget_ > 0 && *resident_bytes_ > memory_budget_) {
+      Entry *victim = nullptr;
+      for (auto &entry : entries_) {
+        Entry *candidate = entry.second.get();
+        if (candidate->model && candidate->model.use_count() == 1 &&
+            (victim == nullptr || candidate->last_use < victim->last_use)) {
+          victim = candidate;
+        }
+      }
+      if (victim == nullptr) {
+        return false;
+      }
+      VLOG(1) << "Unloading G2P model for " << victim->stats.language;
+      ++victim->stats.evictions;
+      Unload(victim);
+    }
+    return true;
+  }
+
+  const std::size_t memory_budget_;
+  mutable std::mutex mutex_;
+  std::map<string, std::unique_ptr<Entry>> entries_;
+  // Shared with the deleters of the models, which may outlive the registry.
+  const std::shared_ptr<std::atomic<std::size_t>> resident_bytes_;
+  uint64 clock_ = 0;
+  // Lets the deleters of handed-out models find the registry while it exists.
+  // Declared last, so that it is destroyed first.
+  const std::shared_ptr<G2PModelRegistry *> self_;
+
+  G2PModelRegistry(const G2PModelRegistry &) = delete;
+  G2PModelRegistry &operator=(const G2PModelRegistry &) = delete;
+};
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_REGISTRY_H__
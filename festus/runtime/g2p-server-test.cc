@@ -0,0 +1,287 @@
+// festus/runtime/g2p-server-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the G2P server, its wire protocol, and its client.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-server.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-protocol.h"
+
+namespace {
+
+string TempPath(const string &name) {
+  const char *dir = std::getenv("TEST_TMPDIR");
+  return string(dir ? dir : "/tmp") + "/" + name;
+}
+
+// Stands in for the G2P model: the pronunciation of a word is the word
+// reversed, except that the word "fail" has no pronunciation.
+bool ReversePronounce(const string &word, festus::G2PResult *result) {
+  result->pronunciations.clear();
+  result->error.clear();
+  if (word == "fail") {
+    result->error = "no pronunciation";
+    return false;
+  }
+  result->pronunciations.emplace_back(string(word.rbegin(), word.rend()),
+                                      0.75f);
+  result->pronunciations.emplace_back(word, 0.25f);
+  return true;
+}
+
+class G2PServerTest : public ::testing::Test {
+ protected:
+  // If reload is not null, the server answers kG2PReload requests with it.
+  void StartServer(const festus::G2PServerOptions &options,
+                   festus::G2PServer::ReloadFunction reload = nullptr) {
+    socket_path_ = TempPath("g2p-server-test.sock");
+    server_.reset(new festus::G2PServer(options, [this]() {
+      return [this](const string &word, festus::G2PResult *result) {
+        ++num_calls_;
+        return ReversePronounce(word, result);
+      };
+    }));
+    if (reload) {
+      server_->SetReloadFunction(reload);
+      server_->SetStatsFunction([this]() {
+        return "reloads\t" + std::to_string(num_reloads_) + "\n";
+      });
+    }
+    ASSERT_TRUE(server_->Start(socket_path_));
+    serve_thread_ = std::thread([this]() { shut_down_ = server_->Serve(); });
+  }
+
+  void TearDown() override {
+    if (server_) server_->Shutdown();
+    if (serve_thread_.joinable()) {
+      serve_thread_.join();
+      // Serve() returned because of Shutdown(), not because of an error.
+      EXPECT_TRUE(shut_down_);
+    }
+  }
+
+  string socket_path_;
+  std::unique_ptr<festus::G2PServer> server_;
+  std::thread serve_thread_;
+  std::atomic<int> num_calls_{0};
+  std::atomic<int> num_reloads_{0};
+  std::atomic<bool> shut_down_{false};
+};
+
+TEST(G2PProtocolTest, EncodeAndDecode) {
+  uint32 id;
+  uint8 type;
+  string word;
+  ASSERT_TRUE(festus::DecodeG2PRequest(
+      festus::EncodeG2PRequest(0x01020304, festus::kG2PPronounce, "kat"),
+      &id, &type, &word));
+  EXPECT_EQ(0x01020304, id);
+  EXPECT_EQ(festus::kG2PPronounce, type);
+  EXPECT_EQ("kat", word);
+  EXPECT_FALSE(festus::DecodeG2PRequest("abc", &id, &type, &word));
+
+  festus::G2PResult result;
+  ASSERT_TRUE(ReversePronounce("kat", &result));
+  festus::G2PResult parsed;
+  ASSERT_TRUE(festus::ParseG2PPronunciations(
+      festus::FormatG2PPronunciations(result), &parsed));
+  EXPECT_EQ(result.pronunciations, parsed.pronunciations);
+  EXPECT_FALSE(festus::ParseG2PPronunciations("tak 0.75\n", &parsed));
+  EXPECT_FALSE(festus::ParseG2PPronunciations("tak\t0.75", &parsed));
+}
+
+TEST_F(G2PServerTest, Pronounce) {
+  StartServer(festus::G2PServerOptions());
+  auto client = festus::G2PClient::Connect(socket_path_);
+  ASSERT_TRUE(client != nullptr);
+
+  festus::G2PResult result;
+  ASSERT_TRUE(client->Pronounce("kat", &result));
+  ASSERT_EQ(2, result.pronunciations.size());
+  EXPECT_EQ("tak", result.pronunciations[0].first);
+  EXPECT_EQ(0.75f, result.pronunciations[0].second);
+  EXPECT_EQ("kat", result.pronunciations[1].first);
+
+  EXPECT_FALSE(client->Pronounce("fail", &result));
+  EXPECT_EQ("no pronunciation", result.error);
+
+  // The empty word is a valid request.
+  EXPECT_TRUE(client->Pronounce("", &result));
+
+  string stats;
+  ASSERT_TRUE(client->GetStats(&stats));
+  EXPECT_NE(string::npos, stats.find("requests\t3\n"));
+  EXPECT_NE(string::npos, stats.find("failures\t1\n"));
+  EXPECT_NE(string::npos, stats.find("queue_depth\t"));
+}
+
+TEST_F(G2PServerTest, PipelinedRequestsFromManyClients) {
+  festus::G2PServerOptions options;
+  options.num_threads = 3;
+  options.max_batch_size = 8;
+  options.max_batch_delay = std::chrono::microseconds(100);
+  options.max_queue_depth = 4;  // Exercise backpressure.
+  StartServer(options);
+
+  const int kNumClients = 4;
+  const int kNumRequests = 200;
+  std::vector<std::thread> clients;
+  std::atomic<int> num_errors(0);
+  for (int c = 0; c < kNumClients; ++c) {
+    clients.emplace_back([this, &num_errors]() {
+      auto client = festus::G2PClient::Connect(socket_path_);
+      if (!client) {
+        ++num_errors;
+        return;
+      }
+      // Send everything before reading any response; the server must not
+      // deadlock even though its queue is much shorter.
+      std::thread sender([&client]() {
+        for (int i = 0; i < kNumRequests; ++i) {
+          // Repeat some words, which are pronounced once per batch.
+          client->Send(i, festus::kG2PPronounce, std::to_string(i % 50));
+        }
+      });
+      std::map<uint32, string> bodies;
+      for (int i = 0; i < kNumRequests; ++i) {
+        uint32 id;
+        uint8 status;
+        string body;
+        if (!client->Receive(&id, &status, &body) ||
+            status != festus::kG2POk) {
+          ++num_errors;
+          break;
+        }
+        bodies[id] = body;
+      }
+      sender.join();
+      for (int i = 0; i < kNumRequests; ++i) {
+        festus::G2PResult expected;
+        ReversePronounce(std::to_string(i % 50), &expected);
+        if (bodies[i] != festus::FormatG2PPronunciations(expected)) {
+          ++num_errors;
+        }
+      }
+    });
+  }
+  for (auto &client : clients) {
+    client.join();
+  }
+  EXPECT_EQ(0, num_errors);
+
+  const festus::G2PServerStats stats = server_->Stats();
+  EXPECT_EQ(kNumClients, stats.connections);
+  EXPECT_EQ(kNumClients * kNumRequests, stats.requests);
+  EXPECT_LE(num_calls_, kNumClients * kNumRequests);
+  EXPECT_LE(stats.peak_queue_depth, options.max_queue_depth);
+  EXPECT_GE(stats.batches * options.max_batch_size, stats.requests);
+}
+
+TEST_F(G2PServerTest, BadRequest) {
+  StartServer(festus::G2PServerOptions());
+  auto client = festus::G2PClient::Connect(socket_path_);
+  ASSERT_TRUE(client != nullptr);
+  ASSERT_TRUE(client->Send(7, static_cast<festus::G2PRequestType>(99), "x"));
+  uint32 id;
+  uint8 status;
+  string body;
+  ASSERT_TRUE(client->Receive(&id, &status, &body));
+  EXPECT_EQ(7, id);
+  EXPECT_EQ(festus::kG2PBadRequest, status);
+
+  // The connection remains usable.
+  festus::G2PResult result;
+  EXPECT_TRUE(client->Pronounce("kat", &result));
+}
+
+TEST_F(G2PServerTest, ReloadNotEnabled) {
+  StartServer(festus::G2PServerOptions());
+  auto client = festus::G2PClient::Connect(socket_path_);
+  ASSERT_TRUE(client != nullptr);
+  string message;
+  EXPECT_FALSE(client->Reload(&message));
+  EXPECT_EQ("Reloading is not enabled", message);
+}
+
+TEST_F(G2PServerTest, Reload) {
+  StartServer(festus::G2PServerOptions(), [this](string *message) {
+    if (++num_reloads_ > 1) {
+      *message = "broken model";
+      return false;
+    }
+    *message = "model version 2";
+    return true;
+  });
+  auto client = festus::G2PClient::Connect(socket_path_);
+  ASSERT_TRUE(client != nullptr);
+  string message;
+  ASSERT_TRUE(client->Reload(&message));
+  EXPECT_EQ("model version 2", message);
+  EXPECT_FALSE(client->Reload(&message));
+  EXPECT_EQ("broken model", message);
+
+  festus::G2PResult result;
+  EXPECT_TRUE(client->Pronounce("kat", &result));
+  string stats;
+  ASSERT_TRUE(client->GetStats(&stats));
+  EXPECT_NE(string::npos, stats.find("requests\t1\n"));
+  EXPECT_NE(string::npos, stats.find("reloads\t2\n"));
+}
+
+TEST(BatchQueueTest, PushAndPopBatch) {
+  festus::BatchQueue<int> queue(10);
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(queue.Push(i));
+  }
+  EXPECT_EQ(5, queue.Size());
+  std::vector<int> batch;
+  ASSERT_TRUE(queue.PopBatch(3, std::chrono::microseconds(0), &batch));
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), batch);
+  // Waits for a full batch, but takes a partial batch after the delay.
+  ASSERT_TRUE(queue.PopBatch(3, std::chrono::microseconds(1000), &batch));
+  EXPECT_EQ(std::vector<int>({3, 4}), batch);
+  EXPECT_EQ(5, queue.PeakSize());
+
+  queue.Close();
+  EXPECT_FALSE(queue.Push(5));
+  EXPECT_FALSE(queue.PopBatch(3, std::chrono::microseconds(0), &batch));
+}
+
+TEST(BatchQueueTest, CloseWakesBlockedProducer) {
+  festus::BatchQueue<int> queue(1);
+  ASSERT_TRUE(queue.Push(0));
+  std::thread producer([&queue]() { EXPECT_FALSE(queue.Push(1)); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  queue.Close();
+  producer.join();
+}
+
+}  // namespace
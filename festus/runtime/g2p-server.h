@@ -0,0 +1,435 @@
+// festus/runtime/g2p-server.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Long-running G2P server that answers pronunciation requests over a Unix
+// domain socket, using the protocol of g2p-protocol.h.
+//
+// Each connection is served by a reader thread, which decodes requests and
+// appends them to a bounded queue shared by all connections. A pool of worker
+// threads takes requests off the queue in batches, pronounces each distinct
+// word of a batch once, and sends the responses back to the connections the
+// requests came from. When the queue is full, readers stop reading from their
+// sockets, so that clients are slowed down by the kernel's flow control
+// (backpressure) instead of piling up requests in the server.
+
+#ifndef FESTUS_RUNTIME_G2P_SERVER_H__
+#define FESTUS_RUNTIME_G2P_SERVER_H__
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-protocol.h"
+#include "g2p.h"
+
+namespace festus {
+
+// Bounded multi-producer, multi-consumer queue from which consumers take
+// items in batches.
+template <class T>
+class BatchQueue {
+ public:
+  explicit BatchQueue(std::size_t capacity) : capacity_(capacity) {
+    CHECK_GT(capacity, 0);
+  }
+
+  // Appends an item, blocking while the queue is full. Returns false (and
+  // drops the item) if the queue has been closed.
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] {
+      return closed_ || items_.size() < capacity_;
+    });
+    if (closed_) return false;
+    items_.push_back(std::move(item));
+    peak_size_ = std::max(peak_size_, items_.size());
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Waits until the queue is non-empty, then waits up to max_delay for it to
+  // hold max_batch_size items, and moves up to max_batch_size items into
+  // *batch (replacing its contents). Returns false if the queue has been
+  // closed.
+  bool PopBatch(std::size_t max_batch_size,
+                std::chrono::microseconds max_delay,
+                std::vector<T> *batch) {
+    batch->clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (max_delay.count() > 0 && items_.size() < max_batch_size) {
+      not_empty_.wait_for(lock, max_delay, [this, max_batch_size] {
+        return closed_ || items_.size() >= max_batch_size;
+      });
+    }
+    if (closed_) return false;
+    // The items may have been taken by another consumer in the meantime.
+    const std::size_t size = std::min(items_.size(), max_batch_size);
+    for (std::size_t i = 0; i < size; ++i) {
+      batch->push_back(std::move(items_.front()));
+      items_.pop_front();
+    }
+    not_full_.notify_all();
+    return true;
+  }
+
+  // Wakes up all waiting producers and consumers and makes all further
+  // operations fail. Items remaining in the queue are dropped.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    items_.clear();
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  std::size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.size();
+  }
+
+  // The largest number of items that have been in the queue at once.
+  std::size_t PeakSize() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_size_;
+  }
+
+ private:
+  const std::size_t capacity_;
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> items_;
+  std::size_t peak_size_ = 0;
+  bool closed_ = false;
+
+  BatchQueue(const BatchQueue &) = delete;
+  BatchQueue &operator=(const BatchQueue &) = delete;
+};
+
+struct G2PServerOptions {
+  // Number of worker threads.
+  int num_threads = 1;
+
+  // Maximal number of requests that a worker takes off the queue at once.
+  std::size_t max_batch_size = 64;
+
+  // How long a worker waits for a batch to fill up before working on a
+  // partial batch. With the default of zero, batches consist of whatever
+  // requests have arrived while all workers were busy, so batching never
+  // adds latency.
+  std::chrono::microseconds max_batch_delay{0};
+
+  // Maximal number of queued requests, beyond which the server stops reading
+  // requests from its clients.
+  std::size_t max_queue_depth = 1024;
+
+  // How long sending a response may block before the client is considered
+  // unresponsive, so that a client that stops reading cannot stall a worker
+  // indefinitely.
+  std::chrono::seconds send_timeout{10};
+};
+
+struct G2PServerStats {
+  uint64 connections = 0;         // Accepted so far.
+  uint64 active_connections = 0;  // Currently open.
+  uint64 requests = 0;            // Pronunciation requests answered so far.
+  uint64 failures = 0;            // Requests that found no pronunciation.
+  uint64 batches = 0;             // Batches processed so far.
+  uint64 queue_depth = 0;         // Requests currently waiting.
+  uint64 peak_queue_depth = 0;    // Most requests waiting at any time.
+
+  // Formats the statistics as "name TAB value" lines.
+  string ToString() const {
+    std::ostringstream strm;
+    strm << "connections\t" << connections << "\n"
+         << "active_connections\t" << active_connections << "\n"
+         << "requests\t" << requests << "\n"
+         << "failures\t" << failures << "\n"
+         << "batches\t" << batches << "\n"
+         << "queue_depth\t" << queue_depth << "\n"
+         << "peak_queue_depth\t" << peak_queue_depth << "\n";
+    return strm.str();
+  }
+};
+
+class G2PServer {
+ public:
+  // Pronounces a single word, like G2P<>::Pronounce(). Each worker thread
+  // calls its own instance, which may therefore own per-thread scratch space
+  // such as a G2PWorkspace.
+  typedef std::function<bool(const string &, G2PResult *)> PronounceFunction;
+
+  // Creates the PronounceFunction of a worker thread.
+  typedef std::function<PronounceFunction()> WorkerFactory;
+
+  // Reloads the model in response to a kG2PReload request. Returns false on
+  // failure. Sets *message to a description of the new model or the error.
+  typedef std::function<bool(string *message)> ReloadFunction;
+
+  // Returns further statistics as "name TAB value" lines, such as those of
+  // the model.
+  typedef std::function<string()> StatsFunction;
+
+  G2PServer(const G2PServerOptions &options, WorkerFactory worker_factory)
+      : options_(options),
+        worker_factory_(std::move(worker_factory)),
+        queue_(std::max<std::size_t>(options.max_queue_depth, 1)) {}
+
+  ~G2PServer() { Shutdown(); }
+
+  // Enables kG2PReload requests. Must be called before Start().
+  void SetReloadFunction(ReloadFunction reload) {
+    reload_ = std::move(reload);
+  }
+
+  // Appends the output of the given function to the response to kG2PStats
+  // requests. Must be called before Start().
+  void SetStatsFunction(StatsFunction stats) { stats_ = std::move(stats); }
+
+  // Starts listening at the given socket path and starts the worker threads.
+  // Returns false on error.
+  bool Start(const string &socket_path) {
+    listen_fd_ = ListenUnixSocket(socket_path, 128);
+    if (listen_fd_ < 0) return false;
+    socket_path_ = socket_path;
+    for (int t = 0; t < std::max(options_.num_threads, 1); ++t) {
+      workers_.emplace_back(&G2PServer::ProcessRequests, this);
+    }
+    return true;
+  }
+
+  // Accepts connections until Shutdown() is called. Returns false if it
+  // stopped for any other reason, i.e. if accepting a connection failed.
+  bool Serve() {
+    for (;;) {
+      const int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (stopping_) return true;
+        LOG(ERROR) << "Could not accept connection: " << std::strerror(errno);
+        return false;
+      }
+      timeval timeout;
+      timeout.tv_sec = options_.send_timeout.count();
+      timeout.tv_usec = 0;
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      std::shared_ptr<Connection> connection(new Connection(fd));
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) return true;
+        connections_.insert(connection);
+      }
+      ++num_connections_;
+      std::thread(&G2PServer::ReadRequests, this, connection).detach();
+    }
+  }
+
+  // Stops accepting connections, closes all connections, drops pending
+  // requests, and stops the worker threads. Safe to call from any thread,
+  // and more than once.
+  void Shutdown() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stopping_) return;
+      stopping_ = true;
+      if (listen_fd_ >= 0) shutdown(listen_fd_, SHUT_RDWR);
+      for (const auto &connection : connections_) {
+        shutdown(connection->fd, SHUT_RDWR);
+      }
+      queue_.Close();
+      readers_done_.wait(lock, [this] { return connections_.empty(); });
+    }
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+    if (listen_fd_ >= 0) {
+      close(listen_fd_);
+      unlink(socket_path_.c_str());
+    }
+  }
+
+  G2PServerStats Stats() const {
+    G2PServerStats stats;
+    stats.connections = num_connections_;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats.active_connections = connections_.size();
+    }
+    stats.requests = num_requests_;
+    stats.failures = num_failures_;
+    stats.batches = num_batches_;
+    stats.queue_depth = queue_.Size();
+    stats.peak_queue_depth = queue_.PeakSize();
+    return stats;
+  }
+
+ private:
+  struct Connection {
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() { close(fd); }
+
+    // Sends a response. Responses of different workers are serialized.
+    void Respond(const string &payload) {
+      std::lock_guard<std::mutex> lock(write_mutex);
+      if (!WriteG2PFrame(fd, payload)) {
+        VLOG(1) << "Could not send response; client has gone away";
+      }
+    }
+
+    const int fd;
+    std::mutex write_mutex;
+  };
+
+  struct Request {
+    std::shared_ptr<Connection> connection;
+    uint32 id;
+    string word;
+  };
+
+  // Reads requests from a connection until it is closed.
+  void ReadRequests(std::shared_ptr<Connection> connection) {
+    string payload;
+    string word;
+    uint32 id;
+    uint8 type;
+    while (ReadG2PFrame(connection->fd, &payload)) {
+      if (!DecodeG2PRequest(payload, &id, &type, &word)) {
+        connection->Respond(EncodeG2PResponse(0, kG2PBadRequest,
+                                              "Request is too short"));
+        break;
+      }
+      if (type == kG2PStats) {
+        string body = Stats().ToString();
+        if (stats_) body += stats_();
+        connection->Respond(EncodeG2PResponse(id, kG2POk, body));
+      } else if (type == kG2PReload) {
+        // Only this connection waits for the reload; workers keep answering
+        // requests with the current model meanwhile.
+        string message;
+        if (!reload_) {
+          connection->Respond(EncodeG2PResponse(id, kG2PBadRequest,
+                                                "Reloading is not enabled"));
+        } else if (reload_(&message)) {
+          connection->Respond(EncodeG2PResponse(id, kG2POk, message));
+        } else {
+          connection->Respond(EncodeG2PResponse(id, kG2PFailed, message));
+        }
+      } else if (type == kG2PPronounce) {
+        // Blocks while the queue is full.
+        if (!queue_.Push(Request{connection, id, std::move(word)})) break;
+      } else {
+        connection->Respond(EncodeG2PResponse(id, kG2PBadRequest,
+                                              "Unknown request type"));
+      }
+    }
+    // Stop receiving, but let the workers send outstanding responses.
+    shutdown(connection->fd, SHUT_RD);
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.erase(connection);
+    readers_done_.notify_all();
+  }
+
+  // Worker thread: answers batches of requests until the queue is closed.
+  void ProcessRequests() {
+    PronounceFunction pronounce = worker_factory_();
+    std::vector<Request> batch;
+    std::vector<string> bodies;
+    std::vector<G2PStatus> statuses;
+    std::unordered_map<string, std::size_t> first_index;
+    G2PResult result;
+    while (queue_.PopBatch(options_.max_batch_size, options_.max_batch_delay,
+                           &batch)) {
+      ++num_batches_;
+      bodies.resize(batch.size());
+      statuses.resize(batch.size());
+      first_index.clear();
+      for (std::size_t i = 0; i < batch.size(); ++i) {
+        const Request &request = batch[i];
+        // Pronounce repeated words only once per batch.
+        auto inserted = first_index.emplace(request.word, i);
+        if (!inserted.second) {
+          const std::size_t first = inserted.first->second;
+          statuses[i] = statuses[first];
+          bodies[i] = bodies[first];
+        } else if (pronounce(request.word, &result)) {
+          statuses[i] = kG2POk;
+          bodies[i] = FormatG2PPronunciations(result);
+        } else {
+          statuses[i] = kG2PFailed;
+          bodies[i] = result.error;
+        }
+        // Count the request before the client can see its response.
+        ++num_requests_;
+        if (statuses[i] != kG2POk) ++num_failures_;
+        request.connection->Respond(
+            EncodeG2PResponse(request.id, statuses[i], bodies[i]));
+      }
+      // Release the connections held by the batch.
+      batch.clear();
+    }
+  }
+
+  const G2PServerOptions options_;
+  const WorkerFactory worker_factory_;
+  ReloadFunction reload_;
+  StatsFunction stats_;
+  BatchQueue<Request> queue_;
+  int listen_fd_ = -1;
+  string socket_path_;
+  std::vector<std::thread> workers_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable readers_done_;
+  std::set<std::shared_ptr<Connection>> connections_;
+  std::atomic<bool> stopping_{false};
+
+  std::atomic<uint64> num_connections_{0};
+  std::atomic<uint64> num_requests_{0};
+  std::atomic<uint64> num_failures_{0};
+  std::atomic<uint64> num_batches_{0};
+
+  G2PServer(const G2PServer &) = delete;
+  G2PServer &operator=(const G2PServer &) = delete;
+};
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_SERVER_H__
@@ -0,0 +1,115 @@
+// festus/runtime/g2p-stats-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the G2P per-stage instrumentation.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-stats.h"
+
+#include <sstream>
+#include <string>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(HistogramTest, Quantiles) {
+  festus::Histogram histogram;
+  EXPECT_EQ(0, histogram.Quantile(0.5));
+  for (int i = 1; i <= 1000; ++i) {
+    histogram.Add(i);
+  }
+  EXPECT_EQ(1000, histogram.Count());
+  EXPECT_DOUBLE_EQ(500.5, histogram.Mean());
+  EXPECT_EQ(1000, histogram.Max());
+  // Quantiles are upper bounds accurate to within one sub-bucket.
+  EXPECT_GE(histogram.Quantile(0.5), 500);
+  EXPECT_LE(histogram.Quantile(0.5), 500 * (1 + 1.0 / 8));
+  EXPECT_GE(histogram.Quantile(0.99), 990);
+  EXPECT_LE(histogram.Quantile(0.99), 1000);
+  EXPECT_EQ(1000, histogram.Quantile(1));
+
+  festus::Histogram small;
+  small.Add(0.25);
+  histogram.Merge(small);
+  EXPECT_EQ(1001, histogram.Count());
+  EXPECT_EQ(1, histogram.Quantile(0));
+}
+
+TEST(G2PStatsTest, AddMergeAndPrint) {
+  festus::G2PStageRecord record;
+  record.micros[festus::kG2PSpellingStage] = 5;
+  record.states[festus::kG2PSpellingStage] = 4;
+  record.arcs[festus::kG2PSpellingStage] = 3;
+  record.done[festus::kG2PSpellingStage] = true;
+
+  festus::G2PStats stats(2);
+  stats.AddWord("kat", record, 10, true);
+  stats.AddWord("hond", record, 30, false);
+
+  festus::G2PStats other;
+  other.AddWord("muis", record, 20, true);
+  stats.Merge(other);
+
+  std::ostringstream strm;
+  stats.Print(strm);
+  const string output = strm.str();
+  EXPECT_EQ(0, output.find("3 words, 1 failures\n"));
+  EXPECT_NE(string::npos, output.find("\nspelling "));
+  EXPECT_EQ(string::npos, output.find("\nviterbi "));
+  // Only the two slowest words are kept, slowest first.
+  const auto hond = output.find(" us  hond  spelling=5/4/3");
+  const auto muis = output.find(" us  muis");
+  ASSERT_NE(string::npos, hond);
+  ASSERT_NE(string::npos, muis);
+  EXPECT_LT(hond, muis);
+  EXPECT_EQ(string::npos, output.find(" us  kat"));
+}
+
+TEST(G2PStageRecorderTest, CountsStatesAndArcs) {
+  fst::StdVectorFst fst;
+  fst.AddState();
+  fst.AddState();
+  fst.SetStart(0);
+  fst.AddArc(0, fst::StdArc(1, 1, 0, 1));
+  fst.AddArc(0, fst::StdArc(2, 2, 0, 1));
+  fst.SetFinal(1, 0);
+
+  festus::G2PStats stats;
+  festus::G2PStageRecorder recorder;
+  // Marks are ignored unless the recorder has been started.
+  recorder.Mark(festus::kG2PGraphonesStage, fst);
+  {
+    const string error;
+    festus::G2PStageScope scope(&recorder, &stats, "kat", &error);
+    EXPECT_TRUE(recorder.Active());
+    recorder.Mark(festus::kG2PPhonemesStage, fst);
+  }
+  EXPECT_FALSE(recorder.Active());
+
+  std::ostringstream strm;
+  stats.Print(strm);
+  const string output = strm.str();
+  EXPECT_EQ(0, output.find("1 words, 0 failures\n"));
+  EXPECT_EQ(string::npos, output.find("\ngraphones "));
+  EXPECT_NE(string::npos, output.find("phonemes=")) << output;
+  EXPECT_NE(string::npos, output.find("/2/2")) << output;
+}
+
+}  // namespace
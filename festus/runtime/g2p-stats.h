@@ -0,0 +1,360 @@
+// festus/runtime/g2p-stats.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Opt-in instrumentation of G2P<>::Pronounce(): per-stage wall time and
+// lattice sizes, collected into histograms, plus the slowest words seen.
+//
+// Statistics are only collected for workspaces that have been given a
+// G2PStats object via G2PWorkspace<>::SetStats(); otherwise the cost is one
+// branch per stage.
+
+#ifndef FESTUS_RUNTIME_G2P_STATS_H__
+#define FESTUS_RUNTIME_G2P_STATS_H__
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+
+namespace festus {
+
+// The stages of G2P<>::Pronounce(), named after the result of each stage.
+// The numbers refer to the steps logged by Pronounce() at --v=2.
+enum G2PStage {
+  kG2PSpellingStage = 0,    // 1. Spelling FST.
+  kG2PGraphonesStage,       // 2. Graphone lattice.
+  kG2PRescoredStage,        // 3. Rescored graphone lattice (or 2-3 at once).
+  kG2PPhonemesStage,        // 4. Phoneme lattice.
+  kG2PDeterminizeStage,     // 5. Determinized phoneme lattice.
+  kG2PTotalWeightStage,     // 6. Total weight and number of hypotheses.
+  kG2PShortestPathStage,    // 7. Shortest paths.
+  kG2PConvertStage,         // 8. Pronunciations.
+  kG2PViterbiStage,         // Best graphone path (G2POptions::VITERBI).
+  kNumG2PStages,
+};
+
+inline const char *G2PStageName(int stage) {
+  static const char *const kNames[kNumG2PStages] = {
+    "spelling", "graphones", "rescored", "phonemes", "determinize",
+    "total_weight", "shortest_path", "convert", "viterbi",
+  };
+  return kNames[stage];
+}
+
+// Histogram of non-negative values with logarithmically spaced buckets:
+// each power of two is split into kSubBuckets buckets, so quantiles are
+// accurate to within a factor of 1 + 1 / kSubBuckets.
+class Histogram {
+ public:
+  static constexpr int kSubBuckets = 8;
+  static constexpr int kNumBuckets = 1 + 64 * kSubBuckets;
+
+  void Add(double value) {
+    ++counts_[BucketIndex(value)];
+    ++count_;
+    sum_ += value;
+    max_ = std::max(max_, value);
+  }
+
+  void Merge(const Histogram &other) {
+    for (int i = 0; i < kNumBuckets; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  uint64 Count() const { return count_; }
+  double Mean() const { return count_ == 0 ? 0 : sum_ / count_; }
+  double Max() const { return max_; }
+
+  // Returns an upper bound on the given quantile (in [0, 1]).
+  double Quantile(double q) const {
+    if (count_ == 0) return 0;
+    const uint64 rank = std::max<uint64>(
+        1, static_cast<uint64>(std::ceil(q * count_)));
+    uint64 seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(BucketLimit(i), max_);
+    }
+    return max_;
+  }
+
+ private:
+  // Bucket 0 holds values below 1. Bucket 1 + e * kSubBuckets + s holds
+  // values in [2^e * (1 + s / kSubBuckets), 2^e * (1 + (s + 1) / kSubBuckets)).
+  static int BucketIndex(double value) {
+    if (!(value >= 1)) return 0;
+    int exponent;
+    const double fraction = std::frexp(value, &exponent);  // In [0.5, 1).
+    const int sub = static_cast<int>((2 * fraction - 1) * kSubBuckets);
+    return std::min(1 + (exponent - 1) * kSubBuckets + sub, kNumBuckets - 1);
+  }
+
+  static double BucketLimit(int index) {
+    if (index == 0) return 1;
+    const int exponent = (index - 1) / kSubBuckets;
+    const int sub = (index - 1) % kSubBuckets;
+    return std::ldexp(1 + (sub + 1.0) / kSubBuckets, exponent);
+  }
+
+  std::array<uint64, kNumBuckets> counts_{};
+  uint64 count_ = 0;
+  double sum_ = 0;
+  double max_ = 0;
+};
+
+// Time and lattice size of each stage for a single word.
+struct G2PStageRecord {
+  std::array<double, kNumG2PStages> micros{};
+  std::array<std::size_t, kNumG2PStages> states{};
+  std::array<std::size_t, kNumG2PStages> arcs{};
+  std::array<bool, kNumG2PStages> done{};
+
+  void Clear() { done.fill(false); }
+};
+
+// Statistics over many calls to G2P<>::Pronounce(). Thread-safe, so that one
+// object can be shared by the workspaces of several threads.
+class G2PStats {
+ public:
+  static constexpr std::size_t kDefaultNumSlowestWords = 10;
+
+  explicit G2PStats(std::size_t num_slowest_words = kDefaultNumSlowestWords)
+      : num_slowest_words_(num_slowest_words) {}
+
+  // Adds the stages of one word. The total time includes time not attributed
+  // to any stage (such as setting up the workspace).
+  void AddWord(const string &word,
+               const G2PStageRecord &record,
+               double total_micros,
+               bool success) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    total_.Add(total_micros);
+    if (!success) ++num_failures_;
+    for (int s = 0; s < kNumG2PStages; ++s) {
+      if (!record.done[s]) continue;
+      stages_[s].micros.Add(record.micros[s]);
+      stages_[s].states.Add(record.states[s]);
+      stages_[s].arcs.Add(record.arcs[s]);
+    }
+    AddSlowWord(SlowWord{total_micros, word, record});
+  }
+
+  // Adds the statistics of other to this object.
+  void Merge(const G2PStats &other) {
+    if (&other == this) return;
+    std::lock(mutex_, other.mutex_);
+    std::lock_guard<std::mutex> lock(mutex_, std::adopt_lock);
+    std::lock_guard<std::mutex> other_lock(other.mutex_, std::adopt_lock);
+    total_.Merge(other.total_);
+    num_failures_ += other.num_failures_;
+    for (int s = 0; s < kNumG2PStages; ++s) {
+      stages_[s].micros.Merge(other.stages_[s].micros);
+      stages_[s].states.Merge(other.stages_[s].states);
+      stages_[s].arcs.Merge(other.stages_[s].arcs);
+    }
+    for (const auto &slow_word : other.slowest_words_) {
+      AddSlowWord(slow_word);
+    }
+  }
+
+  // Prints a table with the count, mean, median, 99th percentile, and
+  // maximum of the time (in microseconds) and lattice sizes of each stage,
+  // followed by the per-stage breakdown of the slowest words.
+  void Print(std::ostream &strm) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    strm << total_.Count() << " words, " << num_failures_ << " failures\n"
+         << std::left << std::setw(14) << "stage" << std::right
+         << std::setw(9) << "count"
+         << std::setw(10) << "mean_us" << std::setw(10) << "p50_us"
+         << std::setw(10) << "p99_us" << std::setw(11) << "max_us"
+         << std::setw(9) << "p50_st" << std::setw(9) << "p99_st"
+         << std::setw(9) << "max_st"
+         << std::setw(9) << "p50_arc" << std::setw(9) << "p99_arc"
+         << std::setw(9) << "max_arc" << "\n";
+    strm << std::fixed << std::setprecision(1);
+    for (int s = 0; s < kNumG2PStages; ++s) {
+      const StageStats &stage = stages_[s];
+      if (stage.micros.Count() == 0) continue;
+      PrintTimes(G2PStageName(s), stage.micros, strm);
+      strm << std::setprecision(0)
+           << std::setw(9) << stage.states.Quantile(0.5)
+           << std::setw(9) << stage.states.Quantile(0.99)
+           << std::setw(9) << stage.states.Max()
+           << std::setw(9) << stage.arcs.Quantile(0.5)
+           << std::setw(9) << stage.arcs.Quantile(0.99)
+           << std::setw(9) << stage.arcs.Max()
+           << std::setprecision(1) << "\n";
+    }
+    PrintTimes("total", total_, strm);
+    strm << "\n";
+    if (slowest_words_.empty()) return;
+    strm << "slowest words (stage=us/states/arcs):\n";
+    for (const auto &slow_word : slowest_words_) {
+      strm << std::setw(10) << slow_word.micros << " us  " << slow_word.word;
+      for (int s = 0; s < kNumG2PStages; ++s) {
+        if (!slow_word.record.done[s]) continue;
+        strm << "  " << G2PStageName(s) << "="
+             << std::setprecision(0) << slow_word.record.micros[s] << "/"
+             << slow_word.record.states[s] << "/"
+             << slow_word.record.arcs[s] << std::setprecision(1);
+      }
+      strm << "\n";
+    }
+  }
+
+ private:
+  struct StageStats {
+    Histogram micros;
+    Histogram states;
+    Histogram arcs;
+  };
+
+  struct SlowWord {
+    double micros;
+    string word;
+    G2PStageRecord record;
+  };
+
+  static void PrintTimes(const char *name, const Histogram &micros,
+                         std::ostream &strm) {
+    strm << std::left << std::setw(14) << name << std::right
+         << std::setw(9) << micros.Count()
+         << std::setw(10) << micros.Mean()
+         << std::setw(10) << micros.Quantile(0.5)
+         << std::setw(10) << micros.Quantile(0.99)
+         << std::setw(11) << micros.Max();
+  }
+
+  // Keeps slowest_words_ sorted by decreasing time.
+  void AddSlowWord(const SlowWord &slow_word) {
+    if (slowest_words_.size() >= num_slowest_words_ &&
+        (slowest_words_.empty() ||
+         slowest_words_.back().micros >= slow_word.micros)) {
+      return;
+    }
+    auto pos = std::upper_bound(
+        slowest_words_.begin(), slowest_words_.end(), slow_word,
+        [](const SlowWord &a, const SlowWord &b) {
+          return a.micros > b.micros;
+        });
+    slowest_words_.insert(pos, slow_word);
+    if (slowest_words_.size() > num_slowest_words_) slowest_words_.pop_back();
+  }
+
+  const std::size_t num_slowest_words_;
+  mutable std::mutex mutex_;
+  Histogram total_;
+  uint64 num_failures_ = 0;
+  std::array<StageStats, kNumG2PStages> stages_;
+  std::vector<SlowWord> slowest_words_;
+};
+
+// Records the stages of a single call to G2P<>::Pronounce().
+class G2PStageRecorder {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  bool Active() const { return active_; }
+
+  void Start() {
+    active_ = true;
+    record_.Clear();
+    start_ = last_ = Clock::now();
+  }
+
+  // Records the end of the given stage, whose result is fst. The time spent
+  // counting states and arcs is not attributed to any stage.
+  template <class F>
+  void Mark(G2PStage stage, const F &fst) {
+    if (!active_) return;
+    const Clock::time_point now = Clock::now();
+    const std::chrono::duration<double, std::micro> micros = now - last_;
+    std::size_t num_states = 0;
+    std::size_t num_arcs = 0;
+    for (fst::StateIterator<F> siter(fst); !siter.Done(); siter.Next()) {
+      ++num_states;
+      num_arcs += fst.NumArcs(siter.Value());
+    }
+    record_.micros[stage] = micros.count();
+    record_.states[stage] = num_states;
+    record_.arcs[stage] = num_arcs;
+    record_.done[stage] = true;
+    last_ = Clock::now();
+    counting_ += last_ - now;
+  }
+
+  // Adds the recorded stages to stats and deactivates the recorder.
+  void Finish(const string &word, bool success, G2PStats *stats) {
+    const std::chrono::duration<double, std::micro> total =
+        Clock::now() - start_ - counting_;
+    stats->AddWord(word, record_, total.count(), success);
+    active_ = false;
+    counting_ = Clock::duration::zero();
+  }
+
+ private:
+  bool active_ = false;
+  G2PStageRecord record_;
+  Clock::time_point start_;
+  Clock::time_point last_;
+  Clock::duration counting_ = Clock::duration::zero();
+};
+
+// Records the stages of one call to G2P<>::Pronounce() for as long as it is in
+// scope, if stats is not null. The call counts as successful if *error is
+// empty at the end of the scope.
+class G2PStageScope {
+ public:
+  G2PStageScope(G2PStageRecorder *recorder,
+                G2PStats *stats,
+                const string &word,
+                const string *error)
+      : recorder_(recorder), stats_(stats), word_(word), error_(error) {
+    if (stats_) recorder_->Start();
+  }
+
+  ~G2PStageScope() {
+    if (stats_) recorder_->Finish(word_, error_->empty(), stats_);
+  }
+
+ private:
+  G2PStageRecorder *const recorder_;
+  G2PStats *const stats_;
+  const string &word_;
+  const string *const error_;
+
+  G2PStageScope(const G2PStageScope &) = delete;
+  G2PStageScope &operator=(const G2PStageScope &) = delete;
+};
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_STATS_H__
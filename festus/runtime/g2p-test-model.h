@@ -0,0 +1,160 @@
+// festus/runtime/g2p-test-model.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Small G2P model for tests and benchmarks, derived from a checked-in graphone
+// language model: its graphone symbol table determines the bytes_to_graphones
+// and phonemes_to_graphones machines, and the language model itself is
+// converted to the log semiring.
+
+#ifndef FESTUS_RUNTIME_G2P_TEST_MODEL_H__
+#define FESTUS_RUNTIME_G2P_TEST_MODEL_H__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "compact.h"
+#include "fst-util.h"
+#include "input-labeler.h"
+
+namespace festus {
+
+// Machines of a test model, in the log semiring.
+struct G2PTestMachines {
+  fst::VectorFst<fst::LogArc> bytes_to_graphones;
+  fst::VectorFst<fst::LogArc> graphone_model;
+  fst::VectorFst<fst::LogArc> phonemes_to_graphones;
+};
+
+namespace internal {
+
+// Adds a path that reads the given input labels and writes the given output
+// label on its last arc, leading from state 0 back to state 0.
+inline void AddGraphonePath(const std::vector<int> &ilabels,
+                            int olabel,
+                            fst::VectorFst<fst::LogArc> *fst) {
+  typedef fst::LogArc Arc;
+  typedef Arc::Weight Weight;
+  if (ilabels.empty()) {
+    fst->AddArc(0, Arc(0, olabel, Weight::One(), 0));
+    return;
+  }
+  Arc::StateId state = 0;
+  for (std::size_t i = 0; i + 1 < ilabels.size(); ++i) {
+    Arc::StateId next = fst->AddState();
+    fst->AddArc(state, Arc(ilabels[i], 0, Weight::One(), next));
+    state = next;
+  }
+  fst->AddArc(state, Arc(ilabels.back(), olabel, Weight::One(), 0));
+}
+
+// Splits a graphone symbol like "ch;k__s" into its spelling "ch" and its
+// phonemes {"k", "s"}.
+inline bool SplitGraphone(const string &graphone,
+                          string *spelling,
+                          std::vector<string> *phonemes) {
+  auto semicolon = graphone.find(';');
+  if (semicolon == string::npos) return false;
+  *spelling = graphone.substr(0, semicolon);
+  phonemes->clear();
+  for (auto pos = semicolon + 1; pos < graphone.size(); /*empty*/) {
+    auto end = graphone.find("__", pos);
+    if (end == string::npos) end = graphone.size();
+    phonemes->push_back(graphone.substr(pos, end - pos));
+    pos = end + 2;
+  }
+  return true;
+}
+
+}  // namespace internal
+
+// Builds the machines of a test model from the graphone language model (in
+// the tropical semiring, with graphone output symbols) read from the given
+// path. The input tape of bytes_to_graphones consists of bytes, or of the
+// labels of the given input labeler if not null. Returns false on error.
+inline bool MakeG2PTestMachines(const string &graphone_model_path,
+                                G2PTestMachines *machines,
+                                const InputLabeler *input_labeler = nullptr) {
+  typedef fst::LogArc Arc;
+  std::unique_ptr<fst::StdVectorFst> model(
+      fst::StdVectorFst::Read(graphone_model_path));
+  if (!model) return false;
+  const fst::SymbolTable *graphones = model->OutputSymbols();
+  if (!graphones) {
+    LOG(ERROR) << "Graphone model has no output symbols";
+    return false;
+  }
+
+  auto *bytes_to_graphones = &machines->bytes_to_graphones;
+  auto *phonemes_to_graphones = &machines->phonemes_to_graphones;
+  for (auto *fst : {bytes_to_graphones, phonemes_to_graphones}) {
+    fst->DeleteStates();
+    fst->AddState();
+    fst->SetStart(0);
+    fst->SetFinal(0, Arc::Weight::One());
+  }
+  fst::SymbolTable phoneme_symbols("phonemes");
+  phoneme_symbols.AddSymbol("<epsilon>");
+  for (fst::SymbolTableIterator siter(*graphones); !siter.Done();
+       siter.Next()) {
+    if (siter.Value() == 0) continue;
+    string spelling;
+    std::vector<string> phonemes;
+    if (!internal::SplitGraphone(siter.Symbol(), &spelling, &phonemes)) {
+      LOG(ERROR) << "Malformed graphone symbol: " << siter.Symbol();
+      return false;
+    }
+    std::vector<int> labels;
+    if (input_labeler == nullptr) {
+      ByteInputLabeler().AppendLabels(spelling, &labels);
+    } else if (!input_labeler->AppendLabels(spelling, &labels)) {
+      LOG(ERROR) << "Cannot convert graphone spelling: " << spelling;
+      return false;
+    }
+    internal::AddGraphonePath(labels, siter.Value(), bytes_to_graphones);
+    labels.clear();
+    for (const auto &phoneme : phonemes) {
+      labels.push_back(phoneme_symbols.AddSymbol(phoneme));
+    }
+    internal::AddGraphonePath(labels, siter.Value(), phonemes_to_graphones);
+  }
+  fst::ArcSort(bytes_to_graphones, fst::ILabelCompare<Arc>());
+  fst::ArcSort(phonemes_to_graphones, fst::OLabelCompare<Arc>());
+  phonemes_to_graphones->SetInputSymbols(&phoneme_symbols);
+
+  ConvertWeight(*model, &machines->graphone_model);
+  machines->graphone_model.SetInputSymbols(nullptr);
+  machines->graphone_model.SetOutputSymbols(nullptr);
+  return true;
+}
+
+// Stores the given machine in the compact format that make-runtime-fsts
+// produces.
+inline std::unique_ptr<const fst::Fst<fst::LogArc>> CompactG2PTestMachine(
+    const fst::VectorFst<fst::LogArc> &fst) {
+  return MakeBitfieldCompactFst(fst);
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_G2P_TEST_MODEL_H__
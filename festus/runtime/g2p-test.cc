@@ -0,0 +1,596 @@
+// festus/runtime/g2p-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the runtime G2P library.
+//
+// The test model is derived from the checked-in graphone language model (see
+// g2p-test-model.h); the language model is converted to an NGramFst, as done
+// by ngramfinalize --to_runtime_model.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p.h"
+
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <fst/extensions/ngram/ngram-fst.h>
+#include <gtest/gtest.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "dense-matcher.h"
+#include "g2p-test-model.h"
+#include "lookahead.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef festus::G2P<MyArc> MyG2P;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+
+const char kGraphoneModel[] =
+    "festus/runtime/ngram_model_with_final_backoff.fst";
+
+const char *const kWords[] = {
+  "aap", "boek", "skool", "kat", "hond", "ding", "water", "lekker", "nooit",
+  "meisie", "tjie", "skryf", "ek", "is", "jy", "ons", "hulle", "vrou", "man",
+  "kind", "sê", "môre", "ewe", "reën", "voël", "geweldig", "ongelooflik",
+};
+
+// Codepoint tape whose labels are shifted beyond the byte range, which
+// exercises lookahead relabeling of labels above 255.
+class ShiftedUnicodeInputLabeler : public festus::UnicodeInputLabeler {
+ public:
+  static constexpr Label kShift = 1000;
+
+  bool AppendLabels(const string &spelling, Labels *labels) const override {
+    const std::size_t begin = labels->size();
+    if (!UnicodeInputLabeler::AppendLabels(spelling, labels)) return false;
+    for (std::size_t i = begin; i < labels->size(); ++i) {
+      (*labels)[i] += kShift;
+    }
+    return true;
+  }
+};
+
+class G2PTest : public ::testing::Test {
+ protected:
+  static void SetUpTestCase() {
+    festus::G2PTestMachines machines;
+    ASSERT_TRUE(festus::MakeG2PTestMachines(kGraphoneModel, &machines));
+    const MyVectorFst &bytes_to_graphones = machines.bytes_to_graphones;
+    const MyVectorFst &phonemes_to_graphones = machines.phonemes_to_graphones;
+    const MyVectorFst &log_model = machines.graphone_model;
+
+    auto compact_bytes_to_graphones =
+        festus::CompactG2PTestMachine(bytes_to_graphones);
+    std::unique_ptr<const MyG2P::Lattice> ngram_model(
+        new fst::NGramFst<MyArc>(log_model));
+    MyVectorFst composed_model;
+    festus::ComposeGraphoneModel(*compact_bytes_to_graphones, *ngram_model,
+                                 0, &composed_model);
+
+    g2p_ = new MyG2P();
+    g2p_->SetBytesToGraphonesFst(std::move(compact_bytes_to_graphones));
+    g2p_->SetGraphoneModelFst(std::move(ngram_model));
+    g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+
+    composed_g2p_ = new MyG2P();
+    composed_g2p_->SetComposedModelFst(std::unique_ptr<const MyG2P::Lattice>(
+        new fst::ConstFst<MyArc>(composed_model)));
+    composed_g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+
+    lookahead_g2p_ = new MyG2P();
+    lookahead_g2p_->SetBytesToGraphonesFst(
+        std::unique_ptr<const MyG2P::Lattice>(
+            new festus::ILabelLookAheadFst<MyArc>(bytes_to_graphones)));
+    lookahead_g2p_->SetGraphoneModelFst(std::unique_ptr<const MyG2P::Lattice>(
+        new fst::NGramFst<MyArc>(log_model)));
+    lookahead_g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+
+    lookahead_composed_g2p_ = new MyG2P();
+    lookahead_composed_g2p_->SetComposedModelFst(
+        std::unique_ptr<const MyG2P::Lattice>(
+            new festus::ILabelLookAheadFst<MyArc>(composed_model)));
+    lookahead_composed_g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+
+    dense_g2p_ = new MyG2P();
+    dense_g2p_->SetBytesToGraphonesFst(std::unique_ptr<const MyG2P::Lattice>(
+        new festus::DenseByteFst<MyArc>(bytes_to_graphones)));
+    dense_g2p_->SetGraphoneModelFst(std::unique_ptr<const MyG2P::Lattice>(
+        new fst::NGramFst<MyArc>(log_model)));
+    dense_g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+
+    festus::G2PTestMachines unicode_machines;
+    festus::UnicodeInputLabeler unicode_labeler;
+    ASSERT_TRUE(festus::MakeG2PTestMachines(kGraphoneModel, &unicode_machines,
+                                            &unicode_labeler));
+    unicode_g2p_ = new MyG2P();
+    unicode_g2p_->SetInputLabeler(std::unique_ptr<const festus::InputLabeler>(
+        new festus::UnicodeInputLabeler()));
+    unicode_g2p_->SetBytesToGraphonesFst(
+        festus::CompactG2PTestMachine(unicode_machines.bytes_to_graphones));
+    unicode_g2p_->SetGraphoneModelFst(std::unique_ptr<const MyG2P::Lattice>(
+        new fst::NGramFst<MyArc>(log_model)));
+    unicode_g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+
+    festus::G2PTestMachines shifted_machines;
+    ShiftedUnicodeInputLabeler shifted_labeler;
+    ASSERT_TRUE(festus::MakeG2PTestMachines(kGraphoneModel, &shifted_machines,
+                                            &shifted_labeler));
+    lookahead_shifted_g2p_ = new MyG2P();
+    lookahead_shifted_g2p_->SetBytesToGraphonesFst(
+        std::unique_ptr<const MyG2P::Lattice>(
+            new festus::ILabelLookAheadFst<MyArc>(
+                shifted_machines.bytes_to_graphones)));
+    lookahead_shifted_g2p_->SetGraphoneModelFst(
+        std::unique_ptr<const MyG2P::Lattice>(
+            new fst::NGramFst<MyArc>(log_model)));
+    lookahead_shifted_g2p_->SetPhonemesToGraphonesFst(
+        festus::CompactG2PTestMachine(phonemes_to_graphones));
+    // The labeler is set last, to check that the relabeling does not depend
+    // on the order of the setters.
+    lookahead_shifted_g2p_->SetInputLabeler(
+        std::unique_ptr<const festus::InputLabeler>(
+            new ShiftedUnicodeInputLabeler()));
+  }
+
+  static void TearDownTestCase() {
+    delete g2p_;
+    g2p_ = nullptr;
+    delete composed_g2p_;
+    composed_g2p_ = nullptr;
+    delete lookahead_g2p_;
+    lookahead_g2p_ = nullptr;
+    delete lookahead_composed_g2p_;
+    lookahead_composed_g2p_ = nullptr;
+    delete dense_g2p_;
+    dense_g2p_ = nullptr;
+    delete unicode_g2p_;
+    unicode_g2p_ = nullptr;
+    delete lookahead_shifted_g2p_;
+    lookahead_shifted_g2p_ = nullptr;
+  }
+
+  // Checks that the given model gives the same results as g2p_.
+  static void ExpectSameResults(const MyG2P &g2p) {
+    festus::G2PWorkspace<MyArc> workspace;
+    festus::G2PResult expected, result;
+    for (const char *word : kWords) {
+      ASSERT_TRUE(g2p_->Pronounce(word, &expected));
+      ASSERT_TRUE(g2p.Pronounce(word, &result, festus::G2POptions(),
+                                &workspace))
+          << word << ": " << result.error;
+      EXPECT_EQ(expected.num_hypotheses, result.num_hypotheses) << word;
+      ASSERT_EQ(expected.pronunciations.size(), result.pronunciations.size())
+          << word;
+      for (std::size_t i = 0; i < result.pronunciations.size(); ++i) {
+        EXPECT_EQ(expected.pronunciations[i].first,
+                  result.pronunciations[i].first) << word;
+        EXPECT_NEAR(expected.pronunciations[i].second,
+                    result.pronunciations[i].second, 1e-4) << word;
+      }
+    }
+    EXPECT_FALSE(g2p.Pronounce("quiz", &result));
+  }
+
+  static MyG2P *g2p_;
+  static MyG2P *composed_g2p_;
+  static MyG2P *lookahead_g2p_;
+  static MyG2P *lookahead_composed_g2p_;
+  static MyG2P *dense_g2p_;
+  static MyG2P *unicode_g2p_;
+  static MyG2P *lookahead_shifted_g2p_;
+};
+
+MyG2P *G2PTest::g2p_ = nullptr;
+MyG2P *G2PTest::composed_g2p_ = nullptr;
+MyG2P *G2PTest::lookahead_g2p_ = nullptr;
+MyG2P *G2PTest::lookahead_composed_g2p_ = nullptr;
+MyG2P *G2PTest::dense_g2p_ = nullptr;
+MyG2P *G2PTest::unicode_g2p_ = nullptr;
+MyG2P *G2PTest::lookahead_shifted_g2p_ = nullptr;
+
+TEST_F(G2PTest, Pronounce) {
+  festus::G2PResult result;
+  for (const char *word : kWords) {
+    ASSERT_TRUE(g2p_->Pronounce(word, &result))
+        << word << ": " << result.error;
+    EXPECT_TRUE(result.error.empty());
+    EXPECT_GE(result.num_hypotheses, 1);
+    ASSERT_FALSE(result.pronunciations.empty()) << word;
+    EXPECT_LE(result.pronunciations.size(), festus::G2POptions().max_prons);
+    float total = 0;
+    for (const auto &pron : result.pronunciations) {
+      EXPECT_FALSE(pron.first.empty()) << word;
+      EXPECT_GT(pron.second, 0) << word;
+      total += pron.second;
+    }
+    EXPECT_LE(total, 1.001f) << word;
+  }
+}
+
+TEST_F(G2PTest, NoPronunciations) {
+  festus::G2PResult result;
+  festus::G2POptions options;
+  options.max_prons = 0;
+  EXPECT_TRUE(g2p_->Pronounce("aap", &result, options));
+  EXPECT_TRUE(result.pronunciations.empty());
+}
+
+TEST_F(G2PTest, OutOfAlphabet) {
+  festus::G2PResult result;
+  EXPECT_FALSE(g2p_->Pronounce("quiz", &result));
+  EXPECT_FALSE(result.error.empty());
+
+  // Control characters do not occur in any graphone, so spellings that
+  // contain them are rejected before composition.
+  festus::G2PResult expected;
+  festus::G2POptions options;
+  for (const MyG2P *g2p : {g2p_, composed_g2p_, lookahead_g2p_,
+                           lookahead_composed_g2p_, dense_g2p_, unicode_g2p_,
+                           lookahead_shifted_g2p_}) {
+    options.skip_out_of_alphabet = false;
+    EXPECT_FALSE(g2p->Pronounce("ka\x01t", &result, options));
+    EXPECT_EQ("Spelling cannot be read by the model", result.error);
+
+    // Unless they are skipped.
+    options.skip_out_of_alphabet = true;
+    ASSERT_TRUE(g2p->Pronounce("kat", &expected, options));
+    ASSERT_TRUE(g2p->Pronounce("\x02ka\x01t\x02", &result, options))
+        << result.error;
+    EXPECT_EQ(expected.pronunciations, result.pronunciations);
+    options.mode = festus::G2POptions::VITERBI;
+    EXPECT_TRUE(g2p->Pronounce("ka\x01t", &result, options));
+    options.mode = festus::G2POptions::MARGINAL;
+  }
+}
+
+TEST_F(G2PTest, ReuseWorkspace) {
+  festus::G2PWorkspace<MyArc> workspace;
+  festus::G2PResult expected, result;
+  festus::G2POptions options;
+  for (int round = 0; round < 2; ++round) {
+    for (const char *word : kWords) {
+      ASSERT_TRUE(g2p_->Pronounce(word, &expected, options));
+      ASSERT_TRUE(g2p_->Pronounce(word, &result, options, &workspace));
+      EXPECT_EQ(expected.pronunciations, result.pronunciations) << word;
+      EXPECT_EQ(expected.num_hypotheses, result.num_hypotheses) << word;
+    }
+    // A failed lookup must not affect subsequent lookups.
+    EXPECT_FALSE(g2p_->Pronounce("quiz", &result, options, &workspace));
+    options.max_prons = 1;
+  }
+}
+
+// The precomposed model must give the same results as the separate machines.
+TEST_F(G2PTest, ComposedModel) {
+  ExpectSameResults(*composed_g2p_);
+}
+
+// Lookahead composition must not change the results either.
+TEST_F(G2PTest, LookAhead) {
+  ExpectSameResults(*lookahead_g2p_);
+  ExpectSameResults(*lookahead_composed_g2p_);
+}
+
+// So must the dense byte matcher.
+TEST_F(G2PTest, DenseByteMatcher) {
+  ExpectSameResults(*dense_g2p_);
+}
+
+// Models over Unicode codepoints have the same graphones as byte models, and
+// therefore give the same results, with and without lookahead.
+TEST_F(G2PTest, UnicodeInputTape) {
+  ExpectSameResults(*unicode_g2p_);
+  ExpectSameResults(*lookahead_shifted_g2p_);
+
+  // Spellings that are not valid UTF-8 cannot be pronounced.
+  festus::G2PResult result;
+  EXPECT_FALSE(unicode_g2p_->Pronounce("s\xC3", &result));
+  EXPECT_EQ("Could not convert spelling to input labels", result.error);
+  festus::G2PLattice<MyArc> lattice;
+  EXPECT_FALSE(lookahead_shifted_g2p_->PronounceLattice("\xFFkat", &lattice));
+  EXPECT_EQ("Could not convert spelling to input labels", lattice.error);
+}
+
+// Pronouncing a batch must give the same results as pronouncing each word.
+TEST_F(G2PTest, PronounceBatch) {
+  std::vector<string> words(std::begin(kWords), std::end(kWords));
+  // Words with shared prefixes, duplicates, and words that fail.
+  for (const char *word : {"kat", "katte", "katjie", "ka", "quiz", "kat", "",
+                           "s\xC3"}) {
+    words.push_back(word);
+  }
+  for (const MyG2P *g2p : {g2p_, composed_g2p_, lookahead_g2p_,
+                           lookahead_composed_g2p_, dense_g2p_, unicode_g2p_,
+                           lookahead_shifted_g2p_}) {
+    festus::G2PWorkspace<MyArc> workspace;
+    std::vector<festus::G2PResult> results;
+    for (int round = 0; round < 2; ++round) {
+      festus::G2POptions options;
+      options.max_prons = round == 0 ? 3 : 1;
+      std::size_t num_successes = 0;
+      std::vector<festus::G2PResult> expected(words.size());
+      for (std::size_t w = 0; w < words.size(); ++w) {
+        if (g2p_->Pronounce(words[w], &expected[w], options)) ++num_successes;
+      }
+      ASSERT_EQ(num_successes,
+                g2p->PronounceBatch(words, &results, options, &workspace));
+      ASSERT_EQ(words.size(), results.size());
+      for (std::size_t w = 0; w < words.size(); ++w) {
+        const festus::G2PResult &result = results[w];
+        ASSERT_EQ(expected[w].error.empty(), result.error.empty()) << words[w];
+        if (!result.error.empty()) continue;
+        EXPECT_EQ(expected[w].num_hypotheses, result.num_hypotheses)
+            << words[w];
+        ASSERT_EQ(expected[w].pronunciations.size(),
+                  result.pronunciations.size()) << words[w];
+        for (std::size_t i = 0; i < result.pronunciations.size(); ++i) {
+          EXPECT_EQ(expected[w].pronunciations[i].first,
+                    result.pronunciations[i].first) << words[w];
+          EXPECT_NEAR(expected[w].pronunciations[i].second,
+                      result.pronunciations[i].second, 1e-4) << words[w];
+        }
+      }
+    }
+  }
+}
+
+TEST_F(G2PTest, Beam) {
+  festus::G2PWorkspace<MyArc> workspace;
+  festus::G2PResult expected, result;
+  festus::G2POptions wide, narrow;
+  // A beam this wide does not prune anything, but exercises the beam search.
+  wide.beam = 1000;
+  narrow.beam = 2;
+  narrow.max_active_states = 4;
+  for (const char *word : kWords) {
+    ASSERT_TRUE(g2p_->Pronounce(word, &expected));
+    ASSERT_TRUE(g2p_->Pronounce(word, &result, wide, &workspace))
+        << word << ": " << result.error;
+    EXPECT_EQ(expected.num_hypotheses, result.num_hypotheses) << word;
+    ASSERT_EQ(expected.pronunciations.size(), result.pronunciations.size())
+        << word;
+    for (std::size_t i = 0; i < result.pronunciations.size(); ++i) {
+      EXPECT_EQ(expected.pronunciations[i].first,
+                result.pronunciations[i].first) << word;
+      EXPECT_NEAR(expected.pronunciations[i].second,
+                  result.pronunciations[i].second, 1e-4) << word;
+    }
+
+    ASSERT_TRUE(g2p_->Pronounce(word, &result, narrow, &workspace))
+        << word << ": " << result.error;
+    ASSERT_FALSE(result.pronunciations.empty()) << word;
+    EXPECT_LE(result.num_hypotheses, expected.num_hypotheses) << word;
+
+    ASSERT_TRUE(composed_g2p_->Pronounce(word, &result, narrow))
+        << word << ": " << result.error;
+    ASSERT_FALSE(result.pronunciations.empty()) << word;
+  }
+  EXPECT_FALSE(g2p_->Pronounce("quiz", &result, narrow, &workspace));
+}
+
+// Returns the pronunciations spelled by the paths of a posterior lattice,
+// with their probabilities.
+std::map<string, float> LatticePronunciations(const fst::Fst<MyArc> &lattice) {
+  fst::StdVectorFst std_lattice, paths;
+  festus::ConvertWeight(lattice, &std_lattice);
+  fst::ShortestPath(std_lattice, &paths, 1000);
+  std::vector<std::pair<string, float>> prons;
+  festus::ShortestPathsToVector(
+      paths, festus::SymbolStringPool(*lattice.OutputSymbols()), &prons);
+  std::map<string, float> probs;
+  for (const auto &pron : prons) {
+    probs[pron.first] += std::exp(-pron.second);
+  }
+  return probs;
+}
+
+std::map<string, float> ResultPronunciations(const festus::G2PResult &result) {
+  return std::map<string, float>(result.pronunciations.begin(),
+                                 result.pronunciations.end());
+}
+
+void ExpectNearProbs(const std::map<string, float> &expected,
+                     const std::map<string, float> &actual,
+                     const string &word) {
+  ASSERT_EQ(expected.size(), actual.size()) << word;
+  for (const auto &pron : expected) {
+    auto iter = actual.find(pron.first);
+    ASSERT_TRUE(iter != actual.end()) << word << ": " << pron.first;
+    EXPECT_NEAR(pron.second, iter->second, 1e-4) << word << ": " << pron.first;
+  }
+}
+
+TEST_F(G2PTest, LazyDeterminization) {
+  festus::G2PWorkspace<MyArc> workspace;
+  festus::G2PResult expected, result;
+  festus::G2POptions lazy, capped, starved;
+  lazy.max_determinized_states = 1000000;
+  capped.max_determinized_states = 2;
+  starved.max_determinized_states = 1;
+  for (const char *word : kWords) {
+    ASSERT_TRUE(g2p_->Pronounce(word, &expected));
+    ASSERT_TRUE(g2p_->Pronounce(word, &result, lazy, &workspace))
+        << word << ": " << result.error;
+    EXPECT_LE(result.num_hypotheses, expected.num_hypotheses) << word;
+    EXPECT_GE(result.num_hypotheses, result.pronunciations.size()) << word;
+    ExpectNearProbs(ResultPronunciations(expected),
+                    ResultPronunciations(result), word);
+    for (std::size_t i = 1; i < result.pronunciations.size(); ++i) {
+      EXPECT_GE(result.pronunciations[i - 1].second,
+                result.pronunciations[i].second) << word;
+    }
+
+    ASSERT_TRUE(composed_g2p_->Pronounce(word, &result, capped, &workspace))
+        << word << ": " << result.error;
+    ASSERT_FALSE(result.pronunciations.empty()) << word;
+    EXPECT_LE(result.pronunciations.size(), expected.pronunciations.size())
+        << word;
+
+    // A single state does not reach any pronunciation of a nonempty word, so
+    // the lattice is determinized in full instead.
+    ASSERT_TRUE(g2p_->Pronounce(word, &result, starved, &workspace))
+        << word << ": " << result.error;
+    EXPECT_EQ(expected.num_hypotheses, result.num_hypotheses) << word;
+    ExpectNearProbs(ResultPronunciations(expected),
+                    ResultPronunciations(result), word);
+  }
+}
+
+// The posterior lattice assigns the same probabilities to pronunciations as
+// Pronounce(), and they sum to one.
+TEST_F(G2PTest, PosteriorLattice) {
+  festus::G2PWorkspace<MyArc> workspace;
+  festus::G2POptions all;
+  all.max_prons = 1000;
+  all.real_pruning_threshold = 0;
+  festus::G2PResult result;
+  festus::G2PLattice<MyArc> lattice;
+  for (const MyG2P *g2p : {g2p_, composed_g2p_}) {
+    for (const char *word : kWords) {
+      ASSERT_TRUE(g2p->Pronounce(word, &result, all));
+      ASSERT_TRUE(g2p->PronounceLattice(word, &lattice,
+                                        festus::G2PLatticeOptions(),
+                                        festus::G2POptions(), &workspace))
+          << word << ": " << lattice.error;
+      ASSERT_TRUE(lattice.fst != nullptr);
+      EXPECT_TRUE(lattice.error.empty());
+      EXPECT_TRUE(lattice.fst->Properties(fst::kIDeterministic, true));
+      EXPECT_NEAR(0, fst::ShortestDistance(*lattice.fst).Value(), 1e-4)
+          << word;
+      ExpectNearProbs(ResultPronunciations(result),
+                      LatticePronunciations(*lattice.fst), word);
+    }
+  }
+  EXPECT_FALSE(g2p_->PronounceLattice("quiz", &lattice));
+  EXPECT_FALSE(lattice.error.empty());
+  EXPECT_TRUE(lattice.fst == nullptr);
+}
+
+// Pruning the lattice keeps (at least) the pronunciations that Pronounce()
+// keeps with the same threshold, with unchanged probabilities.
+TEST_F(G2PTest, PrunedCompactPosteriorLattice) {
+  festus::G2POptions pruned;
+  pruned.max_prons = 1000;
+  pruned.real_pruning_threshold = 0.1f;
+  festus::G2PLatticeOptions lattice_opts;
+  lattice_opts.pruning_threshold = pruned.real_pruning_threshold;
+  lattice_opts.compact = true;
+  festus::G2PResult result;
+  festus::G2PLattice<MyArc> lattice;
+  for (const char *word : kWords) {
+    ASSERT_TRUE(g2p_->Pronounce(word, &result, pruned));
+    ASSERT_TRUE(g2p_->PronounceLattice(word, &lattice, lattice_opts))
+        << word << ": " << lattice.error;
+    EXPECT_TRUE(dynamic_cast<const festus::G2PLattice<MyArc>::CompactFst *>(
+        lattice.fst.get()) != nullptr);
+    const auto probs = LatticePronunciations(*lattice.fst);
+    for (const auto &pron : result.pronunciations) {
+      auto iter = probs.find(pron.first);
+      ASSERT_TRUE(iter != probs.end()) << word << ": " << pron.first;
+      EXPECT_NEAR(pron.second, iter->second, 1e-4) << word;
+    }
+    ASSERT_TRUE(g2p_->PronounceLattice(word, &lattice));
+    EXPECT_LE(probs.size(), LatticePronunciations(*lattice.fst).size());
+  }
+}
+
+TEST_F(G2PTest, Viterbi) {
+  festus::G2POptions viterbi;
+  viterbi.mode = festus::G2POptions::VITERBI;
+  festus::G2POptions marginal;
+  marginal.max_prons = 100;
+  marginal.real_pruning_threshold = 0;
+  festus::G2PWorkspace<MyArc> workspace;
+  festus::G2PResult expected, result;
+  for (const char *word : kWords) {
+    ASSERT_TRUE(g2p_->Pronounce(word, &result, viterbi, &workspace))
+        << word << ": " << result.error;
+    ASSERT_EQ(1, result.pronunciations.size()) << word;
+    EXPECT_EQ(1, result.num_hypotheses) << word;
+    EXPECT_GT(result.pronunciations[0].second, 0) << word;
+    EXPECT_LE(result.pronunciations[0].second, 1) << word;
+    // The Viterbi pronunciation must be among the marginal ones.
+    ASSERT_TRUE(g2p_->Pronounce(word, &expected, marginal, &workspace));
+    bool found = false;
+    for (const auto &pron : expected.pronunciations) {
+      found |= pron.first == result.pronunciations[0].first;
+    }
+    EXPECT_TRUE(found) << word;
+
+    festus::G2PResult composed_result;
+    ASSERT_TRUE(composed_g2p_->Pronounce(word, &composed_result, viterbi));
+    EXPECT_EQ(result.pronunciations[0].first,
+              composed_result.pronunciations[0].first) << word;
+  }
+  EXPECT_FALSE(g2p_->Pronounce("quiz", &result, viterbi, &workspace));
+}
+
+// Stress test for concurrent calls to Pronounce() on a shared model.
+TEST_F(G2PTest, ConcurrentPronounce) {
+  static constexpr int kNumThreads = 8;
+  static constexpr int kNumRounds = 20;
+  static const std::size_t kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+
+  std::vector<festus::G2PResult> expected(kNumWords);
+  for (std::size_t i = 0; i < kNumWords; ++i) {
+    ASSERT_TRUE(g2p_->Pronounce(kWords[i], &expected[i]));
+  }
+
+  std::vector<int> mismatches(kNumThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([t, &expected, &mismatches]() {
+      festus::G2PResult result;
+      for (int round = 0; round < kNumRounds; ++round) {
+        // Each thread visits the words in a different order.
+        for (std::size_t j = 0; j < kNumWords; ++j) {
+          std::size_t i = (j + t * 7 + round) % kNumWords;
+          if (!g2p_->Pronounce(kWords[i], &result) ||
+              result.pronunciations != expected[i].pronunciations ||
+              result.num_hypotheses != expected[i].num_hypotheses) {
+            ++mismatches[t];
+          }
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t < kNumThreads; ++t) {
+    EXPECT_EQ(0, mismatches[t]) << "in thread " << t;
+  }
+}
+
+}  // namespace
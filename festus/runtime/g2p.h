@@ -21,9 +21,13 @@
 #ifndef FESTUS_RUNTIME_G2P_H__
 #define FESTUS_RUNTIME_G2P_H__
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstddef>
+#include <limits>
 #include <memory>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -31,16 +35,24 @@
 #include <fst/fstlib.h>
 
 // NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "dense-matcher.h"
 #include "fst-util.h"
+#include "g2p-stats.h"
+#include "input-alphabet.h"
+#include "input-labeler.h"
+#include "lookahead.h"
 
 namespace festus {
 
 struct G2PResult {
   // A list of pronunciations and their associated posterior probabilities,
-  // in descending order.
+  // in descending order. Pronounce() renders pronunciations into the existing
+  // strings, so reusing a result across calls avoids allocating them anew.
   std::vector<std::pair<string, float>> pronunciations;
 
   // The number of viable hypotheses in the marginal posterior distribution.
+  // This is only a lower bound if G2POptions::max_determinized_states is
+  // set and decoding stopped before it explored all hypotheses.
   double num_hypotheses;
 
   // A diagnostic message that is set if G2P<>::Pronounce() failed.
@@ -68,6 +80,183 @@ struct G2POptions {
 
   // Convergence parameter for FST operations.
   float delta = fst::kDelta;
+
+  // Beam for pruning the rescored graphone lattice while it is being built,
+  // in units of negative natural log probability.
+  //
+  // A partial graphone hypothesis is discarded if its best forward score is
+  // worse than that of the best hypothesis covering the same prefix of the
+  // spelling by more than the beam. Unlike real_pruning_threshold, which only
+  // applies to the final decoding step, this bounds the size of the lattices
+  // built by Pronounce(), at the risk of search errors. Infinity disables it.
+  float beam = std::numeric_limits<float>::infinity();
+
+  // If nonzero, at most (approximately) this many partial graphone hypotheses
+  // are kept per prefix of the spelling, in addition to the beam.
+  std::size_t max_active_states = 0;
+
+  // Spellings that the model cannot read, e.g. because they contain a
+  // character that does not occur in any graphone, are rejected before any
+  // lattice is built, in time linear in their length. If this is true,
+  // labels that do not occur in the input alphabet of the model at all (such
+  // as punctuation or characters of another script) are removed from the
+  // spelling instead, and the rest of it is pronounced.
+  bool skip_out_of_alphabet = false;
+
+  // If nonzero, pronunciations are decoded by a best-first search that
+  // determinizes the phoneme lattice on demand, instead of determinizing it
+  // in full, and that expands at most this many determinized states. The
+  // search stops as soon as max_prons pronunciations (or all pronunciations
+  // within real_pruning_threshold) have been found, so that only the parts
+  // of the lattice that lead to the best pronunciations are determinized.
+  // The pronunciations and their probabilities are the same as otherwise,
+  // unless the limit is reached, in which case fewer may be returned; in
+  // either case num_hypotheses is only a lower bound. Lattices with negative
+  // weights, for which the search is not exact, and lattices in which the
+  // limit is reached before any pronunciation is found are decoded in full.
+  std::size_t max_determinized_states = 0;
+
+  enum Mode {
+    // Computes the marginal posterior distribution over pronunciations by
+    // summing over all graphone paths that yield the same pronunciation.
+    MARGINAL,
+
+    // Viterbi approximation: finds the single best graphone path in the
+    // tropical semiring, directly over the lazily composed model, and returns
+    // its pronunciation. This skips epsilon removal, normalization, and
+    // determinization of the phoneme lattice, which makes it much faster for
+    // long words. At most one pronunciation is returned, regardless of
+    // max_prons. Its probability is the joint probability of the spelling and
+    // the best graphone path (not a posterior), and num_hypotheses is 1.
+    VITERBI,
+  };
+
+  Mode mode = MARGINAL;
+};
+
+struct G2PLatticeOptions {
+  // Threshold for pruning the posterior lattice, in [0;1] like
+  // G2POptions::real_pruning_threshold: if the probability of the best path is
+  // p and the threshold is theta, arcs and states that do not lie on any path
+  // with probability at least p * theta are removed. Zero disables pruning.
+  float pruning_threshold = 0;
+
+  // If true, the lattice is stored as a CompactFst with one compact element
+  // per arc, which is smaller and cheaper to copy than a VectorFst.
+  bool compact = false;
+};
+
+// The posterior distribution over the pronunciations of a word, as computed by
+// G2P<>::PronounceLattice().
+template <class Arc>
+struct G2PLattice {
+  typedef fst::CompactFst<Arc, fst::AcceptorCompactor<Arc>> CompactFst;
+
+  // An acceptor over phoneme labels, with the phoneme symbols of the model
+  // attached. Each path spells a pronunciation and its weight is the negative
+  // log posterior probability of that pronunciation, so the weights of all
+  // paths sum to One(). The weights are pushed towards the initial state, so
+  // the arcs leaving each state (together with its final weight) sum to
+  // One() as well, unless the lattice was pruned.
+  //
+  // When the model is insertion-free (as all models built with festus are),
+  // the lattice is deterministic and acyclic, and each pronunciation is
+  // spelled by exactly one path. Otherwise it may be cyclic and spell a
+  // pronunciation along several paths whose weights sum to its posterior.
+  //
+  // This is a VectorFst<Arc>, or a CompactFst as above if
+  // G2PLatticeOptions::compact was set.
+  std::unique_ptr<const fst::Fst<Arc>> fst;
+
+  // A diagnostic message that is set if G2P<>::PronounceLattice() failed.
+  string error;
+};
+
+// Returns a fresh identifier for a G2P model; see G2PWorkspace.
+inline uint64 NextG2PModelId() {
+  static std::atomic<uint64> next_id(1);
+  return next_id++;
+}
+
+template <class Arc>
+class G2P;
+
+// Buffers for G2P<>::PronounceBatch(), which are kept in a G2PWorkspace.
+template <class Arc>
+struct G2PBatchBuffers {
+  typedef typename Arc::Label Label;
+  typedef typename Arc::StateId StateId;
+
+  std::vector<Label> labels;         // Input labels of all spellings,
+  std::vector<std::size_t> offsets;  // starting at these offsets.
+  std::vector<std::size_t> order;    // Spellings in lexicographic order.
+  std::vector<StateId> path;         // Trie states along the last spelling.
+  fst::VectorFst<Arc> trie;
+
+  // Maps states of the shared lazy lattice to states of the lattice of the
+  // current spelling; kNoStateId for states not visited yet.
+  std::vector<StateId> state_map;
+  std::vector<StateId> visited;
+  std::vector<std::pair<StateId, std::size_t>> queue;
+};
+
+// Scratch space for G2P<>::Pronounce(), which can be reused across calls to
+// avoid allocating fresh lattices for every word. The lattices keep their
+// state and arc storage (drawn from memory pools) between calls, and the
+// workspace holds private copies of the model FSTs, which are made on first
+// use and again whenever the model changes. The copies share the data of the
+// model, so the workspace keeps that data alive until it is used with another
+// model, even if the G2P object itself is destroyed.
+//
+// A workspace must not be used by more than one thread at a time. Typically
+// each thread that calls Pronounce() owns its own workspace.
+template <class Arc>
+class G2PWorkspace {
+ public:
+  G2PWorkspace() = default;
+  ~G2PWorkspace() = default;
+
+  // Makes Pronounce() record the time and lattice size of each of its stages
+  // into *stats (if not null) when using this workspace. Does not take
+  // ownership.
+  void SetStats(G2PStats *stats) { stats_ = stats; }
+
+ private:
+  friend class G2P<Arc>;
+
+  template <class A>
+  using ScratchFst =
+      fst::VectorFst<A, fst::VectorState<A, fst::PoolAllocator<A>>>;
+
+  // Identifies the model from which the FST copies below were made.
+  uint64 model_id_ = 0;
+  std::unique_ptr<const fst::Fst<Arc>> bytes_to_graphones_;
+  std::unique_ptr<const fst::Fst<Arc>> graphone_model_;
+  std::unique_ptr<const fst::Fst<Arc>> composed_model_;
+  std::unique_ptr<const fst::Fst<Arc>> phonemes_to_graphones_;
+
+  // Input labels of the spelling FST, when these are not simply its bytes.
+  std::vector<typename Arc::Label> spelling_labels_;
+
+  // Output labels of the best graphone path in G2POptions::VITERBI mode.
+  std::vector<typename Arc::Label> graphone_labels_;
+
+  BeamSearchBuffers<typename Arc::StateId> beam_buffers_;
+  ConnectBuffers<Arc> connect_buffers_;
+  AcyclicPathsBuffers<typename Arc::StateId> paths_buffers_;
+  LazyShortestPathsBuffers<Arc> lazy_paths_buffers_;
+  G2PBatchBuffers<Arc> batch_buffers_;
+
+  ScratchFst<Arc> lattice_;
+  ScratchFst<Arc> lattice2_;
+  ScratchFst<fst::StdArc> std_lattice_;
+  ScratchFst<fst::StdArc> paths_;
+
+  G2PStats *stats_ = nullptr;
+  G2PStageRecorder recorder_;
+
+  G2PWorkspace(const G2PWorkspace &) = delete;
+  G2PWorkspace &operator=(const G2PWorkspace &) = delete;
 };
 
 template <class Arc>
@@ -85,6 +274,33 @@ class G2P {
   void SetGraphoneModelFst(std::unique_ptr<const Lattice> fst);
   void SetPhonemesToGraphonesFst(std::unique_ptr<const Lattice> fst);
 
+  // The bytes_to_graphones FST may be an ILabelLookAheadFst (as written by
+  // make-runtime-fsts --lookahead), in which case the first composition is
+  // performed with lookahead. It may also be a DenseByteFst (as written by
+  // make-runtime-fsts --dense_matcher), which finds the arcs for each byte of
+  // the spelling in constant time. The same applies to the composed model
+  // below.
+  //
+  // Sets a machine that maps bytes to graphones weighted by the graphone
+  // model, as produced by ComposeGraphoneModel() or compose-runtime-model.
+  // If set, it is used instead of the separate bytes_to_graphones and
+  // graphone_model FSTs, which then need not be set, and Pronounce() performs
+  // a single composition instead of two.
+  void SetComposedModelFst(std::unique_ptr<const Lattice> fst);
+
+  // Sets the conversion of spellings into the input labels of the model,
+  // which must match the input_label_type of the alignables spec that the
+  // model was trained from. By default, each byte of a spelling is an input
+  // label. Models over Unicode codepoints or symbols (as written by
+  // make-runtime-fsts for such specs) need a UnicodeInputLabeler or a
+  // SymbolInputLabeler, respectively. Spellings that the labeler rejects
+  // cannot be pronounced. Since a DenseByteFst only indexes labels below
+  // 256, it should not be used with codepoint or symbol tapes.
+  void SetInputLabeler(std::unique_ptr<const InputLabeler> labeler) {
+    input_labeler_ = std::move(labeler);
+    model_id_ = NextG2PModelId();
+  }
+
   // Finds pronunciations for the given spelling and configured G2P model.
   //
   // Aguments:
@@ -98,37 +314,262 @@ class G2P {
   // On success, result->pronunciations contains pronunciations and their
   // corresponding posterior probabilities under the model. At most
   // opts.max_prons pronunciations are computed.
+  //
+  // Intermediate results are kept in the given workspace, which is set up
+  // for this model on first use and then reused by later calls. Callers that
+  // pronounce many words should keep one workspace per thread.
+  //
+  // Once the model has been set up, Pronounce() may be called concurrently
+  // from multiple threads on the same G2P instance, provided that each thread
+  // passes its own workspace. The setters above must not be called while
+  // Pronounce() is running.
   bool Pronounce(const string &spelling,
                  G2PResult *result,
-                 const G2POptions &opts = G2POptions()) const;
+                 const G2POptions &opts,
+                 G2PWorkspace<Arc> *workspace) const;
+
+  // Same as above, but with a temporary workspace.
+  //
+  // NB: This is much slower than the overload above when called repeatedly.
+  // Every call sets up a fresh G2PWorkspace, which copies each model FST and
+  // allocates new memory pools and buffers, only to discard them afterwards.
+  // Use it for one-off lookups only; to pronounce more than a handful of
+  // words, keep a G2PWorkspace and call the overload above.
+  bool Pronounce(const string &spelling,
+                 G2PResult *result,
+                 const G2POptions &opts = G2POptions()) const {
+    G2PWorkspace<Arc> workspace;
+    return Pronounce(spelling, result, opts, &workspace);
+  }
+
+  // Computes the posterior distribution over pronunciations of the given
+  // spelling as a lattice (see G2PLattice), for consumers that want to
+  // compose with it rather than parse pronunciation strings. The lattice is
+  // built in the same way as by Pronounce(), which reads the most likely
+  // pronunciations off the same lattice. G2POptions::max_prons,
+  // real_pruning_threshold, and mode have no effect here.
+  //
+  // Returns true on success. Returns false on error and sets result->error.
+  bool PronounceLattice(const string &spelling,
+                        G2PLattice<Arc> *result,
+                        const G2PLatticeOptions &lattice_opts,
+                        const G2POptions &opts,
+                        G2PWorkspace<Arc> *workspace) const;
+
+  // Same as above, but with a temporary workspace. Like the corresponding
+  // overload of Pronounce(), this sets up a fresh G2PWorkspace, including
+  // copies of the model FSTs, on every call; keep a workspace and use the
+  // overload above to compute lattices for more than a handful of words.
+  bool PronounceLattice(const string &spelling,
+                        G2PLattice<Arc> *result,
+                        const G2PLatticeOptions &lattice_opts =
+                            G2PLatticeOptions(),
+                        const G2POptions &opts = G2POptions()) const {
+    G2PWorkspace<Arc> workspace;
+    return PronounceLattice(spelling, result, lattice_opts, opts, &workspace);
+  }
+
+  // Pronounces a batch of spellings, and stores the result for spellings[i]
+  // in (*results)[i]. Returns the number of spellings that were pronounced
+  // successfully; for the others, Pronounce() would have returned false, and
+  // the error is set in their results.
+  //
+  // The results are the same as those of Pronounce(), but are computed
+  // together: the spellings are arranged in a trie, which is composed with
+  // the model lazily, so that the states reached by a prefix shared among
+  // several spellings are only expanded once. The lattice of each spelling is
+  // then read off the shared composition at its leaf of the trie. This pays
+  // off for lists of related word forms (say, all inflections of a lemma),
+  // but holds the composition of the whole batch in memory, so callers should
+  // bound the size of each batch.
+  //
+  // The options G2POptions::beam and max_active_states prune the lattice of
+  // each spelling on its own, and G2POptions::VITERBI searches the lazy
+  // composition of each spelling directly, so batches with either of these
+  // options are pronounced one spelling at a time.
+  std::size_t PronounceBatch(const std::vector<string> &spellings,
+                             std::vector<G2PResult> *results,
+                             const G2POptions &opts,
+                             G2PWorkspace<Arc> *workspace) const;
+
+  // Same as above, but with a temporary workspace. This sets up a fresh
+  // G2PWorkspace, including copies of the model FSTs, on every call; callers
+  // that pronounce many batches should keep a workspace and use the overload
+  // above.
+  std::size_t PronounceBatch(const std::vector<string> &spellings,
+                             std::vector<G2PResult> *results,
+                             const G2POptions &opts = G2POptions()) const {
+    G2PWorkspace<Arc> workspace;
+    return PronounceBatch(spellings, results, opts, &workspace);
+  }
+
+  // Identifies the current configuration of the model. Changes whenever one
+  // of the setters above is called, and differs between G2P instances.
+  uint64 ModelId() const { return model_id_; }
 
  private:
+  // Returns true if the epsilon-graph of the given FST, as defined by the
+  // arc filter, is acyclic.
+  template <class ArcFilter>
+  static bool IsInsertionFree(const Lattice &fst,
+                              uint64 no_epsilons_property,
+                              ArcFilter filter);
+
+  void SetUpWorkspace(G2PWorkspace<Arc> *workspace) const;
+
+  // True if the phoneme lattice built for any spelling is acyclic.
+  bool PhonemeLatticeIsAcyclic() const {
+    const bool graphones_insertion_free = composed_model_
+        ? composed_model_is_insertion_free_
+        : bytes_to_graphones_is_insertion_free_;
+    return graphones_insertion_free && phonemes_to_graphones_is_insertion_free_;
+  }
+
+  // The input alphabet of the machine that reads the spelling.
+  const InputAlphabet<Arc> &SpellingAlphabet() const {
+    return composed_model_ ? composed_model_alphabet_
+                           : bytes_to_graphones_alphabet_;
+  }
+
+  // Appends the input labels of the model for the given spelling to
+  // *labels, relabeled for lookahead composition where necessary. Returns
+  // false and sets *error if the input labeler rejects the spelling or the
+  // model cannot read it.
+  bool AppendSpellingLabels(const string &spelling,
+                            const G2POptions &opts,
+                            std::vector<typename Arc::Label> *labels,
+                            string *error) const;
+
+  // Step 1 of Pronounce(): turns the spelling into a string FST over the
+  // input labels of the model. Returns false and sets *error on failure.
+  bool MakeSpellingFst(const string &spelling,
+                       const G2POptions &opts,
+                       G2PWorkspace<Arc> *workspace,
+                       StringFst *spelling_fst,
+                       string *error) const;
+
+  // Steps 2-4 of Pronounce(): builds the epsilon-free phoneme lattice for the
+  // given spelling FST in workspace->lattice_. Returns false and sets *error
+  // on failure.
+  bool BuildPhonemeLattice(const StringFst &spelling_fst,
+                           const G2POptions &opts,
+                           G2PWorkspace<Arc> *workspace,
+                           string *error) const {
+    return BuildRescoredLattice(spelling_fst, opts, workspace, error) &&
+           ProjectPhonemeLattice(opts, workspace, error);
+  }
+
+  // Steps 2-3: builds the epsilon-free rescored graphone lattice for the given
+  // spelling FST in workspace->lattice2_.
+  bool BuildRescoredLattice(const StringFst &spelling_fst,
+                            const G2POptions &opts,
+                            G2PWorkspace<Arc> *workspace,
+                            string *error) const;
+
+  // Step 4: projects workspace->lattice2_ into the phoneme lattice
+  // workspace->lattice_.
+  bool ProjectPhonemeLattice(const G2POptions &opts,
+                             G2PWorkspace<Arc> *workspace,
+                             string *error) const;
+
+  // Steps 5-8 of Pronounce(): decodes the most likely pronunciations from the
+  // phoneme lattice in workspace->lattice_.
+  void DecodePronunciations(G2PResult *result,
+                            const G2POptions &opts,
+                            G2PWorkspace<Arc> *workspace) const;
+
+  // Steps 5-8 with G2POptions::max_determinized_states. Returns false if the
+  // lazy search does not apply to the phoneme lattice, in which case nothing
+  // was decoded.
+  bool DecodePronunciationsLazily(G2PResult *result,
+                                  const G2POptions &opts,
+                                  G2PWorkspace<Arc> *workspace) const;
+
+  // Implements PronounceBatch() given the lazy composition of the trie of the
+  // spellings (in workspace->batch_buffers_) with the model.
+  std::size_t PronounceTrie(const Lattice &graphones,
+                            std::vector<G2PResult> *results,
+                            const G2POptions &opts,
+                            G2PWorkspace<Arc> *workspace) const;
+
+  // Reads the rescored graphone lattice of the spelling with the given labels
+  // off the lazy composition of the trie with the model, and stores it in
+  // workspace->lattice2_, as in step 3 of Pronounce().
+  bool ExtractRescoredLattice(const Lattice &graphones,
+                              const typename Arc::Label *labels,
+                              std::size_t num_labels,
+                              const G2POptions &opts,
+                              G2PWorkspace<Arc> *workspace,
+                              string *error) const;
+
+  // Implements Pronounce() for G2POptions::VITERBI.
+  bool PronounceViterbi(const StringFst &spelling_fst,
+                        G2PResult *result,
+                        const G2POptions &opts,
+                        G2PWorkspace<Arc> *workspace) const;
+
+  uint64 model_id_ = 0;
   std::unique_ptr<const Lattice> bytes_to_graphones_;
   std::unique_ptr<const Lattice> graphone_model_;
+  std::unique_ptr<const Lattice> composed_model_;
   std::unique_ptr<const Lattice> phonemes_to_graphones_;
+
+  // Converts spellings into input labels; null for the byte tape.
+  std::unique_ptr<const InputLabeler> input_labeler_;
+
+  // For lookahead FSTs, maps input labels to the renumbered input labels of
+  // the FST (see LookAheadRelabel()); otherwise empty.
+  std::vector<typename Arc::Label> bytes_to_graphones_relabeling_;
+  std::vector<typename Arc::Label> composed_model_relabeling_;
+
+  // Summaries of the input language, for rejecting spellings early.
+  InputAlphabet<Arc> bytes_to_graphones_alphabet_;
+  InputAlphabet<Arc> composed_model_alphabet_;
+
+  // The phoneme symbols of phonemes_to_graphones, for rendering
+  // pronunciations without allocation.
+  SymbolStringPool phoneme_symbols_;
+
   bool bytes_to_graphones_is_insertion_free_ = false;
+  bool composed_model_is_insertion_free_ = false;
   bool phonemes_to_graphones_is_insertion_free_ = false;
 };
 
 template <class Arc>
 void G2P<Arc>::SetGraphoneModelFst(std::unique_ptr<const Lattice> fst) {
   graphone_model_ = std::move(fst);
+  model_id_ = NextG2PModelId();
+}
+
+template <class Arc>
+template <class ArcFilter>
+bool G2P<Arc>::IsInsertionFree(const Lattice &fst,
+                               uint64 no_epsilons_property,
+                               ArcFilter filter) {
+  if (fst.Properties(no_epsilons_property, true)) return true;
+  // Test for the presence of unanchored insertion loops by checking if the
+  // epsilon-graph has cycles.
+  bool acyclic = false;
+  std::vector<typename Arc::StateId> unused_order;
+  fst::TopOrderVisitor<Arc> top_order_visitor(&unused_order, &acyclic);
+  fst::DfsVisit(fst, &top_order_visitor, filter);
+  return acyclic;
 }
 
 template <class Arc>
 void G2P<Arc>::SetBytesToGraphonesFst(std::unique_ptr<const Lattice> fst) {
   bytes_to_graphones_ = std::move(fst);
-  if (bytes_to_graphones_->Properties(fst::kNoIEpsilons, true)) {
-    bytes_to_graphones_is_insertion_free_ = true;
-  } else {
-    // Test for the presence of unanchored insertion loops by checking if
-    // the epsilon-graph has cycles.
-    std::vector<typename Arc::StateId> unused_order;
-    fst::TopOrderVisitor<Arc> top_order_visitor(
-        &unused_order, &bytes_to_graphones_is_insertion_free_);
-    fst::DfsVisit(*bytes_to_graphones_, &top_order_visitor,
-                  fst::InputEpsilonArcFilter<Arc>());
+  model_id_ = NextG2PModelId();
+  if (GetLookAheadRelabeling(*bytes_to_graphones_, 255,
+                             &bytes_to_graphones_relabeling_)) {
+    VLOG(1) << "bytes_to_graphones is a lookahead FST";
+  } else if (bytes_to_graphones_->Type() == kDenseByteFstType) {
+    VLOG(1) << "bytes_to_graphones has a dense byte matcher";
   }
+  bytes_to_graphones_alphabet_ = InputAlphabet<Arc>(*bytes_to_graphones_);
+  bytes_to_graphones_is_insertion_free_ = IsInsertionFree(
+      *bytes_to_graphones_, fst::kNoIEpsilons,
+      fst::InputEpsilonArcFilter<Arc>());
   if (FLAGS_v >= 1) {
     LOG(INFO) << "bytes_to_graphones is"
               << (bytes_to_graphones_is_insertion_free_ ? " " : " NOT ")
@@ -139,17 +580,13 @@ void G2P<Arc>::SetBytesToGraphonesFst(std::unique_ptr<const Lattice> fst) {
 template <class Arc>
 void G2P<Arc>::SetPhonemesToGraphonesFst(std::unique_ptr<const Lattice> fst) {
   phonemes_to_graphones_ = std::move(fst);
-  if (phonemes_to_graphones_->Properties(fst::kNoOEpsilons, true)) {
-    phonemes_to_graphones_is_insertion_free_ = true;
-  } else {
-    // Test for the presence of unanchored insertion loops by checking if
-    // the epsilon-graph has cycles.
-    std::vector<typename Arc::StateId> unused_order;
-    fst::TopOrderVisitor<Arc> top_order_visitor(
-        &unused_order, &phonemes_to_graphones_is_insertion_free_);
-    fst::DfsVisit(*phonemes_to_graphones_, &top_order_visitor,
-                  fst::OutputEpsilonArcFilter<Arc>());
-  }
+  model_id_ = NextG2PModelId();
+  const fst::SymbolTable *symbols = phonemes_to_graphones_->InputSymbols();
+  CHECK(symbols != nullptr);
+  phoneme_symbols_ = SymbolStringPool(*symbols);
+  phonemes_to_graphones_is_insertion_free_ = IsInsertionFree(
+      *phonemes_to_graphones_, fst::kNoOEpsilons,
+      fst::OutputEpsilonArcFilter<Arc>());
   if (FLAGS_v >= 1) {
     LOG(INFO) << "phonemes_to_graphones is"
               << (phonemes_to_graphones_is_insertion_free_ ? " " : " NOT ")
@@ -157,12 +594,50 @@ void G2P<Arc>::SetPhonemesToGraphonesFst(std::unique_ptr<const Lattice> fst) {
   }
 }
 
+template <class Arc>
+void G2P<Arc>::SetComposedModelFst(std::unique_ptr<const Lattice> fst) {
+  composed_model_ = std::move(fst);
+  model_id_ = NextG2PModelId();
+  if (GetLookAheadRelabeling(*composed_model_, 255,
+                             &composed_model_relabeling_)) {
+    VLOG(1) << "composed_model is a lookahead FST";
+  } else if (composed_model_->Type() == kDenseByteFstType) {
+    VLOG(1) << "composed_model has a dense byte matcher";
+  }
+  composed_model_alphabet_ = InputAlphabet<Arc>(*composed_model_);
+  // The graphone model does not introduce any input epsilons, so the composed
+  // model inherits the insertion-freeness of bytes_to_graphones.
+  composed_model_is_insertion_free_ = IsInsertionFree(
+      *composed_model_, fst::kNoIEpsilons, fst::InputEpsilonArcFilter<Arc>());
+  if (FLAGS_v >= 1) {
+    LOG(INFO) << "composed_model is"
+              << (composed_model_is_insertion_free_ ? " " : " NOT ")
+              << "graphone-insertion-free";
+  }
+}
+
+template <class Arc>
+void G2P<Arc>::SetUpWorkspace(G2PWorkspace<Arc> *workspace) const {
+  if (workspace->model_id_ == model_id_) return;
+  // The model FSTs are not safe for concurrent use: CompactFst expands states
+  // into a cache on demand and NGramFst keeps per-instance iterator state.
+  // Thread-safe copies share the immutable model data but nothing else.
+  // Only the machines that are actually used are present.
+  auto copy = [](const std::unique_ptr<const Lattice> &fst) {
+    return fst ? fst->Copy(true) : nullptr;
+  };
+  workspace->bytes_to_graphones_.reset(copy(bytes_to_graphones_));
+  workspace->graphone_model_.reset(copy(graphone_model_));
+  workspace->composed_model_.reset(copy(composed_model_));
+  workspace->phonemes_to_graphones_.reset(copy(phonemes_to_graphones_));
+  workspace->model_id_ = model_id_;
+}
+
 template <class Arc>
 bool G2P<Arc>::Pronounce(const string &spelling,
                          G2PResult *result,
-                         const G2POptions &opts) const {
-  typedef typename Arc::Weight Weight;
-
+                         const G2POptions &opts,
+                         G2PWorkspace<Arc> *workspace) const {
   if (0 == opts.max_prons) {
     result->pronunciations.clear();
     result->num_hypotheses = 0;
@@ -170,99 +645,715 @@ bool G2P<Arc>::Pronounce(const string &spelling,
     return true;
   }
 
-  VLOG(2) << "1. Turn spelling string into FST.";
-  const unsigned char *begin =
-      reinterpret_cast<const unsigned char *>(spelling.data());
+  G2PStageScope stage_scope(&workspace->recorder_, workspace->stats_,
+                            spelling, &result->error);
+  SetUpWorkspace(workspace);
+
   StringFst spelling_fst;
-  spelling_fst.SetCompactElements(begin, begin + spelling.size());
-  VLOG_PROPERTIES(3, spelling_fst);
+  if (!MakeSpellingFst(spelling, opts, workspace, &spelling_fst,
+                       &result->error)) {
+    return false;
+  }
 
-  VLOG(2) << "2. Reverse-project (inject) spelling FST into graphone lattice.";
-  MutableLattice lattice;
-  ComposeProjectRmEpsilon(
-      spelling_fst, *bytes_to_graphones_, fst::PROJECT_OUTPUT, &lattice,
-      opts.delta, bytes_to_graphones_->Properties(fst::kNoIEpsilons, false));
-  if (fst::kNoStateId == lattice.Start()) {
-    result->error = "Could not create graphone lattice from spelling";
+  if (opts.mode == G2POptions::VITERBI) {
+    return PronounceViterbi(spelling_fst, result, opts, workspace);
+  }
+
+  if (!BuildPhonemeLattice(spelling_fst, opts, workspace, &result->error)) {
     return false;
   }
-  if (bytes_to_graphones_is_insertion_free_) {
-    // Since the spelling_fst is a string and therefore acyclic, and since the
-    // bytes_to_graphones FST is insertion-free, the resulting graphone lattice
-    // must be acyclic.
-    ExpectProperties(lattice, fst::kAcyclic);
+  DecodePronunciations(result, opts, workspace);
+  result->error.clear();
+  return true;
+}
+
+template <class Arc>
+void G2P<Arc>::DecodePronunciations(G2PResult *result,
+                                    const G2POptions &opts,
+                                    G2PWorkspace<Arc> *workspace) const {
+  typedef typename Arc::Weight Weight;
+  if (opts.max_determinized_states > 0 &&
+      DecodePronunciationsLazily(result, opts, workspace)) {
+    return;
   }
-  VLOG_PROPERTIES(3, lattice);
+  auto &recorder = workspace->recorder_;
+  auto &lattice = workspace->lattice_;
+  auto &lattice2 = workspace->lattice2_;
+
+  Weight total_weight;
+  auto &std_lattice = workspace->std_lattice_;
+  bool acyclic_forward = false;
+  if (PhonemeLatticeIsAcyclic()) {
+    VLOG(2) << "5. Determinize the acyclic phoneme lattice in topological "
+            << "order.";
+    // Determinization in the log semiring preserves the total weight of each
+    // pronunciation, and therefore the overall total weight.
+    fst::DeterminizeFstOptions<Arc> nopts;
+    nopts.delta = opts.delta;
+    nopts.gc_limit = 0;  // Each state is expanded once.
+    ConnectAndTopSortInto(fst::DeterminizeFst<Arc>(lattice, nopts), &lattice2,
+                          &workspace->connect_buffers_);
+    recorder.Mark(kG2PDeterminizeStage, lattice2);
+    VLOG_PROPERTIES(3, lattice2);
+
+    VLOG(2) << "6. Compute total weight and number of hypotheses in one "
+            << "forward pass.";
+    acyclic_forward = SumAndCountPathsTopSorted(
+        lattice2, &total_weight, &result->num_hypotheses,
+        &workspace->paths_buffers_);
+    if (acyclic_forward) {
+      VLOG(3) << "Hypotheses end in "
+              << workspace->paths_buffers_.final_states.size()
+              << " final states";
+      ConvertWeight(lattice2, &std_lattice);
+      recorder.Mark(kG2PTotalWeightStage, std_lattice);
+    } else {
+      LOG(ERROR) << "Determinized phoneme lattice is unexpectedly cyclic";
+    }
+  }
+  if (!acyclic_forward) {
+    VLOG(2) << "5. Compute normalizing total of the marginal posterior "
+            << "lattice.";
+    total_weight = fst::ShortestDistance(lattice, opts.delta);
+    recorder.Mark(kG2PTotalWeightStage, lattice);
+
+    VLOG(2) << "6. Convert posterior lattice to tropical semiring for "
+            << "decoding.";
+    DeterminizeConvertWeight(lattice, &std_lattice, opts.delta);
+    result->num_hypotheses = CountPaths(&std_lattice);
+    recorder.Mark(kG2PDeterminizeStage, std_lattice);
+  }
+  if (Weight::Zero() == total_weight) {
+    LOG(WARNING) << "Cannot normalize the posterior distribution";
+    total_weight = Weight::One();
+  }
+  VLOG_PROPERTIES(3, std_lattice);
+
+  VLOG(2) << "7. Decode shortest paths.";
+  auto &paths = workspace->paths_;
+  if (opts.max_prons > 1) {
+    fst::ShortestPath(std_lattice, &paths, opts.max_prons, false, false,
+                      -std::log(opts.real_pruning_threshold));
+  } else {
+    fst::ShortestPath(std_lattice, &paths);
+  }
+  recorder.Mark(kG2PShortestPathStage, paths);
+
+  VLOG(2) << "8. Convert shortest paths to pronunciations.";
+  ShortestPathsToVector(paths, phoneme_symbols_, &result->pronunciations);
+  for (auto &pron : result->pronunciations) {
+    pron.second = std::exp(total_weight.Value() - pron.second);
+  }
+  recorder.Mark(kG2PConvertStage, paths);
+}
+
+template <class Arc>
+bool G2P<Arc>::DecodePronunciationsLazily(G2PResult *result,
+                                          const G2POptions &opts,
+                                          G2PWorkspace<Arc> *workspace) const {
+  typedef typename Arc::Weight Weight;
+  auto &recorder = workspace->recorder_;
+  const auto &lattice = workspace->lattice_;
+
+  VLOG(2) << "5. Compute normalizing total of the phoneme lattice.";
+  // Determinization in the log semiring preserves the total weight, so it
+  // can be computed on the (smaller) undeterminized lattice.
+  Weight total_weight = fst::ShortestDistance(lattice, opts.delta);
+  recorder.Mark(kG2PTotalWeightStage, lattice);
+
+  VLOG(2) << "6-7. Decode shortest paths while determinizing on demand.";
+  fst::DeterminizeFstOptions<Arc> nopts;
+  nopts.delta = opts.delta;
+  fst::DeterminizeFst<Arc> determinized(lattice, nopts);
+  auto &paths = workspace->paths_;
+  bool exact;
+  if (!LazyShortestPaths(determinized, opts.max_prons,
+                         opts.max_prons > 1
+                             ? -std::log(opts.real_pruning_threshold)
+                             : std::numeric_limits<float>::infinity(),
+                         opts.max_determinized_states, &paths,
+                         &result->num_hypotheses, &exact,
+                         &workspace->lazy_paths_buffers_)) {
+    VLOG(1) << "No pronunciation found within the limit on states, or "
+            << "negative weights; determinizing the phoneme lattice in full";
+    return false;
+  }
+  VLOG(2) << "Found " << result->num_hypotheses
+          << (exact ? "" : " or more") << " hypotheses";
+  recorder.Mark(kG2PShortestPathStage, paths);
+  if (Weight::Zero() == total_weight) {
+    LOG(WARNING) << "Cannot normalize the posterior distribution";
+    total_weight = Weight::One();
+  }
+
+  VLOG(2) << "8. Convert shortest paths to pronunciations.";
+  ShortestPathsToVector(paths, phoneme_symbols_, &result->pronunciations);
+  for (auto &pron : result->pronunciations) {
+    pron.second = std::exp(total_weight.Value() - pron.second);
+  }
+  recorder.Mark(kG2PConvertStage, paths);
+  return true;
+}
+
+template <class Arc>
+std::size_t G2P<Arc>::PronounceBatch(const std::vector<string> &spellings,
+                                     std::vector<G2PResult> *results,
+                                     const G2POptions &opts,
+                                     G2PWorkspace<Arc> *workspace) const {
+  typedef typename Arc::Label Label;
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Weight Weight;
 
-  VLOG(2) << "3. Intersect graphone lattice with graphone model.";
-  MutableLattice lattice2;
-  PhiCompose(lattice, *graphone_model_, 0, &lattice2);
+  results->resize(spellings.size());
+  std::size_t num_successes = 0;
+  if (0 == opts.max_prons || opts.mode == G2POptions::VITERBI ||
+      opts.beam < std::numeric_limits<float>::infinity() ||
+      opts.max_active_states > 0) {
+    for (std::size_t i = 0; i < spellings.size(); ++i) {
+      if (Pronounce(spellings[i], &(*results)[i], opts, workspace)) {
+        ++num_successes;
+      }
+    }
+    return num_successes;
+  }
+  SetUpWorkspace(workspace);
+
+  VLOG(2) << "1. Arrange spellings in a trie.";
+  auto &buffers = workspace->batch_buffers_;
+  auto &labels = buffers.labels;
+  auto &offsets = buffers.offsets;
+  auto &order = buffers.order;
+  labels.clear();
+  offsets.clear();
+  order.clear();
+  for (std::size_t i = 0; i < spellings.size(); ++i) {
+    offsets.push_back(labels.size());
+    G2PResult &result = (*results)[i];
+    if (AppendSpellingLabels(spellings[i], opts, &labels, &result.error)) {
+      order.push_back(i);
+    } else {
+      // Rejected spellings are left out of the trie.
+      labels.resize(offsets.back());
+      result.pronunciations.clear();
+      result.num_hypotheses = 0;
+    }
+  }
+  offsets.push_back(labels.size());
+  std::stable_sort(order.begin(), order.end(),
+                   [&labels, &offsets](std::size_t i, std::size_t j) {
+                     return std::lexicographical_compare(
+                         labels.begin() + offsets[i],
+                         labels.begin() + offsets[i + 1],
+                         labels.begin() + offsets[j],
+                         labels.begin() + offsets[j + 1]);
+                   });
+
+  // Since the spellings are sorted, each spelling shares the longest possible
+  // prefix with its predecessor, and the arcs leaving each state of the trie
+  // are added in order of their labels.
+  auto &trie = buffers.trie;
+  auto &path = buffers.path;
+  trie.DeleteStates();
+  trie.SetStart(trie.AddState());
+  path.assign(1, trie.Start());
+  const Label *previous = nullptr;
+  std::size_t previous_size = 0;
+  for (std::size_t i : order) {
+    const Label *current = labels.data() + offsets[i];
+    const std::size_t size = offsets[i + 1] - offsets[i];
+    std::size_t common = 0;
+    while (common < size && common < previous_size &&
+           current[common] == previous[common]) {
+      ++common;
+    }
+    path.resize(common + 1);
+    for (std::size_t k = common; k < size; ++k) {
+      const StateId state = trie.AddState();
+      trie.AddArc(path.back(), Arc(current[k], current[k], Weight::One(),
+                                   state));
+      path.push_back(state);
+    }
+    trie.SetFinal(path.back(), Weight::One());
+    previous = current;
+    previous_size = size;
+  }
+  VLOG_PROPERTIES(3, trie);
+
+  VLOG(2) << "2-3. Lazily compose trie with rescored graphone model.";
+  fst::CacheOptions nopts;
+  nopts.gc = false;  // Keep all states, which are shared among spellings.
+  if (workspace->composed_model_) {
+    fst::ComposeFst<Arc> graphones(trie, *workspace->composed_model_, nopts);
+    return PronounceTrie(graphones, results, opts, workspace);
+  }
+  fst::ComposeFst<Arc> raw(trie, *workspace->bytes_to_graphones_, nopts);
+  fst::ComposeFst<Arc> graphones =
+      PhiComposeFst(raw, *workspace->graphone_model_, 0, nopts);
+  return PronounceTrie(graphones, results, opts, workspace);
+}
+
+template <class Arc>
+std::size_t G2P<Arc>::PronounceTrie(const Lattice &graphones,
+                                    std::vector<G2PResult> *results,
+                                    const G2POptions &opts,
+                                    G2PWorkspace<Arc> *workspace) const {
+  const auto &buffers = workspace->batch_buffers_;
+  const auto &labels = buffers.labels;
+  const auto &offsets = buffers.offsets;
+  std::size_t num_successes = 0;
+  bool previous_success = false;
+  const G2PResult *previous = nullptr;
+  std::size_t previous_begin = 0;
+  std::size_t previous_size = 0;
+  for (std::size_t i : buffers.order) {
+    G2PResult *result = &(*results)[i];
+    const std::size_t begin = offsets[i];
+    const std::size_t size = offsets[i + 1] - begin;
+    if (previous != nullptr && size == previous_size &&
+        std::equal(labels.begin() + begin, labels.begin() + begin + size,
+                   labels.begin() + previous_begin)) {
+      // Duplicates are adjacent in trie order and share their result.
+      *result = *previous;
+    } else {
+      previous_success =
+          ExtractRescoredLattice(graphones, labels.data() + begin, size, opts,
+                                 workspace, &result->error) &&
+          ProjectPhonemeLattice(opts, workspace, &result->error);
+      if (previous_success) {
+        DecodePronunciations(result, opts, workspace);
+        result->error.clear();
+      } else {
+        result->pronunciations.clear();
+        result->num_hypotheses = 0;
+      }
+      previous_begin = begin;
+      previous_size = size;
+    }
+    if (previous_success) ++num_successes;
+    previous = result;
+  }
+  return num_successes;
+}
+
+template <class Arc>
+bool G2P<Arc>::ExtractRescoredLattice(const Lattice &graphones,
+                                      const typename Arc::Label *labels,
+                                      std::size_t num_labels,
+                                      const G2POptions &opts,
+                                      G2PWorkspace<Arc> *workspace,
+                                      string *error) const {
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Weight Weight;
+
+  // Each state of the lazy composition pairs a state of the trie with states
+  // of the model. The prefix of a spelling read along any path to the state
+  // is therefore determined by the state, and so is the position in the
+  // current spelling, if the prefix is one of its prefixes. Arcs with other
+  // input labels lead into other branches of the trie and are skipped.
+  auto &buffers = workspace->batch_buffers_;
+  auto &state_map = buffers.state_map;
+  auto &visited = buffers.visited;
+  auto &queue = buffers.queue;
+  auto &lattice2 = workspace->lattice2_;
+  lattice2.DeleteStates();
+  auto map_state = [&](StateId state, std::size_t position) {
+    if (static_cast<std::size_t>(state) >= state_map.size()) {
+      state_map.resize(state + 1, fst::kNoStateId);
+    }
+    if (fst::kNoStateId == state_map[state]) {
+      state_map[state] = lattice2.AddState();
+      visited.push_back(state);
+      queue.emplace_back(state, position);
+    }
+    return state_map[state];
+  };
+  const StateId start = graphones.Start();
+  if (fst::kNoStateId != start) lattice2.SetStart(map_state(start, 0));
+  while (!queue.empty()) {
+    const StateId state = queue.back().first;
+    const std::size_t position = queue.back().second;
+    queue.pop_back();
+    const StateId source = state_map[state];
+    if (position == num_labels) {
+      lattice2.SetFinal(source, graphones.Final(state));
+    }
+    for (fst::ArcIterator<Lattice> aiter(graphones, state); !aiter.Done();
+         aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      std::size_t next_position = position;
+      if (arc.ilabel != 0) {
+        if (position == num_labels || arc.ilabel != labels[position]) continue;
+        ++next_position;
+      }
+      const StateId target = map_state(arc.nextstate, next_position);
+      lattice2.AddArc(source, Arc(arc.olabel, arc.olabel, arc.weight, target));
+    }
+  }
+  for (StateId state : visited) state_map[state] = fst::kNoStateId;
+  visited.clear();
+
+  fst::Connect(&lattice2);
+  workspace->recorder_.Mark(kG2PRescoredStage, lattice2);
   if (fst::kNoStateId == lattice2.Start()) {
-    result->error = "Could not rescore graphone lattice";
+    *error = "Could not create graphone lattice from spelling";
+    return false;
+  }
+  if (lattice2.Properties(fst::kEpsilons, true)) {
+    fst::RmEpsilon(&lattice2, false, Weight::Zero(), fst::kNoStateId,
+                   opts.delta);
+  }
+  const bool graphones_insertion_free = composed_model_
+      ? composed_model_is_insertion_free_
+      : bytes_to_graphones_is_insertion_free_;
+  if (graphones_insertion_free) {
+    ExpectProperties(lattice2, fst::kAcyclic);
+  }
+  VLOG_PROPERTIES(3, lattice2);
+  return true;
+}
+
+template <class Arc>
+bool G2P<Arc>::PronounceLattice(const string &spelling,
+                                G2PLattice<Arc> *result,
+                                const G2PLatticeOptions &lattice_opts,
+                                const G2POptions &opts,
+                                G2PWorkspace<Arc> *workspace) const {
+  G2PStageScope stage_scope(&workspace->recorder_, workspace->stats_,
+                            spelling, &result->error);
+  auto &recorder = workspace->recorder_;
+  SetUpWorkspace(workspace);
+  result->fst.reset();
+
+  StringFst spelling_fst;
+  if (!MakeSpellingFst(spelling, opts, workspace, &spelling_fst,
+                       &result->error) ||
+      !BuildPhonemeLattice(spelling_fst, opts, workspace, &result->error)) {
+    return false;
+  }
+  auto &lattice = workspace->lattice_;
+  auto &lattice2 = workspace->lattice2_;
+
+  const Lattice *phoneme_lattice = &lattice;
+  if (PhonemeLatticeIsAcyclic()) {
+    VLOG(2) << "5. Determinize the acyclic phoneme lattice.";
+    // As in Pronounce(), this merges the paths of each pronunciation.
+    DeterminizeConvertWeight(lattice, &lattice2, opts.delta);
+    recorder.Mark(kG2PDeterminizeStage, lattice2);
+    phoneme_lattice = &lattice2;
+  }
+
+  VLOG(2) << "6. Normalize the posterior lattice.";
+  std::unique_ptr<MutableLattice> posteriors(new MutableLattice());
+  fst::Push<Arc, fst::REWEIGHT_TO_INITIAL>(
+      *phoneme_lattice, posteriors.get(),
+      fst::kPushWeights | fst::kPushRemoveTotalWeight, opts.delta);
+  if (posteriors->Properties(fst::kError, false)) {
+    result->error = "Cannot normalize the posterior distribution";
     return false;
   }
-  if (bytes_to_graphones_is_insertion_free_) {
+  recorder.Mark(kG2PTotalWeightStage, *posteriors);
+  VLOG_PROPERTIES(3, *posteriors);
+
+  VLOG(2) << "7. Prune and encode the posterior lattice.";
+  if (lattice_opts.pruning_threshold > 0) {
+    auto &std_lattice = workspace->std_lattice_;
+    ConvertWeight(*posteriors, &std_lattice);
+    fst::Prune(&std_lattice, fst::TropicalWeight(
+        -std::log(lattice_opts.pruning_threshold)));
+    ConvertWeight(std_lattice, posteriors.get());
+  }
+  const fst::SymbolTable *symbols = phonemes_to_graphones_->InputSymbols();
+  posteriors->SetInputSymbols(symbols);
+  posteriors->SetOutputSymbols(symbols);
+  if (lattice_opts.compact) {
+    result->fst.reset(new typename G2PLattice<Arc>::CompactFst(*posteriors));
+  } else {
+    result->fst = std::move(posteriors);
+  }
+  recorder.Mark(kG2PConvertStage, *result->fst);
+  result->error.clear();
+  return true;
+}
+
+template <class Arc>
+bool G2P<Arc>::AppendSpellingLabels(const string &spelling,
+                                    const G2POptions &opts,
+                                    std::vector<typename Arc::Label> *labels,
+                                    string *error) const {
+  static_assert(
+      std::is_same<typename Arc::Label, InputLabeler::Label>::value,
+      "Input labelers produce labels of a different type");
+  const auto &relabeling = composed_model_
+      ? composed_model_relabeling_
+      : bytes_to_graphones_relabeling_;
+  const std::size_t begin = labels->size();
+  if (input_labeler_) {
+    if (!input_labeler_->AppendLabels(spelling, labels)) {
+      *error = "Could not convert spelling to input labels";
+      return false;
+    }
+    if (!relabeling.empty()) {
+      for (auto label = labels->begin() + begin; label != labels->end();
+           ++label) {
+        *label = LookAheadRelabel(relabeling, *label);
+      }
+    }
+  } else {
+    for (unsigned char byte : spelling) {
+      labels->push_back(relabeling.empty() ? byte : relabeling[byte]);
+    }
+  }
+  const InputAlphabet<Arc> &alphabet = SpellingAlphabet();
+  if (opts.skip_out_of_alphabet) {
+    labels->erase(std::remove_if(labels->begin() + begin, labels->end(),
+                                 [&alphabet](typename Arc::Label label) {
+                                   return !alphabet.Contains(label);
+                                 }),
+                  labels->end());
+  }
+  if (!alphabet.MayRead(labels->begin() + begin, labels->end())) {
+    *error = "Spelling cannot be read by the model";
+    return false;
+  }
+  return true;
+}
+
+template <class Arc>
+bool G2P<Arc>::MakeSpellingFst(const string &spelling,
+                               const G2POptions &opts,
+                               G2PWorkspace<Arc> *workspace,
+                               StringFst *spelling_fst,
+                               string *error) const {
+  VLOG(2) << "1. Turn spelling string into FST.";
+  const auto &relabeling = composed_model_
+      ? composed_model_relabeling_
+      : bytes_to_graphones_relabeling_;
+  if (!input_labeler_ && relabeling.empty() && !opts.skip_out_of_alphabet) {
+    const unsigned char *begin =
+        reinterpret_cast<const unsigned char *>(spelling.data());
+    const unsigned char *end = begin + spelling.size();
+    if (!SpellingAlphabet().MayRead(begin, end)) {
+      *error = "Spelling cannot be read by the model";
+      return false;
+    }
+    spelling_fst->SetCompactElements(begin, end);
+  } else {
+    auto &labels = workspace->spelling_labels_;
+    labels.clear();
+    if (!AppendSpellingLabels(spelling, opts, &labels, error)) return false;
+    spelling_fst->SetCompactElements(labels.begin(), labels.end());
+  }
+  workspace->recorder_.Mark(kG2PSpellingStage, *spelling_fst);
+  VLOG_PROPERTIES(3, *spelling_fst);
+  return true;
+}
+
+template <class Arc>
+bool G2P<Arc>::BuildRescoredLattice(const StringFst &spelling_fst,
+                                    const G2POptions &opts,
+                                    G2PWorkspace<Arc> *workspace,
+                                    string *error) const {
+  auto &recorder = workspace->recorder_;
+  const bool graphones_insertion_free = composed_model_
+      ? composed_model_is_insertion_free_
+      : bytes_to_graphones_is_insertion_free_;
+
+  auto &lattice = workspace->lattice_;
+  auto &lattice2 = workspace->lattice2_;
+  if (opts.beam < std::numeric_limits<float>::infinity() ||
+      opts.max_active_states > 0) {
+    VLOG(2) << "2-3. Build rescored graphone lattice with beam pruning.";
+    fst::CacheOptions nopts;
+    nopts.gc_limit = 0;  // Each state is expanded at most once.
+    if (workspace->composed_model_) {
+      fst::ComposeFst<Arc> graphones(spelling_fst, *workspace->composed_model_,
+                                     nopts);
+      BeamPruneProjectRmEpsilon(graphones, opts.beam, opts.max_active_states,
+                                fst::PROJECT_OUTPUT, &lattice2,
+                                &workspace->beam_buffers_, opts.delta);
+    } else {
+      fst::ComposeFst<Arc> graphones(spelling_fst,
+                                     *workspace->bytes_to_graphones_, nopts);
+      BeamPruneProjectRmEpsilon(
+          PhiComposeFst(graphones, *workspace->graphone_model_, 0, nopts),
+          opts.beam, opts.max_active_states, fst::PROJECT_OUTPUT, &lattice2,
+          &workspace->beam_buffers_, opts.delta);
+    }
+    recorder.Mark(kG2PRescoredStage, lattice2);
+    if (fst::kNoStateId == lattice2.Start()) {
+      *error = "Could not create graphone lattice from spelling";
+      return false;
+    }
+  } else if (workspace->composed_model_) {
+    VLOG(2) << "2-3. Reverse-project spelling FST into rescored graphone "
+            << "lattice.";
+    const Lattice &composed_model = *workspace->composed_model_;
+    ComposeProjectRmEpsilon(
+        spelling_fst, composed_model, fst::PROJECT_OUTPUT, &lattice2,
+        opts.delta, composed_model.Properties(fst::kNoIEpsilons, false),
+        &workspace->connect_buffers_);
+    recorder.Mark(kG2PRescoredStage, lattice2);
+    if (fst::kNoStateId == lattice2.Start()) {
+      *error = "Could not create graphone lattice from spelling";
+      return false;
+    }
+  } else {
+    const Lattice &bytes_to_graphones = *workspace->bytes_to_graphones_;
+    const Lattice &graphone_model = *workspace->graphone_model_;
+
+    VLOG(2) << "2. Reverse-project (inject) spelling FST into graphone "
+            << "lattice.";
+    ComposeProjectRmEpsilon(
+        spelling_fst, bytes_to_graphones, fst::PROJECT_OUTPUT, &lattice,
+        opts.delta, bytes_to_graphones.Properties(fst::kNoIEpsilons, false),
+        &workspace->connect_buffers_);
+    recorder.Mark(kG2PGraphonesStage, lattice);
+    if (fst::kNoStateId == lattice.Start()) {
+      *error = "Could not create graphone lattice from spelling";
+      return false;
+    }
+    if (graphones_insertion_free) {
+      // Since the spelling_fst is a string and therefore acyclic, and since
+      // the bytes_to_graphones FST is insertion-free, the resulting graphone
+      // lattice must be acyclic.
+      ExpectProperties(lattice, fst::kAcyclic);
+    }
+    VLOG_PROPERTIES(3, lattice);
+
+    VLOG(2) << "3. Intersect graphone lattice with graphone model.";
+    PhiCompose(lattice, graphone_model, 0, &lattice2, true,
+               &workspace->connect_buffers_);
+    recorder.Mark(kG2PRescoredStage, lattice2);
+    if (fst::kNoStateId == lattice2.Start()) {
+      *error = "Could not rescore graphone lattice";
+      return false;
+    }
+  }
+  if (graphones_insertion_free) {
     // Since the raw graphone lattice was acyclic (per above), the rescored
     // graphone lattice must also be acyclic.
     ExpectProperties(lattice2, fst::kAcyclic);
   }
   VLOG_PROPERTIES(3, lattice2);
+  return true;
+}
 
+template <class Arc>
+bool G2P<Arc>::ProjectPhonemeLattice(const G2POptions &opts,
+                                     G2PWorkspace<Arc> *workspace,
+                                     string *error) const {
+  auto &lattice = workspace->lattice_;
+  const auto &lattice2 = workspace->lattice2_;
   VLOG(2) << "4. Project graphone lattice into phoneme lattice.";
   ComposeProjectRmEpsilon(
-      *phonemes_to_graphones_, lattice2, fst::PROJECT_INPUT, &lattice,
-      opts.delta);
+      *workspace->phonemes_to_graphones_, lattice2, fst::PROJECT_INPUT,
+      &lattice, opts.delta, false, &workspace->connect_buffers_);
+  workspace->recorder_.Mark(kG2PPhonemesStage, lattice);
   if (fst::kNoStateId == lattice.Start()) {
-    result->error = "Could not create phoneme lattice";
+    *error = "Could not create phoneme lattice";
     return false;
   }
-  if (bytes_to_graphones_is_insertion_free_ &&
-      phonemes_to_graphones_is_insertion_free_) {
-    // Since the rescored graphone lattice was acyclic (per above), and since
-    // the phonemes_to_graphones FST is insertion-free on the phoneme side, the
-    // resulting phoneme lattice must be acyclic.
+  if (PhonemeLatticeIsAcyclic()) {
+    // The rescored graphone lattice is acyclic (see BuildRescoredLattice()),
+    // and since the phonemes_to_graphones FST is insertion-free on the phoneme
+    // side, the resulting phoneme lattice must be acyclic.
     ExpectProperties(lattice, fst::kAcyclic);
   }
   VLOG_PROPERTIES(3, lattice);
+  return true;
+}
 
-  VLOG(2) << "5. Compute normalizing total of the marginal posterior lattice.";
-  Weight total_weight = fst::ShortestDistance(lattice, opts.delta);
-  if (Weight::Zero() == total_weight) {
-    LOG(WARNING) << "Cannot normalize the posterior distribution";
-    total_weight = Weight::One();
+template <class Arc>
+bool G2P<Arc>::PronounceViterbi(const StringFst &spelling_fst,
+                                G2PResult *result,
+                                const G2POptions &opts,
+                                G2PWorkspace<Arc> *workspace) const {
+  typedef fst::WeightConvertMapper<Arc, fst::StdArc> ToTropical;
+  typedef fst::ArcMapFst<Arc, fst::StdArc, ToTropical> TropicalFst;
+
+  VLOG(2) << "2. Find best graphone path in lazily composed tropical lattice.";
+  auto &path = workspace->paths_;
+  if (workspace->composed_model_) {
+    fst::ComposeFst<Arc> graphones(spelling_fst, *workspace->composed_model_);
+    fst::ShortestPath(TropicalFst(graphones, ToTropical()), &path);
+  } else {
+    fst::ComposeFst<Arc> graphones(spelling_fst,
+                                   *workspace->bytes_to_graphones_);
+    fst::ShortestPath(
+        TropicalFst(PhiComposeFst(graphones, *workspace->graphone_model_, 0),
+                    ToTropical()),
+        &path);
+  }
+  if (fst::kNoStateId == path.Start()) {
+    result->error = "Could not find a graphone path for spelling";
+    return false;
   }
+  VLOG_PROPERTIES(3, path);
 
-  VLOG(2) << "6. Convert posterior lattice to tropical semiring for decoding.";
-  fst::StdVectorFst std_lattice;
-  DeterminizeConvertWeight(lattice, &std_lattice, opts.delta);
-  result->num_hypotheses = CountPaths(&std_lattice);
-  if (bytes_to_graphones_is_insertion_free_ &&
-      phonemes_to_graphones_is_insertion_free_) {
-    // Since the phoneme lattice was acyclic (per above), the converted lattice
-    // must also be acyclic. In fact after CountPaths() it must in fact be
-    // topologically sorted.
-    ExpectProperties(std_lattice, fst::kAcyclic | fst::kTopSorted);
+  VLOG(2) << "3. Read off graphones and weight of best path.";
+  auto &labels = workspace->graphone_labels_;
+  labels.clear();
+  fst::TropicalWeight weight = fst::TropicalWeight::One();
+  auto state = path.Start();
+  while (path.NumArcs(state) > 0) {
+    // The best path is a chain, so each state has at most one arc.
+    const fst::StdArc arc =
+        fst::ArcIterator<fst::Fst<fst::StdArc>>(path, state).Value();
+    if (arc.olabel != 0) labels.push_back(arc.olabel);
+    weight = fst::Times(weight, arc.weight);
+    state = arc.nextstate;
   }
-  VLOG_PROPERTIES(3, std_lattice);
+  weight = fst::Times(weight, path.Final(state));
+  auto &recorder = workspace->recorder_;
+  recorder.Mark(kG2PViterbiStage, path);
 
-  VLOG(2) << "7. Decode shortest paths.";
-  fst::StdVectorFst paths;
-  if (opts.max_prons > 1) {
-    fst::ShortestPath(std_lattice, &paths, opts.max_prons, false, false,
-                      -std::log(opts.real_pruning_threshold));
-  } else {
-    fst::ShortestPath(std_lattice, &paths);
+  VLOG(2) << "4. Project best graphone path into phonemes.";
+  StringFst graphone_fst;
+  graphone_fst.SetCompactElements(labels.begin(), labels.end());
+  auto &lattice = workspace->lattice_;
+  ComposeProjectRmEpsilon(
+      *workspace->phonemes_to_graphones_, graphone_fst, fst::PROJECT_INPUT,
+      &lattice, opts.delta, false, &workspace->connect_buffers_);
+  recorder.Mark(kG2PPhonemesStage, lattice);
+  if (fst::kNoStateId == lattice.Start()) {
+    result->error = "Could not create phoneme lattice";
+    return false;
   }
+  VLOG_PROPERTIES(3, lattice);
 
-  VLOG(2) << "8. Convert shortest paths to pronunciations.";
-  result->pronunciations = ShortestPathsToVector(paths);
+  VLOG(2) << "5. Convert phoneme string to pronunciation.";
+  // The phonemes_to_graphones FST is unweighted and maps each graphone to
+  // a single phoneme string, so this is a trivial conversion.
+  auto &std_lattice = workspace->std_lattice_;
+  ConvertWeight(lattice, &std_lattice);
+  fst::ShortestPath(std_lattice, &path);
+  ShortestPathsToVector(path, phoneme_symbols_, &result->pronunciations);
   for (auto &pron : result->pronunciations) {
-    pron.second = std::exp(total_weight.Value() - pron.second);
+    pron.second = std::exp(-weight.Value());
   }
+  recorder.Mark(kG2PConvertStage, path);
+  result->num_hypotheses = 1;
   result->error.clear();
   return true;
 }
 
+// Composes the bytes_to_graphones FST with the graphone model, for use with
+// G2P<>::SetComposedModelFst(). Arcs of the graphone model with input label
+// phi_label are interpreted as backoff arcs and resolved during composition,
+// so the result contains ordinary arcs only. Since every state of the result
+// pairs a state of bytes_to_graphones with a history of the graphone model,
+// this is only practical for small models.
+template <class Arc>
+void ComposeGraphoneModel(const fst::Fst<Arc> &bytes_to_graphones,
+                          const fst::Fst<Arc> &graphone_model,
+                          typename Arc::Label phi_label,
+                          fst::MutableFst<Arc> *composed_model) {
+  PhiCompose(bytes_to_graphones, graphone_model, phi_label, composed_model);
+  composed_model->SetInputSymbols(nullptr);
+  composed_model->SetOutputSymbols(nullptr);
+  fst::ArcSort(composed_model, fst::ILabelCompare<Arc>());
+}
+
 }  // namespace festus
 
 #endif  // FESTUS_RUNTIME_G2P_H__
@@ -0,0 +1,108 @@
+// festus/runtime/input-alphabet-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the input language summary of an FST.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "input-alphabet.h"
+
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+typedef festus::InputAlphabet<MyArc> MyAlphabet;
+
+// Makes a machine in the shape of bytes_to_graphones, which reads "ab", "c",
+// and (after an input epsilon) "d", any number of times. Label 100000 can
+// only be read after "c".
+MyVectorFst MakeHub() {
+  MyVectorFst fst;
+  for (int s = 0; s < 5; ++s) fst.AddState();
+  fst.SetStart(0);
+  fst.SetFinal(0, MyArc::Weight::One());
+  fst.AddArc(0, MyArc('a', 1, MyArc::Weight::One(), 1));
+  fst.AddArc(1, MyArc('b', 0, MyArc::Weight::One(), 0));
+  fst.AddArc(0, MyArc('c', 2, MyArc::Weight::One(), 3));
+  fst.AddArc(3, MyArc(0, 0, MyArc::Weight::One(), 0));
+  fst.AddArc(3, MyArc(100000, 4, MyArc::Weight::One(), 0));
+  fst.AddArc(0, MyArc(0, 3, MyArc::Weight::One(), 2));
+  fst.AddArc(2, MyArc('d', 0, MyArc::Weight::One(), 0));
+  return fst;
+}
+
+bool MayRead(const MyAlphabet &alphabet, const std::vector<int> &labels) {
+  return alphabet.MayRead(labels.begin(), labels.end());
+}
+
+bool MayRead(const MyAlphabet &alphabet, const string &bytes) {
+  return alphabet.MayRead(bytes.begin(), bytes.end());
+}
+
+TEST(InputAlphabetTest, Hub) {
+  const MyAlphabet alphabet(MakeHub());
+  ASSERT_TRUE(alphabet.Summarized());
+  EXPECT_EQ(5, alphabet.Size());
+  EXPECT_TRUE(alphabet.Contains('a'));
+  EXPECT_TRUE(alphabet.Contains(100000));
+  EXPECT_FALSE(alphabet.Contains('e'));
+  EXPECT_FALSE(alphabet.Contains(0));
+
+  for (const char *readable : {"", "ab", "abc", "cab", "d", "dab", "cd"}) {
+    EXPECT_TRUE(MayRead(alphabet, readable)) << readable;
+  }
+  for (const char *unreadable : {
+           "e",     // Not in the alphabet.
+           "b",     // Cannot begin a sequence.
+           "a",     // Cannot end a sequence.
+           "aa",    // Cannot follow one another.
+           "abe"}) {
+    EXPECT_FALSE(MayRead(alphabet, unreadable)) << unreadable;
+  }
+  EXPECT_TRUE(MayRead(alphabet, std::vector<int>({'c', 100000, 'a', 'b'})));
+  EXPECT_FALSE(MayRead(alphabet, std::vector<int>({'a', 100000})));
+  EXPECT_FALSE(MayRead(alphabet, std::vector<int>({100000})));
+}
+
+TEST(InputAlphabetTest, NoEmptySequence) {
+  MyVectorFst fst = MakeHub();
+  fst.SetFinal(0, MyArc::Weight::Zero());
+  fst.SetFinal(1, MyArc::Weight::One());
+  const MyAlphabet alphabet(fst);
+  EXPECT_FALSE(MayRead(alphabet, ""));
+  EXPECT_TRUE(MayRead(alphabet, "a"));
+  EXPECT_FALSE(MayRead(alphabet, "ab"));
+}
+
+TEST(InputAlphabetTest, LazyFstIsNotSummarized) {
+  const MyVectorFst hub = MakeHub();
+  const fst::ProjectFst<MyArc> lazy(hub, fst::PROJECT_INPUT);
+  const MyAlphabet alphabet(lazy);
+  EXPECT_FALSE(alphabet.Summarized());
+  EXPECT_TRUE(alphabet.Contains('e'));
+  EXPECT_TRUE(MayRead(alphabet, "e"));
+
+  const MyAlphabet empty;
+  EXPECT_TRUE(MayRead(empty, "anything"));
+}
+
+}  // namespace
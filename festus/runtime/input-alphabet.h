@@ -0,0 +1,264 @@
+// festus/runtime/input-alphabet.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Summary of the input language of an FST, for rejecting input sequences
+// that it cannot read in time linear in their length, without composing.
+
+#ifndef FESTUS_RUNTIME_INPUT_ALPHABET_H__
+#define FESTUS_RUNTIME_INPUT_ALPHABET_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+
+namespace festus {
+
+// Records the input labels of an FST, the labels that can begin and end an
+// input sequence, and the pairs of labels that can follow one another. The
+// last three take paths over input epsilons into account. MayRead() checks a
+// sequence against this summary. It returns false only for sequences that the
+// FST cannot read, but may return true for other unreadable sequences, e.g.
+// ones that only fail on a combination of three labels.
+template <class Arc>
+class InputAlphabet {
+ public:
+  typedef typename Arc::Label Label;
+  typedef typename Arc::StateId StateId;
+
+  // Limit on the scratch space (in bits) for the pairs of labels. For larger
+  // FSTs, only their alphabet is recorded.
+  static constexpr std::size_t kMaxSummaryBits = std::size_t{1} << 27;
+
+  // Limit on the number of passes over the FST for following input epsilon
+  // paths. FSTs whose epsilon paths need more passes only have their
+  // alphabet recorded.
+  static constexpr int kMaxEpsilonPasses = 32;
+
+  // The empty summary reads everything.
+  InputAlphabet() = default;
+
+  // Summarizes the input side of fst, which must be expanded; otherwise the
+  // summary is empty.
+  explicit InputAlphabet(const fst::Fst<Arc> &fst);
+
+  // True unless the summary is empty.
+  bool Summarized() const { return summarized_; }
+
+  std::size_t Size() const { return labels_.size(); }
+
+  // True if fst has an arc with this input label. Every label is contained in
+  // an empty summary.
+  bool Contains(Label label) const {
+    return !summarized_ || Index(label) != kNoIndex;
+  }
+
+  // Returns false if fst cannot read the sequence of labels [begin, end).
+  template <class Iterator>
+  bool MayRead(Iterator begin, Iterator end) const;
+
+ private:
+  static constexpr std::size_t kNoIndex =
+      std::numeric_limits<std::size_t>::max();
+
+  // Labels below this limit are looked up in a table.
+  static constexpr Label kMaxDenseLabel = 1 << 16;
+
+  static bool Test(const std::vector<uint64> &bits, std::size_t i) {
+    return bits[i / 64] & (uint64{1} << (i % 64));
+  }
+
+  static void Set(std::vector<uint64> *bits, std::size_t i) {
+    (*bits)[i / 64] |= uint64{1} << (i % 64);
+  }
+
+  // Sets row dst |= row src of the given matrix, and returns true if that
+  // changed row dst.
+  bool MergeRow(std::vector<uint64> *rows, std::size_t dst,
+                std::size_t src) const {
+    bool changed = false;
+    for (std::size_t w = 0; w < words_per_row_; ++w) {
+      const uint64 merged = (*rows)[dst * words_per_row_ + w] |
+                            (*rows)[src * words_per_row_ + w];
+      changed |= merged != (*rows)[dst * words_per_row_ + w];
+      (*rows)[dst * words_per_row_ + w] = merged;
+    }
+    return changed;
+  }
+
+  // Returns the position of label in labels_, or kNoIndex.
+  std::size_t Index(Label label) const {
+    if (label >= 0 && label < kMaxDenseLabel) {
+      return static_cast<std::size_t>(label) < dense_index_.size()
+          ? dense_index_[label]
+          : kNoIndex;
+    }
+    auto iter = std::lower_bound(labels_.begin(), labels_.end(), label);
+    return iter != labels_.end() && *iter == label
+        ? iter - labels_.begin()
+        : kNoIndex;
+  }
+
+  bool summarized_ = false;
+  std::vector<Label> labels_;              // The alphabet, sorted.
+  std::vector<std::size_t> dense_index_;   // Index() of small labels.
+
+  // Bit sets over indices into labels_, and the bit matrix of label pairs;
+  // all empty if only the alphabet is recorded.
+  std::size_t words_per_row_ = 0;
+  std::vector<uint64> first_;
+  std::vector<uint64> last_;
+  std::vector<uint64> pairs_;
+  bool reads_empty_ = true;
+};
+
+template <class Arc>
+constexpr std::size_t InputAlphabet<Arc>::kMaxSummaryBits;
+
+template <class Arc>
+constexpr int InputAlphabet<Arc>::kMaxEpsilonPasses;
+
+template <class Arc>
+constexpr std::size_t InputAlphabet<Arc>::kNoIndex;
+
+template <class Arc>
+constexpr typename Arc::Label InputAlphabet<Arc>::kMaxDenseLabel;
+
+template <class Arc>
+InputAlphabet<Arc>::InputAlphabet(const fst::Fst<Arc> &fst) {
+  if (!fst.Properties(fst::kExpanded, false)) {
+    VLOG(1) << "Cannot summarize the input alphabet of a lazy FST";
+    return;
+  }
+  summarized_ = true;
+  StateId num_states = 0;
+  for (fst::StateIterator<fst::Fst<Arc>> siter(fst); !siter.Done();
+       siter.Next()) {
+    for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, siter.Value());
+         !aiter.Done(); aiter.Next()) {
+      if (aiter.Value().ilabel != 0) labels_.push_back(aiter.Value().ilabel);
+    }
+    ++num_states;
+  }
+  std::sort(labels_.begin(), labels_.end());
+  labels_.erase(std::unique(labels_.begin(), labels_.end()), labels_.end());
+  for (std::size_t i = 0; i < labels_.size(); ++i) {
+    if (labels_[i] < 0 || labels_[i] >= kMaxDenseLabel) break;
+    dense_index_.resize(labels_[i] + 1, kNoIndex);
+    dense_index_[labels_[i]] = i;
+  }
+
+  words_per_row_ = (labels_.size() + 63) / 64;
+  if (num_states == 0 ||
+      num_states * words_per_row_ * 64 > kMaxSummaryBits) {
+    VLOG(1) << "Input alphabet of " << labels_.size() << " labels, without "
+            << "label pairs";
+    words_per_row_ = 0;
+    return;
+  }
+
+  // For each state, the labels that can be read next, and whether a final
+  // state can be reached without reading anything. These propagate backwards
+  // along input epsilon arcs until nothing changes.
+  std::vector<uint64> next(num_states * words_per_row_, 0);
+  std::vector<bool> ends(num_states, false);
+  for (StateId s = 0; s < num_states; ++s) {
+    ends[s] = fst.Final(s) != Arc::Weight::Zero();
+    for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s); !aiter.Done();
+         aiter.Next()) {
+      const Label label = aiter.Value().ilabel;
+      if (label != 0) {
+        Set(&next, s * words_per_row_ * 64 + Index(label));
+      }
+    }
+  }
+  bool changed = true;
+  for (int pass = 0; changed && pass < kMaxEpsilonPasses; ++pass) {
+    changed = false;
+    for (StateId s = num_states - 1; s >= 0; --s) {
+      for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s); !aiter.Done();
+           aiter.Next()) {
+        const Arc &arc = aiter.Value();
+        if (arc.ilabel != 0) continue;
+        changed |= MergeRow(&next, s, arc.nextstate);
+        if (ends[arc.nextstate] && !ends[s]) {
+          ends[s] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+  if (changed) {
+    VLOG(1) << "Input alphabet of " << labels_.size() << " labels, without "
+            << "label pairs";
+    words_per_row_ = 0;
+    return;
+  }
+
+  const StateId start = fst.Start();
+  reads_empty_ = start != fst::kNoStateId && ends[start];
+  first_.assign(words_per_row_, 0);
+  if (start != fst::kNoStateId) {
+    std::copy(next.begin() + start * words_per_row_,
+              next.begin() + (start + 1) * words_per_row_, first_.begin());
+  }
+  last_.assign(words_per_row_, 0);
+  pairs_.assign(labels_.size() * words_per_row_, 0);
+  for (StateId s = 0; s < num_states; ++s) {
+    for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s); !aiter.Done();
+         aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.ilabel == 0) continue;
+      const std::size_t i = Index(arc.ilabel);
+      for (std::size_t w = 0; w < words_per_row_; ++w) {
+        pairs_[i * words_per_row_ + w] |=
+            next[arc.nextstate * words_per_row_ + w];
+      }
+      if (ends[arc.nextstate]) Set(&last_, i);
+    }
+  }
+  VLOG(1) << "Input alphabet of " << labels_.size() << " labels";
+}
+
+template <class Arc>
+template <class Iterator>
+bool InputAlphabet<Arc>::MayRead(Iterator begin, Iterator end) const {
+  if (!summarized_) return true;
+  if (begin == end) return reads_empty_;
+  std::size_t previous = kNoIndex;
+  for (; begin != end; ++begin) {
+    const std::size_t i = Index(*begin);
+    if (i == kNoIndex) return false;
+    if (words_per_row_ > 0) {
+      if (previous == kNoIndex) {
+        if (!Test(first_, i)) return false;
+      } else if (!Test(pairs_, previous * words_per_row_ * 64 + i)) {
+        return false;
+      }
+    }
+    previous = i;
+  }
+  return words_per_row_ == 0 || Test(last_, previous);
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_INPUT_ALPHABET_H__
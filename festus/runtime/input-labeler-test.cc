@@ -0,0 +1,113 @@
+// festus/runtime/input-labeler-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the conversion of spellings into input labels.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "input-labeler.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <fst/symbol-table.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef festus::InputLabeler::Labels Labels;
+
+TEST(InputLabelerTest, Byte) {
+  festus::ByteInputLabeler labeler;
+  Labels labels = {7};
+  ASSERT_TRUE(labeler.AppendLabels("s\xC3\xAA", &labels));
+  EXPECT_EQ(Labels({7, 's', 0xC3, 0xAA}), labels);
+}
+
+TEST(InputLabelerTest, Unicode) {
+  festus::UnicodeInputLabeler labeler;
+  Labels labels;
+  ASSERT_TRUE(labeler.AppendLabels("s\xC3\xAA \xE1\x9E\x80\xF0\x9F\x98\x80",
+                                   &labels));
+  EXPECT_EQ(Labels({'s', 0xEA, ' ', 0x1780, 0x1F600}), labels);
+  ASSERT_TRUE(labeler.AppendLabels("", &labels));
+  EXPECT_EQ(5, labels.size());
+
+  for (const char *invalid : {
+           "\xC3",              // Truncated sequence.
+           "\xC3s",             // Missing continuation byte.
+           "\xAA",              // Stray continuation byte.
+           "\xC0\xAF",          // Overlong encoding of '/'.
+           "\xED\xA0\x80",      // Surrogate.
+           "\xF4\x90\x80\x80",  // Beyond U+10FFFF.
+           "\xFF"}) {
+    EXPECT_FALSE(labeler.AppendLabels(invalid, &labels)) << invalid;
+  }
+}
+
+TEST(InputLabelerTest, Symbol) {
+  std::unique_ptr<fst::SymbolTable> symbols(new fst::SymbolTable("input"));
+  symbols->AddSymbol("<epsilon>", 0);
+  symbols->AddSymbol("ch", 300);
+  symbols->AddSymbol("a", 301);
+  festus::SymbolInputLabeler labeler(std::move(symbols), " +");
+  Labels labels;
+  ASSERT_TRUE(labeler.AppendLabels("  ch a+ch ", &labels));
+  EXPECT_EQ(Labels({300, 301, 300}), labels);
+  EXPECT_FALSE(labeler.AppendLabels("ch b", &labels));
+  EXPECT_EQ("symbol", string(labeler.Type()));
+}
+
+// A minimal converter with the interface of festus::LabelMaker.
+class UppercaseLabelMaker {
+ public:
+  typedef std::vector<int> Labels;
+
+  bool StringToLabels(const string &str, Labels *labels) const {
+    labels->clear();
+    for (char c : str) {
+      if (c < 'A' || c > 'Z') return false;
+      labels->push_back(c - 'A' + 1);
+    }
+    return true;
+  }
+};
+
+TEST(InputLabelerTest, LabelMakerAdapter) {
+  festus::LabelMakerInputLabeler<UppercaseLabelMaker> labeler(
+      std::unique_ptr<const UppercaseLabelMaker>(new UppercaseLabelMaker()),
+      "uppercase");
+  Labels labels = {0};
+  ASSERT_TRUE(labeler.AppendLabels("ABC", &labels));
+  EXPECT_EQ(Labels({0, 1, 2, 3}), labels);
+  EXPECT_FALSE(labeler.AppendLabels("abc", &labels));
+  EXPECT_EQ("uppercase", string(labeler.Type()));
+}
+
+TEST(InputLabelerTest, MakeInputLabeler) {
+  string error;
+  auto labeler = festus::MakeInputLabeler("unicode", "", "", &error);
+  ASSERT_TRUE(labeler != nullptr) << error;
+  EXPECT_EQ("unicode", string(labeler->Type()));
+  EXPECT_TRUE(festus::MakeInputLabeler("symbol", "", " ", &error) == nullptr);
+  EXPECT_EQ("The symbol input tape requires a symbol table", error);
+  EXPECT_TRUE(festus::MakeInputLabeler("utf16", "", "", &error) == nullptr);
+  EXPECT_EQ("Unknown input tape: utf16", error);
+}
+
+}  // namespace
@@ -0,0 +1,214 @@
+// festus/runtime/input-labeler.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Conversion of spellings into the input labels of a G2P model.
+//
+// The input tape of a G2P model is determined by the input_label_type of the
+// alignables spec from which it was trained (see festus/alignables.proto):
+// bytes, Unicode codepoints, or symbols from a symbol table. The labelers
+// below follow the semantics of the corresponding classes in
+// festus/label-maker.h, on which the runtime library does not depend.
+
+#ifndef FESTUS_RUNTIME_INPUT_LABELER_H__
+#define FESTUS_RUNTIME_INPUT_LABELER_H__
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/symbol-table.h>
+
+namespace festus {
+
+// Abstract converter from spellings to input label sequences.
+class InputLabeler {
+ public:
+  typedef int Label;
+  typedef std::vector<Label> Labels;
+
+  virtual ~InputLabeler() = default;
+
+  // The name of the input tape, as accepted by MakeInputLabeler().
+  virtual const char *Type() const = 0;
+
+  // Appends the labels of the given spelling to *labels. Returns false if the
+  // spelling cannot be represented on this input tape, in which case
+  // *labels may have been partially extended.
+  virtual bool AppendLabels(const string &spelling, Labels *labels) const = 0;
+};
+
+// Bytes (viewed as unsigned integers) correspond one-for-one to labels. This
+// is what G2P uses when no input labeler is set.
+class ByteInputLabeler : public InputLabeler {
+ public:
+  const char *Type() const override { return "byte"; }
+
+  bool AppendLabels(const string &spelling, Labels *labels) const override {
+    for (unsigned char byte : spelling) {
+      labels->push_back(byte);
+    }
+    return true;
+  }
+};
+
+// Labels are the Unicode codepoints of a structurally valid UTF-8 spelling.
+class UnicodeInputLabeler : public InputLabeler {
+ public:
+  const char *Type() const override { return "unicode"; }
+
+  bool AppendLabels(const string &spelling, Labels *labels) const override {
+    const std::size_t size = spelling.size();
+    std::size_t i = 0;
+    while (i < size) {
+      const unsigned char lead = spelling[i];
+      if (lead < 0x80) {
+        labels->push_back(lead);
+        ++i;
+        continue;
+      }
+      int length;
+      Label codepoint;
+      Label min_codepoint;
+      if ((lead & 0xE0) == 0xC0) {
+        length = 2;
+        codepoint = lead & 0x1F;
+        min_codepoint = 0x80;
+      } else if ((lead & 0xF0) == 0xE0) {
+        length = 3;
+        codepoint = lead & 0x0F;
+        min_codepoint = 0x800;
+      } else if ((lead & 0xF8) == 0xF0) {
+        length = 4;
+        codepoint = lead & 0x07;
+        min_codepoint = 0x10000;
+      } else {
+        return false;
+      }
+      if (size - i < static_cast<std::size_t>(length)) return false;
+      for (int k = 1; k < length; ++k) {
+        const unsigned char trail = spelling[i + k];
+        if ((trail & 0xC0) != 0x80) return false;
+        codepoint = (codepoint << 6) | (trail & 0x3F);
+      }
+      // Reject overlong encodings, surrogates, and values beyond Unicode.
+      if (codepoint < min_codepoint || codepoint > 0x10FFFF ||
+          (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+        return false;
+      }
+      labels->push_back(codepoint);
+      i += length;
+    }
+    return true;
+  }
+};
+
+// Splits the spelling at any of the delimiter characters and looks up each
+// non-empty piece in the symbol table.
+class SymbolInputLabeler : public InputLabeler {
+ public:
+  SymbolInputLabeler(std::unique_ptr<const fst::SymbolTable> symbols,
+                     string delimiters)
+      : symbols_(std::move(symbols)), delimiters_(std::move(delimiters)) {}
+
+  const char *Type() const override { return "symbol"; }
+
+  const fst::SymbolTable &Symbols() const { return *symbols_; }
+
+  bool AppendLabels(const string &spelling, Labels *labels) const override {
+    string::size_type begin = spelling.find_first_not_of(delimiters_);
+    while (begin != string::npos) {
+      string::size_type end = spelling.find_first_of(delimiters_, begin);
+      if (end == string::npos) end = spelling.size();
+      const int64 label = symbols_->Find(spelling.substr(begin, end - begin));
+      if (label == fst::kNoSymbol || label != static_cast<Label>(label)) {
+        VLOG(1) << "Unknown input symbol: "
+                << spelling.substr(begin, end - begin);
+        return false;
+      }
+      labels->push_back(static_cast<Label>(label));
+      begin = spelling.find_first_not_of(delimiters_, end);
+    }
+    return true;
+  }
+
+ private:
+  std::unique_ptr<const fst::SymbolTable> symbols_;
+  const string delimiters_;
+};
+
+// Adapts any converter with the interface of festus::LabelMaker, such as the
+// UnicodeLabelMaker or SymbolLabelMaker of festus/label-maker.h, so that the
+// same conversion as during training can be used at runtime.
+template <class LabelMakerType>
+class LabelMakerInputLabeler : public InputLabeler {
+ public:
+  LabelMakerInputLabeler(std::unique_ptr<const LabelMakerType> label_maker,
+                         const char *type)
+      : label_maker_(std::move(label_maker)), type_(type) {}
+
+  const char *Type() const override { return type_; }
+
+  bool AppendLabels(const string &spelling, Labels *labels) const override {
+    typename LabelMakerType::Labels spelling_labels;
+    if (!label_maker_->StringToLabels(spelling, &spelling_labels)) {
+      return false;
+    }
+    labels->insert(labels->end(), spelling_labels.begin(),
+                   spelling_labels.end());
+    return true;
+  }
+
+ private:
+  std::unique_ptr<const LabelMakerType> label_maker_;
+  const char *type_;
+};
+
+// Makes the input labeler for the given input tape: "byte", "unicode", or
+// "symbol". The symbol tape reads its symbol table in text format from
+// symbols_path and splits spellings at the given delimiters. Returns null
+// and sets *error on failure.
+inline std::unique_ptr<const InputLabeler> MakeInputLabeler(
+    const string &type, const string &symbols_path, const string &delimiters,
+    string *error) {
+  std::unique_ptr<const InputLabeler> labeler;
+  if (type == "byte") {
+    labeler.reset(new ByteInputLabeler());
+  } else if (type == "unicode") {
+    labeler.reset(new UnicodeInputLabeler());
+  } else if (type == "symbol") {
+    if (symbols_path.empty()) {
+      *error = "The symbol input tape requires a symbol table";
+      return labeler;
+    }
+    std::unique_ptr<const fst::SymbolTable> symbols(
+        fst::SymbolTable::ReadText(symbols_path));
+    if (!symbols) {
+      *error = "Could not read input symbols from " + symbols_path;
+      return labeler;
+    }
+    labeler.reset(new SymbolInputLabeler(std::move(symbols), delimiters));
+  } else {
+    *error = "Unknown input tape: " + type;
+  }
+  return labeler;
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_INPUT_LABELER_H__
@@ -0,0 +1,98 @@
+// festus/runtime/lookahead.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Input label lookahead FSTs for use on the right side of composition.
+//
+// An ILabelLookAheadFst carries precomputed label reachability information.
+// When it appears as the second argument of a ComposeFst, OpenFst switches
+// to lookahead composition automatically: a composition state is only
+// created if the remainder of the first machine can still be matched, and the
+// weights of the second machine are pushed towards the initial state. The
+// price is that the input labels of the lookahead FST are renumbered, so the
+// output labels of the first machine must be renumbered in the same way; see
+// GetLookAheadRelabeling().
+
+#ifndef FESTUS_RUNTIME_LOOKAHEAD_H__
+#define FESTUS_RUNTIME_LOOKAHEAD_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+#include <fst/matcher-fst.h>
+
+namespace festus {
+
+// This is the same type name as used by OpenFst's lookahead extension, so
+// that the FST utilities of that extension can read such files.
+static constexpr char kILabelLookAheadFstType[] = "ilabel_lookahead";
+
+template <class Arc>
+using ILabelLookAheadFst = fst::MatcherFst<
+    fst::ConstFst<Arc>,
+    fst::LabelLookAheadMatcher<fst::SortedMatcher<fst::ConstFst<Arc>>,
+                               fst::ilabel_lookahead_flags,
+                               fst::FastLogAccumulator<Arc>>,
+    kILabelLookAheadFstType,
+    fst::LabelLookAheadRelabeler<Arc>>;
+
+// If fst is an ILabelLookAheadFst, sets *relabeling to a table that maps
+// each label in [0, max_label] to the label that replaces it in the input
+// alphabet of fst, and returns true. Labels that do not occur in fst are
+// mapped to a label that does not occur in it either. The table extends past
+// max_label and past every label of fst by one entry, so that labels beyond
+// the table are mapped by its last entry; see LookAheadRelabel(). Otherwise
+// clears *relabeling and returns false.
+template <class Arc>
+bool GetLookAheadRelabeling(const fst::Fst<Arc> &fst,
+                            typename Arc::Label max_label,
+                            std::vector<typename Arc::Label> *relabeling) {
+  typedef typename Arc::Label Label;
+  relabeling->clear();
+  const auto *lookahead_fst =
+      dynamic_cast<const ILabelLookAheadFst<Arc> *>(&fst);
+  if (lookahead_fst == nullptr) return false;
+  std::vector<std::pair<Label, Label>> pairs;
+  fst::LabelLookAheadRelabeler<Arc>::RelabelPairs(*lookahead_fst, &pairs);
+  Label unused_label = max_label + 1;
+  for (const auto &pair : pairs) {
+    max_label = std::max(max_label, pair.first);
+    unused_label = std::max(unused_label, pair.second + 1);
+  }
+  relabeling->assign(max_label + 2, unused_label);
+  (*relabeling)[0] = 0;
+  for (const auto &pair : pairs) {
+    if (pair.first > 0) (*relabeling)[pair.first] = pair.second;
+  }
+  return true;
+}
+
+// Maps label through a non-empty table made by GetLookAheadRelabeling().
+template <class Label>
+inline Label LookAheadRelabel(const std::vector<Label> &relabeling,
+                              Label label) {
+  const std::size_t last = relabeling.size() - 1;
+  return relabeling[std::min(static_cast<std::size_t>(label), last)];
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_LOOKAHEAD_H__
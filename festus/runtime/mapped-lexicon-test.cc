@@ -0,0 +1,115 @@
+// festus/runtime/mapped-lexicon-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for the memory-mapped pronunciation lexicon.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "mapped-lexicon.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+string TempPath(const string &name) {
+  const char *dir = std::getenv("TEST_TMPDIR");
+  return string(dir ? dir : "/tmp") + "/" + name;
+}
+
+std::unique_ptr<festus::MappedLexicon> CompileAndMap(
+    const festus::LexiconEntries &entries, const string &name) {
+  const string path = TempPath(name);
+  {
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    EXPECT_TRUE(festus::WriteMappedLexicon(entries, file));
+  }
+  return festus::MappedLexicon::FromFile(path);
+}
+
+TEST(MappedLexiconTest, Lookup) {
+  festus::LexiconEntries entries;
+  entries["aap"] = {{"A: p", 1.0f}};
+  entries["dié"] = {{"d i", 0.7f}, {"d i @", 0.2f}, {"d i E", 0.1f}};
+  entries["ek"] = {{"E k", 1.0f}};
+  entries["ekke"] = {{"E k @", 1.0f}};
+  auto lexicon = CompileAndMap(entries, "lookup.lex");
+  ASSERT_TRUE(lexicon != nullptr);
+  EXPECT_EQ(4, lexicon->NumWords());
+
+  festus::G2POptions opts;
+  opts.real_pruning_threshold = 0;
+  festus::G2PResult result;
+  for (const auto &entry : entries) {
+    ASSERT_TRUE(lexicon->Lookup(entry.first, opts, &result)) << entry.first;
+    EXPECT_EQ(entry.second, result.pronunciations);
+    EXPECT_EQ(entry.second.size(), result.num_hypotheses);
+  }
+  for (const char *word : {"", "a", "aapie", "di", "e", "ekk", "zulu"}) {
+    EXPECT_FALSE(lexicon->Lookup(word, opts, &result)) << word;
+  }
+}
+
+TEST(MappedLexiconTest, MaxPronsAndPruning) {
+  festus::LexiconEntries entries;
+  entries["dié"] = {{"d i", 0.7f}, {"d i @", 0.2f}, {"d i E", 0.1f}};
+  auto lexicon = CompileAndMap(entries, "pruning.lex");
+  ASSERT_TRUE(lexicon != nullptr);
+
+  festus::G2POptions opts;
+  festus::G2PResult result;
+  opts.max_prons = 2;
+  opts.real_pruning_threshold = 0;
+  ASSERT_TRUE(lexicon->Lookup("dié", opts, &result));
+  EXPECT_EQ(2, result.pronunciations.size());
+
+  opts.max_prons = 3;
+  opts.real_pruning_threshold = 0.25f;
+  ASSERT_TRUE(lexicon->Lookup("dié", opts, &result));
+  ASSERT_EQ(2, result.pronunciations.size());
+  EXPECT_EQ("d i @", result.pronunciations[1].first);
+
+  opts.max_prons = 1;
+  opts.real_pruning_threshold = 1;
+  ASSERT_TRUE(lexicon->Lookup("dié", opts, &result));
+  ASSERT_EQ(1, result.pronunciations.size());
+  EXPECT_EQ("d i", result.pronunciations[0].first);
+}
+
+TEST(MappedLexiconTest, Empty) {
+  auto lexicon = CompileAndMap(festus::LexiconEntries(), "empty.lex");
+  ASSERT_TRUE(lexicon != nullptr);
+  EXPECT_EQ(0, lexicon->NumWords());
+  festus::G2PResult result;
+  EXPECT_FALSE(lexicon->Lookup("aap", festus::G2POptions(), &result));
+}
+
+TEST(MappedLexiconTest, Invalid) {
+  const string path = TempPath("invalid.lex");
+  {
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    file << string(100, 'x');
+  }
+  EXPECT_TRUE(festus::MappedLexicon::FromFile(path) == nullptr);
+  EXPECT_TRUE(festus::MappedLexicon::FromFile(TempPath("missing.lex")) ==
+              nullptr);
+}
+
+}  // namespace
@@ -0,0 +1,306 @@
+// festus/runtime/mapped-lexicon.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Read-only, memory-mapped pronunciation lexicon for use in front of the G2P
+// model.
+//
+// A compiled lexicon is a sorted string table: a small header followed by
+// offset arrays and a blob of string bytes, all of which are used in place
+// after mapping the file into memory. Opening a lexicon therefore takes
+// constant time regardless of its size, and the (read-only, shared) pages are
+// shared by all processes that map the same file.
+
+#ifndef FESTUS_RUNTIME_MAPPED_LEXICON_H__
+#define FESTUS_RUNTIME_MAPPED_LEXICON_H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include <fst/compat.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-cache.h"
+#include "g2p.h"
+
+namespace festus {
+
+// Pronunciations and their probabilities, keyed on the orthographic word.
+typedef std::map<string, std::vector<std::pair<string, float>>> LexiconEntries;
+
+// On-disk layout of a compiled lexicon. All sections are 8-byte aligned and
+// stored in native byte order:
+//
+//   MappedLexiconHeader header;
+//   uint64 word_offsets[num_words + 1];
+//   uint64 word_prons[num_words + 1];
+//   uint64 pron_offsets[num_prons + 1];
+//   float pron_probs[num_prons];  // padded to a multiple of 8 bytes
+//   char strings[string_bytes];
+//
+// The spelling of word i is strings[word_offsets[i], word_offsets[i + 1]).
+// Its pronunciations are those with indices [word_prons[i], word_prons[i + 1]),
+// and the string of pronunciation p is located via pron_offsets in the same
+// way.
+//
+// Words are sorted in increasing byte-wise order.
+struct MappedLexiconHeader {
+  char magic[8];
+  uint32 byte_order_mark;
+  uint32 reserved;
+  uint64 num_words;
+  uint64 num_prons;
+  uint64 string_bytes;
+};
+
+static_assert(sizeof(MappedLexiconHeader) == 40,
+              "Unexpected size of MappedLexiconHeader");
+
+constexpr char kMappedLexiconMagic[8] = {
+  'F', 'E', 'S', 'T', 'L', 'E', 'X', '1',
+};
+constexpr uint32 kMappedLexiconByteOrderMark = 0x01020304;
+
+namespace internal {
+
+inline uint64 PaddedSize(uint64 size) { return (size + 7) & ~uint64(7); }
+
+inline uint64 MappedLexiconSize(const MappedLexiconHeader &header) {
+  return sizeof(MappedLexiconHeader) +
+      sizeof(uint64) * (2 * (header.num_words + 1) + header.num_prons + 1) +
+      PaddedSize(sizeof(float) * header.num_prons) +
+      header.string_bytes;
+}
+
+template <class T>
+void WriteArray(const std::vector<T> &array, std::ostream *strm) {
+  strm->write(reinterpret_cast<const char *>(array.data()),
+              sizeof(T) * array.size());
+}
+
+}  // namespace internal
+
+// Writes the given entries in compiled form. Returns false on error.
+inline bool WriteMappedLexicon(const LexiconEntries &entries,
+                               std::ostream &strm) {
+  std::vector<uint64> word_offsets, word_prons, pron_offsets;
+  std::vector<float> pron_probs;
+  string strings;
+  word_offsets.reserve(entries.size() + 1);
+  word_prons.reserve(entries.size() + 1);
+  // All spellings come first, followed by all pronunciations, so that the
+  // extent of each string is delimited by the next offset.
+  for (const auto &entry : entries) {
+    word_offsets.push_back(strings.size());
+    strings.append(entry.first);
+  }
+  word_offsets.push_back(strings.size());
+  for (const auto &entry : entries) {
+    word_prons.push_back(pron_offsets.size());
+    for (const auto &pron : entry.second) {
+      pron_offsets.push_back(strings.size());
+      strings.append(pron.first);
+      pron_probs.push_back(pron.second);
+    }
+  }
+  word_prons.push_back(pron_offsets.size());
+  pron_offsets.push_back(strings.size());
+
+  MappedLexiconHeader header;
+  std::memcpy(header.magic, kMappedLexiconMagic, sizeof(header.magic));
+  header.byte_order_mark = kMappedLexiconByteOrderMark;
+  header.reserved = 0;
+  header.num_words = entries.size();
+  header.num_prons = pron_probs.size();
+  header.string_bytes = strings.size();
+  strm.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  internal::WriteArray(word_offsets, &strm);
+  internal::WriteArray(word_prons, &strm);
+  internal::WriteArray(pron_offsets, &strm);
+  internal::WriteArray(pron_probs, &strm);
+  const std::size_t probs_size = sizeof(float) * pron_probs.size();
+  strm.write("\0\0\0\0\0\0\0", internal::PaddedSize(probs_size) - probs_size);
+  strm.write(strings.data(), strings.size());
+  return !strm.fail();
+}
+
+// A compiled lexicon mapped read-only into memory.
+class MappedLexicon {
+ public:
+  ~MappedLexicon() {
+    if (data_ != nullptr) munmap(const_cast<char *>(data_), size_);
+  }
+
+  // Maps a compiled lexicon into memory. Returns nullptr on error.
+  static std::unique_ptr<MappedLexicon> FromFile(const string &path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LOG(ERROR) << "Could not open lexicon " << path;
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<uint64>(st.st_size) < sizeof(MappedLexiconHeader)) {
+      LOG(ERROR) << "Lexicon file is too short: " << path;
+      close(fd);
+      return nullptr;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Could not map lexicon " << path;
+      return nullptr;
+    }
+    std::unique_ptr<MappedLexicon> lexicon(
+        new MappedLexicon(static_cast<const char *>(data), st.st_size));
+    if (!lexicon->Init()) {
+      LOG(ERROR) << "Invalid lexicon file: " << path;
+      return nullptr;
+    }
+    return lexicon;
+  }
+
+  std::size_t NumWords() const { return header_->num_words; }
+
+  // Looks up the pronunciations of the given spelling. Returns false if the
+  // spelling is not in the lexicon. Otherwise returns true and stores at most
+  // opts.max_prons pronunciations in *result, subject to the same relative
+  // pruning by opts.real_pruning_threshold as in G2P<>::Pronounce().
+  bool Lookup(const string &spelling,
+              const G2POptions &opts,
+              G2PResult *result) const {
+    // Binary search for the first word not less than the spelling.
+    uint64 word = 0;
+    for (uint64 count = header_->num_words; count > 0; /*empty*/) {
+      const uint64 half = count / 2;
+      if (Compare(word + half, spelling) < 0) {
+        word += half + 1;
+        count -= half + 1;
+      } else {
+        count = half;
+      }
+    }
+    if (word == header_->num_words || Compare(word, spelling) != 0) {
+      return false;
+    }
+    const uint64 begin = word_prons_[word];
+    const uint64 end = word_prons_[word + 1];
+    result->num_hypotheses = end - begin;
+    result->pronunciations.clear();
+    result->error.clear();
+    for (uint64 p = begin; p < end; ++p) {
+      if (result->pronunciations.size() >= opts.max_prons) break;
+      if (opts.max_prons > 1 && p > begin &&
+          pron_probs_[p] < pron_probs_[begin] * opts.real_pruning_threshold) {
+        break;
+      }
+      result->pronunciations.emplace_back(
+          string(strings_ + pron_offsets_[p],
+                 pron_offsets_[p + 1] - pron_offsets_[p]),
+          pron_probs_[p]);
+    }
+    return true;
+  }
+
+ private:
+  MappedLexicon(const char *data, std::size_t size)
+      : data_(data), size_(size) {}
+
+  // Sets up pointers into the mapped data and validates the header.
+  bool Init() {
+    header_ = reinterpret_cast<const MappedLexiconHeader *>(data_);
+    if (std::memcmp(header_->magic, kMappedLexiconMagic,
+                    sizeof(header_->magic)) != 0) {
+      LOG(ERROR) << "Bad magic number";
+      return false;
+    }
+    if (header_->byte_order_mark != kMappedLexiconByteOrderMark) {
+      LOG(ERROR) << "Lexicon was compiled with a different byte order";
+      return false;
+    }
+    if (internal::MappedLexiconSize(*header_) != size_) {
+      LOG(ERROR) << "Lexicon file size does not match its header";
+      return false;
+    }
+    const char *ptr = data_ + sizeof(MappedLexiconHeader);
+    word_offsets_ = reinterpret_cast<const uint64 *>(ptr);
+    ptr += sizeof(uint64) * (header_->num_words + 1);
+    word_prons_ = reinterpret_cast<const uint64 *>(ptr);
+    ptr += sizeof(uint64) * (header_->num_words + 1);
+    pron_offsets_ = reinterpret_cast<const uint64 *>(ptr);
+    ptr += sizeof(uint64) * (header_->num_prons + 1);
+    pron_probs_ = reinterpret_cast<const float *>(ptr);
+    ptr += internal::PaddedSize(sizeof(float) * header_->num_prons);
+    strings_ = ptr;
+    // Check the last offsets only; this keeps opening the lexicon O(1).
+    return word_offsets_[header_->num_words] <= header_->string_bytes &&
+        pron_offsets_[header_->num_prons] <= header_->string_bytes &&
+        word_prons_[header_->num_words] == header_->num_prons;
+  }
+
+  // Compares the i-th word with the given spelling in byte-wise order.
+  int Compare(uint64 i, const string &spelling) const {
+    const std::size_t size = word_offsets_[i + 1] - word_offsets_[i];
+    const int cmp = std::memcmp(strings_ + word_offsets_[i], spelling.data(),
+                                std::min(size, spelling.size()));
+    if (cmp != 0) return cmp;
+    return size < spelling.size() ? -1 : (size > spelling.size() ? 1 : 0);
+  }
+
+  const char *const data_;
+  const std::size_t size_;
+  const MappedLexiconHeader *header_ = nullptr;
+  const uint64 *word_offsets_ = nullptr;
+  const uint64 *word_prons_ = nullptr;
+  const uint64 *pron_offsets_ = nullptr;
+  const float *pron_probs_ = nullptr;
+  const char *strings_ = nullptr;
+
+  MappedLexicon(const MappedLexicon &) = delete;
+  MappedLexicon &operator=(const MappedLexicon &) = delete;
+};
+
+// Finds pronunciations like G2P<>::Pronounce(), but answers exact matches
+// from the lexicon (if not null) without consulting the model. Other words
+// are looked up in the cache (if not null) before the model is used, as by
+// CachedPronounce().
+template <class Arc>
+bool LexiconPronounce(const G2P<Arc> &g2p,
+                      const MappedLexicon *lexicon,
+                      G2PCache *cache,
+                      const string &spelling,
+                      G2PResult *result,
+                      const G2POptions &opts,
+                      G2PWorkspace<Arc> *workspace) {
+  if (lexicon && lexicon->Lookup(spelling, opts, result)) return true;
+  return CachedPronounce(g2p, cache, spelling, result, opts, workspace);
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_MAPPED_LEXICON_H__
@@ -0,0 +1,133 @@
+// festus/runtime/model-io-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for reading and writing memory-mappable runtime model FSTs.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "model-io.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include <fst/fstlib.h>
+#include <fst/extensions/ngram/ngram-fst.h>
+#include <gtest/gtest.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "compact.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+typedef fst::VectorFst<MyArc> MyVectorFst;
+
+static fst::FstRegisterer<festus::Compact_8_10_0_14_Fst<MyArc>> compact_reg;
+
+const char kGraphoneModel[] =
+    "festus/runtime/ngram_model_with_final_backoff.fst";
+
+string TempPath(const string &name) {
+  const char *dir = std::getenv("TEST_TMPDIR");
+  return string(dir ? dir : "/tmp") + "/" + name;
+}
+
+MyVectorFst ReadGraphoneModel() {
+  std::unique_ptr<fst::StdVectorFst> model(
+      fst::StdVectorFst::Read(kGraphoneModel));
+  EXPECT_TRUE(model != nullptr);
+  MyVectorFst log_model;
+  if (model) fst::Map(*model, &log_model, fst::StdToLogMapper());
+  log_model.SetInputSymbols(nullptr);
+  log_model.SetOutputSymbols(nullptr);
+  return log_model;
+}
+
+TEST(ModelIoTest, MappableNGramFst) {
+  const fst::NGramFst<MyArc> ngram(ReadGraphoneModel());
+  const string path = TempPath("model-io-test.ngram");
+  ASSERT_TRUE(festus::WriteMappableNGramFst(ngram, path));
+
+  for (bool memory_map : {true, false}) {
+    std::unique_ptr<fst::Fst<MyArc>> fst(
+        festus::ReadModelFst<MyArc>(path, memory_map));
+    ASSERT_TRUE(fst != nullptr);
+    EXPECT_EQ("ngram", fst->Type());
+    EXPECT_TRUE(fst::Equal(ngram, *fst));
+
+    // Copies remain valid after the original is gone.
+    std::unique_ptr<fst::Fst<MyArc>> copy(fst->Copy(true));
+    fst.reset();
+    EXPECT_TRUE(fst::Equal(ngram, *copy));
+  }
+
+  // Reading with the wrong arc type fails.
+  std::unique_ptr<fst::StdFst> std_fst(
+      festus::ReadModelFst<fst::StdArc>(path, true));
+  EXPECT_TRUE(std_fst == nullptr);
+}
+
+TEST(ModelIoTest, TruncatedNGramFst) {
+  const fst::NGramFst<MyArc> ngram(ReadGraphoneModel());
+  const string path = TempPath("model-io-test-truncated.ngram");
+  ASSERT_TRUE(festus::WriteMappableNGramFst(ngram, path));
+  string contents;
+  {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+  }
+  {
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    file.write(contents.data(), contents.size() / 2);
+  }
+  std::unique_ptr<fst::Fst<MyArc>> fst(
+      festus::ReadModelFst<MyArc>(path, true));
+  EXPECT_TRUE(fst == nullptr);
+}
+
+TEST(ModelIoTest, AlignedCompactFst) {
+  MyVectorFst vector_fst;
+  vector_fst.AddState();
+  vector_fst.AddState();
+  vector_fst.SetStart(0);
+  vector_fst.AddArc(0, MyArc(1, 2, MyArc::Weight::One(), 1));
+  vector_fst.AddArc(1, MyArc(3, 4, MyArc::Weight::One(), 0));
+  vector_fst.SetFinal(1, MyArc::Weight::One());
+  const festus::Compact_8_10_0_14_Fst<MyArc> compact_fst(vector_fst);
+  const string path = TempPath("model-io-test.compact");
+  ASSERT_TRUE(festus::WriteAlignedFst(compact_fst, path));
+
+  for (bool memory_map : {true, false}) {
+    std::unique_ptr<fst::Fst<MyArc>> fst(
+        festus::ReadModelFst<MyArc>(path, memory_map));
+    ASSERT_TRUE(fst != nullptr);
+    EXPECT_EQ(compact_fst.Type(), fst->Type());
+    EXPECT_TRUE(fst::Equal(vector_fst, *fst));
+  }
+}
+
+TEST(ModelIoTest, MissingFile) {
+  std::unique_ptr<fst::Fst<MyArc>> fst(
+      festus::ReadModelFst<MyArc>(TempPath("model-io-test.missing"), true));
+  EXPECT_TRUE(fst == nullptr);
+}
+
+}  // namespace
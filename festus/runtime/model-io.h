@@ -0,0 +1,222 @@
+// festus/runtime/model-io.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Reading and writing of runtime model FSTs in memory-mappable form.
+//
+// Compact and const FSTs can be mapped into memory by OpenFst itself, provided
+// that they were written with aligned sections; see WriteAlignedFst().
+//
+// NGramFst, on the other hand, always copies its data to the heap when read in
+// the standard format, since its data section follows the variable-length FST
+// header. A mappable NGramFst file instead consists of a fixed-size header
+// followed by the (aligned) data of the NGramFst, which is used in place after
+// mapping the file into memory; see WriteMappableNGramFst().
+//
+// In both cases, loading a model takes time independent of its size, and the
+// (read-only, shared) pages are shared by all processes that map the same file.
+
+#ifndef FESTUS_RUNTIME_MODEL_IO_H__
+#define FESTUS_RUNTIME_MODEL_IO_H__
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <utility>
+
+#include <fst/compat.h>
+#include <fst/fstlib.h>
+#include <fst/mapped-file.h>
+#include <fst/extensions/ngram/ngram-fst.h>
+
+namespace festus {
+
+// Writes the given FST with its sections aligned, so that compact and const
+// FSTs can later be mapped into memory. Writes to stdout if path is empty,
+// which then has to be seekable.
+template <class Arc>
+bool WriteAlignedFst(const fst::Fst<Arc> &fst, const string &path) {
+  std::ofstream file;
+  if (!path.empty()) {
+    file.open(path, std::ios::out | std::ios::binary);
+    if (!file) {
+      LOG(ERROR) << "Could not open " << path << " for writing";
+      return false;
+    }
+  }
+  std::ostream &strm = path.empty() ? std::cout : file;
+  fst::FstWriteOptions opts(path.empty() ? "standard output" : path);
+  opts.align = true;
+  return fst.Write(strm, opts);
+}
+
+// On-disk layout of a mappable NGramFst, in native byte order:
+//
+//   MappableNGramHeader header;
+//   char data[data_size];  // as returned by NGramFst<>::GetData()
+//
+// The size of the header is a multiple of the alignment required by the data.
+struct MappableNGramHeader {
+  char magic[8];
+  uint32 byte_order_mark;
+  uint32 reserved;
+  uint64 data_size;
+  char arc_type[24];  // NUL-terminated
+};
+
+static_assert(sizeof(MappableNGramHeader) == 48,
+              "Unexpected size of MappableNGramHeader");
+static_assert(sizeof(MappableNGramHeader) % fst::MappedFile::kArchAlignment
+              == 0, "MappableNGramHeader breaks the alignment of the data");
+
+constexpr char kMappableNGramMagic[8] = {
+  'F', 'E', 'S', 'T', 'N', 'G', 'M', '1',
+};
+constexpr uint32 kMappableNGramByteOrderMark = 0x01020304;
+
+// An NGramFst whose data is owned by a (possibly memory-mapped) region of a
+// file. Copies share the region, so that it outlives all of them.
+template <class Arc>
+class MappedNGramFst : public fst::NGramFst<Arc> {
+ public:
+  explicit MappedNGramFst(std::shared_ptr<fst::MappedFile> region)
+      : fst::NGramFst<Arc>(static_cast<const char *>(region->data()),
+                           false /* not owned */),
+        region_(std::move(region)) {}
+
+  MappedNGramFst(const MappedNGramFst &fst, bool safe = false)
+      : fst::NGramFst<Arc>(fst, safe), region_(fst.region_) {}
+
+  MappedNGramFst *Copy(bool safe = false) const override {
+    return new MappedNGramFst(*this, safe);
+  }
+
+ private:
+  std::shared_ptr<fst::MappedFile> region_;
+};
+
+// Writes the given NGramFst in mappable form. Writes to stdout if path is
+// empty. Returns false on error.
+template <class Arc>
+bool WriteMappableNGramFst(const fst::NGramFst<Arc> &fst,
+                           const string &path) {
+  MappableNGramHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMappableNGramMagic, sizeof(header.magic));
+  header.byte_order_mark = kMappableNGramByteOrderMark;
+  const string &arc_type = Arc::Type();
+  if (arc_type.size() >= sizeof(header.arc_type)) {
+    LOG(ERROR) << "Arc type name is too long: " << arc_type;
+    return false;
+  }
+  arc_type.copy(header.arc_type, arc_type.size());
+  std::size_t data_size = 0;
+  const char *data = fst.GetData(&data_size);
+  header.data_size = data_size;
+
+  std::ofstream file;
+  if (!path.empty()) {
+    file.open(path, std::ios::out | std::ios::binary);
+    if (!file) {
+      LOG(ERROR) << "Could not open " << path << " for writing";
+      return false;
+    }
+  }
+  std::ostream &strm = path.empty() ? std::cout : file;
+  strm.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  strm.write(data, data_size);
+  strm.flush();
+  if (strm.fail()) {
+    LOG(ERROR) << "Could not write NGramFst to "
+               << (path.empty() ? "standard output" : path);
+    return false;
+  }
+  return true;
+}
+
+namespace internal {
+
+// Reads the remainder of a mappable NGramFst whose header has been read from
+// strm. Returns nullptr on error.
+template <class Arc>
+fst::Fst<Arc> *ReadMappableNGramFst(const MappableNGramHeader &header,
+                                    std::istream *strm,
+                                    const string &path,
+                                    bool memory_map) {
+  if (header.byte_order_mark != kMappableNGramByteOrderMark) {
+    LOG(ERROR) << "NGramFst was written with a different byte order: " << path;
+    return nullptr;
+  }
+  if (string(header.arc_type, strnlen(header.arc_type,
+                                      sizeof(header.arc_type))) !=
+      Arc::Type()) {
+    LOG(ERROR) << "NGramFst has arc type " << header.arc_type
+               << ", expected " << Arc::Type() << ": " << path;
+    return nullptr;
+  }
+  // Validate the file size up front, since NGramFst trusts its data.
+  const std::streampos begin = strm->tellg();
+  strm->seekg(0, std::ios::end);
+  if (static_cast<uint64>(strm->tellg() - begin) != header.data_size) {
+    LOG(ERROR) << "NGramFst file size does not match its header: " << path;
+    return nullptr;
+  }
+  strm->seekg(begin);
+  std::shared_ptr<fst::MappedFile> region(
+      fst::MappedFile::Map(strm, memory_map, path, header.data_size));
+  if (!region || strm->fail()) {
+    LOG(ERROR) << "Could not read NGramFst data: " << path;
+    return nullptr;
+  }
+  return new MappedNGramFst<Arc>(std::move(region));
+}
+
+}  // namespace internal
+
+// Reads a runtime model FST from the given file, or from stdin if path is
+// empty. Both mappable NGramFsts and FSTs in the standard format are
+// recognized, where the latter are read through the FST registry, so their
+// types must be registered. If memory_map is true, the model is mapped into
+// memory where its on-disk layout allows, and read into the heap otherwise.
+// Returns nullptr on error.
+template <class Arc>
+fst::Fst<Arc> *ReadModelFst(const string &path, bool memory_map) {
+  if (path.empty()) return fst::Fst<Arc>::Read(path);
+  std::ifstream strm(path, std::ios::in | std::ios::binary);
+  if (!strm) {
+    LOG(ERROR) << "Could not open " << path;
+    return nullptr;
+  }
+  MappableNGramHeader header;
+  if (strm.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+      std::memcmp(header.magic, kMappableNGramMagic,
+                  sizeof(header.magic)) == 0) {
+    return internal::ReadMappableNGramFst<Arc>(header, &strm, path,
+                                               memory_map);
+  }
+  strm.clear();
+  strm.seekg(0);
+  fst::FstReadOptions opts(path);
+  opts.mode = memory_map ? fst::FstReadOptions::MAP : fst::FstReadOptions::READ;
+  return fst::Fst<Arc>::Read(strm, opts);
+}
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_MODEL_IO_H__
@@ -0,0 +1,127 @@
+// festus/runtime/quantized-test.cc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Unit test for quantized n-gram models.
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "quantized.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <fst/fstlib.h>
+#include <gtest/gtest.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "g2p-test-model.h"
+
+namespace {
+
+typedef fst::LogArc MyArc;
+
+static festus::QuantizedCompactFstRegisterer<MyArc> quantized_reg;
+
+const char kGraphoneModel[] =
+    "festus/runtime/ngram_model_with_final_backoff.fst";
+
+double MeanSquaredError(const festus::WeightCodebook &codebook,
+                        const std::vector<float> &weights) {
+  double sum = 0;
+  for (float weight : weights) {
+    const double error = codebook.Quantize(weight) - weight;
+    sum += error * error;
+  }
+  return sum / weights.size();
+}
+
+TEST(WeightCodebookTest, Exact) {
+  const std::vector<float> weights = {3, 1, 2, 1, 3};
+  const auto codebook = festus::WeightCodebook::Train(weights, 4);
+  ASSERT_EQ(3, codebook.Size());
+  for (float weight : weights) {
+    EXPECT_EQ(weight, codebook.Quantize(weight));
+  }
+  EXPECT_EQ(0, codebook.Index(-10));
+  EXPECT_EQ(2, codebook.Index(10));
+  EXPECT_EQ(1, codebook.Index(2.4f));
+}
+
+TEST(WeightCodebookTest, Lloyd) {
+  std::vector<float> weights;
+  for (int i = 0; i < 10000; ++i) {
+    weights.push_back(std::sqrt(i * 0.01f));
+  }
+  const auto codebook = festus::WeightCodebook::Train(weights, 16);
+  EXPECT_LE(codebook.Size(), 16);
+  // Lloyd's algorithm improves on its initialization at the quantiles.
+  const auto initial = festus::WeightCodebook::Train(weights, 16, 0);
+  EXPECT_LT(MeanSquaredError(codebook, weights),
+            MeanSquaredError(initial, weights));
+
+  std::stringstream strm;
+  ASSERT_TRUE(codebook.Write(strm));
+  festus::WeightCodebook read_codebook;
+  ASSERT_TRUE(read_codebook.Read(strm));
+  ASSERT_EQ(codebook.Size(), read_codebook.Size());
+  for (std::size_t i = 0; i < codebook.Size(); ++i) {
+    EXPECT_EQ(codebook.Value(i), read_codebook.Value(i));
+  }
+}
+
+TEST(QuantizedTest, GraphoneModel) {
+  festus::G2PTestMachines machines;
+  ASSERT_TRUE(festus::MakeG2PTestMachines(kGraphoneModel, &machines));
+  const fst::VectorFst<MyArc> &model = machines.graphone_model;
+
+  for (int weight_bits : {8, 16}) {
+    festus::QuantizationReport report;
+    auto quantized = festus::MakeQuantizedCompactFst(model, 0, weight_bits,
+                                                     &report);
+    ASSERT_TRUE(quantized != nullptr);
+    EXPECT_LE(report.prob_codebook_size, 1 << weight_bits);
+    EXPECT_LE(report.backoff_codebook_size, 1 << weight_bits);
+    EXPECT_GT(report.num_probs, 0);
+    EXPECT_GT(report.num_backoffs, 0);
+    EXPECT_LE(report.prob_mean_error, report.prob_max_error);
+    const float delta =
+        std::max(report.prob_max_error, report.backoff_max_error) + 1e-5;
+    EXPECT_TRUE(fst::Equal(model, *quantized, delta));
+
+    std::stringstream strm;
+    ASSERT_TRUE(quantized->Write(strm, fst::FstWriteOptions("test")));
+    std::unique_ptr<fst::Fst<MyArc>> read_fst(
+        fst::Fst<MyArc>::Read(strm, fst::FstReadOptions("test")));
+    ASSERT_TRUE(read_fst != nullptr);
+    EXPECT_EQ(report.type, read_fst->Type());
+    EXPECT_TRUE(fst::Equal(*quantized, *read_fst));
+  }
+}
+
+TEST(QuantizedTest, RejectsTransducers) {
+  fst::VectorFst<MyArc> fst;
+  fst.AddState();
+  fst.SetStart(0);
+  fst.SetFinal(0, MyArc::Weight::One());
+  fst.AddArc(0, MyArc(1, 2, 0.5f, 0));
+  EXPECT_TRUE(festus::MakeQuantizedCompactFst(fst, 0, 8) == nullptr);
+}
+
+}  // namespace
@@ -0,0 +1,467 @@
+// festus/runtime/quantized.h
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2016 Google, Inc.
+// Author: mjansche@google.com (Martin Jansche)
+//
+// \file
+// Weighted compact representation of backoff n-gram models with quantized
+// weights, for use with OpenFst's CompactFst template class.
+//
+// Each arc (and each final weight) is packed into a 32-bit or 64-bit element
+// holding its label, its target state, and an 8-bit or 16-bit index into a
+// per-model codebook of weights. There are two codebooks, one for the weights
+// of backoff arcs and one for all other weights (n-gram log-probabilities and
+// final weights), since their distributions differ. Codebooks are trained
+// with Lloyd's algorithm, which minimizes the mean squared quantization error.
+//
+// Models in this format are ordinary CompactFsts: they can be read with the
+// generic Fst<>::Read() once QuantizedCompactFstRegisterer has registered them,
+// and mapped into memory if written with aligned sections.
+
+#ifndef FESTUS_RUNTIME_QUANTIZED_H__
+#define FESTUS_RUNTIME_QUANTIZED_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fst/compact-fst.h>
+#include <fst/compat.h>
+#include <fst/fst.h>
+#include <fst/util.h>
+
+// NB: Non-standard include directive to facilitate stand-alone compilation.
+#include "compact.h"
+
+namespace festus {
+
+// Sorted table of weight values, indexed by quantized weights.
+class WeightCodebook {
+ public:
+  // Trains a codebook with at most max_size values that minimizes the mean
+  // squared error of quantizing the given weights. If there are no more than
+  // max_size distinct weights, the codebook represents them exactly.
+  static WeightCodebook Train(std::vector<float> weights,
+                              std::size_t max_size,
+                              int max_iterations = 30) {
+    WeightCodebook codebook;
+    if (weights.empty() || max_size == 0) return codebook;
+    std::sort(weights.begin(), weights.end());
+    std::vector<float> &values = codebook.values_;
+    std::unique_copy(weights.begin(), weights.end(),
+                     std::back_inserter(values));
+    if (values.size() <= max_size) return codebook;
+
+    // Lloyd's algorithm in one dimension, starting from evenly spaced
+    // quantiles. Since both weights and values are sorted, each iteration
+    // assigns weights to their nearest values in a single merge-like pass.
+    const std::size_t n = weights.size();
+    values.clear();
+    for (std::size_t k = 0; k < max_size; ++k) {
+      values.push_back(weights[(2 * k + 1) * n / (2 * max_size)]);
+    }
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    std::vector<double> sums;
+    std::vector<std::size_t> counts;
+    for (int iteration = 0; iteration < max_iterations; ++iteration) {
+      sums.assign(values.size(), 0);
+      counts.assign(values.size(), 0);
+      std::size_t k = 0;
+      for (float weight : weights) {
+        while (k + 1 < values.size() &&
+               weight - values[k] > values[k + 1] - weight) {
+          ++k;
+        }
+        sums[k] += weight;
+        ++counts[k];
+      }
+      bool changed = false;
+      for (k = 0; k < values.size(); ++k) {
+        if (counts[k] == 0) continue;
+        const float mean = sums[k] / counts[k];
+        changed |= mean != values[k];
+        values[k] = mean;
+      }
+      values.erase(std::unique(values.begin(), values.end()), values.end());
+      if (!changed) break;
+    }
+    return codebook;
+  }
+
+  std::size_t Size() const { return values_.size(); }
+
+  float Value(std::size_t index) const { return values_[index]; }
+
+  // Returns the index of the value nearest to the given weight.
+  std::size_t Index(float weight) const {
+    CHECK(!values_.empty());
+    auto iter = std::lower_bound(values_.begin(), values_.end(), weight);
+    if (iter == values_.end()) return values_.size() - 1;
+    if (iter != values_.begin() && weight - iter[-1] <= *iter - weight) {
+      --iter;
+    }
+    return iter - values_.begin();
+  }
+
+  float Quantize(float weight) const { return values_[Index(weight)]; }
+
+  bool Write(std::ostream &strm) const {
+    fst::WriteType(strm, values_);
+    return !strm.fail();
+  }
+
+  bool Read(std::istream &strm) {
+    fst::ReadType(strm, &values_);
+    return !strm.fail() && std::is_sorted(values_.begin(), values_.end());
+  }
+
+ private:
+  std::vector<float> values_;
+};
+
+// The codebooks of a quantized model and the label of its backoff arcs.
+struct QuantizationTables {
+  int backoff_label = 0;
+  WeightCodebook probs;
+  WeightCodebook backoffs;
+
+  const WeightCodebook &ForLabel(int label) const {
+    return label == backoff_label ? backoffs : probs;
+  }
+
+  bool Write(std::ostream &strm) const {
+    fst::WriteType(strm, backoff_label);
+    return !strm.fail() && probs.Write(strm) && backoffs.Write(strm);
+  }
+
+  bool Read(std::istream &strm) {
+    fst::ReadType(strm, &backoff_label);
+    return !strm.fail() && probs.Read(strm) && backoffs.Read(strm);
+  }
+};
+
+// Compactor for weighted acceptors whose weights are quantized with the given
+// codebooks.
+template <class A, int LABEL_BITS, int WEIGHT_BITS, int NEXTSTATE_BITS>
+class QuantizedAcceptorCompactor {
+ public:
+  typedef A Arc;
+  typedef typename A::Label Label;
+  typedef typename A::StateId StateId;
+  typedef typename A::Weight Weight;
+
+  static_assert(LABEL_BITS + WEIGHT_BITS + NEXTSTATE_BITS <= 64,
+                "Bitfields do not fit into 64 bits");
+
+  // Elements occupy 32 bits if the fields fit, and 64 bits otherwise.
+  typedef typename std::conditional<
+    LABEL_BITS + WEIGHT_BITS + NEXTSTATE_BITS <= 32,
+    uint32, uint64>::type Storage;
+
+  struct Element {
+    Storage label : LABEL_BITS;
+    Storage weight : WEIGHT_BITS;
+    Storage nextstate : NEXTSTATE_BITS;
+  };
+
+  static_assert(sizeof(Element) == sizeof(Storage),
+                "Unexpected size of Element");
+
+  static constexpr int kWeightBits = WEIGHT_BITS;
+
+  // The largest label and state values are reserved for the final weight
+  // element, which has label kNoLabel and target state kNoStateId.
+  static constexpr uint64 kMaxLabel = (uint64{1} << LABEL_BITS) - 1;
+  static constexpr uint64 kMaxState = (uint64{1} << NEXTSTATE_BITS) - 1;
+  static constexpr uint64 kMaxCodebookSize = uint64{1} << WEIGHT_BITS;
+
+  QuantizedAcceptorCompactor()
+      : tables_(std::make_shared<QuantizationTables>()) {}
+
+  explicit QuantizedAcceptorCompactor(
+      std::shared_ptr<const QuantizationTables> tables)
+      : tables_(std::move(tables)) {}
+
+  // Returns true if all labels and state IDs within the given extent can be
+  // represented.
+  static bool Fits(const BitfieldExtent &extent) {
+    return extent.max_ilabel < kMaxLabel &&
+        extent.max_olabel < kMaxLabel &&
+        extent.max_state < kMaxState;
+  }
+
+  Element Compact(StateId s, const A &arc) const {
+    Element element;
+    if (arc.ilabel == fst::kNoLabel) {
+      element.label = kMaxLabel;
+    } else {
+      CHECK_GE(arc.ilabel, 0);
+      if (arc.ilabel != arc.olabel) {
+        LOG(ERROR) << "Not an acceptor arc: " << arc.ilabel << ":"
+                   << arc.olabel;
+      }
+      const uint64 label = arc.ilabel;
+      if (label < kMaxLabel) {
+        element.label = label;
+      } else {
+        LOG(ERROR) << "Label too large: " << label;
+        element.label = kMaxLabel;
+      }
+    }
+    const WeightCodebook &codebook = tables_->ForLabel(arc.ilabel);
+    if (arc.weight == Weight::Zero()) {
+      LOG(ERROR) << "Arc weight is Zero; this cannot happen!";
+      element.weight = 0;
+    } else {
+      element.weight = codebook.Index(arc.weight.Value());
+    }
+    if (arc.nextstate == fst::kNoStateId) {
+      element.nextstate = kMaxState;
+    } else {
+      CHECK_GE(arc.nextstate, 0);
+      const uint64 next = arc.nextstate;
+      if (next < kMaxState) {
+        element.nextstate = next;
+      } else {
+        LOG(ERROR) << "Target state ID too large: " << next;
+        element.nextstate = kMaxState;
+      }
+    }
+    return element;
+  }
+
+  Arc Expand(StateId s, const Element &e,
+             uint32 f = fst::kArcValueFlags) const {
+    Label label = e.label == kMaxLabel
+        ? fst::kNoLabel : static_cast<Label>(e.label);
+    StateId next = e.nextstate == kMaxState
+        ? fst::kNoStateId : static_cast<StateId>(e.nextstate);
+    Weight weight(tables_->ForLabel(label).Value(e.weight));
+    return Arc(label, label, weight, next);
+  }
+
+  ssize_t Size() const { return -1; }
+
+  uint64 Properties() const { return fst::kAcceptor; }
+
+  bool Compatible(const fst::Fst<A> &fst) const {
+    uint64 props = Properties();
+    return fst.Properties(props, true) == props &&
+        tables_->probs.Size() <= kMaxCodebookSize &&
+        tables_->backoffs.Size() <= kMaxCodebookSize;
+  }
+
+  static const string &Type() {
+    static const string type = MakeTypeName();
+    return type;
+  }
+
+  bool Write(std::ostream &strm) const { return tables_->Write(strm); }
+
+  static QuantizedAcceptorCompactor *Read(std::istream &strm) {
+    auto tables = std::make_shared<QuantizationTables>();
+    if (!tables->Read(strm) ||
+        tables->probs.Size() > kMaxCodebookSize ||
+        tables->backoffs.Size() > kMaxCodebookSize) {
+      LOG(ERROR) << "Could not read quantization tables";
+      return nullptr;
+    }
+    return new QuantizedAcceptorCompactor(std::move(tables));
+  }
+
+  const QuantizationTables &Tables() const { return *tables_; }
+
+ private:
+  static string MakeTypeName() {
+    char buf[48];
+    int len = std::snprintf(buf, sizeof(buf),
+                            "quantized_%d_%d_%d",
+                            LABEL_BITS, WEIGHT_BITS, NEXTSTATE_BITS);
+    return string(buf, len);
+  }
+
+  std::shared_ptr<const QuantizationTables> tables_;
+};
+
+// The family of quantized layouts supported by the runtime, ordered by element
+// size for each number of weight bits. As with BitfieldCompactors, layouts can
+// be added, but must never be removed.
+template <class A>
+using QuantizedCompactors = std::tuple<
+    // 8-bit weight indices.
+    QuantizedAcceptorCompactor<A, 10, 8, 14>,
+    QuantizedAcceptorCompactor<A, 12, 8, 12>,
+    QuantizedAcceptorCompactor<A, 24, 8, 32>,
+    // 16-bit weight indices.
+    QuantizedAcceptorCompactor<A, 16, 16, 32>,
+    QuantizedAcceptorCompactor<A, 20, 16, 28>>;
+
+// Quantization errors (absolute differences between original and quantized
+// weights, in nats) of a quantized model.
+struct QuantizationReport {
+  string type;
+  std::size_t num_probs = 0;
+  std::size_t num_backoffs = 0;
+  std::size_t prob_codebook_size = 0;
+  std::size_t backoff_codebook_size = 0;
+  double prob_mean_error = 0;
+  double prob_max_error = 0;
+  double backoff_mean_error = 0;
+  double backoff_max_error = 0;
+};
+
+namespace internal {
+
+template <class A>
+class QuantizedCompactFstMaker {
+ public:
+  QuantizedCompactFstMaker(const fst::Fst<A> &fst,
+                           const BitfieldExtent &extent,
+                           int weight_bits,
+                           std::shared_ptr<const QuantizationTables> tables)
+      : fst_(fst), extent_(extent), weight_bits_(weight_bits),
+        tables_(std::move(tables)) {}
+
+  template <class C>
+  void Visit() {
+    if (!result_ && C::kWeightBits == weight_bits_ && C::Fits(extent_)) {
+      result_.reset(new fst::CompactFst<A, C>(fst_, C(tables_)));
+    }
+  }
+
+  std::unique_ptr<fst::Fst<A>> Release() { return std::move(result_); }
+
+ private:
+  const fst::Fst<A> &fst_;
+  const BitfieldExtent &extent_;
+  const int weight_bits_;
+  const std::shared_ptr<const QuantizationTables> tables_;
+  std::unique_ptr<fst::Fst<A>> result_;
+};
+
+inline void AddError(double error, double *sum, double *max) {
+  *sum += error;
+  *max = std::max(*max, error);
+}
+
+}  // namespace internal
+
+// Returns a copy of the given backoff n-gram model (an acceptor) with its
+// weights quantized to weight_bits (8 or 16) bits, in the smallest layout
+// that can represent all its labels and state IDs, or nullptr on error. If
+// report is not null, it receives the quantization errors.
+template <class A>
+std::unique_ptr<fst::Fst<A>> MakeQuantizedCompactFst(
+    const fst::Fst<A> &model,
+    int backoff_label,
+    int weight_bits,
+    QuantizationReport *report = nullptr) {
+  typedef typename A::Weight Weight;
+  if (weight_bits != 8 && weight_bits != 16) {
+    LOG(ERROR) << "Unsupported number of weight bits: " << weight_bits;
+    return nullptr;
+  }
+  if (model.Properties(fst::kAcceptor, true) != fst::kAcceptor) {
+    LOG(ERROR) << "Model is not an acceptor";
+    return nullptr;
+  }
+
+  std::vector<float> probs;
+  std::vector<float> backoffs;
+  for (fst::StateIterator<fst::Fst<A>> siter(model); !siter.Done();
+       siter.Next()) {
+    const auto s = siter.Value();
+    const Weight final_weight = model.Final(s);
+    if (final_weight != Weight::Zero()) probs.push_back(final_weight.Value());
+    for (fst::ArcIterator<fst::Fst<A>> aiter(model, s); !aiter.Done();
+         aiter.Next()) {
+      const A &arc = aiter.Value();
+      (arc.ilabel == backoff_label ? backoffs : probs).push_back(
+          arc.weight.Value());
+    }
+  }
+  for (const auto *weights : {&probs, &backoffs}) {
+    for (float weight : *weights) {
+      if (!std::isfinite(weight)) {
+        LOG(ERROR) << "Cannot quantize non-finite weight " << weight;
+        return nullptr;
+      }
+    }
+  }
+
+  auto tables = std::make_shared<QuantizationTables>();
+  tables->backoff_label = backoff_label;
+  const std::size_t max_size = std::size_t{1} << weight_bits;
+  tables->probs = WeightCodebook::Train(probs, max_size);
+  tables->backoffs = WeightCodebook::Train(backoffs, max_size);
+
+  const BitfieldExtent extent = GetBitfieldExtent(model);
+  internal::QuantizedCompactFstMaker<A> maker(model, extent, weight_bits,
+                                              tables);
+  internal::ForEachTupleType<QuantizedCompactors<A>>::Apply(&maker);
+  auto result = maker.Release();
+  if (!result) {
+    LOG(ERROR) << "No quantized layout with " << weight_bits
+               << "-bit weights can represent labels up to "
+               << std::max(extent.max_ilabel, extent.max_olabel)
+               << " and state IDs up to " << extent.max_state;
+    return nullptr;
+  }
+
+  if (report) {
+    *report = QuantizationReport();
+    report->type = result->Type();
+    report->num_probs = probs.size();
+    report->num_backoffs = backoffs.size();
+    report->prob_codebook_size = tables->probs.Size();
+    report->backoff_codebook_size = tables->backoffs.Size();
+    for (float weight : probs) {
+      internal::AddError(std::abs(tables->probs.Quantize(weight) - weight),
+                         &report->prob_mean_error, &report->prob_max_error);
+    }
+    for (float weight : backoffs) {
+      internal::AddError(std::abs(tables->backoffs.Quantize(weight) - weight),
+                         &report->backoff_mean_error,
+                         &report->backoff_max_error);
+    }
+    if (!probs.empty()) report->prob_mean_error /= probs.size();
+    if (!backoffs.empty()) report->backoff_mean_error /= backoffs.size();
+  }
+  return result;
+}
+
+// Registers the CompactFst types of all layouts in QuantizedCompactors<A>.
+// Declare a static instance for each arc type, like fst::FstRegisterer.
+template <class A>
+class QuantizedCompactFstRegisterer {
+ public:
+  QuantizedCompactFstRegisterer() {
+    internal::CompactFstRegistrar<A> registrar;
+    internal::ForEachTupleType<QuantizedCompactors<A>>::Apply(&registrar);
+  }
+};
+
+}  // namespace festus
+
+#endif  // FESTUS_RUNTIME_QUANTIZED_H__